@@ -17,7 +17,6 @@ static const unsigned int MAX_BLOCK_COUNT_PER_REQUEST = 4 * 4 * 4;
 static const unsigned int MAX_LOD = 32;
 static const unsigned int MAX_VOLUME_EXTENT = 0x1fffffff;
 static const unsigned int MAX_VOLUME_SIZE = 2 * MAX_VOLUME_EXTENT; // 1,073,741,822 voxels
-static const unsigned int MAIN_THREAD_MESHING_BUDGET_MS = 8;
 
 static const float INV_0x7f = 1.f / 0x7f;
 static const float INV_0x7fff = 1.f / 0x7fff;
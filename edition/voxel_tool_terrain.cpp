@@ -205,7 +205,6 @@ void VoxelToolTerrain::set_voxel_metadata(Vector3i pos, Variant meta) {
 	VoxelDataMap &map = _terrain->get_storage();
 	VoxelDataBlock *block = map.get_block(map.voxel_to_block(pos));
 	ERR_FAIL_COND_MSG(block == nullptr, "Area not editable");
-	RWLockWrite lock(block->voxels->get_lock());
 	block->voxels->set_voxel_metadata(map.to_local(pos), meta);
 }
 
@@ -214,7 +213,6 @@ Variant VoxelToolTerrain::get_voxel_metadata(Vector3i pos) {
 	VoxelDataMap &map = _terrain->get_storage();
 	VoxelDataBlock *block = map.get_block(map.voxel_to_block(pos));
 	ERR_FAIL_COND_V_MSG(block == nullptr, Variant(), "Area not editable");
-	RWLockRead lock(block->voxels->get_lock());
 	return block->voxels->get_voxel_metadata(map.to_local(pos));
 }
 
@@ -268,36 +266,31 @@ void VoxelToolTerrain::run_blocky_random_tick(AABB voxel_area, int voxel_count,
 		const VoxelDataBlock *block = map.get_block(block_pos);
 		if (block != nullptr) {
 			// Doing ONLY reads here.
-			{
-				RWLockRead lock(block->voxels->get_lock());
-
-				if (block->voxels->get_channel_compression(channel) == VoxelBuffer::COMPRESSION_UNIFORM) {
-					const uint64_t v = block->voxels->get_voxel(0, 0, 0, channel);
-					if (lib.has_voxel(v)) {
-						const Voxel &vt = lib.get_voxel_const(v);
-						if (!vt.is_random_tickable()) {
-							// Skip whole block
-							continue;
-						}
+			if (block->voxels->get_channel_compression(channel) == VoxelBuffer::COMPRESSION_UNIFORM) {
+				const uint64_t v = block->voxels->get_voxel(0, 0, 0, channel);
+				if (lib.has_voxel(v)) {
+					const Voxel &vt = lib.get_voxel_const(v);
+					if (!vt.is_random_tickable()) {
+						// Skip whole block
+						continue;
 					}
 				}
+			}
 
-				// Choose a bunch of voxels at random within the block.
-				// Batching this way improves performance a little by reducing block lookups.
-				for (int vi = 0; vi < batch_count; ++vi) {
-					const Vector3i rpos(
-							Math::rand() & bs_mask,
-							Math::rand() & bs_mask,
-							Math::rand() & bs_mask);
+			// Choose a bunch of voxels at random within the block.
+			// Batching this way improves performance a little by reducing block lookups.
+			for (int vi = 0; vi < batch_count; ++vi) {
+				const Vector3i rpos(
+						Math::rand() & bs_mask,
+						Math::rand() & bs_mask,
+						Math::rand() & bs_mask);
 
-					const uint64_t v = block->voxels->get_voxel(rpos, channel);
-					picks[vi] = Pick{ v, rpos };
-				}
+				const uint64_t v = block->voxels->get_voxel(rpos, channel);
+				picks[vi] = Pick{ v, rpos };
 			}
 
 			// The following may or may not read AND write voxels randomly due to its exposition to scripts.
-			// However, we don't send the buffer directly, so it will go through an API taking care of locking.
-			// So we don't (and shouldn't) lock anything here.
+			// We don't send the buffer directly, so it will go through the terrain API.
 			for (size_t i = 0; i < picks.size(); ++i) {
 				const Pick pick = picks[i];
 
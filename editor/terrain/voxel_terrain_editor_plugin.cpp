@@ -2,6 +2,7 @@
 #include "../../generators/voxel_generator.h"
 #include "../../terrain/voxel_lod_terrain.h"
 #include "../../terrain/voxel_terrain.h"
+#include "../../terrain/voxel_viewer.h"
 #include "../about_window.h"
 #include "../graph/voxel_graph_node_inspector_wrapper.h"
 
@@ -221,9 +222,13 @@ void VoxelTerrainEditorPlugin::make_visible(bool visible) {
 bool VoxelTerrainEditorPlugin::forward_spatial_gui_input(Camera *p_camera, const Ref<InputEvent> &p_event) {
 	VoxelServer::get_singleton()->set_viewer_distance(_editor_viewer_id, p_camera->get_zfar());
 	_editor_camera_last_position = p_camera->get_global_transform().origin;
+	_editor_camera_last_direction = -p_camera->get_global_transform().basis.get_axis(Vector3::AXIS_Z);
 
 	if (_editor_viewer_follows_camera) {
 		VoxelServer::get_singleton()->set_viewer_position(_editor_viewer_id, _editor_camera_last_position);
+		VoxelServer::get_singleton()->set_viewer_view_direction(_editor_viewer_id, _editor_camera_last_direction);
+		VoxelServer::get_singleton()->set_viewer_view_fov(
+				_editor_viewer_id, VoxelViewer::get_camera_view_cone_fov(*p_camera));
 	}
 
 	return false;
@@ -249,6 +254,11 @@ void VoxelTerrainEditorPlugin::_on_menu_item_selected(int id) {
 
 			if (_editor_viewer_follows_camera) {
 				VoxelServer::get_singleton()->set_viewer_position(_editor_viewer_id, _editor_camera_last_position);
+				VoxelServer::get_singleton()->set_viewer_view_direction(
+						_editor_viewer_id, _editor_camera_last_direction);
+			} else {
+				// The view can't be favored when loading doesn't follow the camera
+				VoxelServer::get_singleton()->set_viewer_view_direction(_editor_viewer_id, Vector3());
 			}
 		} break;
 
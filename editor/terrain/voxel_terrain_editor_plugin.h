@@ -41,6 +41,7 @@ private:
 
 	uint32_t _editor_viewer_id = -1;
 	Vector3 _editor_camera_last_position;
+	Vector3 _editor_camera_last_direction;
 	bool _editor_viewer_follows_camera = false;
 
 	MenuButton *_menu_button = nullptr;
@@ -442,13 +442,17 @@ void VoxelMesherBlocky::build(VoxelMesher::Output &output, const VoxelMesher::In
 		return;
 
 	} else if (voxels.get_channel_compression(channel) != VoxelBuffer::COMPRESSION_NONE) {
-		// No other form of compression is allowed
-		ERR_PRINT("VoxelMesherBlocky received unsupported voxel compression");
-		return;
+		// Decode palettes or bricks into a dense array so the same algorithm can be used
+		cache.decoded_voxels.resize(VoxelBuffer::get_size_in_bytes_for_volume(
+				voxels.get_size(), voxels.get_channel_depth(channel)));
+		voxels.decode_channel(channel, to_span(cache.decoded_voxels));
 	}
 
 	Span<uint8_t> raw_channel;
-	if (!voxels.get_channel_raw(channel, raw_channel)) {
+	if (voxels.get_channel_compression(channel) != VoxelBuffer::COMPRESSION_NONE) {
+		raw_channel = to_span(cache.decoded_voxels);
+
+	} else if (!voxels.get_channel_raw(channel, raw_channel)) {
 		/*       _
 		//      | \
 		//     /\ \\
@@ -69,6 +69,8 @@ private:
 
 	struct Cache {
 		FixedArray<Arrays, MAX_MATERIALS> arrays_per_material;
+		// Voxels of compressed channels, decoded
+		std::vector<uint8_t> decoded_voxels;
 	};
 
 	// Parameters
@@ -78,6 +78,8 @@ private:
 	struct Cache {
 		FixedArray<Arrays, MATERIAL_COUNT> arrays_per_material;
 		std::vector<uint8_t> mask_memory_pool;
+		// Voxels of compressed channels, decoded
+		std::vector<uint8_t> decoded_voxels;
 	};
 
 	// Parameters
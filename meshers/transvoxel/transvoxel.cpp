@@ -1121,24 +1121,21 @@ void build_transition_mesh(
 template <typename T>
 Span<const T> get_or_decompress_channel(
 		const VoxelBuffer &voxels, std::vector<T> &backing_buffer, unsigned int channel) {
-	//
-	ERR_FAIL_COND_V(voxels.get_channel_depth(channel) != VoxelBuffer::get_depth_from_size(sizeof(T)),
-			Span<const T>());
-
-	if (voxels.get_channel_compression(channel) == VoxelBuffer::COMPRESSION_UNIFORM) {
-		backing_buffer.resize(voxels.get_size().volume());
-		const T v = voxels.get_voxel(Vector3i(), channel);
-		// TODO Could use a fast fill using 8-byte blocks or intrinsics?
-		for (unsigned int i = 0; i < backing_buffer.size(); ++i) {
-			backing_buffer[i] = v;
-		}
-		return to_span_const(backing_buffer);
+	return voxels.get_channel_view_decoded(channel, backing_buffer).data;
+}
 
-	} else {
-		Span<uint8_t> data_bytes;
-		CRASH_COND(voxels.get_channel_raw(channel, data_bytes) == false);
-		return data_bytes.reinterpret_cast_to<const T>();
+// Same as `get_or_decompress_channel`, for channels known not to be uniform
+Span<const uint8_t> get_or_decode_channel_raw(
+		const VoxelBuffer &voxels, std::vector<uint8_t> &backing_buffer, unsigned int channel) {
+	Span<uint8_t> data_bytes;
+	if (voxels.get_channel_raw(channel, data_bytes)) {
+		return Span<const uint8_t>(data_bytes.data(), data_bytes.size());
 	}
+	CRASH_COND(voxels.get_channel_compression(channel) == VoxelBuffer::COMPRESSION_UNIFORM);
+	backing_buffer.resize(
+			VoxelBuffer::get_size_in_bytes_for_volume(voxels.get_size(), voxels.get_channel_depth(channel)));
+	voxels.decode_channel(channel, to_span(backing_buffer));
+	return to_span_const(backing_buffer);
 }
 
 TextureIndicesData get_texture_indices_data(const VoxelBuffer &voxels, unsigned int channel,
@@ -1157,9 +1154,9 @@ TextureIndicesData get_texture_indices_data(const VoxelBuffer &voxels, unsigned
 		out_default_texture_indices_data.use = true;
 
 	} else {
-		Span<uint8_t> data_bytes;
-		CRASH_COND(voxels.get_channel_raw(channel, data_bytes) == false);
-		data.buffer = data_bytes.reinterpret_cast_to<const uint16_t>();
+		static thread_local std::vector<uint8_t> s_indices_backing_buffer;
+		data.buffer = get_or_decode_channel_raw(voxels, s_indices_backing_buffer, channel)
+							  .reinterpret_cast_to<const uint16_t>();
 
 		out_default_texture_indices_data.use = false;
 	}
@@ -1206,8 +1203,8 @@ DefaultTextureIndicesData build_regular_mesh(const VoxelBuffer &voxels, unsigned
 	VOXEL_PROFILE_SCOPE();
 	// From this point, we expect the buffer to contain allocated data in the relevant channels.
 
-	Span<uint8_t> sdf_data_raw;
-	CRASH_COND(voxels.get_channel_raw(sdf_channel, sdf_data_raw) == false);
+	static thread_local std::vector<uint8_t> s_sdf_backing_buffer;
+	Span<const uint8_t> sdf_data_raw = get_or_decode_channel_raw(voxels, s_sdf_backing_buffer, sdf_channel);
 
 	const unsigned int voxels_count = voxels.get_size().volume();
 
@@ -1282,8 +1279,8 @@ void build_transition_mesh(const VoxelBuffer &voxels, unsigned int sdf_channel,
 	VOXEL_PROFILE_SCOPE();
 	// From this point, we expect the buffer to contain allocated data in the relevant channels.
 
-	Span<uint8_t> sdf_data_raw;
-	CRASH_COND(voxels.get_channel_raw(sdf_channel, sdf_data_raw) == false);
+	static thread_local std::vector<uint8_t> s_sdf_backing_buffer;
+	Span<const uint8_t> sdf_data_raw = get_or_decode_channel_raw(voxels, s_sdf_backing_buffer, sdf_channel);
 
 	const unsigned int voxels_count = voxels.get_size().volume();
 
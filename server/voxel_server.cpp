@@ -1,16 +1,23 @@
 #include "voxel_server.h"
 #include "../constants/voxel_constants.h"
 #include "../meshers/transvoxel/voxel_mesher_transvoxel.h"
+#include "../storage/voxel_memory_pool.h"
 #include "../util/funcs.h"
 #include "../util/macros.h"
 #include "../util/profiling.h"
+#include "../util/profiling_clock.h"
+#include <core/engine.h>
 #include <core/os/memory.h>
+#include <core/os/os.h>
 #include <scene/main/viewport.h>
-#include <thread>
 
 namespace {
 VoxelServer *g_voxel_server = nullptr;
+
+inline uint32_t get_ticks_msec() {
+	return OS::get_singleton()->get_ticks_msec();
 }
+} // namespace
 
 template <typename Dst_T>
 inline Dst_T *must_be_cast(IVoxelTask *src) {
@@ -23,12 +30,6 @@ inline Dst_T *must_be_cast(IVoxelTask *src) {
 #endif
 }
 
-template <typename T>
-inline std::shared_ptr<T> gd_make_shared() {
-	// std::make_shared() apparently wont allow us to specify custom new and delete
-	return std::shared_ptr<T>(memnew(T), memdelete<T>);
-}
-
 VoxelServer *VoxelServer::get_singleton() {
 	CRASH_COND_MSG(g_voxel_server == nullptr, "Accessing singleton while it's null");
 	return g_voxel_server;
@@ -46,29 +47,35 @@ void VoxelServer::destroy_singleton() {
 }
 
 VoxelServer::VoxelServer() {
-	const unsigned int hw_threads_hint = std::thread::hardware_concurrency();
-	PRINT_VERBOSE(String("HW threads hint: {0}").format(varray(hw_threads_hint)));
-	// TODO Automatic thread assignment and project settings
+	const unsigned int hw_threads = VoxelThreadPool::get_hardware_thread_count();
+	PRINT_VERBOSE(String("HW threads: {0}").format(varray(hw_threads)));
+	// TODO Project settings
+
+	// By default, leave one thread for the main thread
+	_general_thread_pool.set_name("Voxel general");
+	_general_thread_pool.set_thread_count(MAX(hw_threads, 2u) - 1);
 
 	// Can't be more than 1 thread. File access with more threads isn't worth it.
-	_streaming_thread_pool.set_name("Voxel streaming");
-	_streaming_thread_pool.set_thread_count(1);
-	_streaming_thread_pool.set_priority_update_period(300);
-	_streaming_thread_pool.set_batch_count(16);
+	// This also prevents I/O from starving CPU work.
+	_general_thread_pool.set_kind_max_threads(TASK_KIND_STREAMING, 1);
+	_general_thread_pool.set_kind_priority_update_period(TASK_KIND_STREAMING, 300);
+	_general_thread_pool.set_kind_batch_count(TASK_KIND_STREAMING, 16);
+	// Batches group blocks of the same region among the closest ones, so streams open fewer files
+	_general_thread_pool.set_kind_batch_lookahead(TASK_KIND_STREAMING, 64);
+	_general_thread_pool.set_kind_batch_runner(TASK_KIND_STREAMING, &BlockDataRequest::run_batch);
 
-	_generation_thread_pool.set_name("Voxel generation");
-	_generation_thread_pool.set_thread_count(2);
-	_generation_thread_pool.set_priority_update_period(300);
-	_generation_thread_pool.set_batch_count(1);
+	_general_thread_pool.set_kind_priority_update_period(TASK_KIND_GENERATION, 300);
+	_general_thread_pool.set_kind_batch_count(TASK_KIND_GENERATION, 1);
 
-	// This pool works on visuals so it must have lower latency
-	_meshing_thread_pool.set_name("Voxel meshing");
-	_meshing_thread_pool.set_thread_count(2);
-	_meshing_thread_pool.set_priority_update_period(64);
-	_meshing_thread_pool.set_batch_count(1);
+	// Meshing works on visuals so it must have lower latency
+	_general_thread_pool.set_kind_priority_update_period(TASK_KIND_MESHING, 64);
+	_general_thread_pool.set_kind_batch_count(TASK_KIND_MESHING, 1);
+	_general_thread_pool.set_kind_weight(TASK_KIND_MESHING, 2);
 
-	// Init world
-	_world.shared_priority_dependency = gd_make_shared<PriorityDependencyShared>();
+	// Half a frame at 60 FPS, leaving room for the game itself
+	_main_thread_time_budget_usec = 8000;
+
+	_default_world_id = add_world();
 
 	PRINT_VERBOSE(String("Size of BlockDataRequest: {0}").format(varray((int)sizeof(BlockDataRequest))));
 	PRINT_VERBOSE(String("Size of BlockMeshRequest: {0}").format(varray((int)sizeof(BlockMeshRequest))));
@@ -84,49 +91,124 @@ VoxelServer::~VoxelServer() {
 }
 
 void VoxelServer::wait_and_clear_all_tasks(bool warn) {
-	_streaming_thread_pool.wait_for_all_tasks();
-	_generation_thread_pool.wait_for_all_tasks();
+	// Meshing tasks waiting for blocks are referenced by these, they must be released
+	_volumes.for_each([](Volume &volume) {
+		for (unsigned int lod_index = 0; lod_index < volume.pending_data_blocks.size(); ++lod_index) {
+			volume.pending_data_blocks[lod_index].clear();
+		}
+	});
 
-	// Wait a second time because the generation pool can generate streaming requests
-	_streaming_thread_pool.wait_for_all_tasks();
+	// Tasks can schedule other tasks when they complete or get cleared,
+	// so repeat until nothing is left
+	unsigned int cleared_count;
+	do {
+		_general_thread_pool.wait_for_all_tasks();
+
+		cleared_count = 0;
+		_general_thread_pool.dequeue_completed_tasks([this, warn, &cleared_count](IVoxelTask *task) {
+			switch (task->get_kind()) {
+				case TASK_KIND_STREAMING: {
+					if (warn) {
+						WARN_PRINT("Streaming tasks remain on module cleanup, "
+								   "this could become a problem if they reference scripts");
+					}
+					BlockDataRequest *r = must_be_cast<BlockDataRequest>(task);
+					if (r->type != BlockDataRequest::TYPE_FALLBACK_ON_GENERATOR) {
+						on_pending_data_block_returned(nullptr, r->pending_block, r->position, r->lod);
+					}
+				} break;
 
-	_meshing_thread_pool.wait_for_all_tasks();
+				case TASK_KIND_GENERATION: {
+					if (warn) {
+						WARN_PRINT("Generator tasks remain on module cleanup, "
+								   "this could become a problem if they reference scripts");
+					}
+					BlockGenerateRequest *r = must_be_cast<BlockGenerateRequest>(task);
+					on_pending_data_block_returned(nullptr, r->pending_block, r->position, r->lod);
+				} break;
 
-	_streaming_thread_pool.dequeue_completed_tasks([warn](IVoxelTask *task) {
-		if (warn) {
-			WARN_PRINT("Streaming tasks remain on module cleanup, "
-					   "this could become a problem if they reference scripts");
-		}
-		memdelete(task);
-	});
+				default:
+					break;
+			}
+			recycle_task(task);
+			++cleared_count;
+		});
+	} while (cleared_count > 0);
+}
 
-	_meshing_thread_pool.dequeue_completed_tasks([](IVoxelTask *task) {
-		memdelete(task);
-	});
+void VoxelServer::recycle_unscheduled_task(IVoxelTask *task) {
+	VoxelServer::get_singleton()->recycle_task(task);
+}
 
-	_generation_thread_pool.dequeue_completed_tasks([warn](IVoxelTask *task) {
-		if (warn) {
-			WARN_PRINT("Generator tasks remain on module cleanup, "
-					   "this could become a problem if they reference scripts");
-		}
-		memdelete(task);
-	});
+void VoxelServer::recycle_task(IVoxelTask *task) {
+	switch (task->get_kind()) {
+		case TASK_KIND_STREAMING:
+			_block_data_request_pool.recycle(must_be_cast<BlockDataRequest>(task));
+			break;
+
+		case TASK_KIND_GENERATION:
+			_block_generate_request_pool.recycle(must_be_cast<BlockGenerateRequest>(task));
+			break;
+
+		case TASK_KIND_MESHING:
+			_block_mesh_request_pool.recycle(must_be_cast<BlockMeshRequest>(task));
+			break;
+
+		default:
+			CRASH_NOW_MSG("Unexpected task kind");
+	}
 }
 
 int VoxelServer::get_priority(const PriorityDependency &dep, uint8_t lod_index, float *out_closest_distance_sq) {
-	const std::vector<Vector3> &viewer_positions = dep.shared->viewers;
+	const PriorityDependencyShared &shared = *dep.shared;
+	const std::vector<PriorityDependencyShared::ViewerState> &viewers = shared.viewers;
+	const size_t viewer_count = MIN(static_cast<size_t>(shared.viewer_count), viewers.size());
 	const Vector3 block_position = dep.world_position;
 
+	// Viewers are compared by where they will likely be once the task completes, so work in front of moving
+	// viewers comes first, and work left behind gets dropped sooner.
+	// The prediction is limited to a fraction of the drop distance, so blocks close to where viewers are now
+	// can't get dropped by an overshooting prediction.
+	const float prediction_time = shared.prediction_time;
+	const float max_prediction_distance_sq = dep.drop_distance_squared * (0.25f * 0.25f);
+
 	float closest_distance_sq = 99999.f;
-	if (viewer_positions.size() == 0) {
+	// Same as distance, but larger for blocks out of view
+	float closest_priority_distance_sq = 99999.f;
+	if (viewer_count == 0) {
 		// Assume origin
 		closest_distance_sq = block_position.length_squared();
+		closest_priority_distance_sq = closest_distance_sq;
 	} else {
-		for (size_t i = 0; i < viewer_positions.size(); ++i) {
-			float d = viewer_positions[i].distance_squared_to(block_position);
+		for (size_t i = 0; i < viewer_count; ++i) {
+			const PriorityDependencyShared::ViewerState &viewer = viewers[i];
+			Vector3 offset = viewer.velocity * prediction_time;
+			const float offset_length_sq = offset.length_squared();
+			if (offset_length_sq > max_prediction_distance_sq) {
+				offset *= Math::sqrt(max_prediction_distance_sq / offset_length_sq);
+			}
+			const Vector3 predicted_position = viewer.position + offset;
+			const float d = predicted_position.distance_squared_to(block_position);
 			if (d < closest_distance_sq) {
 				closest_distance_sq = d;
 			}
+
+			float priority_d = d;
+			if (viewer.view_direction != Vector3()) {
+				// Distance between the block's bounding sphere and the predicted view cone, in a plane containing
+				// the cone's axis. Negative or small values mean the block is at least partially in view.
+				const Vector3 v = block_position - predicted_position;
+				const float along = v.dot(viewer.view_direction);
+				const float across = (v - viewer.view_direction * along).length();
+				const float cone_distance = across * viewer.view_cone_cos - along * viewer.view_cone_sin;
+				if (cone_distance > dep.world_radius) {
+					// Out of view blocks compete with in-view blocks twice as far
+					priority_d *= 4.f;
+				}
+			}
+			if (priority_d < closest_priority_distance_sq) {
+				closest_priority_distance_sq = priority_d;
+			}
 		}
 	}
 
@@ -137,7 +219,7 @@ int VoxelServer::get_priority(const PriorityDependency &dep, uint8_t lod_index,
 	// TODO Any way to optimize out the sqrt?
 	// I added it because the LOD modifier was not working with squared distances,
 	// which led blocks to subdivide too much compared to their neighbors, making cracks more likely to happen
-	int priority = static_cast<int>(Math::sqrt(closest_distance_sq));
+	int priority = static_cast<int>(Math::sqrt(closest_priority_distance_sq));
 
 	// TODO Prioritizing LOD makes generation slower... but not prioritizing makes cracks more likely to appear...
 	// This could be fixed by allowing the volume to preemptively request blocks of the next LOD?
@@ -149,32 +231,103 @@ int VoxelServer::get_priority(const PriorityDependency &dep, uint8_t lod_index,
 	return priority;
 }
 
+uint32_t VoxelServer::add_world() {
+	World world;
+	world.shared_priority_dependency = gd_make_shared<PriorityDependencyShared>();
+	return _worlds.create(world);
+}
+
+void VoxelServer::remove_world(uint32_t world_id) {
+	ERR_FAIL_COND_MSG(world_id == _default_world_id, "The default world can't be removed");
+	const World &world = _worlds.get(world_id);
+	ERR_FAIL_COND_MSG(world.volume_count != 0 || world.viewer_count != 0,
+			"The world still has volumes or viewers, they must be moved or removed first");
+	_worlds.destroy(world_id);
+}
+
+bool VoxelServer::world_exists(uint32_t world_id) const {
+	return _worlds.is_valid(world_id);
+}
+
+uint32_t VoxelServer::get_default_world() const {
+	return _default_world_id;
+}
+
+uint32_t VoxelServer::get_world_for_godot_world(ObjectID godot_world_id) {
+	CRASH_COND(godot_world_id == 0);
+	uint32_t found_id = 0;
+	bool found = false;
+	// There are only a few worlds, a linear search is fine
+	_worlds.for_each_with_id([godot_world_id, &found_id, &found](const World &world, uint32_t world_id) {
+		if (world.godot_world_id == godot_world_id) {
+			found_id = world_id;
+			found = true;
+		}
+	});
+	if (found) {
+		return found_id;
+	}
+	const uint32_t world_id = add_world();
+	_worlds.get(world_id).godot_world_id = godot_world_id;
+	PRINT_VERBOSE(String("Created voxel world {0} for Godot world {1}").format(varray(world_id, godot_world_id)));
+	return world_id;
+}
+
+void VoxelServer::release_world(uint32_t world_id) {
+	const World &world = _worlds.get(world_id);
+	if (world.godot_world_id != 0 && world.volume_count == 0 && world.viewer_count == 0) {
+		PRINT_VERBOSE(String("Removing unused voxel world {0}").format(varray(world_id)));
+		_worlds.destroy(world_id);
+	}
+}
+
 uint32_t VoxelServer::add_volume(ReceptionBuffers *buffers, VolumeType type) {
 	CRASH_COND(buffers == nullptr);
 	Volume volume;
 	volume.type = type;
 	volume.reception_buffers = buffers;
 	volume.meshing_dependency = gd_make_shared<MeshingDependency>();
-	return _world.volumes.create(volume);
+	volume.world_id = _default_world_id;
+	++_worlds.get(_default_world_id).volume_count;
+	return _volumes.create(volume);
+}
+
+void VoxelServer::set_volume_world(uint32_t volume_id, uint32_t world_id) {
+	ERR_FAIL_COND(!_worlds.is_valid(world_id));
+	Volume &volume = _volumes.get(volume_id);
+	if (volume.world_id == world_id) {
+		return;
+	}
+	const uint32_t prev_world_id = volume.world_id;
+	volume.world_id = world_id;
+	++_worlds.get(world_id).volume_count;
+	--_worlds.get(prev_world_id).volume_count;
+	release_world(prev_world_id);
+	// Tasks already scheduled keep the priority dependency of the previous world until they run
+}
+
+uint32_t VoxelServer::get_volume_world(uint32_t volume_id) const {
+	const Volume &volume = _volumes.get(volume_id);
+	return volume.world_id;
 }
 
 void VoxelServer::set_volume_transform(uint32_t volume_id, Transform t) {
-	Volume &volume = _world.volumes.get(volume_id);
+	Volume &volume = _volumes.get(volume_id);
 	volume.transform = t;
 }
 
 void VoxelServer::set_volume_render_block_size(uint32_t volume_id, uint32_t block_size) {
-	Volume &volume = _world.volumes.get(volume_id);
+	Volume &volume = _volumes.get(volume_id);
 	volume.render_block_size = block_size;
 }
 
 void VoxelServer::set_volume_data_block_size(uint32_t volume_id, uint32_t block_size) {
-	Volume &volume = _world.volumes.get(volume_id);
+	Volume &volume = _volumes.get(volume_id);
 	volume.data_block_size = block_size;
 }
 
 void VoxelServer::set_volume_stream(uint32_t volume_id, Ref<VoxelStream> stream) {
-	Volume &volume = _world.volumes.get(volume_id);
+	Volume &volume = _volumes.get(volume_id);
 	volume.stream = stream;
 
 	// Commit a new dependency to process requests with
@@ -188,7 +341,7 @@ void VoxelServer::set_volume_stream(uint32_t volume_id, Ref<VoxelStream> stream)
 }
 
 void VoxelServer::set_volume_generator(uint32_t volume_id, Ref<VoxelGenerator> generator) {
-	Volume &volume = _world.volumes.get(volume_id);
+	Volume &volume = _volumes.get(volume_id);
 	volume.generator = generator;
 
 	// Commit a new dependency to process requests with
@@ -202,19 +355,26 @@ void VoxelServer::set_volume_generator(uint32_t volume_id, Ref<VoxelGenerator> g
 }
 
 void VoxelServer::set_volume_mesher(uint32_t volume_id, Ref<VoxelMesher> mesher) {
-	Volume &volume = _world.volumes.get(volume_id);
+	Volume &volume = _volumes.get(volume_id);
 	volume.mesher = mesher;
 	volume.meshing_dependency = gd_make_shared<MeshingDependency>();
 	volume.meshing_dependency->mesher = volume.mesher;
 }
 
 void VoxelServer::set_volume_octree_lod_distance(uint32_t volume_id, float lod_distance) {
-	Volume &volume = _world.volumes.get(volume_id);
+	Volume &volume = _volumes.get(volume_id);
 	volume.octree_lod_distance = lod_distance;
 }
 
+void VoxelServer::set_volume_data_memory_usage(uint32_t volume_id, uint64_t usage) {
+	Volume &volume = _volumes.get(volume_id);
+	_data_memory_usage -= volume.data_memory_usage;
+	volume.data_memory_usage = usage;
+	_data_memory_usage += usage;
+}
+
 void VoxelServer::invalidate_volume_mesh_requests(uint32_t volume_id) {
-	Volume &volume = _world.volumes.get(volume_id);
+	Volume &volume = _volumes.get(volume_id);
 	volume.meshing_dependency->valid = false;
 	volume.meshing_dependency = gd_make_shared<MeshingDependency>();
 	volume.meshing_dependency->mesher = volume.mesher;
@@ -228,10 +388,13 @@ void VoxelServer::init_priority_dependency(
 		VoxelServer::PriorityDependency &dep, Vector3i block_position, uint8_t lod, const Volume &volume, int block_size) {
 	const Vector3i voxel_pos = get_block_center(block_position, block_size, lod);
 	const float block_radius = (block_size << lod) / 2;
-	dep.shared = _world.shared_priority_dependency;
+	const World &world = _worlds.get(volume.world_id);
+	dep.shared = world.shared_priority_dependency;
 	dep.world_position = volume.transform.xform(voxel_pos.to_vec3());
+	dep.request_time_msec = get_ticks_msec();
 	const float transformed_block_radius =
 			volume.transform.basis.xform(Vector3(block_radius, block_radius, block_radius)).length();
+	dep.world_radius = transformed_block_radius;
 
 	switch (volume.type) {
 		case VOLUME_SPARSE_GRID:
@@ -239,7 +402,7 @@ void VoxelServer::init_priority_dependency(
 			// Doubling block radius to account for an extra margin of blocks,
 			// since they are used to provide neighbors when meshing
 			dep.drop_distance_squared =
-					squared(_world.shared_priority_dependency->highest_view_distance + 2.f * transformed_block_radius);
+					squared(world.shared_priority_dependency->highest_view_distance + 2.f * transformed_block_radius);
 			break;
 
 		case VOLUME_SPARSE_OCTREE:
@@ -256,13 +419,51 @@ void VoxelServer::init_priority_dependency(
 	}
 }
 
+VoxelServer::PendingDataBlock::~PendingDataBlock() {
+	if (!dependents.is_completed()) {
+		result->dropped = true;
+		dependents.complete();
+	}
+}
+
+void VoxelServer::on_pending_data_block_returned(Volume *volume,
+		const std::shared_ptr<PendingDataBlock> &pending_block, Vector3i position, uint8_t lod) {
+	if (pending_block == nullptr) {
+		return;
+	}
+
+	if (!pending_block->dependents.is_completed()) {
+		// The task was cancelled or failed before producing a result.
+		// Tasks depending on it will see that and drop too.
+		pending_block->result->dropped = true;
+		pending_block->dependents.complete();
+	}
+
+	if (volume != nullptr) {
+		// The main thread now knows about that block, new requests don't need to wait for it
+		HashMap<Vector3i, std::shared_ptr<PendingDataBlock>, Vector3iHasher> &pending_data_blocks =
+				volume->pending_data_blocks[lod];
+		const std::shared_ptr<PendingDataBlock> *existing = pending_data_blocks.getptr(position);
+		if (existing != nullptr && *existing == pending_block) {
+			pending_data_blocks.erase(position);
+		}
+	}
+}
+
 void VoxelServer::request_block_mesh(uint32_t volume_id, const BlockMeshInput &input) {
-	const Volume &volume = _world.volumes.get(volume_id);
+	const Volume &volume = _volumes.get(volume_id);
 	ERR_FAIL_COND(volume.meshing_dependency == nullptr);
+	ERR_FAIL_COND(input.lod >= volume.pending_data_blocks.size());
 
-	BlockMeshRequest *r = memnew(BlockMeshRequest);
+	BlockMeshRequest *r = _block_mesh_request_pool.create();
 	r->volume_id = volume_id;
-	r->blocks = input.data_blocks;
+	// The task reads snapshots, so the volume can keep modifying its blocks in the meantime
+	for (unsigned int i = 0; i < input.data_blocks_count; ++i) {
+		const Ref<VoxelBuffer> &voxels = input.data_blocks[i];
+		if (voxels.is_valid()) {
+			r->blocks[i] = voxels->duplicate(false);
+		}
+	}
 	r->blocks_count = input.data_blocks_count;
 	r->position = input.render_block_position;
 	r->lod = input.lod;
@@ -271,16 +472,62 @@ void VoxelServer::request_block_mesh(uint32_t volume_id, const BlockMeshInput &i
 	init_priority_dependency(
 			r->priority_dependency, input.render_block_position, input.lod, volume, volume.render_block_size);
 
-	// We'll allocate this quite often. If it becomes a problem, it should be easy to pool.
-	_meshing_thread_pool.enqueue(r);
+	// Find missing blocks which are still loading, so we can wait for them
+	FixedArray<PendingDataBlock *, VoxelConstants::MAX_BLOCK_COUNT_PER_REQUEST> pending_blocks;
+	unsigned int pending_blocks_count = 0;
+	const HashMap<Vector3i, std::shared_ptr<PendingDataBlock>, Vector3iHasher> &pending_data_blocks =
+			volume.pending_data_blocks[input.lod];
+	if (!pending_data_blocks.empty()) {
+		const int factor = volume.render_block_size / volume.data_block_size;
+		const Box3i data_box = Box3i(factor * input.render_block_position, Vector3i(factor)).padded(1);
+		unsigned int i = 0;
+		// Same iteration order as the input
+		data_box.for_each_cell_zxy([&i, &input, &pending_data_blocks, &pending_blocks, &pending_blocks_count, r](
+											Vector3i data_block_pos) {
+			if (i < input.data_blocks_count && input.data_blocks[i].is_null()) {
+				const std::shared_ptr<PendingDataBlock> *pending_block = pending_data_blocks.getptr(data_block_pos);
+				if (pending_block != nullptr) {
+					BlockMeshRequest::PendingBlock pb;
+					pb.data = (*pending_block)->result;
+					pb.index = i;
+					r->pending_blocks.push_back(pb);
+					pending_blocks[pending_blocks_count] = pending_block->get();
+					++pending_blocks_count;
+				}
+			}
+			++i;
+		});
+	}
+
+	if (pending_blocks_count == 0) {
+		_general_thread_pool.enqueue(r);
+
+	} else {
+		// The task will be scheduled by the thread completing the last block it depends on
+		std::shared_ptr<VoxelTaskGraphNode> node(
+				memnew(VoxelTaskGraphNode(r, _general_thread_pool, recycle_unscheduled_task)),
+				memdelete<VoxelTaskGraphNode>);
+		for (unsigned int i = 0; i < pending_blocks_count; ++i) {
+			pending_blocks[i]->dependents.add(node);
+		}
+		node->schedule();
+	}
 }
 
 void VoxelServer::request_block_load(uint32_t volume_id, Vector3i block_pos, int lod, bool request_instances) {
-	const Volume &volume = _world.volumes.get(volume_id);
+	Volume &volume = _volumes.get(volume_id);
 	ERR_FAIL_COND(volume.stream_dependency == nullptr);
+	ERR_FAIL_INDEX(lod, static_cast<int>(volume.pending_data_blocks.size()));
+	ERR_FAIL_COND(volume.stream_dependency->stream.is_null() && volume.stream_dependency->generator.is_null());
+
+	// Meshing tasks can depend on this block while it loads.
+	// If the block was already requested, this replaces it because the previous result might get dropped.
+	std::shared_ptr<PendingDataBlock> pending_block = gd_make_shared<PendingDataBlock>();
+	pending_block->result = gd_make_shared<PendingDataBlockResult>();
+	volume.pending_data_blocks[lod].set(block_pos, pending_block);
 
 	if (volume.stream_dependency->stream.is_valid()) {
-		BlockDataRequest *r = memnew(BlockDataRequest);
+		BlockDataRequest *r = _block_data_request_pool.create();
 		r->volume_id = volume_id;
 		r->position = block_pos;
 		r->lod = lod;
@@ -288,35 +535,34 @@ void VoxelServer::request_block_load(uint32_t volume_id, Vector3i block_pos, int
 		r->block_size = volume.data_block_size;
 		r->stream_dependency = volume.stream_dependency;
 		r->request_instances = request_instances;
+		r->pending_block = pending_block;
 
 		init_priority_dependency(r->priority_dependency, block_pos, lod, volume, volume.data_block_size);
 
-		_streaming_thread_pool.enqueue(r);
+		_general_thread_pool.enqueue(r);
 
 	} else {
 		// Directly generate the block without checking the stream
-		ERR_FAIL_COND(volume.stream_dependency->generator.is_null());
-
-		BlockGenerateRequest r;
-		r.volume_id = volume_id;
-		r.position = block_pos;
-		r.lod = lod;
-		r.block_size = volume.data_block_size;
-		r.stream_dependency = volume.stream_dependency;
+		BlockGenerateRequest *r = _block_generate_request_pool.create();
+		r->volume_id = volume_id;
+		r->position = block_pos;
+		r->lod = lod;
+		r->block_size = volume.data_block_size;
+		r->stream_dependency = volume.stream_dependency;
+		r->pending_block = pending_block;
 
-		init_priority_dependency(r.priority_dependency, block_pos, lod, volume, volume.data_block_size);
+		init_priority_dependency(r->priority_dependency, block_pos, lod, volume, volume.data_block_size);
 
-		BlockGenerateRequest *rp = memnew(BlockGenerateRequest(r));
-		_generation_thread_pool.enqueue(rp);
+		_general_thread_pool.enqueue(r);
 	}
 }
 
 void VoxelServer::request_voxel_block_save(uint32_t volume_id, Ref<VoxelBuffer> voxels, Vector3i block_pos, int lod) {
-	const Volume &volume = _world.volumes.get(volume_id);
+	const Volume &volume = _volumes.get(volume_id);
 	ERR_FAIL_COND(volume.stream.is_null());
 	CRASH_COND(volume.stream_dependency == nullptr);
 
-	BlockDataRequest *r = memnew(BlockDataRequest);
+	BlockDataRequest *r = _block_data_request_pool.create();
 	r->voxels = voxels;
 	r->volume_id = volume_id;
 	r->position = block_pos;
@@ -329,16 +575,16 @@ void VoxelServer::request_voxel_block_save(uint32_t volume_id, Ref<VoxelBuffer>
 
 	// No priority data, saving doesnt need sorting
 
-	_streaming_thread_pool.enqueue(r);
+	_general_thread_pool.enqueue(r);
 }
 
 void VoxelServer::request_instance_block_save(uint32_t volume_id, std::unique_ptr<VoxelInstanceBlockData> instances,
 		Vector3i block_pos, int lod) {
-	const Volume &volume = _world.volumes.get(volume_id);
+	const Volume &volume = _volumes.get(volume_id);
 	ERR_FAIL_COND(volume.stream.is_null());
 	CRASH_COND(volume.stream_dependency == nullptr);
 
-	BlockDataRequest *r = memnew(BlockDataRequest);
+	BlockDataRequest *r = _block_data_request_pool.create();
 	r->instances = std::move(instances);
 	r->volume_id = volume_id;
 	r->position = block_pos;
@@ -351,23 +597,24 @@ void VoxelServer::request_instance_block_save(uint32_t volume_id, std::unique_pt
 
 	// No priority data, saving doesnt need sorting
 
-	_streaming_thread_pool.enqueue(r);
+	_general_thread_pool.enqueue(r);
 }
 
 void VoxelServer::request_block_generate_from_data_request(BlockDataRequest *src) {
 	// This can be called from another thread
 
-	BlockGenerateRequest r;
-	r.voxels = src->voxels;
-	r.volume_id = src->volume_id;
-	r.position = src->position;
-	r.lod = src->lod;
-	r.block_size = src->block_size;
-	r.stream_dependency = src->stream_dependency;
-	r.priority_dependency = src->priority_dependency;
+	BlockGenerateRequest *r = _block_generate_request_pool.create();
+	r->voxels = src->voxels;
+	r->volume_id = src->volume_id;
+	r->position = src->position;
+	r->lod = src->lod;
+	r->block_size = src->block_size;
+	r->stream_dependency = src->stream_dependency;
+	r->priority_dependency = src->priority_dependency;
+	// The block is not ready yet, generation takes over
+	r->pending_block = src->pending_block;
 
-	BlockGenerateRequest *rp = memnew(BlockGenerateRequest(r));
-	_generation_thread_pool.enqueue(rp);
+	_general_thread_pool.enqueue(r);
 }
 
 void VoxelServer::request_block_save_from_generate_request(BlockGenerateRequest *src) {
@@ -378,7 +625,7 @@ void VoxelServer::request_block_save_from_generate_request(BlockGenerateRequest
 
 	ERR_FAIL_COND(src->voxels.is_null());
 
-	BlockDataRequest *r = memnew(BlockDataRequest());
+	BlockDataRequest *r = _block_data_request_pool.create();
 	r->voxels = src->voxels->duplicate(true);
 	r->volume_id = src->volume_id;
 	r->position = src->position;
@@ -390,12 +637,12 @@ void VoxelServer::request_block_save_from_generate_request(BlockGenerateRequest
 	// No instances, generators are not designed to produce them at this stage yet.
 	// No priority data, saving doesnt need sorting
 
-	_streaming_thread_pool.enqueue(r);
+	_general_thread_pool.enqueue(r);
 }
 
 void VoxelServer::remove_volume(uint32_t volume_id) {
 	{
-		Volume &volume = _world.volumes.get(volume_id);
+		Volume &volume = _volumes.get(volume_id);
 		if (volume.stream_dependency != nullptr) {
 			volume.stream_dependency->valid = false;
 		}
@@ -404,10 +651,15 @@ void VoxelServer::remove_volume(uint32_t volume_id) {
 		}
 	}
 
-	_world.volumes.destroy(volume_id);
+	const uint32_t world_id = _volumes.get(volume_id).world_id;
+	_data_memory_usage -= _volumes.get(volume_id).data_memory_usage;
+	_volumes.destroy(volume_id);
 	// TODO How to cancel meshing tasks?
 
-	if (_world.volumes.count() == 0) {
+	--_worlds.get(world_id).volume_count;
+	release_world(world_id);
+
+	if (_volumes.count() == 0) {
 		// To workaround https://github.com/Zylann/godot_voxel/issues/189
 		// When the last remaining volume got destroyed (as in game exit)
 		wait_and_clear_all_tasks(false);
@@ -415,218 +667,519 @@ void VoxelServer::remove_volume(uint32_t volume_id) {
 }
 
 uint32_t VoxelServer::add_viewer() {
-	return _world.viewers.create(Viewer());
+	Viewer viewer;
+	viewer.world_id = _default_world_id;
+	++_worlds.get(_default_world_id).viewer_count;
+	return _viewers.create(viewer);
 }
 
 void VoxelServer::remove_viewer(uint32_t viewer_id) {
-	_world.viewers.destroy(viewer_id);
+	const uint32_t world_id = _viewers.get(viewer_id).world_id;
+	_viewers.destroy(viewer_id);
+	--_worlds.get(world_id).viewer_count;
+	release_world(world_id);
+}
+
+void VoxelServer::set_viewer_world(uint32_t viewer_id, uint32_t world_id) {
+	ERR_FAIL_COND(!_worlds.is_valid(world_id));
+	Viewer &viewer = _viewers.get(viewer_id);
+	if (viewer.world_id == world_id) {
+		return;
+	}
+	const uint32_t prev_world_id = viewer.world_id;
+	viewer.world_id = world_id;
+	++_worlds.get(world_id).viewer_count;
+	--_worlds.get(prev_world_id).viewer_count;
+	release_world(prev_world_id);
+}
+
+uint32_t VoxelServer::get_viewer_world(uint32_t viewer_id) const {
+	const Viewer &viewer = _viewers.get(viewer_id);
+	return viewer.world_id;
 }
 
 void VoxelServer::set_viewer_position(uint32_t viewer_id, Vector3 position) {
-	Viewer &viewer = _world.viewers.get(viewer_id);
+	Viewer &viewer = _viewers.get(viewer_id);
 	viewer.world_position = position;
 }
 
+void VoxelServer::set_viewer_view_direction(uint32_t viewer_id, Vector3 direction) {
+	Viewer &viewer = _viewers.get(viewer_id);
+	viewer.view_direction = direction;
+}
+
+void VoxelServer::set_viewer_view_fov(uint32_t viewer_id, float fov_degrees) {
+	Viewer &viewer = _viewers.get(viewer_id);
+	viewer.view_fov_degrees = fov_degrees;
+}
+
 void VoxelServer::set_viewer_distance(uint32_t viewer_id, unsigned int distance) {
-	Viewer &viewer = _world.viewers.get(viewer_id);
+	Viewer &viewer = _viewers.get(viewer_id);
 	viewer.view_distance = distance;
 }
 
 unsigned int VoxelServer::get_viewer_distance(uint32_t viewer_id) const {
-	const Viewer &viewer = _world.viewers.get(viewer_id);
+	const Viewer &viewer = _viewers.get(viewer_id);
 	return viewer.view_distance;
 }
 
 void VoxelServer::set_viewer_requires_visuals(uint32_t viewer_id, bool enabled) {
-	Viewer &viewer = _world.viewers.get(viewer_id);
+	Viewer &viewer = _viewers.get(viewer_id);
 	viewer.require_visuals = enabled;
 }
 
 bool VoxelServer::is_viewer_requiring_visuals(uint32_t viewer_id) const {
-	const Viewer &viewer = _world.viewers.get(viewer_id);
+	const Viewer &viewer = _viewers.get(viewer_id);
 	return viewer.require_visuals;
 }
 
 void VoxelServer::set_viewer_requires_collisions(uint32_t viewer_id, bool enabled) {
-	Viewer &viewer = _world.viewers.get(viewer_id);
+	Viewer &viewer = _viewers.get(viewer_id);
 	viewer.require_collisions = enabled;
 }
 
 bool VoxelServer::is_viewer_requiring_collisions(uint32_t viewer_id) const {
-	const Viewer &viewer = _world.viewers.get(viewer_id);
+	const Viewer &viewer = _viewers.get(viewer_id);
 	return viewer.require_collisions;
 }
 
 bool VoxelServer::viewer_exists(uint32_t viewer_id) const {
-	return _world.viewers.is_valid(viewer_id);
+	return _viewers.is_valid(viewer_id);
 }
 
-void VoxelServer::process() {
-	// Note, this shouldn't be here. It should normally done just after SwapBuffers.
-	// Godot does not have any C++ profiler usage anywhere, so when using Tracy Profiler I have to put it somewhere...
-	VOXEL_PROFILE_MARK_FRAME();
+void VoxelServer::reserve_reception_buffers(Span<IVoxelTask *> tasks) {
 	VOXEL_PROFILE_SCOPE();
 
-	// Receive data updates
-	_streaming_thread_pool.dequeue_completed_tasks([this](IVoxelTask *task) {
-		BlockDataRequest *r = must_be_cast<BlockDataRequest>(task);
-		Volume *volume = _world.volumes.try_get(r->volume_id);
-
-		if (volume != nullptr) {
-			// TODO Comparing pointer may not be guaranteed
-			// The request response must match the dependency it would have been requested with.
-			// If it doesn't match, we are no longer interested in the result.
-			if (r->stream_dependency == volume->stream_dependency &&
-					r->type != BlockDataRequest::TYPE_FALLBACK_ON_GENERATOR) {
-				BlockDataOutput o;
-				o.voxels = r->voxels;
-				o.instances = std::move(r->instances);
-				o.position = r->position;
-				o.lod = r->lod;
-				o.dropped = !r->has_run;
-
-				switch (r->type) {
-					case BlockDataRequest::TYPE_SAVE:
-						o.type = BlockDataOutput::TYPE_SAVE;
-						break;
-
-					case BlockDataRequest::TYPE_LOAD:
-						o.type = BlockDataOutput::TYPE_LOAD;
-						break;
-
-					default:
-						CRASH_NOW_MSG("Unexpected data request response type");
+	_volumes.for_each([](Volume &volume) {
+		volume.received_data_count = 0;
+		volume.received_mesh_count = 0;
+	});
+
+	for (size_t i = 0; i < tasks.size(); ++i) {
+		IVoxelTask *task = tasks[i];
+
+		switch (task->get_kind()) {
+			case TASK_KIND_STREAMING: {
+				const BlockDataRequest *r = must_be_cast<BlockDataRequest>(task);
+				Volume *volume = _volumes.try_get(r->volume_id);
+				if (volume != nullptr && r->type != BlockDataRequest::TYPE_FALLBACK_ON_GENERATOR) {
+					++volume->received_data_count;
 				}
+			} break;
 
-				volume->reception_buffers->data_output.push_back(std::move(o));
-			}
+			case TASK_KIND_GENERATION: {
+				const BlockGenerateRequest *r = must_be_cast<BlockGenerateRequest>(task);
+				Volume *volume = _volumes.try_get(r->volume_id);
+				if (volume != nullptr) {
+					++volume->received_data_count;
+				}
+			} break;
 
-		} else {
-			// This can happen if the user removes the volume while requests are still about to return
-			PRINT_VERBOSE("Stream data request response came back but volume wasn't found");
+			case TASK_KIND_MESHING: {
+				const BlockMeshRequest *r = must_be_cast<BlockMeshRequest>(task);
+				Volume *volume = _volumes.try_get(r->volume_id);
+				if (volume != nullptr) {
+					++volume->received_mesh_count;
+				}
+			} break;
+
+			default:
+				CRASH_NOW_MSG("Unexpected task kind");
 		}
+	}
 
-		memdelete(r);
+	_volumes.for_each([](Volume &volume) {
+		ReceptionBuffers &rb = *volume.reception_buffers;
+		rb.data_output.reserve(rb.data_output.size() + volume.received_data_count);
+		rb.mesh_output.reserve(rb.mesh_output.size() + volume.received_mesh_count);
 	});
+}
 
-	// Receive generation updates
-	_generation_thread_pool.dequeue_completed_tasks([this](IVoxelTask *task) {
-		BlockGenerateRequest *r = must_be_cast<BlockGenerateRequest>(task);
-		Volume *volume = _world.volumes.try_get(r->volume_id);
-
-		if (volume != nullptr) {
-			// TODO Comparing pointer may not be guaranteed
-			// The request response must match the dependency it would have been requested with.
-			// If it doesn't match, we are no longer interested in the result.
-			if (r->stream_dependency == volume->stream_dependency) {
-				BlockDataOutput o;
-				o.voxels = r->voxels;
-				o.position = r->position;
-				o.lod = r->lod;
-				o.dropped = !r->has_run;
-				o.type = BlockDataOutput::TYPE_LOAD;
-				volume->reception_buffers->data_output.push_back(std::move(o));
-			}
+void VoxelServer::update_viewer_velocities() {
+	const uint64_t now_usec = OS::get_singleton()->get_ticks_usec();
+	const float delta = static_cast<float>(now_usec - _last_process_time_usec) / 1000000.f;
+	_last_process_time_usec = now_usec;
+	if (delta <= 0.f) {
+		return;
+	}
 
-		} else {
-			// This can happen if the user removes the volume while requests are still about to return
-			PRINT_VERBOSE("Gemerated data request response came back but volume wasn't found");
+	_viewers.for_each([delta](Viewer &viewer) {
+		if (viewer.has_last_world_position) {
+			const Vector3 instant_velocity = (viewer.world_position - viewer.last_world_position) / delta;
+			// Smoothed, so uneven frame times and occasional teleports don't throw predictions too far
+			viewer.velocity = viewer.velocity.linear_interpolate(instant_velocity, 0.25f);
 		}
+		viewer.last_world_position = viewer.world_position;
+		viewer.has_last_world_position = true;
+	});
+}
+
+void VoxelServer::update_task_latency(const PriorityDependency &dep) {
+	if (dep.request_time_msec == 0) {
+		return;
+	}
+	const float latency = static_cast<float>(get_ticks_msec() - dep.request_time_msec) / 1000.f;
+	_average_task_latency = Math::lerp(_average_task_latency, latency, 0.05f);
+}
 
-		memdelete(r);
+void VoxelServer::update_world_priority_dependency(uint32_t world_id, World &world) {
+	if (world.shared_priority_dependency->viewers.size() < world.viewer_count) {
+		// Tasks referencing the previous instance will see its viewers stop moving, but this only happens
+		// when there are more viewers than ever before in the world
+		world.shared_priority_dependency = gd_make_shared<PriorityDependencyShared>();
+		world.shared_priority_dependency->viewers.resize(MAX(world.viewer_count, 4u));
+	}
+	size_t i = 0;
+	unsigned int max_distance = 0;
+	PriorityDependencyShared &dep = *world.shared_priority_dependency;
+	// Viewers of other worlds must not affect tasks of this one
+	for_each_viewer(world_id, [&i, &max_distance, &dep](const Viewer &viewer, uint32_t viewer_id) {
+		PriorityDependencyShared::ViewerState &state = dep.viewers[i];
+		state.position = viewer.world_position;
+		state.velocity = viewer.velocity;
+		if (viewer.view_fov_degrees > 0.f && viewer.view_direction != Vector3()) {
+			const float half_angle = Math::deg2rad(0.5f * MIN(viewer.view_fov_degrees, 180.f));
+			state.view_direction = viewer.view_direction.normalized();
+			state.view_cone_sin = Math::sin(half_angle);
+			state.view_cone_cos = Math::cos(half_angle);
+		} else {
+			state.view_direction = Vector3();
+		}
+		if (viewer.view_distance > max_distance) {
+			max_distance = viewer.view_distance;
+		}
+		++i;
 	});
+	dep.viewer_count = i;
+	// Cancel distance is increased because of two reasons:
+	// - Some volumes use a cubic area which has higher distances on their corners
+	// - Hysteresis is needed to reduce ping-pong
+	dep.highest_view_distance = max_distance * 2;
+	// Predict where viewers will be by the time new tasks complete. Capped, because a stalled queue would
+	// otherwise make predictions meaningless.
+	dep.prediction_time = MIN(_average_task_latency, 1.f);
+}
 
-	// Receive mesh updates
-	_meshing_thread_pool.dequeue_completed_tasks([this](IVoxelTask *task) {
-		BlockMeshRequest *r = must_be_cast<BlockMeshRequest>(task);
-		Volume *volume = _world.volumes.try_get(r->volume_id);
-
-		if (volume != nullptr) {
-			// TODO Comparing pointer may not be guaranteed
-			// The request response must match the dependency it would have been requested with.
-			// If it doesn't match, we are no longer interested in the result.
-			if (volume->meshing_dependency == r->meshing_dependency) {
-				BlockMeshOutput o;
-				// TODO Check for invalidation due to property changes
-
-				if (r->has_run) {
-					o.type = BlockMeshOutput::TYPE_MESHED;
-				} else {
-					o.type = BlockMeshOutput::TYPE_DROPPED;
-				}
+void VoxelServer::process() {
+	// Note, this shouldn't be here. It should normally done just after SwapBuffers.
+	// Godot does not have any C++ profiler usage anywhere, so when using Tracy Profiler I have to put it somewhere...
+	VOXEL_PROFILE_MARK_FRAME();
+	VOXEL_PROFILE_SCOPE();
 
-				o.position = r->position;
-				o.lod = r->lod;
-				o.surfaces = r->surfaces_output;
+	ProfilingClock profiling_clock;
 
-				volume->reception_buffers->mesh_output.push_back(o);
-			}
+	// Receive results
+	_general_thread_pool.dequeue_completed_tasks_batch([this](Span<IVoxelTask *> tasks) {
+		reserve_reception_buffers(tasks);
 
-		} else {
-			// This can happen if the user removes the volume while requests are still about to return
-			PRINT_VERBOSE("Mesh request response came back but volume wasn't found");
-		}
+		for (size_t task_index = 0; task_index < tasks.size(); ++task_index) {
+			IVoxelTask *task = tasks[task_index];
+
+			switch (task->get_kind()) {
+				case TASK_KIND_STREAMING: {
+					BlockDataRequest *r = must_be_cast<BlockDataRequest>(task);
+					Volume *volume = _volumes.try_get(r->volume_id);
+					if (r->has_run) {
+						update_task_latency(r->priority_dependency);
+					}
+
+					if (r->type != BlockDataRequest::TYPE_FALLBACK_ON_GENERATOR) {
+						on_pending_data_block_returned(volume, r->pending_block, r->position, r->lod);
+					}
+
+					if (volume != nullptr) {
+						// TODO Comparing pointer may not be guaranteed
+						// The request response must match the dependency it would have been requested with.
+						// If it doesn't match, we are no longer interested in the result.
+						if (r->stream_dependency == volume->stream_dependency &&
+								r->type != BlockDataRequest::TYPE_FALLBACK_ON_GENERATOR) {
+							BlockDataOutput o;
+							o.voxels = r->voxels;
+							o.instances = std::move(r->instances);
+							o.position = r->position;
+							o.lod = r->lod;
+							o.dropped = !r->has_run;
+
+							switch (r->type) {
+								case BlockDataRequest::TYPE_SAVE:
+									o.type = BlockDataOutput::TYPE_SAVE;
+									break;
+
+								case BlockDataRequest::TYPE_LOAD:
+									o.type = BlockDataOutput::TYPE_LOAD;
+									break;
+
+								default:
+									CRASH_NOW_MSG("Unexpected data request response type");
+							}
+
+							volume->reception_buffers->data_output.push_back(std::move(o));
+						}
+
+					} else {
+						// This can happen if the user removes the volume while requests are still about to return
+						PRINT_VERBOSE("Stream data request response came back but volume wasn't found");
+					}
+
+					_block_data_request_pool.recycle(r);
+				} break;
+
+				case TASK_KIND_GENERATION: {
+					BlockGenerateRequest *r = must_be_cast<BlockGenerateRequest>(task);
+					Volume *volume = _volumes.try_get(r->volume_id);
+					if (r->has_run) {
+						update_task_latency(r->priority_dependency);
+					}
+					on_pending_data_block_returned(volume, r->pending_block, r->position, r->lod);
+
+					if (volume != nullptr) {
+						// TODO Comparing pointer may not be guaranteed
+						// The request response must match the dependency it would have been requested with.
+						// If it doesn't match, we are no longer interested in the result.
+						if (r->stream_dependency == volume->stream_dependency) {
+							BlockDataOutput o;
+							o.voxels = r->voxels;
+							o.position = r->position;
+							o.lod = r->lod;
+							o.dropped = !r->has_run;
+							o.type = BlockDataOutput::TYPE_LOAD;
+							volume->reception_buffers->data_output.push_back(std::move(o));
+						}
+
+					} else {
+						// This can happen if the user removes the volume while requests are still about to return
+						PRINT_VERBOSE("Gemerated data request response came back but volume wasn't found");
+					}
+
+					_block_generate_request_pool.recycle(r);
+				} break;
 
-		memdelete(r);
+				case TASK_KIND_MESHING: {
+					BlockMeshRequest *r = must_be_cast<BlockMeshRequest>(task);
+					Volume *volume = _volumes.try_get(r->volume_id);
+					if (r->has_run) {
+						update_task_latency(r->priority_dependency);
+					}
+
+					if (volume != nullptr) {
+						// TODO Comparing pointer may not be guaranteed
+						// The request response must match the dependency it would have been requested with.
+						// If it doesn't match, we are no longer interested in the result.
+						if (volume->meshing_dependency == r->meshing_dependency) {
+							BlockMeshOutput o;
+							// TODO Check for invalidation due to property changes
+
+							if (r->has_run) {
+								o.type = BlockMeshOutput::TYPE_MESHED;
+							} else {
+								o.type = BlockMeshOutput::TYPE_DROPPED;
+							}
+
+							o.position = r->position;
+							o.lod = r->lod;
+							o.surfaces = std::move(r->surfaces_output);
+
+							volume->reception_buffers->mesh_output.push_back(std::move(o));
+						}
+
+					} else {
+						// This can happen if the user removes the volume while requests are still about to return
+						PRINT_VERBOSE("Mesh request response came back but volume wasn't found");
+					}
+
+					_block_mesh_request_pool.recycle(r);
+				} break;
+
+				default:
+					CRASH_NOW_MSG("Unexpected task kind");
+			}
+		}
 	});
 
 	// Update viewer dependencies
-	{
-		const size_t viewer_count = _world.viewers.count();
-		if (_world.shared_priority_dependency->viewers.size() != viewer_count) {
-			// TODO We can avoid the invalidation by using an atomic size or memory barrier?
-			_world.shared_priority_dependency = gd_make_shared<PriorityDependencyShared>();
-			_world.shared_priority_dependency->viewers.resize(viewer_count);
-		}
-		size_t i = 0;
-		unsigned int max_distance = 0;
-		_world.viewers.for_each([&i, &max_distance, this](Viewer &viewer) {
-			_world.shared_priority_dependency->viewers[i] = viewer.world_position;
-			if (viewer.view_distance > max_distance) {
-				max_distance = viewer.view_distance;
-			}
-			++i;
-		});
-		// Cancel distance is increased because of two reasons:
-		// - Some volumes use a cubic area which has higher distances on their corners
-		// - Hysteresis is needed to reduce ping-pong
-		_world.shared_priority_dependency->highest_view_distance = max_distance * 2;
-	}
-}
+	update_viewer_velocities();
+	_worlds.for_each_with_id([this](World &world, uint32_t world_id) {
+		update_world_priority_dependency(world_id, world);
+	});
 
-static unsigned int debug_get_active_thread_count(const VoxelThreadPool &pool) {
-	unsigned int active_count = 0;
-	for (unsigned int i = 0; i < pool.get_thread_count(); ++i) {
-		VoxelThreadPool::State s = pool.get_thread_debug_state(i);
-		if (s == VoxelThreadPool::STATE_RUNNING) {
-			++active_count;
-		}
-	}
-	return active_count;
+	add_main_thread_time_spent_usec(profiling_clock.restart());
+
+	// Main thread work submitted by volumes, spread over frames.
+	// It gets what volumes that were processed earlier in the frame left of the budget.
+	_time_spread_task_runner.process(get_main_thread_time_budget_left_usec());
+
+	add_main_thread_time_spent_usec(profiling_clock.restart());
 }
 
-static VoxelServer::Stats::ThreadPoolStats debug_get_pool_stats(const VoxelThreadPool &pool) {
+static VoxelServer::Stats::ThreadPoolStats debug_get_pool_stats(const VoxelThreadPool &pool, uint8_t kind) {
 	VoxelServer::Stats::ThreadPoolStats d;
-	d.tasks = pool.get_debug_remaining_tasks();
-	d.active_threads = debug_get_active_thread_count(pool);
-	d.thread_count = pool.get_thread_count();
+	d.tasks = pool.get_debug_remaining_tasks(kind);
+	d.active_threads = pool.get_debug_active_threads(kind);
+	d.thread_count = MIN(pool.get_thread_count(), pool.get_kind_max_threads(kind));
+	return d;
+}
+
+template <typename T>
+static VoxelServer::Stats::ObjectPoolStats debug_get_object_pool_stats(const ThreadSafeObjectPool<T> &pool) {
+	VoxelServer::Stats::ObjectPoolStats d;
+	d.created = pool.get_created_count();
+	d.reused = pool.get_reused_count();
+	d.pooled = pool.get_pooled_count();
 	return d;
 }
 
 VoxelServer::Stats VoxelServer::get_stats() const {
 	Stats s;
-	s.streaming = debug_get_pool_stats(_streaming_thread_pool);
-	s.generation = debug_get_pool_stats(_generation_thread_pool);
-	s.meshing = debug_get_pool_stats(_meshing_thread_pool);
+	s.streaming = debug_get_pool_stats(_general_thread_pool, TASK_KIND_STREAMING);
+	s.generation = debug_get_pool_stats(_general_thread_pool, TASK_KIND_GENERATION);
+	s.meshing = debug_get_pool_stats(_general_thread_pool, TASK_KIND_MESHING);
+	s.block_data_request_pool = debug_get_object_pool_stats(_block_data_request_pool);
+	s.block_generate_request_pool = debug_get_object_pool_stats(_block_generate_request_pool);
+	s.block_mesh_request_pool = debug_get_object_pool_stats(_block_mesh_request_pool);
+	const VoxelMemoryPool::Stats memory_pool_stats = VoxelMemoryPool::get_singleton()->get_stats();
+	s.memory_pool.created = memory_pool_stats.created;
+	s.memory_pool.reused = memory_pool_stats.reused;
+	s.memory_pool.cached_bytes = memory_pool_stats.cached_bytes;
+	s.memory_pool.live_bytes = memory_pool_stats.live_bytes;
+	s.data_memory_usage = _data_memory_usage;
+	s.data_memory_budget = _data_memory_budget;
+	s.main_thread_tasks = _time_spread_task_runner.get_pending_count();
+	s.worlds = _worlds.count();
 	return s;
 }
 
+void VoxelServer::set_thread_count(unsigned int count) {
+	ERR_FAIL_COND_MSG(count == 0, "At least one thread is needed for streaming and meshing to make progress");
+	_general_thread_pool.set_thread_count(count);
+}
+
+unsigned int VoxelServer::get_thread_count() const {
+	return _general_thread_pool.get_thread_count();
+}
+
+void VoxelServer::set_thread_pool_work_stealing_enabled(bool enabled) {
+	_general_thread_pool.set_work_stealing_enabled(enabled);
+}
+
+bool VoxelServer::is_thread_pool_work_stealing_enabled() const {
+	return _general_thread_pool.is_work_stealing_enabled();
+}
+
+void VoxelServer::set_task_kind_max_threads(TaskKind kind, unsigned int count) {
+	ERR_FAIL_INDEX(kind, TASK_KIND_COUNT);
+	_general_thread_pool.set_kind_max_threads(kind, count);
+}
+
+unsigned int VoxelServer::get_task_kind_max_threads(TaskKind kind) const {
+	ERR_FAIL_INDEX_V(kind, TASK_KIND_COUNT, 0);
+	return _general_thread_pool.get_kind_max_threads(kind);
+}
+
+void VoxelServer::set_task_kind_weight(TaskKind kind, unsigned int weight) {
+	ERR_FAIL_INDEX(kind, TASK_KIND_COUNT);
+	_general_thread_pool.set_kind_weight(kind, weight);
+}
+
+void VoxelServer::push_time_spread_task(IVoxelTimeSpreadTask *task, VoxelTimeSpreadTaskRunner::Priority priority) {
+	_time_spread_task_runner.push(task, priority);
+}
+
+void VoxelServer::add_main_thread_time_spent_usec(uint64_t usec) {
+	const uint64_t frame = Engine::get_singleton()->get_idle_frames();
+	if (frame != _main_thread_time_frame) {
+		// Volumes and the server are processed in no particular order, so the budget is tracked per frame
+		_main_thread_time_frame = frame;
+		_main_thread_time_spent_usec = 0;
+	}
+	_main_thread_time_spent_usec += usec;
+}
+
+uint64_t VoxelServer::get_main_thread_time_budget_left_usec() const {
+	if (Engine::get_singleton()->get_idle_frames() != _main_thread_time_frame) {
+		// Nothing was spent yet this frame
+		return _main_thread_time_budget_usec;
+	}
+	if (_main_thread_time_spent_usec >= _main_thread_time_budget_usec) {
+		return 0;
+	}
+	return _main_thread_time_budget_usec - _main_thread_time_spent_usec;
+}
+
+void VoxelServer::set_main_thread_time_budget_usec(unsigned int usec) {
+	_main_thread_time_budget_usec = usec;
+}
+
+unsigned int VoxelServer::get_main_thread_time_budget_usec() const {
+	return _main_thread_time_budget_usec;
+}
+
+void VoxelServer::set_memory_pool_max_cached_bytes(int64_t max_bytes) {
+	ERR_FAIL_COND(max_bytes < 0);
+	VoxelMemoryPool::get_singleton()->set_max_cached_bytes(max_bytes);
+}
+
+int64_t VoxelServer::get_memory_pool_max_cached_bytes() const {
+	return VoxelMemoryPool::get_singleton()->get_max_cached_bytes();
+}
+
+void VoxelServer::trim_memory_pool() {
+	VoxelMemoryPool::get_singleton()->trim();
+}
+
+void VoxelServer::set_data_memory_budget(int64_t budget_bytes) {
+	ERR_FAIL_COND(budget_bytes < 0);
+	_data_memory_budget = budget_bytes;
+}
+
+int64_t VoxelServer::get_data_memory_budget() const {
+	return _data_memory_budget;
+}
+
+uint64_t VoxelServer::get_data_memory_usage() const {
+	return _data_memory_usage;
+}
+
+bool VoxelServer::is_data_memory_over_budget() const {
+	return _data_memory_budget != 0 && _data_memory_usage > _data_memory_budget;
+}
+
+bool VoxelServer::has_data_memory_room() const {
+	return _data_memory_budget == 0 || _data_memory_usage < _data_memory_budget - _data_memory_budget / 4;
+}
+
 Dictionary VoxelServer::_b_get_stats() {
 	return get_stats().to_dict();
 }
 
 void VoxelServer::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("get_stats"), &VoxelServer::_b_get_stats);
+
+	ClassDB::bind_method(D_METHOD("set_thread_count", "count"), &VoxelServer::set_thread_count);
+	ClassDB::bind_method(D_METHOD("get_thread_count"), &VoxelServer::get_thread_count);
+	ClassDB::bind_method(D_METHOD("set_thread_pool_work_stealing_enabled", "enabled"),
+			&VoxelServer::set_thread_pool_work_stealing_enabled);
+	ClassDB::bind_method(D_METHOD("is_thread_pool_work_stealing_enabled"),
+			&VoxelServer::is_thread_pool_work_stealing_enabled);
+	ClassDB::bind_method(D_METHOD("set_task_kind_max_threads", "kind", "count"),
+			&VoxelServer::set_task_kind_max_threads);
+	ClassDB::bind_method(D_METHOD("get_task_kind_max_threads", "kind"), &VoxelServer::get_task_kind_max_threads);
+	ClassDB::bind_method(D_METHOD("set_task_kind_weight", "kind", "weight"), &VoxelServer::set_task_kind_weight);
+	ClassDB::bind_method(D_METHOD("set_main_thread_time_budget_usec", "usec"),
+			&VoxelServer::set_main_thread_time_budget_usec);
+	ClassDB::bind_method(D_METHOD("get_main_thread_time_budget_usec"),
+			&VoxelServer::get_main_thread_time_budget_usec);
+	ClassDB::bind_method(D_METHOD("set_memory_pool_max_cached_bytes", "max_bytes"),
+			&VoxelServer::set_memory_pool_max_cached_bytes);
+	ClassDB::bind_method(D_METHOD("get_memory_pool_max_cached_bytes"),
+			&VoxelServer::get_memory_pool_max_cached_bytes);
+	ClassDB::bind_method(D_METHOD("trim_memory_pool"), &VoxelServer::trim_memory_pool);
+	ClassDB::bind_method(D_METHOD("set_data_memory_budget", "budget_bytes"), &VoxelServer::set_data_memory_budget);
+	ClassDB::bind_method(D_METHOD("get_data_memory_budget"), &VoxelServer::get_data_memory_budget);
+
+	BIND_ENUM_CONSTANT(TASK_KIND_STREAMING);
+	BIND_ENUM_CONSTANT(TASK_KIND_GENERATION);
+	BIND_ENUM_CONSTANT(TASK_KIND_MESHING);
+	BIND_ENUM_CONSTANT(TASK_KIND_COUNT);
 }
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -638,63 +1191,22 @@ void VoxelServer::BlockDataRequest::run(VoxelTaskContext ctx) {
 	Ref<VoxelStream> stream = stream_dependency->stream;
 	CRASH_COND(stream.is_null());
 
-	const Vector3i origin_in_voxels = (position << lod) * block_size;
+	const Vector3i origin_in_voxels = get_origin_in_voxels();
 
 	switch (type) {
 		case TYPE_LOAD: {
-			voxels.instance();
-			voxels->create(block_size, block_size, block_size);
-
-			// TODO We should consider batching this again, but it needs to be done carefully.
-			// Each task is one block, and priority depends on distance to closest viewer.
-			// If we batch blocks, we have to do it by distance too.
-
+			prepare_load();
 			const VoxelStream::Result voxel_result = stream->emerge_block(voxels, origin_in_voxels, lod);
-
-			if (voxel_result == VoxelStream::RESULT_ERROR) {
-				ERR_PRINT("Error loading voxel block");
-
-			} else if (voxel_result == VoxelStream::RESULT_BLOCK_NOT_FOUND) {
-				Ref<VoxelGenerator> generator = stream_dependency->generator;
-				if (generator.is_valid()) {
-					VoxelServer::get_singleton()->request_block_generate_from_data_request(this);
-					type = TYPE_FALLBACK_ON_GENERATOR;
-				} else {
-					// If there is no generator... what do we do? What defines the format of that empty block?
-					// If the user leaves the defaults it's fine, but otherwise blocks of inconsistent format can
-					// end up in the volume and that can cause errors.
-					// TODO Define format on volume?
-				}
-			}
-
-			if (request_instances && stream->supports_instance_blocks()) {
-				ERR_FAIL_COND(instances != nullptr);
-
-				VoxelStreamInstanceDataRequest instance_data_request;
-				instance_data_request.lod = lod;
-				instance_data_request.position = position;
-				VoxelStream::Result instances_result;
-				stream->load_instance_blocks(
-						Span<VoxelStreamInstanceDataRequest>(&instance_data_request, 1),
-						Span<VoxelStream::Result>(&instances_result, 1));
-
-				if (instances_result == VoxelStream::RESULT_ERROR) {
-					ERR_PRINT("Error loading instance block");
-
-				} else if (voxel_result == VoxelStream::RESULT_BLOCK_FOUND) {
-					instances = std::move(instance_data_request.data);
-				}
-				// If not found, instances will return null,
-				// which means it can be generated by the instancer after the meshing process
-			}
-		} break;
+			finish_load(**stream, voxel_result);
+			// `has_run` is set by `finish_load`
+			return;
+		}
 
 		case TYPE_SAVE: {
 			if (request_voxels) {
 				Ref<VoxelBuffer> voxels_copy;
 				// TODO Is that copy necessary? It's possible it was already done while issuing the request
 				if (voxels.is_valid()) {
-					RWLockRead lock(voxels->get_lock());
 					voxels_copy = voxels->duplicate(true);
 				}
 				voxels.unref();
@@ -725,6 +1237,132 @@ void VoxelServer::BlockDataRequest::run(VoxelTaskContext ctx) {
 	has_run = true;
 }
 
+void VoxelServer::BlockDataRequest::run_batch(Span<IVoxelTask *> tasks, VoxelTaskContext ctx) {
+	VOXEL_PROFILE_SCOPE();
+
+	// Blocks to load are given to streams in a single call, so they can group file access.
+	// For example, region files open each region once per batch, and SQLite uses a single transaction.
+	// The pool groups blocks of the same area among the closest ones, so they are close to each other.
+	std::vector<BlockDataRequest *> loads;
+
+	for (size_t i = 0; i < tasks.size(); ++i) {
+		BlockDataRequest *r = must_be_cast<BlockDataRequest>(tasks[i]);
+		if (r->type == TYPE_LOAD) {
+			loads.push_back(r);
+		} else {
+			// Saves don't need sorting
+			r->run(ctx);
+		}
+	}
+
+	Vector<VoxelBlockRequest> block_requests;
+	Vector<VoxelStream::Result> results;
+	std::vector<BlockDataRequest *> group;
+
+	while (loads.size() > 0) {
+		// Requests of the same batch can come from different volumes, so group them by stream
+		Ref<VoxelStream> stream = loads[0]->stream_dependency->stream;
+		CRASH_COND(stream.is_null());
+
+		group.clear();
+		block_requests.clear();
+		for (size_t i = 0; i < loads.size();) {
+			BlockDataRequest *r = loads[i];
+			if (r->stream_dependency->stream == stream) {
+				r->prepare_load();
+				VoxelBlockRequest br;
+				br.voxel_buffer = r->voxels;
+				br.origin_in_voxels = r->get_origin_in_voxels();
+				br.lod = r->lod;
+				block_requests.push_back(br);
+				group.push_back(r);
+				// Order of remaining loads doesn't matter, they were picked together
+				loads[i] = loads.back();
+				loads.pop_back();
+			} else {
+				++i;
+			}
+		}
+
+		results.clear();
+		stream->emerge_blocks(block_requests, results);
+
+		if (results.size() != block_requests.size()) {
+			// Can't tell which result goes with which block. Requests still have to complete,
+			// otherwise their volume would wait for them forever.
+			ERR_PRINT(String("Stream returned {0} results for {1} blocks")
+							  .format(varray(results.size(), block_requests.size())));
+			for (size_t i = 0; i < group.size(); ++i) {
+				group[i]->finish_load(**stream, VoxelStream::RESULT_ERROR);
+			}
+			continue;
+		}
+
+		for (size_t i = 0; i < group.size(); ++i) {
+			group[i]->finish_load(**stream, results[i]);
+		}
+	}
+}
+
+void VoxelServer::BlockDataRequest::prepare_load() {
+	voxels.instance();
+	voxels->create(block_size, block_size, block_size);
+}
+
+void VoxelServer::BlockDataRequest::finish_load(VoxelStream &stream, VoxelStream::Result voxel_result) {
+	if (voxel_result == VoxelStream::RESULT_ERROR) {
+		ERR_PRINT("Error loading voxel block");
+
+	} else if (voxel_result == VoxelStream::RESULT_BLOCK_NOT_FOUND) {
+		Ref<VoxelGenerator> generator = stream_dependency->generator;
+		if (generator.is_valid()) {
+			VoxelServer::get_singleton()->request_block_generate_from_data_request(this);
+			type = TYPE_FALLBACK_ON_GENERATOR;
+		} else {
+			// If there is no generator... what do we do? What defines the format of that empty block?
+			// If the user leaves the defaults it's fine, but otherwise blocks of inconsistent format can
+			// end up in the volume and that can cause errors.
+			// TODO Define format on volume?
+		}
+	}
+
+	if (voxel_result == VoxelStream::RESULT_BLOCK_FOUND) {
+		// Loaded blocks may stay in memory for a long time
+		voxels->compress_palette_channels();
+		voxels->compress_brick_channels();
+	}
+
+	if (request_instances && stream.supports_instance_blocks()) {
+		ERR_FAIL_COND(instances != nullptr);
+
+		VoxelStreamInstanceDataRequest instance_data_request;
+		instance_data_request.lod = lod;
+		instance_data_request.position = position;
+		VoxelStream::Result instances_result;
+		stream.load_instance_blocks(
+				Span<VoxelStreamInstanceDataRequest>(&instance_data_request, 1),
+				Span<VoxelStream::Result>(&instances_result, 1));
+
+		if (instances_result == VoxelStream::RESULT_ERROR) {
+			ERR_PRINT("Error loading instance block");
+
+		} else if (voxel_result == VoxelStream::RESULT_BLOCK_FOUND) {
+			instances = std::move(instance_data_request.data);
+		}
+		// If not found, instances will return null,
+		// which means it can be generated by the instancer after the meshing process
+	}
+
+	if (type != TYPE_FALLBACK_ON_GENERATOR && pending_block != nullptr) {
+		// Let tasks depending on this block start without waiting for the main thread.
+		// They get a snapshot, because the main thread may modify the block once it receives it.
+		pending_block->result->voxels = voxels->duplicate(false);
+		pending_block->dependents.complete();
+	}
+
+	has_run = true;
+}
+
 int VoxelServer::BlockDataRequest::get_priority() {
 	if (type == TYPE_SAVE) {
 		return 0;
@@ -739,6 +1377,17 @@ bool VoxelServer::BlockDataRequest::is_cancelled() {
 	return type == TYPE_LOAD && (!stream_dependency->valid || too_far);
 }
 
+uint64_t VoxelServer::BlockDataRequest::get_batch_key() {
+	// Streams usually store nearby blocks together, like in region files or in neighbor rows of a database.
+	// Blocks are grouped by areas the size of a default region, so a batch accesses fewer of them.
+	const int area_size_po2 = 4;
+	const Vector3i area_position = position >> area_size_po2;
+	const Ref<VoxelStream> &stream = stream_dependency->stream;
+	uint64_t key = hash_djb2_one_64(stream.is_valid() ? stream->get_instance_id() : 0);
+	key = hash_djb2_one_64(lod, key);
+	return hash_djb2_one_64(Vector3iHasher::hash(area_position), key);
+}
+
 //----------------------------------------------------------------------------------------------------------------------
 
 void VoxelServer::BlockGenerateRequest::run(VoxelTaskContext ctx) {
@@ -757,6 +1406,16 @@ void VoxelServer::BlockGenerateRequest::run(VoxelTaskContext ctx) {
 
 	VoxelBlockRequest r{ voxels, origin_in_voxels, lod };
 	generator->generate_block(r);
+	// Reduces memory usage of the block while it is stored in the volume
+	voxels->compress_palette_channels();
+	voxels->compress_brick_channels();
+
+	if (pending_block != nullptr) {
+		// Let tasks depending on this block start without waiting for the main thread.
+		// They get a snapshot, because the main thread may modify the block once it receives it.
+		pending_block->result->voxels = voxels->duplicate(false);
+		pending_block->dependents.complete();
+	}
 
 	if (stream_dependency->valid) {
 		Ref<VoxelStream> stream = stream_dependency->stream;
@@ -833,7 +1492,7 @@ static void copy_block_and_neighbors(Span<Ref<VoxelBuffer>> blocks, VoxelBuffer
 	const Vector3i min_pos = -Vector3i(min_padding);
 	const Vector3i max_pos = Vector3i(mesh_block_size + max_padding);
 
-	// Using ZXY as convention to reconstruct positions with thread locking consistency
+	// Using ZXY as convention to reconstruct positions
 	unsigned int i = 0;
 	for (int z = -1; z < edge_size - 1; ++z) {
 		for (int x = -1; x < edge_size - 1; ++x) {
@@ -849,11 +1508,8 @@ static void copy_block_and_neighbors(Span<Ref<VoxelBuffer>> blocks, VoxelBuffer
 				const Vector3i src_min = min_pos - offset;
 				const Vector3i src_max = max_pos - offset;
 
-				{
-					RWLockRead read(src->get_lock());
-					for (unsigned int ci = 0; ci < channels_count; ++ci) {
-						dst.copy_from(**src, src_min, src_max, Vector3(), channels[ci]);
-					}
+				for (unsigned int ci = 0; ci < channels_count; ++ci) {
+					dst.copy_from(**src, src_min, src_max, Vector3(), channels[ci]);
 				}
 			}
 		}
@@ -864,6 +1520,17 @@ void VoxelServer::BlockMeshRequest::run(VoxelTaskContext ctx) {
 	VOXEL_PROFILE_SCOPE();
 	CRASH_COND(meshing_dependency == nullptr);
 
+	// Blocks we were waiting for are ready at this point
+	for (unsigned int i = 0; i < pending_blocks.size(); ++i) {
+		const PendingBlock &pb = pending_blocks[i];
+		if (pb.data->dropped) {
+			// Can't build a correct mesh without that block, it will have to be requested again
+			return;
+		}
+		blocks[pb.index] = pb.data->voxels;
+	}
+	pending_blocks.clear();
+
 	Ref<VoxelMesher> mesher = meshing_dependency->mesher;
 	CRASH_COND(mesher.is_null());
 	const unsigned int min_padding = mesher->get_minimum_padding();
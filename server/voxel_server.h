@@ -5,10 +5,15 @@
 #include "../meshers/blocky/voxel_mesher_blocky.h"
 #include "../streams/voxel_stream.h"
 #include "../util/file_locker.h"
+#include "../util/macros.h"
+#include "../util/object_pool.h"
 #include "struct_db.h"
+#include "voxel_task_graph.h"
 #include "voxel_thread_pool.h"
+#include "voxel_time_spread_task_runner.h"
 #include <scene/main/node.h>
 
+#include <atomic>
 #include <memory>
 
 // TODO Don't inherit Object. Instead have a Godot wrapper, there is very little use for Object stuff
@@ -45,7 +50,8 @@ public:
 	};
 
 	struct BlockMeshInput {
-		// Moore area ordered by forward XYZ iteration
+		// Moore area ordered by forward XYZ iteration.
+		// Blocks left null which are still being loaded by the server will be waited for before meshing.
 		FixedArray<Ref<VoxelBuffer>, VoxelConstants::MAX_BLOCK_COUNT_PER_REQUEST> data_blocks;
 		unsigned int data_blocks_count = 0;
 		Vector3i render_block_position;
@@ -65,9 +71,19 @@ public:
 		// 	FLAGS_COUNT = 3
 		// };
 		Vector3 world_position;
+		// Estimated from position changes over frames, in world units per second
+		Vector3 velocity;
+		Vector3 last_world_position;
+		bool has_last_world_position = false;
+		// Where the viewer is looking at. Blocks in view are processed first.
+		// Not used if zero, or if the field of view is zero.
+		Vector3 view_direction;
+		// Full angle of a cone enclosing the view, in degrees
+		float view_fov_degrees = 0.f;
 		unsigned int view_distance = 128;
 		bool require_collisions = false;
 		bool require_visuals = true;
+		uint32_t world_id = 0;
 	};
 
 	enum VolumeType {
@@ -75,6 +91,14 @@ public:
 		VOLUME_SPARSE_OCTREE
 	};
 
+	// All tasks run in the same thread pool, but each kind has its own budget
+	enum TaskKind {
+		TASK_KIND_STREAMING = 0,
+		TASK_KIND_GENERATION,
+		TASK_KIND_MESHING,
+		TASK_KIND_COUNT
+	};
+
 	static VoxelServer *get_singleton();
 	static void create_singleton();
 	static void destroy_singleton();
@@ -83,7 +107,22 @@ public:
 	~VoxelServer();
 
 	// TODO Rename functions to C convention
+	// Worlds isolate volumes and viewers from each other. Volumes only pair with viewers of the same world,
+	// and their tasks are prioritized and dropped based on these viewers only.
+	// Tasks of all worlds share the same threads, ordered by distance to the closest viewer of their own world,
+	// so a busy world doesn't starve the others of nearby work.
+	// Volumes and viewers start in the default world.
+	uint32_t add_world();
+	void remove_world(uint32_t world_id);
+	bool world_exists(uint32_t world_id) const;
+	uint32_t get_default_world() const;
+	// Gets the world matching a Godot World, creating it if needed.
+	// Such worlds are removed automatically once no volume or viewer uses them.
+	uint32_t get_world_for_godot_world(ObjectID godot_world_id);
+
 	uint32_t add_volume(ReceptionBuffers *buffers, VolumeType type);
+	void set_volume_world(uint32_t volume_id, uint32_t world_id);
+	uint32_t get_volume_world(uint32_t volume_id) const;
 	void set_volume_transform(uint32_t volume_id, Transform t);
 	void set_volume_render_block_size(uint32_t volume_id, uint32_t block_size);
 	void set_volume_data_block_size(uint32_t volume_id, uint32_t block_size);
@@ -91,6 +130,8 @@ public:
 	void set_volume_generator(uint32_t volume_id, Ref<VoxelGenerator> generator);
 	void set_volume_mesher(uint32_t volume_id, Ref<VoxelMesher> mesher);
 	void set_volume_octree_lod_distance(uint32_t volume_id, float lod_distance);
+	// Volumes report how much memory their voxel data takes, so it can be compared to the global budget
+	void set_volume_data_memory_usage(uint32_t volume_id, uint64_t usage);
 	void invalidate_volume_mesh_requests(uint32_t volume_id);
 	void request_block_mesh(uint32_t volume_id, const BlockMeshInput &input);
 	void request_block_load(uint32_t volume_id, Vector3i block_pos, int lod, bool request_instances);
@@ -102,7 +143,11 @@ public:
 	// TODO Rename functions to C convention
 	uint32_t add_viewer();
 	void remove_viewer(uint32_t viewer_id);
+	void set_viewer_world(uint32_t viewer_id, uint32_t world_id);
+	uint32_t get_viewer_world(uint32_t viewer_id) const;
 	void set_viewer_position(uint32_t viewer_id, Vector3 position);
+	void set_viewer_view_direction(uint32_t viewer_id, Vector3 direction);
+	void set_viewer_view_fov(uint32_t viewer_id, float fov_degrees);
 	void set_viewer_distance(uint32_t viewer_id, unsigned int distance);
 	unsigned int get_viewer_distance(uint32_t viewer_id) const;
 	void set_viewer_requires_visuals(uint32_t viewer_id, bool enabled);
@@ -112,8 +157,12 @@ public:
 	bool viewer_exists(uint32_t viewer_id) const;
 
 	template <typename F>
-	inline void for_each_viewer(F f) const {
-		_world.viewers.for_each_with_id(f);
+	inline void for_each_viewer(uint32_t world_id, F f) const {
+		_viewers.for_each_with_id([world_id, &f](const Viewer &viewer, uint32_t viewer_id) {
+			if (viewer.world_id == world_id) {
+				f(viewer, viewer_id);
+			}
+		});
 	}
 
 	// Gets by how much voxels must be padded with neighbors in order to be polygonized properly
@@ -150,26 +199,132 @@ public:
 			}
 		};
 
+		struct ObjectPoolStats {
+			unsigned int created;
+			unsigned int reused;
+			unsigned int pooled;
+
+			Dictionary to_dict() {
+				Dictionary d;
+				d["created"] = created;
+				d["reused"] = reused;
+				d["pooled"] = pooled;
+				// Ratio of objects obtained without allocating
+				d["hit_rate"] = created + reused == 0 ? 0.f : static_cast<float>(reused) / (created + reused);
+				return d;
+			}
+		};
+
+		struct MemoryPoolStats {
+			uint64_t created;
+			uint64_t reused;
+			uint64_t cached_bytes;
+			uint64_t live_bytes;
+
+			Dictionary to_dict() {
+				Dictionary d;
+				d["created"] = SIZE_T_TO_VARIANT(created);
+				d["reused"] = SIZE_T_TO_VARIANT(reused);
+				// Ratio of voxel data allocations that reused memory
+				d["hit_rate"] = created + reused == 0 ? 0.f : static_cast<float>(reused) / (created + reused);
+				d["cached_bytes"] = SIZE_T_TO_VARIANT(cached_bytes);
+				d["live_bytes"] = SIZE_T_TO_VARIANT(live_bytes);
+				return d;
+			}
+		};
+
 		ThreadPoolStats streaming;
 		ThreadPoolStats generation;
 		ThreadPoolStats meshing;
 
+		ObjectPoolStats block_data_request_pool;
+		ObjectPoolStats block_generate_request_pool;
+		ObjectPoolStats block_mesh_request_pool;
+
+		MemoryPoolStats memory_pool;
+
+		uint64_t data_memory_usage;
+		uint64_t data_memory_budget;
+
+		unsigned int main_thread_tasks;
+		unsigned int worlds;
+
 		Dictionary to_dict() {
 			Dictionary d;
 			d["streaming"] = streaming.to_dict();
 			d["generation"] = generation.to_dict();
 			d["meshing"] = meshing.to_dict();
+			Dictionary pools;
+			pools["block_data_requests"] = block_data_request_pool.to_dict();
+			pools["block_generate_requests"] = block_generate_request_pool.to_dict();
+			pools["block_mesh_requests"] = block_mesh_request_pool.to_dict();
+			d["pools"] = pools;
+			d["memory_pool"] = memory_pool.to_dict();
+			d["data_memory_usage"] = SIZE_T_TO_VARIANT(data_memory_usage);
+			d["data_memory_budget"] = SIZE_T_TO_VARIANT(data_memory_budget);
+			d["main_thread_tasks"] = main_thread_tasks;
+			d["worlds"] = worlds;
 			return d;
 		}
 	};
 
 	Stats get_stats() const;
 
+	// Thread settings can be changed at any time, without dropping tasks.
+	// For example, a headless pre-generation job can use more threads than an interactive client.
+
+	void set_thread_count(unsigned int count);
+	unsigned int get_thread_count() const;
+
+	// Gives each thread its own task queue, and lets idle threads steal from others.
+	// Reduces contention when there are many threads, but priority order becomes approximate.
+	void set_thread_pool_work_stealing_enabled(bool enabled);
+	bool is_thread_pool_work_stealing_enabled() const;
+
+	// Maximum number of threads that can run tasks of the given kind at the same time
+	void set_task_kind_max_threads(TaskKind kind, unsigned int count);
+	unsigned int get_task_kind_max_threads(TaskKind kind) const;
+
+	// When tasks of several kinds are waiting, each kind gets threads in proportion to its weight
+	void set_task_kind_weight(TaskKind kind, unsigned int weight);
+
+	// Main thread work resulting from tasks, like building meshes and colliders, is spread over several frames.
+	// Each frame, `process()` runs as many of these as fit in the budget, and the rest carries over to the next.
+	// Takes ownership of the task. Must be called from the main thread.
+	void push_time_spread_task(IVoxelTimeSpreadTask *task, VoxelTimeSpreadTaskRunner::Priority priority);
+
+	// Main thread work that volumes have to do right away, like storing received voxel data or requesting saves,
+	// is reported here. It takes from the same budget as spread tasks, so those get less time on busy frames.
+	void add_main_thread_time_spent_usec(uint64_t usec);
+	// Time left in the budget of the current frame.
+	// Work that can be interrupted should stop when there is none left, and resume on the next frame.
+	uint64_t get_main_thread_time_budget_left_usec() const;
+
+	void set_main_thread_time_budget_usec(unsigned int usec);
+	unsigned int get_main_thread_time_budget_usec() const;
+
+	// Voxel data memory no longer used is kept for reuse, up to this amount. 0 means no limit.
+	void set_memory_pool_max_cached_bytes(int64_t max_bytes);
+	int64_t get_memory_pool_max_cached_bytes() const;
+	// Gives memory kept for reuse back to the system, for example after loading a large area
+	void trim_memory_pool();
+
+	// Memory voxel data of all volumes can take. 0 means no limit.
+	// Volumes shorten their view distance while it is exceeded, so blocks farthest from viewers get unloaded.
+	void set_data_memory_budget(int64_t budget_bytes);
+	int64_t get_data_memory_budget() const;
+	uint64_t get_data_memory_usage() const;
+	bool is_data_memory_over_budget() const;
+	// Volumes only grow their view distance back when usage is well below the budget, so they don't oscillate
+	bool has_data_memory_room() const;
+
 private:
 	class BlockDataRequest;
 	class BlockGenerateRequest;
 
 	void request_block_generate_from_data_request(BlockDataRequest *src);
+	void recycle_task(IVoxelTask *task);
+	static void recycle_unscheduled_task(IVoxelTask *task);
 	void request_block_save_from_generate_request(BlockGenerateRequest *src);
 
 	Dictionary _b_get_stats();
@@ -199,8 +354,28 @@ private:
 		bool valid = true;
 	};
 
+	// Voxels of a block being loaded or generated, available once it completes
+	struct PendingDataBlockResult {
+		// Written before completion, read-only after
+		Ref<VoxelBuffer> voxels;
+		bool dropped = false;
+	};
+
+	// Block being loaded or generated.
+	// Meshing tasks can depend on it, so they start as soon as the data is ready instead of waiting for
+	// the main thread to receive it and send a new request.
+	struct PendingDataBlock {
+		VoxelTaskDependents dependents;
+		// Waiting tasks only keep the result, otherwise they would keep the block alive through its dependents
+		std::shared_ptr<PendingDataBlockResult> result;
+
+		// If the block goes away before completing, waiting tasks still get scheduled and see it dropped
+		~PendingDataBlock();
+	};
+
 	struct Volume {
 		VolumeType type;
+		uint32_t world_id = 0;
 		ReceptionBuffers *reception_buffers = nullptr;
 		Transform transform;
 		Ref<VoxelStream> stream;
@@ -211,34 +386,70 @@ private:
 		float octree_lod_distance = 0;
 		std::shared_ptr<StreamingDependency> stream_dependency;
 		std::shared_ptr<MeshingDependency> meshing_dependency;
+		// Blocks being loaded, per LOD. Only accessed from the main thread.
+		FixedArray<HashMap<Vector3i, std::shared_ptr<PendingDataBlock>, Vector3iHasher>, VoxelConstants::MAX_LOD>
+				pending_data_blocks;
+		// Results about to be received, used to reserve reception buffers
+		uint32_t received_data_count = 0;
+		uint32_t received_mesh_count = 0;
+		uint64_t data_memory_usage = 0;
 	};
 
 	struct PriorityDependencyShared {
-		// These positions are written by the main thread and read by block processing threads.
+		struct ViewerState {
+			Vector3 position;
+			Vector3 velocity;
+			// Normalized, or zero if the view cone isn't used
+			Vector3 view_direction;
+			float view_cone_sin = 0.f;
+			float view_cone_cos = 1.f;
+		};
+		// These are written by the main thread every frame and read by block processing threads.
 		// Order doesn't matter.
 		// It's only used to adjust task priority so using a lock isn't worth it. In worst case scenario,
 		// a task will run much sooner or later than expected, but it will run in any case.
-		std::vector<Vector3> viewers;
+		// Slots beyond `viewer_count` are unused, so viewers can come and go without reallocating.
+		std::vector<ViewerState> viewers;
+		std::atomic<uint32_t> viewer_count;
 		float highest_view_distance = 999999;
+		// How far ahead viewer positions are predicted, roughly the time it takes for a task to complete
+		float prediction_time = 0.f;
+
+		PriorityDependencyShared() :
+				viewer_count(0) {}
 	};
 
 	struct World {
-		StructDB<Volume> volumes;
-		StructDB<Viewer> viewers;
-
-		// Must be overwritten with a new instance if count changes.
+		// Must be overwritten with a new instance if viewers don't fit in it anymore.
+		// Otherwise it is updated in place, so queued tasks see viewers moving.
 		std::shared_ptr<PriorityDependencyShared> shared_priority_dependency;
+		// Set if the world was created for a Godot World, in which case it gets removed when no longer used
+		ObjectID godot_world_id = 0;
+		unsigned int volume_count = 0;
+		unsigned int viewer_count = 0;
 	};
 
 	struct PriorityDependency {
 		std::shared_ptr<PriorityDependencyShared> shared;
-		Vector3 world_position; // TODO Won't update while in queue. Can it be bad?
+		// Position of the block.
+		// TODO Won't update while in queue if the volume moves. Can it be bad?
+		Vector3 world_position;
+		float world_radius;
+		// Used to estimate how long tasks take to complete
+		uint32_t request_time_msec = 0;
 		// If the closest viewer is further away than this distance, the request can be cancelled as not worth it
 		float drop_distance_squared;
 	};
 
 	void init_priority_dependency(PriorityDependency &dep, Vector3i block_position, uint8_t lod, const Volume &volume,
 			int block_size);
+	void reserve_reception_buffers(Span<IVoxelTask *> tasks);
+	void release_world(uint32_t world_id);
+	void update_world_priority_dependency(uint32_t world_id, World &world);
+	void update_viewer_velocities();
+	void update_task_latency(const PriorityDependency &dep);
+	static void on_pending_data_block_returned(Volume *volume, const std::shared_ptr<PendingDataBlock> &pending_block,
+			Vector3i position, uint8_t lod);
 	static int get_priority(const PriorityDependency &dep, uint8_t lod_index, float *out_closest_distance_sq);
 
 	class BlockDataRequest : public IVoxelTask {
@@ -253,6 +464,40 @@ private:
 		int get_priority() override;
 		bool is_cancelled() override;
 
+		uint8_t get_kind() override {
+			return TASK_KIND_STREAMING;
+		}
+
+		uint64_t get_batch_key() override;
+
+		// Resets to defaults before being pooled
+		void init() {
+			voxels.unref();
+			instances.reset();
+			position = Vector3i();
+			volume_id = 0;
+			lod = 0;
+			block_size = 0;
+			type = TYPE_LOAD;
+			has_run = false;
+			too_far = false;
+			request_instances = false;
+			request_voxels = false;
+			priority_dependency = PriorityDependency();
+			stream_dependency.reset();
+			pending_block.reset();
+		}
+
+		// Runs several requests at once, so loading can be batched
+		static void run_batch(Span<IVoxelTask *> tasks, VoxelTaskContext ctx);
+
+		inline Vector3i get_origin_in_voxels() const {
+			return (position << lod) * block_size;
+		}
+
+		void prepare_load();
+		void finish_load(VoxelStream &stream, VoxelStream::Result voxel_result);
+
 		Ref<VoxelBuffer> voxels;
 		std::unique_ptr<VoxelInstanceBlockData> instances;
 		Vector3i position;
@@ -266,6 +511,8 @@ private:
 		bool request_voxels = false;
 		PriorityDependency priority_dependency;
 		std::shared_ptr<StreamingDependency> stream_dependency;
+		// Only for loading
+		std::shared_ptr<PendingDataBlock> pending_block;
 		// TODO Find a way to separate save, it doesnt need sorting
 	};
 
@@ -275,6 +522,24 @@ private:
 		int get_priority() override;
 		bool is_cancelled() override;
 
+		uint8_t get_kind() override {
+			return TASK_KIND_GENERATION;
+		}
+
+		// Resets to defaults before being pooled
+		void init() {
+			voxels.unref();
+			position = Vector3i();
+			volume_id = 0;
+			lod = 0;
+			block_size = 0;
+			has_run = false;
+			too_far = false;
+			priority_dependency = PriorityDependency();
+			stream_dependency.reset();
+			pending_block.reset();
+		}
+
 		Ref<VoxelBuffer> voxels;
 		Vector3i position;
 		uint32_t volume_id;
@@ -284,6 +549,7 @@ private:
 		bool too_far = false;
 		PriorityDependency priority_dependency;
 		std::shared_ptr<StreamingDependency> stream_dependency;
+		std::shared_ptr<PendingDataBlock> pending_block;
 	};
 
 	class BlockMeshRequest : public IVoxelTask {
@@ -292,6 +558,33 @@ private:
 		int get_priority() override;
 		bool is_cancelled() override;
 
+		uint8_t get_kind() override {
+			return TASK_KIND_MESHING;
+		}
+
+		// Resets to defaults before being pooled.
+		// Containers are cleared rather than reassigned, so their capacity is reused by the next request.
+		void init() {
+			for (unsigned int i = 0; i < blocks.size(); ++i) {
+				blocks[i].unref();
+			}
+			position = Vector3i();
+			volume_id = 0;
+			lod = 0;
+			blocks_count = 0;
+			has_run = false;
+			too_far = false;
+			priority_dependency = PriorityDependency();
+			meshing_dependency.reset();
+			surfaces_output.surfaces.clear();
+			for (unsigned int i = 0; i < surfaces_output.transition_surfaces.size(); ++i) {
+				surfaces_output.transition_surfaces[i].clear();
+			}
+			surfaces_output.primitive_type = Mesh::PRIMITIVE_TRIANGLES;
+			surfaces_output.compression_flags = Mesh::ARRAY_COMPRESS_DEFAULT;
+			pending_blocks.clear();
+		}
+
 		FixedArray<Ref<VoxelBuffer>, VoxelConstants::MAX_BLOCK_COUNT_PER_REQUEST> blocks;
 		Vector3i position;
 		uint32_t volume_id;
@@ -302,18 +595,50 @@ private:
 		PriorityDependency priority_dependency;
 		std::shared_ptr<MeshingDependency> meshing_dependency;
 		VoxelMesher::Output surfaces_output;
+
+		struct PendingBlock {
+			std::shared_ptr<PendingDataBlockResult> data;
+			uint8_t index; // In `blocks`
+		};
+		// Blocks that were still loading when the request was made.
+		// The task is scheduled once they are all ready.
+		std::vector<PendingBlock> pending_blocks;
 	};
 
-	// TODO multi-world support in the future
-	World _world;
+	// Volumes and viewers are not stored per world, because their IDs are used to address them directly
+	StructDB<Volume> _volumes;
+	StructDB<Viewer> _viewers;
+	StructDB<World> _worlds;
+	uint32_t _default_world_id;
+
+	uint64_t _last_process_time_usec = 0;
+	// Smoothed time between the request of a task and the reception of its result
+	float _average_task_latency = 0.f;
+
+	// Requests are created very often, so they are recycled instead of being freed.
+	// Declared before the thread pool so they outlive its threads.
+	ThreadSafeObjectPool<BlockDataRequest> _block_data_request_pool;
+	ThreadSafeObjectPool<BlockGenerateRequest> _block_generate_request_pool;
+	ThreadSafeObjectPool<BlockMeshRequest> _block_mesh_request_pool;
 
-	VoxelThreadPool _streaming_thread_pool;
-	VoxelThreadPool _generation_thread_pool;
-	VoxelThreadPool _meshing_thread_pool;
+	// Runs tasks of all kinds, so threads don't sit idle when one kind of work dominates
+	VoxelThreadPool _general_thread_pool;
+
+	VoxelTimeSpreadTaskRunner _time_spread_task_runner;
+	unsigned int _main_thread_time_budget_usec;
+	// Main thread time spent on voxel work during the frame `_main_thread_time_frame`
+	uint64_t _main_thread_time_spent_usec = 0;
+	uint64_t _main_thread_time_frame = 0;
+
+	// Sum of the usage reported by volumes
+	uint64_t _data_memory_usage = 0;
+	uint64_t _data_memory_budget = 0;
 
 	VoxelFileLocker _file_locker;
 };
 
+VARIANT_ENUM_CAST(VoxelServer::TaskKind);
+
 // TODO Hack to make VoxelServer update... need ways to integrate callbacks from main loop!
 class VoxelServerUpdater : public Node {
 	GDCLASS(VoxelServerUpdater, Node)
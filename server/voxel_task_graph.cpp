@@ -0,0 +1,58 @@
+#include "voxel_task_graph.h"
+#include "voxel_thread_pool.h"
+
+VoxelTaskGraphNode::VoxelTaskGraphNode(IVoxelTask *task, VoxelThreadPool &pool, ReleaseTaskFunc release_task) :
+		_task(task), _pool(pool), _release_task(release_task), _remaining_dependencies(1) {
+	CRASH_COND(task == nullptr);
+	CRASH_COND(release_task == nullptr);
+}
+
+VoxelTaskGraphNode::~VoxelTaskGraphNode() {
+	if (_task != nullptr) {
+		// The node was never scheduled, so the task will never run
+		_release_task(_task);
+	}
+}
+
+void VoxelTaskGraphNode::schedule() {
+	notify_dependency_completed();
+}
+
+void VoxelTaskGraphNode::notify_dependency_completed() {
+	const uint32_t prev = _remaining_dependencies--;
+	CRASH_COND(prev == 0);
+	if (prev == 1) {
+		IVoxelTask *task = _task;
+		_task = nullptr;
+		_pool.enqueue(task);
+	}
+}
+
+void VoxelTaskDependents::add(std::shared_ptr<VoxelTaskGraphNode> node) {
+	CRASH_COND(node == nullptr);
+	MutexLock lock(_mutex);
+	if (_completed) {
+		return;
+	}
+	++node->_remaining_dependencies;
+	_nodes.push_back(node);
+}
+
+void VoxelTaskDependents::complete() {
+	std::vector<std::shared_ptr<VoxelTaskGraphNode>> nodes;
+	{
+		MutexLock lock(_mutex);
+		CRASH_COND(_completed);
+		_completed = true;
+		nodes.swap(_nodes);
+	}
+	// Notify outside of the lock, this can enqueue tasks
+	for (size_t i = 0; i < nodes.size(); ++i) {
+		nodes[i]->notify_dependency_completed();
+	}
+}
+
+bool VoxelTaskDependents::is_completed() const {
+	MutexLock lock(_mutex);
+	return _completed;
+}
@@ -0,0 +1,65 @@
+#ifndef VOXEL_TASK_GRAPH_H
+#define VOXEL_TASK_GRAPH_H
+
+#include <core/os/mutex.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+class IVoxelTask;
+class VoxelThreadPool;
+
+// Lightweight dependencies between tasks of a VoxelThreadPool.
+// A task can wait for other tasks to complete before being scheduled. Instead of coming back to the main thread,
+// it gets enqueued by the thread completing its last dependency.
+
+// Holds a task until all its dependencies have completed.
+class VoxelTaskGraphNode {
+public:
+	typedef void (*ReleaseTaskFunc)(IVoxelTask *task);
+
+	// Takes ownership of the task. It won't be enqueued before `schedule()` is called.
+	// If it never gets enqueued, it is given back to `release_task` when the node is destroyed.
+	VoxelTaskGraphNode(IVoxelTask *task, VoxelThreadPool &pool, ReleaseTaskFunc release_task);
+
+	~VoxelTaskGraphNode();
+
+	// Must be called once all dependencies have been added.
+	// If they all completed already, the task is enqueued immediately.
+	void schedule();
+
+	// Called by dependencies when they complete. The last call enqueues the task.
+	void notify_dependency_completed();
+
+private:
+	friend class VoxelTaskDependents;
+
+	IVoxelTask *_task;
+	VoxelThreadPool &_pool;
+	ReleaseTaskFunc _release_task;
+	// Starts at 1 so the task can't be enqueued while dependencies are still being added
+	std::atomic<uint32_t> _remaining_dependencies;
+};
+
+// Nodes waiting for the completion of a task.
+// It keeps waiting nodes alive, so the task producing the result should own it,
+// while tasks consuming the result should not, otherwise they would form a reference cycle.
+class VoxelTaskDependents {
+public:
+	// Makes a node wait for the completion of the task. Does nothing if it completed already.
+	void add(std::shared_ptr<VoxelTaskGraphNode> node);
+
+	// Must be called once the result of the task is available.
+	// Nodes for which it was the last dependency get scheduled from the calling thread.
+	void complete();
+
+	bool is_completed() const;
+
+private:
+	mutable Mutex _mutex;
+	std::vector<std::shared_ptr<VoxelTaskGraphNode>> _nodes;
+	bool _completed = false;
+};
+
+#endif // VOXEL_TASK_GRAPH_H
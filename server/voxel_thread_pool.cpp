@@ -5,6 +5,8 @@
 #include <core/os/semaphore.h>
 #include <core/os/thread.h>
 
+#include <thread>
+
 // template <typename T>
 // static bool contains(const std::vector<T> vec, T v) {
 // 	for (size_t i = 0; i < vec.size(); ++i) {
@@ -15,11 +17,14 @@
 // 	return false;
 // }
 
-VoxelThreadPool::VoxelThreadPool() {
+VoxelThreadPool::VoxelThreadPool() :
+		_thread_count(0),
+		_work_stealing_enabled(false),
+		_next_thread_index(0) {
 }
 
 VoxelThreadPool::~VoxelThreadPool() {
-	destroy_all_threads();
+	resize_threads(0);
 
 	if (_completed_tasks.size() != 0) {
 		// We don't have ownership over tasks, so it's an error to destroy the pool without handling them
@@ -27,10 +32,17 @@ VoxelThreadPool::~VoxelThreadPool() {
 	}
 }
 
+uint32_t VoxelThreadPool::get_hardware_thread_count() {
+	const unsigned int hw_threads_hint = std::thread::hardware_concurrency();
+	// The standard allows returning 0 if the value is not computable
+	return hw_threads_hint != 0 ? hw_threads_hint : 4;
+}
+
 void VoxelThreadPool::create_thread(ThreadData &d, uint32_t i) {
 	d.pool = this;
 	d.stop = false;
 	d.waiting = false;
+	d.exited = false;
 	d.index = i;
 	if (!_name.empty()) {
 		d.name = String("{0} {1}").format(varray(_name, i));
@@ -38,22 +50,24 @@ void VoxelThreadPool::create_thread(ThreadData &d, uint32_t i) {
 	d.thread.start(thread_func_static, &d);
 }
 
-void VoxelThreadPool::destroy_all_threads() {
-	// We have only one semaphore to signal threads to resume, and one `post()` lets only one pass.
-	// We cannot tell one single thread to stop, because when we post and other threads are waiting, we can't guarantee
-	// the one to pass will be the one we want.
-	// So we can only choose to stop ALL threads, and then start them again if we want to adjust their count.
-	// Also, it shouldn't drop tasks. Any tasks the thread was working on should still complete normally.
-	for (size_t i = 0; i < _thread_count; ++i) {
-		ThreadData &d = _threads[i];
-		d.stop = true;
-	}
-	for (size_t i = 0; i < _thread_count; ++i) {
-		_tasks_semaphore.post();
+void VoxelThreadPool::stop_threads(Span<ThreadData *> threads) {
+	// It shouldn't drop tasks. Any tasks the thread was working on should still complete normally.
+	for (size_t i = 0; i < threads.size(); ++i) {
+		threads[i]->stop = true;
 	}
-	for (size_t i = 0; i < _thread_count; ++i) {
-		ThreadData &d = _threads[i];
-		d.wait_to_finish_and_reset();
+	// We have only one semaphore to signal threads to resume, and one `post()` lets only one pass.
+	// When we post and other threads are waiting, we can't guarantee the one to pass will be the one we want to stop.
+	// So we keep posting as long as threads to stop are still waiting. Threads woken up by mistake will find no task
+	// and go back to waiting.
+	for (size_t i = 0; i < threads.size(); ++i) {
+		ThreadData &d = *threads[i];
+		while (!d.exited) {
+			if (d.waiting) {
+				_tasks_semaphore.post();
+			}
+			OS::get_singleton()->delay_usec(100);
+		}
+		d.thread.wait_to_finish();
 	}
 }
 
@@ -62,53 +76,181 @@ void VoxelThreadPool::set_name(String name) {
 }
 
 void VoxelThreadPool::set_thread_count(uint32_t count) {
-	if (count > MAX_THREADS) {
-		count = MAX_THREADS;
+	ERR_FAIL_COND_MSG(count == 0, "Thread pool needs at least one thread to run tasks");
+	resize_threads(count);
+}
+
+void VoxelThreadPool::resize_threads(uint32_t count) {
+	if (count == _thread_count) {
+		return;
+	}
+
+	if (count > _thread_count) {
+		MutexLock lock(_threads_mutex);
+		for (uint32_t i = _thread_count; i < count; ++i) {
+			ThreadData *d = memnew(ThreadData);
+			_threads.push_back(d);
+			create_thread(*d, i);
+		}
+		_thread_count = count;
+		return;
+	}
+
+	// Detach threads to remove from the list first, so other threads stop stealing from them
+	std::vector<ThreadData *> removed_threads;
+	{
+		MutexLock lock(_threads_mutex);
+		for (uint32_t i = count; i < _threads.size(); ++i) {
+			removed_threads.push_back(_threads[i]);
+		}
+		_threads.resize(count);
+		_thread_count = count;
 	}
-	destroy_all_threads();
-	for (uint32_t i = _thread_count; i < count; ++i) {
-		ThreadData &d = _threads[i];
-		create_thread(d, i);
+
+	stop_threads(to_span(removed_threads));
+
+	// Hand over tasks that were left in queues of removed threads.
+	// Threads in work-stealing mode also look into the shared queue, so they will get picked up.
+	unsigned int handed_over_count = 0;
+	{
+		MutexLock lock(_tasks_mutex);
+		for (size_t i = 0; i < removed_threads.size(); ++i) {
+			ThreadData *d = removed_threads[i];
+			handed_over_count += d->local_tasks.size();
+			d->local_tasks.move_all_to(_tasks);
+			memdelete(d);
+		}
 	}
-	_thread_count = count;
+	post_for_new_tasks(handed_over_count);
 }
 
 void VoxelThreadPool::set_batch_count(uint32_t count) {
-	_batch_count = count;
+	for (unsigned int i = 0; i < _kinds.size(); ++i) {
+		_kinds[i].batch_count = count;
+	}
 }
 
 void VoxelThreadPool::set_priority_update_period(uint32_t milliseconds) {
-	_priority_update_period = milliseconds;
+	for (unsigned int i = 0; i < _kinds.size(); ++i) {
+		_kinds[i].priority_update_period = milliseconds;
+	}
+}
+
+void VoxelThreadPool::set_kind_batch_count(uint8_t kind, uint32_t count) {
+	ERR_FAIL_INDEX(kind, MAX_KINDS);
+	_kinds[kind].batch_count = count;
+}
+
+void VoxelThreadPool::set_kind_batch_lookahead(uint8_t kind, uint32_t count) {
+	ERR_FAIL_INDEX(kind, MAX_KINDS);
+	_kinds[kind].batch_lookahead = count;
+}
+
+void VoxelThreadPool::set_kind_priority_update_period(uint8_t kind, uint32_t milliseconds) {
+	ERR_FAIL_INDEX(kind, MAX_KINDS);
+	_kinds[kind].priority_update_period = milliseconds;
+}
+
+void VoxelThreadPool::set_kind_max_threads(uint8_t kind, uint32_t count) {
+	ERR_FAIL_INDEX(kind, MAX_KINDS);
+	// Lowering it below the number of active threads is fine, it will apply as they finish their tasks
+	_kinds[kind].max_threads = count;
+}
+
+uint32_t VoxelThreadPool::get_kind_max_threads(uint8_t kind) const {
+	ERR_FAIL_INDEX_V(kind, MAX_KINDS, 0);
+	return _kinds[kind].max_threads;
+}
+
+void VoxelThreadPool::set_kind_weight(uint8_t kind, uint32_t weight) {
+	ERR_FAIL_INDEX(kind, MAX_KINDS);
+	ERR_FAIL_COND(weight == 0);
+	_kinds[kind].weight = weight;
+}
+
+void VoxelThreadPool::set_kind_batch_runner(uint8_t kind, VoxelTaskBatchRunner runner) {
+	ERR_FAIL_INDEX(kind, MAX_KINDS);
+	_kinds[kind].batch_runner = runner;
+}
+
+void VoxelThreadPool::set_work_stealing_enabled(bool enabled) {
+	if (enabled == _work_stealing_enabled) {
+		return;
+	}
+	// Threads read the mode without locking, so they are stopped while it changes.
+	// Stopping them also hands their local queues over to the shared queue, which threads look into in both modes,
+	// so no task gets stranded.
+	const uint32_t thread_count = _thread_count;
+	resize_threads(0);
+	_work_stealing_enabled = enabled;
+	resize_threads(thread_count);
+}
+
+void VoxelThreadPool::post_for_new_tasks(uint32_t task_count) {
+	// Threads keep picking tasks until they find none, so there is no need to post once per task.
+	// Waking up as many threads as there are new tasks is enough.
+	const uint32_t post_count = MIN(task_count, _thread_count.load());
+	for (uint32_t i = 0; i < post_count; ++i) {
+		_tasks_semaphore.post();
+	}
 }
 
 void VoxelThreadPool::enqueue(IVoxelTask *task) {
+	enqueue(Span<IVoxelTask *>(&task, 1));
+}
+
+VoxelThreadPool::TaskItem VoxelThreadPool::make_task_item(IVoxelTask *task, uint32_t now) {
 	CRASH_COND(task == nullptr);
-	{
-		MutexLock lock(_tasks_mutex);
-		TaskItem t;
-		t.task = task;
-		_tasks.push_back(t);
-		++_debug_received_tasks;
-	}
-	// TODO Do I need to post a certain amount of times?
-	_tasks_semaphore.post();
+	TaskItem item;
+	item.task = task;
+	// Priority is evaluated right away so the task can be inserted at the right place in the queue
+	item.cached_priority = task->get_priority();
+	item.last_priority_update_time = now;
+	item.kind = task->get_kind();
+	CRASH_COND(item.kind >= MAX_KINDS);
+	item.batch_key = task->get_batch_key();
+	return item;
 }
 
 void VoxelThreadPool::enqueue(Span<IVoxelTask *> tasks) {
-	{
+	const uint32_t now = OS::get_singleton()->get_ticks_msec();
+
+	// Counted before tasks become visible to threads, so remaining tasks can't appear negative
+	for (size_t i = 0; i < tasks.size(); ++i) {
+		++_kinds[tasks[i]->get_kind()].debug_received_tasks;
+	}
+
+	bool queued_in_threads = false;
+
+	if (_work_stealing_enabled) {
+		MutexLock threads_lock(_threads_mutex);
+		const uint32_t thread_count = _threads.size();
+
+		if (thread_count > 1) {
+			// Spread tasks evenly across threads
+			const uint32_t first_thread_index = _next_thread_index++;
+
+			for (uint32_t ti = 0; ti < thread_count && ti < tasks.size(); ++ti) {
+				ThreadData &thread_data = *_threads[(first_thread_index + ti) % thread_count];
+				MutexLock lock(thread_data.local_tasks_mutex);
+
+				for (size_t i = ti; i < tasks.size(); i += thread_count) {
+					thread_data.local_tasks.push(make_task_item(tasks[i], now));
+				}
+			}
+
+			queued_in_threads = true;
+		}
+	}
+
+	if (!queued_in_threads) {
 		MutexLock lock(_tasks_mutex);
 		for (size_t i = 0; i < tasks.size(); ++i) {
-			TaskItem t;
-			t.task = tasks[i];
-			CRASH_COND(t.task == nullptr);
-			_tasks.push_back(t);
-			++_debug_received_tasks;
+			_tasks.push(make_task_item(tasks[i], now));
 		}
 	}
-	// TODO Do I need to post a certain amount of times?
-	for (size_t i = 0; i < tasks.size(); ++i) {
-		_tasks_semaphore.post();
-	}
+
+	post_for_new_tasks(tasks.size());
 }
 
 void VoxelThreadPool::thread_func_static(void *p_data) {
@@ -125,6 +267,8 @@ void VoxelThreadPool::thread_func_static(void *p_data) {
 	}
 
 	pool.thread_func(data);
+
+	data.exited = true;
 }
 
 void VoxelThreadPool::thread_func(ThreadData &data) {
@@ -132,6 +276,7 @@ void VoxelThreadPool::thread_func(ThreadData &data) {
 
 	std::vector<TaskItem> tasks;
 	std::vector<IVoxelTask *> cancelled_tasks;
+	std::vector<IVoxelTask *> tasks_to_run;
 
 	while (!data.stop) {
 		{
@@ -140,55 +285,20 @@ void VoxelThreadPool::thread_func(ThreadData &data) {
 			data.debug_state = STATE_PICKING;
 			const uint32_t now = OS::get_singleton()->get_ticks_msec();
 
-			MutexLock lock(_tasks_mutex);
-
-			// Pick best tasks
-			for (uint32_t bi = 0; bi < _batch_count && _tasks.size() != 0; ++bi) {
-				size_t best_index = 0; // Take first by default, this is a valid index
-				int best_priority = 999999;
-
-				// TODO This takes a lot of time when there are many queued tasks. Use a better container?
-				for (size_t i = 0; i < _tasks.size(); ++i) {
-					TaskItem &item = _tasks[i];
-					CRASH_COND(item.task == nullptr);
-
-					if (now - item.last_priority_update_time > _priority_update_period) {
-						// Calling `get_priority()` first since it can update cancellation
-						// (not clear API tho, might review that in the future)
-						item.cached_priority = item.task->get_priority();
-
-						if (item.task->is_cancelled()) {
-							cancelled_tasks.push_back(item.task);
-							_tasks[i] = _tasks.back();
-							_tasks.pop_back();
-							--i;
-							continue;
-						}
-
-						item.last_priority_update_time = now;
-					}
-
-					if (item.cached_priority < best_priority) {
-						best_priority = item.cached_priority;
-						best_index = i;
-					}
-				}
-
-				// If not all tasks were cancelled
-				if (_tasks.size() != 0) {
-					tasks.push_back(_tasks[best_index]);
-					CRASH_COND(best_index >= _tasks.size());
-					_tasks[best_index] = _tasks.back();
-					_tasks.pop_back();
-				}
+			if (_work_stealing_enabled) {
+				pick_tasks_work_stealing(data, now, tasks, cancelled_tasks);
+			} else {
+				MutexLock lock(_tasks_mutex);
+				pick_tasks(_tasks, now, tasks, cancelled_tasks);
 			}
 		}
 
 		if (cancelled_tasks.size() > 0) {
 			MutexLock lock(_completed_tasks_mutex);
 			for (size_t i = 0; i < cancelled_tasks.size(); ++i) {
-				_completed_tasks.push_back(cancelled_tasks[i]);
-				++_debug_completed_tasks;
+				IVoxelTask *task = cancelled_tasks[i];
+				_completed_tasks.push_back(task);
+				++_kinds[task->get_kind()].debug_completed_tasks;
 			}
 		}
 		cancelled_tasks.clear();
@@ -206,21 +316,48 @@ void VoxelThreadPool::thread_func(ThreadData &data) {
 		} else {
 			data.debug_state = STATE_RUNNING;
 
-			for (size_t i = 0; i < tasks.size(); ++i) {
-				TaskItem &item = tasks[i];
-				if (!item.task->is_cancelled()) {
-					VoxelTaskContext ctx;
-					ctx.thread_index = data.index;
-					item.task->run(ctx);
+			// Batches only contain tasks of the same kind
+			KindState &kind = _kinds[tasks[0].kind];
+
+			VoxelTaskContext ctx;
+			ctx.thread_index = data.index;
+
+			const VoxelTaskBatchRunner batch_runner = kind.batch_runner;
+			if (batch_runner != nullptr) {
+				for (size_t i = 0; i < tasks.size(); ++i) {
+					TaskItem &item = tasks[i];
+					if (!item.task->is_cancelled()) {
+						tasks_to_run.push_back(item.task);
+					}
+				}
+				if (tasks_to_run.size() > 0) {
+					batch_runner(to_span(tasks_to_run), ctx);
+				}
+				tasks_to_run.clear();
+
+			} else {
+				for (size_t i = 0; i < tasks.size(); ++i) {
+					TaskItem &item = tasks[i];
+					if (!item.task->is_cancelled()) {
+						item.task->run(ctx);
+					}
 				}
 			}
+
 			{
 				MutexLock lock(_completed_tasks_mutex);
 				for (size_t i = 0; i < tasks.size(); ++i) {
 					TaskItem &item = tasks[i];
 					_completed_tasks.push_back(item.task);
-					++_debug_completed_tasks;
 				}
+				kind.debug_completed_tasks += tasks.size();
+			}
+
+			const uint32_t prev_active_threads = kind.active_threads--;
+			if (prev_active_threads >= kind.max_threads) {
+				// That kind was at its limit, so other threads may have gone waiting while tasks of that kind remain.
+				// Wake one up to pick them.
+				_tasks_semaphore.post();
 			}
 
 			tasks.clear();
@@ -230,6 +367,44 @@ void VoxelThreadPool::thread_func(ThreadData &data) {
 	data.debug_state = STATE_STOPPED;
 }
 
+// Must be called while the queue is locked
+bool VoxelThreadPool::pick_tasks(TaskQueue &queue, uint32_t now, std::vector<TaskItem> &tasks,
+		std::vector<IVoxelTask *> &cancelled_tasks) {
+	const bool picked = queue.pop_batch(tasks, now, _kinds, cancelled_tasks);
+	queue.refresh(now, _kinds, cancelled_tasks);
+	return picked;
+}
+
+void VoxelThreadPool::pick_tasks_work_stealing(ThreadData &data, uint32_t now, std::vector<TaskItem> &tasks,
+		std::vector<IVoxelTask *> &cancelled_tasks) {
+	{
+		MutexLock lock(data.local_tasks_mutex);
+		pick_tasks(data.local_tasks, now, tasks, cancelled_tasks);
+	}
+
+	if (tasks.size() == 0) {
+		// Tasks may have been queued in the shared queue before work-stealing got enabled
+		MutexLock lock(_tasks_mutex);
+		pick_tasks(_tasks, now, tasks, cancelled_tasks);
+	}
+
+	if (tasks.size() == 0) {
+		// Nothing left in our own queue, steal from other threads.
+		// Only one thread queue is locked at a time, so threads can't deadlock each other.
+		MutexLock threads_lock(_threads_mutex);
+		const uint32_t thread_count = _threads.size();
+
+		for (uint32_t i = 1; i <= thread_count && tasks.size() == 0; ++i) {
+			ThreadData &victim = *_threads[(data.index + i) % thread_count];
+			if (&victim == &data) {
+				continue;
+			}
+			MutexLock lock(victim.local_tasks_mutex);
+			pick_tasks(victim.local_tasks, now, tasks, cancelled_tasks);
+		}
+	}
+}
+
 void VoxelThreadPool::wait_for_all_tasks() {
 	const uint32_t suspicious_delay_msec = 10000;
 
@@ -238,11 +413,19 @@ void VoxelThreadPool::wait_for_all_tasks() {
 
 	// Wait until all tasks have been taken
 	while (true) {
+		bool all_taken;
 		{
 			MutexLock lock(_tasks_mutex);
-			if (_tasks.size() == 0) {
-				break;
-			}
+			all_taken = _tasks.is_empty();
+		}
+		MutexLock threads_lock(_threads_mutex);
+		for (size_t i = 0; i < _threads.size() && all_taken; ++i) {
+			ThreadData &d = *_threads[i];
+			MutexLock lock(d.local_tasks_mutex);
+			all_taken = d.local_tasks.is_empty();
+		}
+		if (all_taken) {
+			break;
 		}
 
 		OS::get_singleton()->delay_usec(2000);
@@ -260,11 +443,14 @@ void VoxelThreadPool::wait_for_all_tasks() {
 	bool any_working_thread = true;
 	while (any_working_thread) {
 		any_working_thread = false;
-		for (size_t i = 0; i < _thread_count; ++i) {
-			const ThreadData &t = _threads[i];
-			if (t.waiting == false) {
-				any_working_thread = true;
-				break;
+		{
+			MutexLock threads_lock(_threads_mutex);
+			for (size_t i = 0; i < _threads.size(); ++i) {
+				const ThreadData &t = *_threads[i];
+				if (t.waiting == false) {
+					any_working_thread = true;
+					break;
+				}
 			}
 		}
 
@@ -277,14 +463,328 @@ void VoxelThreadPool::wait_for_all_tasks() {
 	}
 }
 
+//----------------------------------------------------------------------------------------------------------------------
+
+bool VoxelThreadPool::TaskHeap::update_priority(TaskItem &item, uint32_t now) {
+	// Calling `get_priority()` first since it can update cancellation
+	// (not clear API tho, might review that in the future)
+	item.cached_priority = item.task->get_priority();
+	if (item.task->is_cancelled()) {
+		return false;
+	}
+	item.last_priority_update_time = now;
+	return true;
+}
+
+void VoxelThreadPool::TaskHeap::push(const TaskItem &item) {
+	_items.push_back(item);
+	sift_up(_items.size() - 1);
+}
+
+bool VoxelThreadPool::TaskHeap::pop_best(TaskItem &out_item, uint32_t now, uint32_t update_period,
+		std::vector<IVoxelTask *> &cancelled_tasks) {
+	// Bounds how much work is done when many items became stale at once.
+	// If that limit is reached, we take the best item even if it is not up to date.
+	uint32_t updates_left = MAX_PRIORITY_UPDATES_PER_POP;
+
+	while (_items.size() != 0) {
+		TaskItem &top = _items[0];
+		CRASH_COND(top.task == nullptr);
+
+		if (updates_left > 0 && now - top.last_priority_update_time > update_period) {
+			--updates_left;
+			IVoxelTask *task = top.task;
+
+			if (!update_priority(top, now)) {
+				cancelled_tasks.push_back(task);
+				remove_at(0);
+				continue;
+			}
+
+			sift_down(0);
+			if (_items[0].task != task) {
+				// Its priority decreased and another item is now better, check that one instead
+				continue;
+			}
+		}
+
+		out_item = _items[0];
+		remove_at(0);
+		return true;
+	}
+
+	return false;
+}
+
+void VoxelThreadPool::TaskHeap::refresh(uint32_t count, uint32_t now, uint32_t update_period,
+		std::vector<IVoxelTask *> &cancelled_tasks) {
+	for (uint32_t i = 0; i < count && _items.size() != 0; ++i) {
+		if (_refresh_cursor >= _items.size()) {
+			_refresh_cursor = 0;
+		}
+
+		TaskItem &item = _items[_refresh_cursor];
+		if (now - item.last_priority_update_time > update_period) {
+			const int prev_priority = item.cached_priority;
+
+			if (!update_priority(item, now)) {
+				cancelled_tasks.push_back(item.task);
+				remove_at(_refresh_cursor);
+				continue;
+			}
+
+			if (item.cached_priority < prev_priority) {
+				sift_up(_refresh_cursor);
+			} else if (item.cached_priority > prev_priority) {
+				sift_down(_refresh_cursor);
+			}
+		}
+
+		// Items might have moved due to sifting, so some can be visited twice or skipped during a cycle.
+		// That's fine, it only needs to be approximate.
+		++_refresh_cursor;
+	}
+}
+
+void VoxelThreadPool::TaskHeap::clear() {
+	_items.clear();
+	_refresh_cursor = 0;
+}
+
+void VoxelThreadPool::TaskHeap::sift_up(size_t i) {
+	const TaskItem item = _items[i];
+	while (i > 0) {
+		const size_t parent_index = (i - 1) / 2;
+		if (_items[parent_index].cached_priority <= item.cached_priority) {
+			break;
+		}
+		_items[i] = _items[parent_index];
+		i = parent_index;
+	}
+	_items[i] = item;
+}
+
+void VoxelThreadPool::TaskHeap::sift_down(size_t i) {
+	const TaskItem item = _items[i];
+	const size_t count = _items.size();
+	while (true) {
+		size_t child_index = 2 * i + 1;
+		if (child_index >= count) {
+			break;
+		}
+		if (child_index + 1 < count && _items[child_index + 1].cached_priority < _items[child_index].cached_priority) {
+			++child_index;
+		}
+		if (item.cached_priority <= _items[child_index].cached_priority) {
+			break;
+		}
+		_items[i] = _items[child_index];
+		i = child_index;
+	}
+	_items[i] = item;
+}
+
+void VoxelThreadPool::TaskHeap::remove_at(size_t i) {
+	CRASH_COND(i >= _items.size());
+	const size_t last_index = _items.size() - 1;
+	if (i != last_index) {
+		_items[i] = _items[last_index];
+		_items.pop_back();
+		// The moved item can be either better or worse than the one it replaces
+		sift_up(i);
+		sift_down(i);
+	} else {
+		_items.pop_back();
+	}
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
+VoxelThreadPool::TaskQueue::TaskQueue() {
+	_passes.fill(0);
+}
+
+void VoxelThreadPool::TaskQueue::push(const TaskItem &item) {
+	CRASH_COND(item.kind >= MAX_KINDS);
+	_heaps[item.kind].push(item);
+}
+
+bool VoxelThreadPool::TaskQueue::pop_batch(std::vector<TaskItem> &out_tasks, uint32_t now,
+		FixedArray<KindState, MAX_KINDS> &kinds, std::vector<IVoxelTask *> &cancelled_tasks) {
+	// Kinds we already tried in this call and that could not provide a task
+	uint32_t skipped_kinds_mask = 0;
+
+	while (true) {
+		// Find which kind is the most behind its fair share
+		int kind_index = -1;
+		uint64_t best_pass = 0;
+		for (unsigned int i = 0; i < MAX_KINDS; ++i) {
+			if ((skipped_kinds_mask & (1 << i)) != 0 || _heaps[i].is_empty()) {
+				continue;
+			}
+			const KindState &kind = kinds[i];
+			if (kind.active_threads >= kind.max_threads) {
+				continue;
+			}
+			const uint64_t pass = MAX(_passes[i], _current_pass);
+			if (kind_index == -1 || pass < best_pass) {
+				kind_index = i;
+				best_pass = pass;
+			}
+		}
+
+		if (kind_index == -1) {
+			return false;
+		}
+
+		KindState &kind = kinds[kind_index];
+		TaskHeap &heap = _heaps[kind_index];
+
+		TaskItem item;
+		if (!heap.pop_best(item, now, kind.priority_update_period, cancelled_tasks)) {
+			// All tasks of that kind were cancelled
+			skipped_kinds_mask |= (1 << kind_index);
+			continue;
+		}
+
+		if (!kind.try_acquire_thread()) {
+			// Another thread took the last slot in the meantime
+			heap.push(item);
+			skipped_kinds_mask |= (1 << kind_index);
+			continue;
+		}
+
+		const uint32_t batch_count = kind.batch_count;
+		const uint32_t batch_lookahead = kind.batch_lookahead;
+
+		if (batch_lookahead > batch_count) {
+			pop_grouped_batch(item, heap, batch_count, batch_lookahead, now, kind.priority_update_period,
+					out_tasks, cancelled_tasks);
+
+		} else {
+			out_tasks.push_back(item);
+
+			for (uint32_t bi = 1; bi < batch_count; ++bi) {
+				if (!heap.pop_best(item, now, kind.priority_update_period, cancelled_tasks)) {
+					break;
+				}
+				out_tasks.push_back(item);
+			}
+		}
+
+		const uint32_t weight = MAX(kind.weight.load(), 1u);
+		_current_pass = best_pass;
+		_passes[kind_index] = best_pass + KIND_STRIDE_SCALE / weight;
+		return true;
+	}
+}
+
+void VoxelThreadPool::TaskQueue::pop_grouped_batch(const TaskItem &best_item, TaskHeap &heap, uint32_t batch_count,
+		uint32_t batch_lookahead, uint32_t now, uint32_t priority_update_period, std::vector<TaskItem> &out_tasks,
+		std::vector<IVoxelTask *> &cancelled_tasks) {
+	// Candidates come out of the heap in priority order
+	std::vector<TaskItem> &candidates = _lookahead_items;
+	candidates.clear();
+	candidates.push_back(best_item);
+	TaskItem item;
+	while (candidates.size() < batch_lookahead &&
+			heap.pop_best(item, now, priority_update_period, cancelled_tasks)) {
+		candidates.push_back(item);
+	}
+
+	std::vector<bool> &picked = _lookahead_picked;
+	picked.clear();
+	picked.resize(candidates.size(), false);
+
+	// Groups are taken in the order of their best task, so a group never goes before a better one
+	uint32_t picked_count = 0;
+	for (size_t i = 0; i < candidates.size() && picked_count < batch_count; ++i) {
+		if (picked[i]) {
+			continue;
+		}
+		const uint64_t key = candidates[i].batch_key;
+		for (size_t j = i; j < candidates.size() && picked_count < batch_count; ++j) {
+			if (!picked[j] && candidates[j].batch_key == key) {
+				out_tasks.push_back(candidates[j]);
+				picked[j] = true;
+				++picked_count;
+			}
+		}
+	}
+
+	// Put back candidates that didn't fit in the batch
+	for (size_t i = 0; i < candidates.size(); ++i) {
+		if (!picked[i]) {
+			heap.push(candidates[i]);
+		}
+	}
+}
+
+void VoxelThreadPool::TaskQueue::refresh(uint32_t now, const FixedArray<KindState, MAX_KINDS> &kinds,
+		std::vector<IVoxelTask *> &cancelled_tasks) {
+	for (unsigned int i = 0; i < MAX_KINDS; ++i) {
+		_heaps[i].refresh(PRIORITY_REFRESH_COUNT_PER_PICK, now, kinds[i].priority_update_period, cancelled_tasks);
+	}
+}
+
+void VoxelThreadPool::TaskQueue::move_all_to(TaskQueue &dst) {
+	for (unsigned int i = 0; i < MAX_KINDS; ++i) {
+		TaskHeap &heap = _heaps[i];
+		const std::vector<TaskItem> &items = heap.get_items();
+		for (size_t j = 0; j < items.size(); ++j) {
+			dst.push(items[j]);
+		}
+		heap.clear();
+	}
+}
+
+size_t VoxelThreadPool::TaskQueue::size() const {
+	size_t count = 0;
+	for (unsigned int i = 0; i < MAX_KINDS; ++i) {
+		count += _heaps[i].size();
+	}
+	return count;
+}
+
+bool VoxelThreadPool::TaskQueue::is_empty() const {
+	for (unsigned int i = 0; i < MAX_KINDS; ++i) {
+		if (!_heaps[i].is_empty()) {
+			return false;
+		}
+	}
+	return true;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+
 // Debug information can be wrong, on some rare occasions.
 // The variables should be safely updated, but computing or reading from them is not thread safe.
 // Thought it wasnt worth locking for debugging.
 
 VoxelThreadPool::State VoxelThreadPool::get_thread_debug_state(uint32_t i) const {
-	return _threads[i].debug_state;
+	MutexLock lock(_threads_mutex);
+	ERR_FAIL_INDEX_V(i, _threads.size(), STATE_STOPPED);
+	return _threads[i]->debug_state;
 }
 
 unsigned int VoxelThreadPool::get_debug_remaining_tasks() const {
-	return _debug_received_tasks - _debug_completed_tasks;
+	unsigned int count = 0;
+	for (unsigned int i = 0; i < MAX_KINDS; ++i) {
+		count += get_debug_remaining_tasks(i);
+	}
+	return count;
+}
+
+unsigned int VoxelThreadPool::get_debug_remaining_tasks(uint8_t kind) const {
+	ERR_FAIL_INDEX_V(kind, MAX_KINDS, 0);
+	const KindState &ks = _kinds[kind];
+	// Completed tasks are read first. Tasks completing in between can only make the result larger.
+	const unsigned int completed_count = ks.debug_completed_tasks;
+	const unsigned int received_count = ks.debug_received_tasks;
+	return received_count - completed_count;
+}
+
+unsigned int VoxelThreadPool::get_debug_active_threads(uint8_t kind) const {
+	ERR_FAIL_INDEX_V(kind, MAX_KINDS, 0);
+	return _kinds[kind].active_threads;
 }
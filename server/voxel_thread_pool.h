@@ -8,12 +8,13 @@
 #include <core/os/semaphore.h>
 #include <core/os/thread.h>
 
+#include <atomic>
 #include <queue>
 
 class Thread;
 
 struct VoxelTaskContext {
-	uint8_t thread_index;
+	uint32_t thread_index;
 };
 
 class IVoxelTask {
@@ -26,12 +27,26 @@ public:
 	virtual int get_priority() { return 0; }
 
 	virtual bool is_cancelled() { return false; }
+
+	// Tasks of different kinds can be scheduled with different settings by the pool running them.
+	// Must be lower than `VoxelThreadPool::MAX_KINDS`, and must not change once the task is queued.
+	virtual uint8_t get_kind() { return 0; }
+
+	// Tasks with the same key are cheaper to run in the same batch, for example because they access the same file.
+	// Only used by kinds having a batch lookahead. Must not change once the task is queued.
+	virtual uint64_t get_batch_key() { return 0; }
 };
 
-// Generic thread pool that performs batches of tasks based on priority
+// Runs several tasks of the same kind at once, for work that is cheaper when grouped (like file access).
+// Tasks are given in priority order, and none of them is cancelled.
+typedef void (*VoxelTaskBatchRunner)(Span<IVoxelTask *> tasks, VoxelTaskContext ctx);
+
+// Generic thread pool that performs batches of tasks based on priority.
+// Tasks can be of different kinds, each with their own budget of threads and share of the pool,
+// so a single pool can run all sorts of work without one kind starving the others.
 class VoxelThreadPool {
 public:
-	static const uint32_t MAX_THREADS = 8;
+	static const unsigned int MAX_KINDS = 4;
 
 	enum State {
 		STATE_RUNNING = 0,
@@ -47,33 +62,79 @@ public:
 	// Must be called before configuring thread count.
 	void set_name(String name);
 
-	// TODO Add ability to change it while running without skipping tasks
-	// Can't be changed after tasks have been queued
+	// Can be changed while tasks are running. No task gets dropped: removed threads finish what they were doing,
+	// and tasks remaining in their queue are handed over to other threads.
+	// Blocks until removed threads have exited.
+	// There must be at least one thread, otherwise queued tasks would never run.
 	void set_thread_count(uint32_t count);
 	uint32_t get_thread_count() const { return _thread_count; }
 
-	// TODO Add ability to change it while running
-	// Can't be changed after tasks have been queued
+	// Sets the batch count of all kinds. Can be changed while tasks are running
 	void set_batch_count(uint32_t count);
 
-	// TODO Add ability to change it while running
-	// Can't be changed after tasks have been queued
+	// Sets the priority update period of all kinds. Can be changed while tasks are running
 	void set_priority_update_period(uint32_t milliseconds);
 
+	// Per-kind settings. They can be changed while tasks are running.
+
+	// How many tasks of this kind a thread picks at once
+	void set_kind_batch_count(uint8_t kind, uint32_t count);
+	// How many of the best tasks of this kind are considered when picking a batch. Among them, tasks sharing the
+	// batch key of the best one are picked first, then those sharing the key of the next best, and so on.
+	// This groups related tasks without picking any of them before a better task of another group.
+	// A value lower than the batch count just picks tasks in priority order.
+	void set_kind_batch_lookahead(uint8_t kind, uint32_t count);
+	// How often priority of tasks of this kind is re-evaluated while they are queued
+	void set_kind_priority_update_period(uint8_t kind, uint32_t milliseconds);
+	// How many threads can run tasks of this kind at the same time.
+	// Useful for work that does not scale with threads, like file I/O.
+	void set_kind_max_threads(uint8_t kind, uint32_t count);
+	uint32_t get_kind_max_threads(uint8_t kind) const;
+	// When tasks of several kinds are waiting, each kind gets picked in proportion to its weight
+	void set_kind_weight(uint8_t kind, uint32_t weight);
+	// If set, batches of tasks of this kind are given to this function instead of running each task separately.
+	// Pass null to go back to running tasks separately.
+	void set_kind_batch_runner(uint8_t kind, VoxelTaskBatchRunner runner);
+
+	// Gets how many threads the hardware can run concurrently. Falls back to a guess if that can't be determined.
+	static uint32_t get_hardware_thread_count();
+
+	// When enabled, each thread gets its own queue. Scheduled tasks are spread across them, and threads running out
+	// of work steal from others. This reduces contention when there are many threads, at the cost of priority
+	// ordering becoming approximate (each thread picks the best of its own queue, not the best of all).
+	// Can be changed while tasks are running. Threads are restarted, so this blocks until they finish their current
+	// tasks. No task gets dropped.
+	void set_work_stealing_enabled(bool enabled);
+	bool is_work_stealing_enabled() const { return _work_stealing_enabled; }
+
 	// Schedules a task.
 	// Ownership is NOT passed to the pool, so make sure you get them back when completed if you want to delete them.
 	void enqueue(IVoxelTask *task);
 	void enqueue(Span<IVoxelTask *> tasks);
 
-	// TODO Lambda might not be the best API. memcpying to a vector would ensure we lock for a shorter time.
+	// Runs a function on each completed task.
+	// Threads are not blocked while it runs, so the function can take its time.
+	// Must not be called from more than one thread at a time.
 	template <typename F>
 	void dequeue_completed_tasks(F f) {
-		MutexLock lock(_completed_tasks_mutex);
-		for (size_t i = 0; i < _completed_tasks.size(); ++i) {
-			IVoxelTask *task = _completed_tasks[i];
-			f(task);
+		dequeue_completed_tasks_batch([&f](Span<IVoxelTask *> tasks) {
+			for (size_t i = 0; i < tasks.size(); ++i) {
+				f(tasks[i]);
+			}
+		});
+	}
+
+	// Same as `dequeue_completed_tasks`, but gives all completed tasks at once.
+	template <typename F>
+	void dequeue_completed_tasks_batch(F f) {
+		// Swap buffers so the lock is held for a constant time, regardless of how many tasks completed.
+		// Both buffers keep their capacity, so this doesn't allocate once they are big enough.
+		{
+			MutexLock lock(_completed_tasks_mutex);
+			_completed_tasks.swap(_dequeued_tasks);
 		}
-		_completed_tasks.clear();
+		f(to_span(_dequeued_tasks));
+		_dequeued_tasks.clear();
 	}
 
 	// Blocks and wait for all tasks to finish (assuming no more are getting added!)
@@ -81,58 +142,202 @@ public:
 
 	State get_thread_debug_state(uint32_t i) const;
 	unsigned int get_debug_remaining_tasks() const;
+	unsigned int get_debug_remaining_tasks(uint8_t kind) const;
+	unsigned int get_debug_active_threads(uint8_t kind) const;
 
 private:
+	// How many queued tasks get their priority re-evaluated each time a thread picks tasks
+	static const uint32_t PRIORITY_REFRESH_COUNT_PER_PICK = 8;
+	// How many times the best task can be re-evaluated in a single pick before it is taken regardless
+	static const uint32_t MAX_PRIORITY_UPDATES_PER_POP = 16;
+
+	// Divided by a kind's weight to get how much it advances in the fair-share schedule when picked
+	static const uint32_t KIND_STRIDE_SCALE = 1 << 16;
+
 	struct TaskItem {
 		IVoxelTask *task = nullptr;
 		int cached_priority = 99999;
 		uint32_t last_priority_update_time = 0;
+		uint64_t batch_key = 0;
+		uint8_t kind = 0;
+	};
+
+	struct KindState {
+		// Settings. Atomic because they can be changed while threads are running
+		std::atomic<uint32_t> batch_count;
+		std::atomic<uint32_t> batch_lookahead;
+		std::atomic<uint32_t> priority_update_period;
+		std::atomic<uint32_t> max_threads;
+		std::atomic<uint32_t> weight;
+		std::atomic<VoxelTaskBatchRunner> batch_runner;
+
+		// How many threads are currently running tasks of this kind
+		std::atomic<uint32_t> active_threads;
+
+		// Atomic because tasks can be received and completed under different locks
+		std::atomic<unsigned int> debug_received_tasks;
+		std::atomic<unsigned int> debug_completed_tasks;
+
+		KindState() :
+				batch_count(1),
+				batch_lookahead(0),
+				priority_update_period(32),
+				max_threads(0xffffffff),
+				weight(1),
+				batch_runner(nullptr),
+				active_threads(0),
+				debug_received_tasks(0),
+				debug_completed_tasks(0) {}
+
+		// Reserves a thread slot to run tasks of this kind. Returns false if all slots are in use.
+		bool try_acquire_thread() {
+			uint32_t count = active_threads;
+			while (count < max_threads) {
+				if (active_threads.compare_exchange_weak(count, count + 1)) {
+					return true;
+				}
+			}
+			return false;
+		}
+	};
+
+	// Binary min-heap of tasks, ordered by cached priority.
+	// Priorities are updated lazily: the best item is re-evaluated before being picked, and a few other items are
+	// re-evaluated in round-robin on every pick. This way, picking a task costs O(log n) instead of scanning the
+	// whole queue, and the time spent holding the lock no longer depends on how many tasks are queued.
+	class TaskHeap {
+	public:
+		void push(const TaskItem &item);
+
+		// Removes the item with the lowest priority value. Items found cancelled in the process are removed too.
+		// Returns false if the queue became empty.
+		bool pop_best(TaskItem &out_item, uint32_t now, uint32_t update_period,
+				std::vector<IVoxelTask *> &cancelled_tasks);
+
+		// Re-evaluates priority of a few more items, so those further down the heap don't stay stale forever
+		void refresh(uint32_t count, uint32_t now, uint32_t update_period,
+				std::vector<IVoxelTask *> &cancelled_tasks);
+
+		inline size_t size() const {
+			return _items.size();
+		}
+
+		inline bool is_empty() const {
+			return _items.empty();
+		}
+
+		inline const std::vector<TaskItem> &get_items() const {
+			return _items;
+		}
+
+		void clear();
+
+	private:
+		// Returns false if the task got cancelled
+		static bool update_priority(TaskItem &item, uint32_t now);
+
+		void sift_up(size_t i);
+		void sift_down(size_t i);
+		void remove_at(size_t i);
+
+		std::vector<TaskItem> _items;
+		size_t _refresh_cursor = 0;
+	};
+
+	// Queue of tasks of all kinds. Picks batches of the same kind, alternating between kinds in proportion to their
+	// weight (stride scheduling), while skipping kinds that have no thread slot left.
+	class TaskQueue {
+	public:
+		TaskQueue();
+
+		void push(const TaskItem &item);
+
+		// Picks a batch of tasks of the same kind, and reserves a thread slot for that kind.
+		// Returns false if no task could be picked, in which case no slot is reserved.
+		// Tasks are grouped by batch key if the kind has a lookahead.
+		bool pop_batch(std::vector<TaskItem> &out_tasks, uint32_t now, FixedArray<KindState, MAX_KINDS> &kinds,
+				std::vector<IVoxelTask *> &cancelled_tasks);
+
+		void refresh(uint32_t now, const FixedArray<KindState, MAX_KINDS> &kinds,
+				std::vector<IVoxelTask *> &cancelled_tasks);
+
+		// Moves all items into another queue
+		void move_all_to(TaskQueue &dst);
+
+		size_t size() const;
+		bool is_empty() const;
+
+	private:
+		void pop_grouped_batch(const TaskItem &best_item, TaskHeap &heap, uint32_t batch_count,
+				uint32_t batch_lookahead, uint32_t now, uint32_t priority_update_period,
+				std::vector<TaskItem> &out_tasks, std::vector<IVoxelTask *> &cancelled_tasks);
+
+		FixedArray<TaskHeap, MAX_KINDS> _heaps;
+		// Position of each kind in the fair-share schedule. The kind with the lowest pass is picked next.
+		FixedArray<uint64_t, MAX_KINDS> _passes;
+		// Pass of the last picked kind. Kinds that were idle catch up to it, so they can't monopolize the queue.
+		uint64_t _current_pass = 0;
+		// Best tasks considered when grouping a batch. Kept to avoid allocating on every pick.
+		std::vector<TaskItem> _lookahead_items;
+		std::vector<bool> _lookahead_picked;
 	};
 
 	struct ThreadData {
 		Thread thread;
 		VoxelThreadPool *pool = nullptr;
 		uint32_t index = 0;
-		bool stop = false;
-		bool waiting = false;
+		// Atomic because they are written and polled by different threads
+		std::atomic<bool> stop;
+		std::atomic<bool> waiting;
+		std::atomic<bool> exited;
 		State debug_state = STATE_STOPPED;
 		String name;
+		// Only used in work-stealing mode
+		TaskQueue local_tasks;
+		Mutex local_tasks_mutex;
 
-		void wait_to_finish_and_reset() {
-			thread.wait_to_finish();
-			pool = nullptr;
-			index = 0;
-			stop = false;
-			waiting = false;
-			debug_state = STATE_STOPPED;
-			name.clear();
-		}
+		ThreadData() :
+				stop(false),
+				waiting(false),
+				exited(false) {}
 	};
 
 	static void thread_func_static(void *p_data);
 	void thread_func(ThreadData &data);
 
+	bool pick_tasks(TaskQueue &queue, uint32_t now, std::vector<TaskItem> &tasks,
+			std::vector<IVoxelTask *> &cancelled_tasks);
+	void pick_tasks_work_stealing(ThreadData &data, uint32_t now, std::vector<TaskItem> &tasks,
+			std::vector<IVoxelTask *> &cancelled_tasks);
+	void post_for_new_tasks(uint32_t task_count);
+	static TaskItem make_task_item(IVoxelTask *task, uint32_t now);
+
+	void resize_threads(uint32_t count);
 	void create_thread(ThreadData &d, uint32_t i);
-	void destroy_all_threads();
+	void stop_threads(Span<ThreadData *> threads);
 
-	FixedArray<ThreadData, MAX_THREADS> _threads;
-	uint32_t _thread_count = 0;
+	// Threads are allocated individually so they don't move when the list changes
+	std::vector<ThreadData *> _threads;
+	// Protects the list of threads, which can be accessed by threads when stealing tasks
+	Mutex _threads_mutex;
+	std::atomic<uint32_t> _thread_count;
 
-	// TODO Optimize this with a less naive design? Maybe moodycamel
-	std::vector<TaskItem> _tasks;
+	TaskQueue _tasks;
 	Mutex _tasks_mutex;
 	Semaphore _tasks_semaphore;
 
 	std::vector<IVoxelTask *> _completed_tasks;
 	Mutex _completed_tasks_mutex;
+	// Only used by the thread dequeuing completed tasks
+	std::vector<IVoxelTask *> _dequeued_tasks;
 
-	uint32_t _batch_count = 1;
-	uint32_t _priority_update_period = 32;
+	FixedArray<KindState, MAX_KINDS> _kinds;
 
-	String _name;
+	std::atomic<bool> _work_stealing_enabled;
+	// Rotates which thread receives new tasks first in work-stealing mode
+	std::atomic<uint32_t> _next_thread_index;
 
-	unsigned int _debug_received_tasks = 0;
-	unsigned int _debug_completed_tasks = 0;
+	String _name;
 };
 
-#endif // VOXEL_THREAD_TASK_MANAGER_H
+#endif // VOXEL_THREAD_POOL_H
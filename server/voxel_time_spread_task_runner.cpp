@@ -0,0 +1,90 @@
+#include "voxel_time_spread_task_runner.h"
+#include "../util/profiling.h"
+
+#include <core/os/memory.h>
+#include <core/os/os.h>
+
+VoxelTimeSpreadTaskRunner::~VoxelTimeSpreadTaskRunner() {
+	// Tasks are only run from the main loop, so remaining ones are dropped
+	for (unsigned int priority = 0; priority < _tasks.size(); ++priority) {
+		std::queue<IVoxelTimeSpreadTask *> &tasks = _tasks[priority];
+		while (!tasks.empty()) {
+			memdelete(tasks.front());
+			tasks.pop();
+		}
+	}
+}
+
+void VoxelTimeSpreadTaskRunner::push(IVoxelTimeSpreadTask *task, Priority priority) {
+	CRASH_COND(task == nullptr);
+	ERR_FAIL_INDEX(priority, PRIORITY_COUNT);
+	_tasks[priority].push(task);
+}
+
+void VoxelTimeSpreadTaskRunner::process(uint64_t time_budget_usec) {
+	VOXEL_PROFILE_SCOPE();
+
+	const OS &os = *OS::get_singleton();
+	const uint64_t time_before = os.get_ticks_usec();
+
+	for (unsigned int priority = 0; priority < _tasks.size(); ++priority) {
+		std::queue<IVoxelTimeSpreadTask *> &tasks = _tasks[priority];
+
+		// Tasks can push more tasks while running. Those will run next frame at the earliest,
+		// so a task that keeps re-submitting itself can't lock the loop.
+		size_t count = tasks.size();
+		bool first = true;
+
+		while (count > 0 && (first || os.get_ticks_usec() - time_before < time_budget_usec)) {
+			IVoxelTimeSpreadTask *task = tasks.front();
+			tasks.pop();
+			--count;
+			first = false;
+
+			task->run();
+			memdelete(task);
+		}
+	}
+}
+
+void VoxelTimeSpreadTaskRunner::flush() {
+	VOXEL_PROFILE_SCOPE();
+
+	// Tasks pushed while running are run by the next pass. Passes stop once they no longer reduce the number of
+	// pending tasks, so a task that keeps re-submitting itself can't lock the loop. Those are left for `process()`.
+	unsigned int pending_count = get_pending_count();
+
+	while (pending_count > 0) {
+		for (unsigned int priority = 0; priority < _tasks.size(); ++priority) {
+			std::queue<IVoxelTimeSpreadTask *> &tasks = _tasks[priority];
+
+			size_t count = tasks.size();
+			while (count > 0) {
+				IVoxelTimeSpreadTask *task = tasks.front();
+				tasks.pop();
+				--count;
+				task->run();
+				memdelete(task);
+			}
+		}
+
+		const unsigned int new_pending_count = get_pending_count();
+		if (new_pending_count >= pending_count) {
+			break;
+		}
+		pending_count = new_pending_count;
+	}
+}
+
+unsigned int VoxelTimeSpreadTaskRunner::get_pending_count() const {
+	unsigned int count = 0;
+	for (unsigned int priority = 0; priority < _tasks.size(); ++priority) {
+		count += _tasks[priority].size();
+	}
+	return count;
+}
+
+unsigned int VoxelTimeSpreadTaskRunner::get_pending_count(Priority priority) const {
+	ERR_FAIL_INDEX_V(priority, PRIORITY_COUNT, 0);
+	return _tasks[priority].size();
+}
@@ -0,0 +1,50 @@
+#ifndef VOXEL_TIME_SPREAD_TASK_RUNNER_H
+#define VOXEL_TIME_SPREAD_TASK_RUNNER_H
+
+#include "../util/fixed_array.h"
+
+#include <cstdint>
+#include <queue>
+
+// Work that must be done on the main thread, but which doesn't need to complete in the frame it was submitted.
+class IVoxelTimeSpreadTask {
+public:
+	virtual ~IVoxelTimeSpreadTask() {}
+	virtual void run() = 0;
+};
+
+// Runs main thread tasks within a time budget per frame, to avoid spikes when a lot of work comes in at once.
+// Tasks that don't fit in the budget carry over to the next frame, keeping their order.
+// Must be used from the main thread only.
+class VoxelTimeSpreadTaskRunner {
+public:
+	enum Priority {
+		// Results the user is waiting to see, like new meshes
+		PRIORITY_HIGH = 0,
+		PRIORITY_NORMAL,
+		// Work that can lag behind without being noticed, like delayed collision updates
+		PRIORITY_LOW,
+		PRIORITY_COUNT
+	};
+
+	~VoxelTimeSpreadTaskRunner();
+
+	// Takes ownership of the task
+	void push(IVoxelTimeSpreadTask *task, Priority priority);
+
+	// Runs tasks until the time budget is spent, higher priorities first.
+	// At least one task of each priority runs per call, so none of them can starve.
+	void process(uint64_t time_budget_usec);
+
+	// Runs all tasks, regardless of time spent.
+	// Tasks they push are run too, unless they keep pushing as many as were run.
+	void flush();
+
+	unsigned int get_pending_count() const;
+	unsigned int get_pending_count(Priority priority) const;
+
+private:
+	FixedArray<std::queue<IVoxelTimeSpreadTask *>, PRIORITY_COUNT> _tasks;
+};
+
+#endif // VOXEL_TIME_SPREAD_TASK_RUNNER_H
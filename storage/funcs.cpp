@@ -1,32 +1,346 @@
 #include "funcs.h"
+#include "../util/funcs.h"
 #include "../util/math/box3i.h"
 
-void copy_3d_region_zxy(
-		Span<uint8_t> dst, Vector3i dst_size, Vector3i dst_min,
-		Span<const uint8_t> src, Vector3i src_size, Vector3i src_min, Vector3i src_max,
+#include <string.h>
+
+// SIMD kernels are chosen at compile time, depending on what the target allows.
+// SSE2 is always available on x86_64. AVX2 requires building with it enabled (like `-mavx2` or `/arch:AVX2`).
+#if defined(__AVX2__)
+#define VOXEL_SIMD_AVX2
+#include <immintrin.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define VOXEL_SIMD_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// Largest amount of bytes processed at once by kernels
+const unsigned int KERNEL_PATTERN_SIZE = 32;
+
+// Items repeated over the width of the largest register, so the same wide stores and compares can be used
+// for every depth. Wide accesses always start at an item boundary and have a size multiple of the item size.
+struct alignas(KERNEL_PATTERN_SIZE) ItemPattern {
+	uint8_t bytes[KERNEL_PATTERN_SIZE];
+};
+
+inline void make_item_pattern(ItemPattern &pattern, const uint8_t *item, size_t item_size) {
+	for (unsigned int i = 0; i < KERNEL_PATTERN_SIZE; i += item_size) {
+		memcpy(pattern.bytes + i, item, item_size);
+	}
+}
+
+template <typename T>
+inline void make_item_pattern_t(ItemPattern &pattern, uint64_t value) {
+	const T v = value;
+	make_item_pattern(pattern, reinterpret_cast<const uint8_t *>(&v), sizeof(T));
+}
+
+inline void make_item_pattern(ItemPattern &pattern, uint64_t value, size_t item_size) {
+	switch (item_size) {
+		case 1:
+			make_item_pattern_t<uint8_t>(pattern, value);
+			break;
+		case 2:
+			make_item_pattern_t<uint16_t>(pattern, value);
+			break;
+		case 4:
+			make_item_pattern_t<uint32_t>(pattern, value);
+			break;
+		case 8:
+			make_item_pattern_t<uint64_t>(pattern, value);
+			break;
+		default:
+			CRASH_NOW_MSG("Unsupported item size");
+	}
+}
+
+// Kernels below handle the end of a span with one more access overlapping the previous one, rather than
+// with a loop. This is valid because the end is at an item boundary, and access sizes are multiples of items.
+// Rows are often short (16 to 34 items), so this matters as much as the main loop.
+
+inline void copy_bytes(uint8_t *dst, const uint8_t *src, size_t count) {
+#ifdef VOXEL_SIMD_AVX2
+	if (count >= 32) {
+		const size_t last = count - 32;
+		for (size_t i = 0; i < last; i += 32) {
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i),
+					_mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i)));
+		}
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + last),
+				_mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + last)));
+		return;
+	}
+#endif
+#ifdef VOXEL_SIMD_SSE2
+	if (count >= 16) {
+		const size_t last = count - 16;
+		for (size_t i = 0; i < last; i += 16) {
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+					_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i)));
+		}
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + last),
+				_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + last)));
+		return;
+	}
+#endif
+	if (count >= 8) {
+		const size_t last = count - 8;
+		for (size_t i = 0; i < last; i += 8) {
+			memcpy(dst + i, src + i, 8);
+		}
+		memcpy(dst + last, src + last, 8);
+	} else if (count >= 4) {
+		memcpy(dst, src, 4);
+		memcpy(dst + count - 4, src + count - 4, 4);
+	} else {
+		for (size_t i = 0; i < count; ++i) {
+			dst[i] = src[i];
+		}
+	}
+}
+
+inline void fill_bytes(uint8_t *dst, size_t count, const ItemPattern &pattern) {
+#ifdef VOXEL_SIMD_AVX2
+	if (count >= 32) {
+		const __m256i v = _mm256_load_si256(reinterpret_cast<const __m256i *>(pattern.bytes));
+		const size_t last = count - 32;
+		for (size_t i = 0; i < last; i += 32) {
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), v);
+		}
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + last), v);
+		return;
+	}
+#endif
+#ifdef VOXEL_SIMD_SSE2
+	if (count >= 16) {
+		const __m128i v = _mm_load_si128(reinterpret_cast<const __m128i *>(pattern.bytes));
+		const size_t last = count - 16;
+		for (size_t i = 0; i < last; i += 16) {
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), v);
+		}
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + last), v);
+		return;
+	}
+#endif
+	if (count >= 8) {
+		const size_t last = count - 8;
+		for (size_t i = 0; i < last; i += 8) {
+			memcpy(dst + i, pattern.bytes, 8);
+		}
+		memcpy(dst + last, pattern.bytes, 8);
+	} else if (count >= 4) {
+		memcpy(dst, pattern.bytes, 4);
+		memcpy(dst + count - 4, pattern.bytes, 4);
+	} else {
+		for (size_t i = 0; i < count; ++i) {
+			dst[i] = pattern.bytes[i];
+		}
+	}
+}
+
+inline bool equals_pattern(const uint8_t *data, size_t count, const ItemPattern &pattern) {
+#ifdef VOXEL_SIMD_AVX2
+	if (count >= 32) {
+		const __m256i ref = _mm256_load_si256(reinterpret_cast<const __m256i *>(pattern.bytes));
+		// Differences are accumulated over a few registers before testing them, so there are fewer branches
+		size_t i = 0;
+		for (; i + 128 <= count; i += 128) {
+			const __m256i *p = reinterpret_cast<const __m256i *>(data + i);
+			const __m256i d0 = _mm256_xor_si256(_mm256_loadu_si256(p), ref);
+			const __m256i d1 = _mm256_xor_si256(_mm256_loadu_si256(p + 1), ref);
+			const __m256i d2 = _mm256_xor_si256(_mm256_loadu_si256(p + 2), ref);
+			const __m256i d3 = _mm256_xor_si256(_mm256_loadu_si256(p + 3), ref);
+			const __m256i d = _mm256_or_si256(_mm256_or_si256(d0, d1), _mm256_or_si256(d2, d3));
+			if (!_mm256_testz_si256(d, d)) {
+				return false;
+			}
+		}
+		const size_t last = count - 32;
+		for (; i < last; i += 32) {
+			const __m256i d = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i)), ref);
+			if (!_mm256_testz_si256(d, d)) {
+				return false;
+			}
+		}
+		const __m256i d = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + last)), ref);
+		return _mm256_testz_si256(d, d);
+	}
+#endif
+#ifdef VOXEL_SIMD_SSE2
+	if (count >= 16) {
+		const __m128i ref = _mm_load_si128(reinterpret_cast<const __m128i *>(pattern.bytes));
+		const __m128i zero = _mm_setzero_si128();
+		// Differences are accumulated over a few registers before testing them, so there are fewer branches
+		size_t i = 0;
+		for (; i + 64 <= count; i += 64) {
+			const __m128i *p = reinterpret_cast<const __m128i *>(data + i);
+			const __m128i d0 = _mm_xor_si128(_mm_loadu_si128(p), ref);
+			const __m128i d1 = _mm_xor_si128(_mm_loadu_si128(p + 1), ref);
+			const __m128i d2 = _mm_xor_si128(_mm_loadu_si128(p + 2), ref);
+			const __m128i d3 = _mm_xor_si128(_mm_loadu_si128(p + 3), ref);
+			const __m128i d = _mm_or_si128(_mm_or_si128(d0, d1), _mm_or_si128(d2, d3));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(d, zero)) != 0xffff) {
+				return false;
+			}
+		}
+		const size_t last = count - 16;
+		for (; i < last; i += 16) {
+			const __m128i d = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i)), ref);
+			if (_mm_movemask_epi8(_mm_cmpeq_epi8(d, zero)) != 0xffff) {
+				return false;
+			}
+		}
+		const __m128i d = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + last)), ref);
+		return _mm_movemask_epi8(_mm_cmpeq_epi8(d, zero)) == 0xffff;
+	}
+#endif
+	uint64_t ref;
+	memcpy(&ref, pattern.bytes, 8);
+	if (count >= 8) {
+		const size_t last = count - 8;
+		uint64_t v;
+		for (size_t i = 0; i < last; i += 8) {
+			memcpy(&v, data + i, 8);
+			if (v != ref) {
+				return false;
+			}
+		}
+		memcpy(&v, data + last, 8);
+		return v == ref;
+	}
+	return memcmp(data, pattern.bytes, count) == 0;
+}
+
+// Sorts and clips a region to fill, returning false if there is nothing to fill
+inline bool clip_fill_region(Vector3i dst_size, Vector3i &dst_min, Vector3i &dst_max) {
+	Vector3i::sort_min_max(dst_min, dst_max);
+	dst_min.x = clamp(dst_min.x, 0, dst_size.x);
+	dst_min.y = clamp(dst_min.y, 0, dst_size.y);
+	dst_min.z = clamp(dst_min.z, 0, dst_size.z);
+	dst_max.x = clamp(dst_max.x, 0, dst_size.x);
+	dst_max.y = clamp(dst_max.y, 0, dst_size.y);
+	dst_max.z = clamp(dst_max.z, 0, dst_size.z);
+	const Vector3i area_size = dst_max - dst_min;
+	return area_size.x > 0 && area_size.y > 0 && area_size.z > 0;
+}
+
+// Sorts and clips a region to copy, returning false if there is nothing to copy
+inline bool clip_copy_region_checked(
+		Span<uint8_t> dst, Vector3i dst_size, Vector3i &dst_min,
+		Span<const uint8_t> src, Vector3i src_size, Vector3i &src_min, Vector3i &src_max,
 		size_t item_size) {
-	//
 	Vector3i::sort_min_max(src_min, src_max);
 	clip_copy_region(src_min, src_max, src_size, dst_min, dst_size);
 	const Vector3i area_size = src_max - src_min;
 	if (area_size.x <= 0 || area_size.y <= 0 || area_size.z <= 0) {
 		// Degenerate area, we'll not copy anything.
-		return;
+		return false;
 	}
 
 #ifdef DEBUG_ENABLED
 	if (src.data() == dst.data()) {
-		ERR_FAIL_COND_MSG(
+		ERR_FAIL_COND_V_MSG(
 				Box3i::from_min_max(src_min, src_max).intersects(Box3i::from_min_max(dst_min, dst_min + area_size)),
-				"Copy across the same buffer to an overlapping area is not supported");
+				false, "Copy across the same buffer to an overlapping area is not supported");
 	}
-	ERR_FAIL_COND(area_size.volume() * item_size > dst.size());
-	ERR_FAIL_COND(area_size.volume() * item_size > src.size());
+	ERR_FAIL_COND_V(area_size.volume() * item_size > dst.size(), false);
+	ERR_FAIL_COND_V(area_size.volume() * item_size > src.size(), false);
 #endif
 
+	return true;
+}
+
+template <typename T>
+inline void fill_3d_region_zxy_scalar_t(Span<T> dst, Vector3i dst_size, Vector3i dst_min, Vector3i area_size,
+		const T value) {
+	if (area_size == dst_size) {
+		for (unsigned int i = 0; i < dst.size(); ++i) {
+			dst[i] = value;
+		}
+
+	} else {
+		const unsigned int dst_row_offset = dst_size.y;
+		Vector3i pos;
+		for (pos.z = 0; pos.z < area_size.z; ++pos.z) {
+			pos.x = 0;
+			pos.y = 0;
+			unsigned int dst_ri = Vector3i(dst_min + pos).get_zxy_index(dst_size);
+			for (; pos.x < area_size.x; ++pos.x) {
+				// Fill row
+				for (pos.y = 0; pos.y < area_size.y; ++pos.y) {
+					dst[dst_ri + pos.y] = value;
+				}
+				dst_ri += dst_row_offset;
+			}
+		}
+	}
+}
+
+} // namespace
+
+void copy_3d_region_zxy(
+		Span<uint8_t> dst, Vector3i dst_size, Vector3i dst_min,
+		Span<const uint8_t> src, Vector3i src_size, Vector3i src_min, Vector3i src_max,
+		size_t item_size) {
+	//
+	if (!clip_copy_region_checked(dst, dst_size, dst_min, src, src_size, src_min, src_max, item_size)) {
+		return;
+	}
+	const Vector3i area_size = src_max - src_min;
+
+	// Rows following each other in both buffers are copied as a single span.
+	// Meshing and pasting often copy whole columns or slices, where this is much longer than a row.
+	unsigned int rows_per_span = 1;
+	unsigned int spans_per_slice = area_size.x;
+	unsigned int slice_count = area_size.z;
+	if (area_size.y == src_size.y && area_size.y == dst_size.y) {
+		rows_per_span = area_size.x;
+		spans_per_slice = 1;
+		if (area_size.x == src_size.x && area_size.x == dst_size.x) {
+			// Copy everything in one go
+			rows_per_span *= area_size.z;
+			slice_count = 1;
+		}
+	}
+	const size_t span_size = rows_per_span * area_size.y * item_size;
+
+	// This offset is how much to move in order to advance by one row (row direction is Y),
+	// essentially doing y+1
+	const size_t src_row_offset = src_size.y * item_size;
+	const size_t dst_row_offset = dst_size.y * item_size;
+	uint8_t *dst_data = dst.data();
+	const uint8_t *src_data = src.data();
+
+	Vector3i pos;
+	for (pos.z = 0; pos.z < static_cast<int>(slice_count); ++pos.z) {
+		pos.x = 0;
+		size_t src_ri = Vector3i(src_min + pos).get_zxy_index(src_size) * item_size;
+		size_t dst_ri = Vector3i(dst_min + pos).get_zxy_index(dst_size) * item_size;
+		for (unsigned int i = 0; i < spans_per_slice; ++i) {
+			copy_bytes(dst_data + dst_ri, src_data + src_ri, span_size);
+			src_ri += src_row_offset;
+			dst_ri += dst_row_offset;
+		}
+	}
+}
+
+void copy_3d_region_zxy_scalar(
+		Span<uint8_t> dst, Vector3i dst_size, Vector3i dst_min,
+		Span<const uint8_t> src, Vector3i src_size, Vector3i src_min, Vector3i src_max,
+		size_t item_size) {
+	//
+	if (!clip_copy_region_checked(dst, dst_size, dst_min, src, src_size, src_min, src_max, item_size)) {
+		return;
+	}
+	const Vector3i area_size = src_max - src_min;
+
 	if (area_size == src_size && area_size == dst_size) {
 		// Copy everything
-		memcpy(dst.data(), src.data(), dst.size() * item_size);
+		memcpy(dst.data(), src.data(), area_size.volume() * item_size);
 
 	} else {
 		// Copy area row by row:
@@ -40,8 +354,6 @@ void copy_3d_region_zxy(
 			unsigned int src_ri = Vector3i(src_min + pos).get_zxy_index(src_size) * item_size;
 			unsigned int dst_ri = Vector3i(dst_min + pos).get_zxy_index(dst_size) * item_size;
 			for (; pos.x < area_size.x; ++pos.x) {
-				// TODO Cast src and dst to `restrict` so the optimizer can assume adresses don't overlap,
-				//      which might allow to write as a for loop (which may compile as a `memcpy`)?
 				memcpy(&dst[dst_ri], &src[src_ri], area_size.y * item_size);
 				src_ri += src_row_offset;
 				dst_ri += dst_row_offset;
@@ -49,3 +361,108 @@ void copy_3d_region_zxy(
 		}
 	}
 }
+
+void fill_3d_region_zxy(Span<uint8_t> dst, Vector3i dst_size, Vector3i dst_min, Vector3i dst_max, uint64_t value,
+		size_t item_size) {
+	//
+	if (!clip_fill_region(dst_size, dst_min, dst_max)) {
+		// Degenerate area, we'll not fill anything.
+		return;
+	}
+	const Vector3i area_size = dst_max - dst_min;
+
+#ifdef DEBUG_ENABLED
+	ERR_FAIL_COND(area_size.volume() * item_size > dst.size());
+#endif
+
+	ItemPattern pattern;
+	make_item_pattern(pattern, value, item_size);
+
+	// Same as copies, rows following each other are filled as a single span
+	unsigned int rows_per_span = 1;
+	unsigned int spans_per_slice = area_size.x;
+	unsigned int slice_count = area_size.z;
+	if (area_size.y == dst_size.y) {
+		rows_per_span = area_size.x;
+		spans_per_slice = 1;
+		if (area_size.x == dst_size.x) {
+			rows_per_span *= area_size.z;
+			slice_count = 1;
+		}
+	}
+	const size_t span_size = rows_per_span * area_size.y * item_size;
+	const size_t dst_row_offset = dst_size.y * item_size;
+	uint8_t *dst_data = dst.data();
+
+	Vector3i pos;
+	for (pos.z = 0; pos.z < static_cast<int>(slice_count); ++pos.z) {
+		pos.x = 0;
+		size_t dst_ri = Vector3i(dst_min + pos).get_zxy_index(dst_size) * item_size;
+		for (unsigned int i = 0; i < spans_per_slice; ++i) {
+			fill_bytes(dst_data + dst_ri, span_size, pattern);
+			dst_ri += dst_row_offset;
+		}
+	}
+}
+
+void fill_3d_region_zxy_scalar(Span<uint8_t> dst, Vector3i dst_size, Vector3i dst_min, Vector3i dst_max,
+		uint64_t value, size_t item_size) {
+	//
+	if (!clip_fill_region(dst_size, dst_min, dst_max)) {
+		// Degenerate area, we'll not fill anything.
+		return;
+	}
+	const Vector3i area_size = dst_max - dst_min;
+
+#ifdef DEBUG_ENABLED
+	ERR_FAIL_COND(area_size.volume() * item_size > dst.size());
+#endif
+
+	switch (item_size) {
+		case 1:
+			fill_3d_region_zxy_scalar_t<uint8_t>(dst, dst_size, dst_min, area_size, value);
+			break;
+		case 2:
+			fill_3d_region_zxy_scalar_t<uint16_t>(
+					dst.reinterpret_cast_to<uint16_t>(), dst_size, dst_min, area_size, value);
+			break;
+		case 4:
+			fill_3d_region_zxy_scalar_t<uint32_t>(
+					dst.reinterpret_cast_to<uint32_t>(), dst_size, dst_min, area_size, value);
+			break;
+		case 8:
+			fill_3d_region_zxy_scalar_t<uint64_t>(
+					dst.reinterpret_cast_to<uint64_t>(), dst_size, dst_min, area_size, value);
+			break;
+		default:
+			ERR_FAIL_MSG("Unsupported item size");
+	}
+}
+
+bool is_uniform_b(Span<const uint8_t> data, size_t item_size) {
+	if (data.size() <= item_size) {
+		return true;
+	}
+	ItemPattern pattern;
+	make_item_pattern(pattern, data.data(), item_size);
+	return equals_pattern(data.data(), data.size(), pattern);
+}
+
+bool is_uniform_b_scalar(Span<const uint8_t> data, size_t item_size) {
+	if (data.size() <= item_size) {
+		return true;
+	}
+	const unsigned int item_count = data.size() / item_size;
+	switch (item_size) {
+		case 1:
+			return is_uniform<uint8_t>(data.data(), item_count);
+		case 2:
+			return is_uniform<uint16_t>(reinterpret_cast<const uint16_t *>(data.data()), item_count);
+		case 4:
+			return is_uniform<uint32_t>(reinterpret_cast<const uint32_t *>(data.data()), item_count);
+		case 8:
+			return is_uniform<uint64_t>(reinterpret_cast<const uint64_t *>(data.data()), item_count);
+		default:
+			ERR_FAIL_V_MSG(true, "Unsupported item size");
+	}
+}
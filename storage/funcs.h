@@ -5,6 +5,7 @@
 #include "../util/math/vector3i.h"
 #include "../util/span.h"
 #include <stdint.h>
+#include <type_traits>
 
 inline void clip_copy_region_coord(int &src_min, int &src_max, const int src_size, int &dst_min, const int dst_size) {
 	// Clamp source and shrink destination for moved borders
@@ -38,11 +39,20 @@ inline void clip_copy_region(
 	clip_copy_region_coord(src_min.z, src_max.z, src_size.z, dst_min.z, dst_size.z);
 }
 
+// Copies a sub-region of a 3D grid of items into another 3D grid, both stored in ZXY order.
+// `item_size` can be 1, 2, 4 or 8 bytes.
+// Uses SIMD when the target supports it.
 void copy_3d_region_zxy(
 		Span<uint8_t> dst, Vector3i dst_size, Vector3i dst_min,
 		Span<const uint8_t> src, Vector3i src_size, Vector3i src_min, Vector3i src_max,
 		size_t item_size);
 
+// Reference implementation of `copy_3d_region_zxy`, copying row by row without SIMD.
+void copy_3d_region_zxy_scalar(
+		Span<uint8_t> dst, Vector3i dst_size, Vector3i dst_min,
+		Span<const uint8_t> src, Vector3i src_size, Vector3i src_min, Vector3i src_max,
+		size_t item_size);
+
 template <typename T>
 inline void copy_3d_region_zxy(
 		Span<T> dst, Vector3i dst_size, Vector3i dst_min,
@@ -54,46 +64,29 @@ inline void copy_3d_region_zxy(
 			sizeof(T));
 }
 
-template <typename T>
-void fill_3d_region_zxy(Span<T> dst, Vector3i dst_size, Vector3i dst_min, Vector3i dst_max, const T value) {
-	Vector3i::sort_min_max(dst_min, dst_max);
-	dst_min.x = clamp(dst_min.x, 0, dst_size.x);
-	dst_min.y = clamp(dst_min.y, 0, dst_size.y);
-	dst_min.z = clamp(dst_min.z, 0, dst_size.z);
-	dst_max.x = clamp(dst_max.x, 0, dst_size.x);
-	dst_max.y = clamp(dst_max.y, 0, dst_size.y);
-	dst_max.z = clamp(dst_max.z, 0, dst_size.z);
-	const Vector3i area_size = dst_max - dst_min;
-	if (area_size.x <= 0 || area_size.y <= 0 || area_size.z <= 0) {
-		// Degenerate area, we'll not copy anything.
-		return;
-	}
+// Fills a sub-region of a 3D grid of items stored in ZXY order.
+// `value` is truncated to `item_size`, which can be 1, 2, 4 or 8 bytes.
+// Uses SIMD when the target supports it.
+void fill_3d_region_zxy(Span<uint8_t> dst, Vector3i dst_size, Vector3i dst_min, Vector3i dst_max, uint64_t value,
+		size_t item_size);
 
-#ifdef DEBUG_ENABLED
-	ERR_FAIL_COND(area_size.volume() > dst.size());
-#endif
-
-	if (area_size == dst_size) {
-		for (unsigned int i = 0; i < dst.size(); ++i) {
-			dst[i] = value;
-		}
-
-	} else {
-		const unsigned int dst_row_offset = dst_size.y;
-		Vector3i pos;
-		for (pos.z = 0; pos.z < area_size.z; ++pos.z) {
-			unsigned int dst_ri = Vector3i(dst_min + pos).get_zxy_index(dst_size);
-			for (pos.x = 0; pos.x < area_size.x; ++pos.x) {
-				// Fill row
-				for (pos.y = 0; pos.y < area_size.y; ++pos.y) {
-					dst[dst_ri + pos.y] = value;
-				}
-				dst_ri += dst_row_offset;
-			}
-		}
-	}
+// Reference implementation of `fill_3d_region_zxy`, filling item by item.
+void fill_3d_region_zxy_scalar(Span<uint8_t> dst, Vector3i dst_size, Vector3i dst_min, Vector3i dst_max,
+		uint64_t value, size_t item_size);
+
+template <typename T>
+inline void fill_3d_region_zxy(Span<T> dst, Vector3i dst_size, Vector3i dst_min, Vector3i dst_max, const T value) {
+	static_assert(std::is_integral<T>::value, "Only integer items are supported");
+	fill_3d_region_zxy(dst.template reinterpret_cast_to<uint8_t>(), dst_size, dst_min, dst_max, value, sizeof(T));
 }
 
+// Tests if all items in `data` have the same value. `item_size` can be 1, 2, 4 or 8 bytes.
+// Uses SIMD when the target supports it.
+bool is_uniform_b(Span<const uint8_t> data, size_t item_size);
+
+// Reference implementation of `is_uniform_b`, comparing words of items.
+bool is_uniform_b_scalar(Span<const uint8_t> data, size_t item_size);
+
 // TODO Switch to using GPU format inorm16 for these conversions
 // The current ones seem to work but aren't really correct
 
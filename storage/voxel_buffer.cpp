@@ -13,26 +13,57 @@
 #include <core/image.h>
 #include <core/io/marshalls.h>
 #include <core/math/math_funcs.h>
+#include <atomic>
 #include <string.h>
 
 namespace {
 
+// Channel data can be shared by buffers duplicated from each other, so it starts with a reference count.
+// Data is copied only when one of them needs to modify it.
+struct ChannelDataHeader {
+	std::atomic<uint32_t> ref_count;
+	// Keeps voxel data aligned for 64-bit values
+	uint32_t padding;
+};
+
+inline ChannelDataHeader *get_channel_data_header(uint8_t *data) {
+	return reinterpret_cast<ChannelDataHeader *>(data - sizeof(ChannelDataHeader));
+}
+
 inline uint8_t *allocate_channel_data(uint32_t size) {
+	const uint32_t total_size = size + sizeof(ChannelDataHeader);
 #ifdef VOXEL_BUFFER_USE_MEMORY_POOL
-	return VoxelMemoryPool::get_singleton()->allocate(size);
+	uint8_t *p = VoxelMemoryPool::get_singleton()->allocate(total_size);
 #else
-	return (uint8_t *)memalloc(size * sizeof(uint8_t));
+	uint8_t *p = (uint8_t *)memalloc(total_size * sizeof(uint8_t));
 #endif
+	ChannelDataHeader *header = memnew_placement(p, ChannelDataHeader);
+	header->ref_count = 1;
+	return p + sizeof(ChannelDataHeader);
 }
 
+// Releases one reference to the data. It is freed when no buffer uses it anymore.
 inline void free_channel_data(uint8_t *data, uint32_t size) {
+	ChannelDataHeader *header = get_channel_data_header(data);
+	if (header->ref_count.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+		return;
+	}
+	header->~ChannelDataHeader();
 #ifdef VOXEL_BUFFER_USE_MEMORY_POOL
-	VoxelMemoryPool::get_singleton()->recycle(data, size);
+	VoxelMemoryPool::get_singleton()->recycle(reinterpret_cast<uint8_t *>(header), size + sizeof(ChannelDataHeader));
 #else
-	memfree(data);
+	memfree(header);
 #endif
 }
 
+inline void reference_channel_data(uint8_t *data) {
+	get_channel_data_header(data)->ref_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline bool is_channel_data_shared(uint8_t *data) {
+	return data != nullptr && get_channel_data_header(data)->ref_count.load(std::memory_order_acquire) > 1;
+}
+
 uint64_t g_depth_max_values[] = {
 	0xff, // 8
 	0xffff, // 16
@@ -112,6 +143,243 @@ inline real_t raw_voxel_to_real(uint64_t value, VoxelBuffer::Depth depth) {
 	}
 }
 
+// Palette indices use power-of-two bit counts, so none of them straddles two bytes
+
+inline uint32_t get_palette_index(const uint8_t *packed, uint32_t i, uint32_t bits) {
+	const uint32_t bit_index = i * bits;
+	return (packed[bit_index >> 3] >> (bit_index & 7)) & ((1 << bits) - 1);
+}
+
+inline void set_palette_index(uint8_t *packed, uint32_t i, uint32_t bits, uint32_t palette_index) {
+	const uint32_t bit_index = i * bits;
+	const uint32_t shift = bit_index & 7;
+	const uint32_t mask = ((1 << bits) - 1) << shift;
+	uint8_t &b = packed[bit_index >> 3];
+	b = (b & ~mask) | ((palette_index << shift) & mask);
+}
+
+inline uint32_t get_size_in_bytes_for_palette_indices(uint32_t volume, uint32_t bits) {
+	return (volume * bits + 7) >> 3;
+}
+
+// Indices must be smaller than values, otherwise there is no point using a palette
+inline uint32_t get_max_palette_index_bits(VoxelBuffer::Depth d) {
+	return MIN(get_depth_bit_count(d) >> 1, 8u);
+}
+
+inline uint32_t get_palette_index_bits_for_count(uint32_t count) {
+	if (count <= 2) {
+		return 1;
+	} else if (count <= 4) {
+		return 2;
+	} else if (count <= 16) {
+		return 4;
+	}
+	return 8;
+}
+
+inline int find_palette_index(const std::vector<uint64_t> &palette, uint64_t value) {
+	for (unsigned int i = 0; i < palette.size(); ++i) {
+		if (palette[i] == value) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+inline uint64_t get_raw_value(const uint8_t *data, VoxelBuffer::Depth depth, uint32_t i) {
+	switch (depth) {
+		case VoxelBuffer::DEPTH_8_BIT:
+			return data[i];
+		case VoxelBuffer::DEPTH_16_BIT:
+			return reinterpret_cast<const uint16_t *>(data)[i];
+		case VoxelBuffer::DEPTH_32_BIT:
+			return reinterpret_cast<const uint32_t *>(data)[i];
+		case VoxelBuffer::DEPTH_64_BIT:
+			return reinterpret_cast<const uint64_t *>(data)[i];
+		default:
+			CRASH_NOW();
+			return 0;
+	}
+}
+
+inline void set_raw_value(uint8_t *data, VoxelBuffer::Depth depth, uint32_t i, uint64_t value) {
+	switch (depth) {
+		case VoxelBuffer::DEPTH_8_BIT:
+			data[i] = value;
+			break;
+		case VoxelBuffer::DEPTH_16_BIT:
+			reinterpret_cast<uint16_t *>(data)[i] = value;
+			break;
+		case VoxelBuffer::DEPTH_32_BIT:
+			reinterpret_cast<uint32_t *>(data)[i] = value;
+			break;
+		case VoxelBuffer::DEPTH_64_BIT:
+			reinterpret_cast<uint64_t *>(data)[i] = value;
+			break;
+		default:
+			CRASH_NOW();
+			break;
+	}
+}
+
+// Slow, only for places which don't have a faster path. Doesn't work with bricks.
+inline uint64_t get_channel_value(const VoxelBuffer::Channel &channel, uint32_t i) {
+	if (channel.palette_index_bits != 0) {
+		return channel.palette[get_palette_index(channel.data, i, channel.palette_index_bits)];
+	}
+	return get_raw_value(channel.data, channel.depth, i);
+}
+
+template <typename T, unsigned int BITS>
+inline void decode_palette_indices(T *dst, const uint8_t *packed, uint32_t src_index, uint32_t count,
+		const T *palette) {
+	const uint32_t mask = (1 << BITS) - 1;
+	for (uint32_t j = 0; j < count; ++j) {
+		const uint32_t bit_index = (src_index + j) * BITS;
+		dst[j] = palette[(packed[bit_index >> 3] >> (bit_index & 7)) & mask];
+	}
+}
+
+template <typename T>
+inline void decode_palette_indices(T *dst, const uint8_t *packed, uint32_t src_index, uint32_t count,
+		uint32_t bits, const T *palette) {
+	// Dispatching outside of the loop lets the compiler turn shifts and masks into constants
+	switch (bits) {
+		case 1:
+			decode_palette_indices<T, 1>(dst, packed, src_index, count, palette);
+			break;
+		case 2:
+			decode_palette_indices<T, 2>(dst, packed, src_index, count, palette);
+			break;
+		case 4:
+			decode_palette_indices<T, 4>(dst, packed, src_index, count, palette);
+			break;
+		case 8:
+			decode_palette_indices<T, 8>(dst, packed, src_index, count, palette);
+			break;
+		default:
+			CRASH_NOW();
+			break;
+	}
+}
+
+template <typename T>
+void decode_palette_region(const VoxelBuffer::Channel &channel, Vector3i src_size,
+		Span<T> dst, Vector3i dst_size, Vector3i dst_min, Vector3i src_min, Vector3i src_max) {
+	Vector3i::sort_min_max(src_min, src_max);
+	clip_copy_region(src_min, src_max, src_size, dst_min, dst_size);
+	const Vector3i area_size = src_max - src_min;
+	if (area_size.x <= 0 || area_size.y <= 0 || area_size.z <= 0) {
+		// Degenerate area, we'll not copy anything.
+		return;
+	}
+
+#ifdef DEBUG_ENABLED
+	ERR_FAIL_COND(area_size.volume() > dst.size());
+	ERR_FAIL_COND(channel.palette.size() > 256);
+#endif
+
+	// Convert the palette once, so decoding is just a lookup
+	FixedArray<T, 256> palette;
+	for (unsigned int i = 0; i < channel.palette.size(); ++i) {
+		palette[i] = channel.palette[i];
+	}
+
+	const uint32_t bits = channel.palette_index_bits;
+
+	if (area_size == src_size && area_size == dst_size) {
+		decode_palette_indices(dst.data(), channel.data, 0, dst.size(), bits, palette.data());
+
+	} else {
+		Vector3i pos;
+		for (pos.z = 0; pos.z < area_size.z; ++pos.z) {
+			for (pos.x = 0; pos.x < area_size.x; ++pos.x) {
+				const unsigned int src_ri = Vector3i(src_min + pos).get_zxy_index(src_size);
+				const unsigned int dst_ri = Vector3i(dst_min + pos).get_zxy_index(dst_size);
+				decode_palette_indices(&dst[dst_ri], channel.data, src_ri, area_size.y, bits, palette.data());
+			}
+		}
+	}
+}
+
+// 4x4x4 voxels
+const uint32_t BRICK_SIZE_PO2 = 2;
+
+// Data of brick channels starts with a table of bricks, in ZXY order, followed by voxels of non-uniform bricks.
+struct Brick {
+	// Value of all voxels of the brick when it is uniform
+	uint64_t value;
+	// Where voxels of the brick start in channel data. Zero when the brick is uniform, since the table comes first.
+	uint32_t data_offset;
+};
+
+inline Brick &get_brick(VoxelBuffer::Channel &channel, uint32_t brick_index) {
+	return reinterpret_cast<Brick *>(channel.data)[brick_index];
+}
+
+inline const Brick &get_brick(const VoxelBuffer::Channel &channel, uint32_t brick_index) {
+	return reinterpret_cast<const Brick *>(channel.data)[brick_index];
+}
+
+inline uint32_t get_brick_index(Vector3i pos, Vector3i size, uint32_t po2) {
+	return Vector3i(pos >> po2).get_zxy_index(size >> po2);
+}
+
+// Index of a voxel within the data of its brick, also in ZXY order
+inline uint32_t get_brick_local_index(Vector3i pos, uint32_t po2) {
+	const int mask = (1 << po2) - 1;
+	return (pos.y & mask) + (((pos.x & mask) + ((pos.z & mask) << po2)) << po2);
+}
+
+template <typename T>
+void decode_brick_region(const VoxelBuffer::Channel &channel, Vector3i src_size,
+		Span<T> dst, Vector3i dst_size, Vector3i dst_min, Vector3i src_min, Vector3i src_max) {
+	Vector3i::sort_min_max(src_min, src_max);
+	clip_copy_region(src_min, src_max, src_size, dst_min, dst_size);
+	const Vector3i area_size = src_max - src_min;
+	if (area_size.x <= 0 || area_size.y <= 0 || area_size.z <= 0) {
+		// Degenerate area, we'll not copy anything.
+		return;
+	}
+
+#ifdef DEBUG_ENABLED
+	ERR_FAIL_COND(area_size.volume() > dst.size());
+#endif
+
+	const uint32_t po2 = channel.brick_size_po2;
+	const int brick_mask = (1 << po2) - 1;
+
+	Vector3i pos;
+	for (pos.z = 0; pos.z < area_size.z; ++pos.z) {
+		for (pos.x = 0; pos.x < area_size.x; ++pos.x) {
+			Vector3i src_pos = src_min + pos;
+			unsigned int dst_i = Vector3i(dst_min + pos).get_zxy_index(dst_size);
+
+			// Rows of voxels are split in segments, one per brick they cross.
+			// Within a brick, voxels of a row are contiguous too.
+			while (src_pos.y < src_max.y) {
+				const int segment_end = MIN((src_pos.y | brick_mask) + 1, src_max.y);
+				const unsigned int count = segment_end - src_pos.y;
+				const Brick &brick = get_brick(channel, get_brick_index(src_pos, src_size, po2));
+
+				if (brick.data_offset == 0) {
+					const T v = brick.value;
+					for (unsigned int i = 0; i < count; ++i) {
+						dst[dst_i + i] = v;
+					}
+				} else {
+					const T *src = reinterpret_cast<const T *>(channel.data + brick.data_offset);
+					memcpy(&dst[dst_i], src + get_brick_local_index(src_pos, po2), count * sizeof(T));
+				}
+
+				dst_i += count;
+				src_pos.y = segment_end;
+			}
+		}
+	}
+}
+
 } // namespace
 
 const char *VoxelBuffer::CHANNEL_ID_HINT_STRING = "Type,Sdf,Color,Indices,Weights,Data5,Data6,Data7";
@@ -139,9 +407,9 @@ VoxelBuffer::~VoxelBuffer() {
 void VoxelBuffer::create(unsigned int sx, unsigned int sy, unsigned int sz) {
 	ERR_FAIL_COND(sx > MAX_SIZE || sy > MAX_SIZE || sz > MAX_SIZE);
 
-	clear_voxel_metadata();
-
 	Vector3i new_size(sx, sy, sz);
+	_voxel_metadata.create(new_size);
+
 	if (new_size != _size) {
 		for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
 			Channel &channel = _channels[i];
@@ -167,7 +435,7 @@ void VoxelBuffer::clear() {
 		}
 	}
 	_size = Vector3i();
-	clear_voxel_metadata();
+	_voxel_metadata.create(_size);
 }
 
 void VoxelBuffer::clear_channel(unsigned int channel_index, uint64_t clear_value) {
@@ -200,6 +468,20 @@ uint64_t VoxelBuffer::get_voxel(int x, int y, int z, unsigned int channel_index)
 	if (channel.data != nullptr) {
 		const uint32_t i = get_index(x, y, z);
 
+		if (channel.palette_index_bits != 0) {
+			return channel.palette[::get_palette_index(channel.data, i, channel.palette_index_bits)];
+		}
+
+		if (channel.brick_size_po2 != 0) {
+			const Vector3i pos(x, y, z);
+			const Brick &brick = get_brick(channel, get_brick_index(pos, _size, channel.brick_size_po2));
+			if (brick.data_offset == 0) {
+				return brick.value;
+			}
+			return get_raw_value(channel.data + brick.data_offset, channel.depth,
+					get_brick_local_index(pos, channel.brick_size_po2));
+		}
+
 		switch (channel.depth) {
 			case DEPTH_8_BIT:
 				return channel.data[i];
@@ -230,6 +512,15 @@ void VoxelBuffer::set_voxel(uint64_t value, int x, int y, int z, unsigned int ch
 	Channel &channel = _channels[channel_index];
 
 	value = clamp_value_for_depth(value, channel.depth);
+
+	if (get_voxel(x, y, z, channel_index) == value) {
+		// Nothing changes, which also spares copying data shared with duplicates
+		return;
+	}
+
+	// Duplicates of this buffer must not see the change
+	fork_channel_if_shared(channel_index);
+
 	bool do_set = true;
 
 	if (channel.data == nullptr) {
@@ -239,6 +530,51 @@ void VoxelBuffer::set_voxel(uint64_t value, int x, int y, int z, unsigned int ch
 		} else {
 			do_set = false;
 		}
+
+	} else if (channel.palette_index_bits != 0) {
+		int palette_index = find_palette_index(channel.palette, value);
+
+		if (palette_index == -1) {
+			if (channel.palette.size() == (1u << channel.palette_index_bits)) {
+				// No room left for a new value
+				const uint32_t index_bits = channel.palette_index_bits << 1;
+				if (index_bits <= ::get_max_palette_index_bits(channel.depth)) {
+					repack_palette_channel(channel_index, index_bits);
+				} else {
+					// Too many distinct values for the palette to save memory
+					decompress_channel(channel_index);
+				}
+			}
+			if (channel.palette_index_bits != 0) {
+				palette_index = channel.palette.size();
+				channel.palette.push_back(value);
+			}
+		}
+
+		if (channel.palette_index_bits != 0) {
+			::set_palette_index(channel.data, get_index(x, y, z), channel.palette_index_bits, palette_index);
+			do_set = false;
+		}
+
+	} else if (channel.brick_size_po2 != 0) {
+		const Vector3i pos(x, y, z);
+		const uint32_t brick_index = get_brick_index(pos, _size, channel.brick_size_po2);
+
+		if (get_brick(channel, brick_index).data_offset == 0) {
+			if (get_brick(channel, brick_index).value == value) {
+				do_set = false;
+			} else {
+				// Voxels of the brick will no longer be all the same
+				allocate_brick_voxels(channel_index, brick_index);
+			}
+		}
+
+		if (do_set && channel.brick_size_po2 != 0) {
+			const Brick &brick = get_brick(channel, brick_index);
+			set_raw_value(channel.data + brick.data_offset, channel.depth,
+					get_brick_local_index(pos, channel.brick_size_po2), value);
+			do_set = false;
+		}
 	}
 
 	if (do_set) {
@@ -285,6 +621,11 @@ void VoxelBuffer::fill(uint64_t defval, unsigned int channel_index) {
 
 	defval = clamp_value_for_depth(defval, channel.depth);
 
+	if (channel.palette_index_bits != 0 || channel.brick_size_po2 != 0 || is_channel_data_shared(channel.data)) {
+		// The channel becomes uniform, no need to keep indices, bricks or a copy of shared data
+		delete_channel(channel_index);
+	}
+
 	if (channel.data == nullptr) {
 		// Channel is already optimized and uniform
 		if (channel.defval == defval) {
@@ -297,35 +638,8 @@ void VoxelBuffer::fill(uint64_t defval, unsigned int channel_index) {
 		}
 	}
 
-	const unsigned int volume = get_volume();
-
-	switch (channel.depth) {
-		case DEPTH_8_BIT:
-			memset(channel.data, defval, channel.size_in_bytes);
-			break;
-
-		case DEPTH_16_BIT:
-			for (uint32_t i = 0; i < volume; ++i) {
-				reinterpret_cast<uint16_t *>(channel.data)[i] = defval;
-			}
-			break;
-
-		case DEPTH_32_BIT:
-			for (uint32_t i = 0; i < volume; ++i) {
-				reinterpret_cast<uint32_t *>(channel.data)[i] = defval;
-			}
-			break;
-
-		case DEPTH_64_BIT:
-			for (uint32_t i = 0; i < volume; ++i) {
-				reinterpret_cast<uint64_t *>(channel.data)[i] = defval;
-			}
-			break;
-
-		default:
-			CRASH_NOW();
-			break;
-	}
+	fill_3d_region_zxy(Span<uint8_t>(channel.data, channel.size_in_bytes), _size, Vector3i(), _size, defval,
+			get_depth_byte_count(channel.depth));
 }
 
 void VoxelBuffer::fill_area(uint64_t defval, Vector3i min, Vector3i max, unsigned int channel_index) {
@@ -342,51 +656,13 @@ void VoxelBuffer::fill_area(uint64_t defval, Vector3i min, Vector3i max, unsigne
 	Channel &channel = _channels[channel_index];
 	defval = clamp_value_for_depth(defval, channel.depth);
 
-	if (channel.data == nullptr) {
-		if (channel.defval == defval) {
-			return;
-		} else {
-			create_channel(channel_index, _size, channel.defval);
-		}
+	if (channel.data == nullptr && channel.defval == defval) {
+		return;
 	}
+	decompress_channel(channel_index);
 
-	Vector3i pos;
-	const unsigned int volume = get_volume();
-	for (pos.z = min.z; pos.z < max.z; ++pos.z) {
-		for (pos.x = min.x; pos.x < max.x; ++pos.x) {
-			const unsigned int dst_ri = get_index(pos.x, pos.y + min.y, pos.z);
-			CRASH_COND(dst_ri >= volume);
-
-			switch (channel.depth) {
-				case DEPTH_8_BIT:
-					// Fill row by row
-					memset(&channel.data[dst_ri], defval, area_size.y * sizeof(uint8_t));
-					break;
-
-				case DEPTH_16_BIT:
-					for (int i = 0; i < area_size.y; ++i) {
-						((uint16_t *)channel.data)[dst_ri + i] = defval;
-					}
-					break;
-
-				case DEPTH_32_BIT:
-					for (int i = 0; i < area_size.y; ++i) {
-						((uint32_t *)channel.data)[dst_ri + i] = defval;
-					}
-					break;
-
-				case DEPTH_64_BIT:
-					for (int i = 0; i < area_size.y; ++i) {
-						((uint64_t *)channel.data)[dst_ri + i] = defval;
-					}
-					break;
-
-				default:
-					CRASH_NOW();
-					break;
-			}
-		}
-	}
+	fill_3d_region_zxy(Span<uint8_t>(channel.data, channel.size_in_bytes), _size, min, max, defval,
+			get_depth_byte_count(channel.depth));
 }
 
 void VoxelBuffer::fill_area_f(float fvalue, Vector3i min, Vector3i max, unsigned int channel_index) {
@@ -400,11 +676,6 @@ void VoxelBuffer::fill_f(real_t value, unsigned int channel) {
 	fill(real_to_raw_voxel(value, _channels[channel].depth), channel);
 }
 
-template <typename T>
-inline bool is_uniform_b(const uint8_t *data, unsigned int item_count) {
-	return is_uniform<T>(reinterpret_cast<const T *>(data), item_count);
-}
-
 bool VoxelBuffer::is_uniform(unsigned int channel_index) const {
 	ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, true);
 
@@ -414,24 +685,19 @@ bool VoxelBuffer::is_uniform(unsigned int channel_index) const {
 		return true;
 	}
 
-	const unsigned int volume = get_volume();
+	const unsigned int size_in_bytes = get_size_in_bytes_for_volume(_size, channel.depth);
+	const uint8_t *data = channel.data;
 
-	// Channel isn't optimized, so must look at each voxel
-	switch (channel.depth) {
-		case DEPTH_8_BIT:
-			return ::is_uniform_b<uint8_t>(channel.data, volume);
-		case DEPTH_16_BIT:
-			return ::is_uniform_b<uint16_t>(channel.data, volume);
-		case DEPTH_32_BIT:
-			return ::is_uniform_b<uint32_t>(channel.data, volume);
-		case DEPTH_64_BIT:
-			return ::is_uniform_b<uint64_t>(channel.data, volume);
-		default:
-			CRASH_NOW();
-			break;
+	if (channel.palette_index_bits != 0 || channel.brick_size_po2 != 0) {
+		// Compressed channels can end up uniform after edits, so they are checked decoded
+		static thread_local std::vector<uint8_t> s_decoded;
+		s_decoded.resize(size_in_bytes);
+		decode_channel(channel_index, to_span(s_decoded));
+		data = s_decoded.data();
 	}
 
-	return true;
+	// Channel isn't optimized, so must look at each voxel
+	return ::is_uniform_b(Span<const uint8_t>(data, size_in_bytes), get_depth_byte_count(channel.depth));
 }
 
 void VoxelBuffer::compress_uniform_channels() {
@@ -444,12 +710,276 @@ void VoxelBuffer::compress_uniform_channels() {
 	}
 }
 
+void VoxelBuffer::compress_palette_channels() {
+	VOXEL_PROFILE_SCOPE();
+	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
+		compress_channel_palette(i);
+	}
+}
+
+bool VoxelBuffer::compress_channel_palette(unsigned int channel_index) {
+	Channel &channel = _channels[channel_index];
+	if (channel.data == nullptr || channel.brick_size_po2 != 0) {
+		// Uniform is already the smallest, and bricks were chosen already
+		return false;
+	}
+
+	const uint32_t max_palette_size = 1 << ::get_max_palette_index_bits(channel.depth);
+	const unsigned int volume = get_volume();
+
+	// Palettes are rebuilt from scratch, which also drops entries no longer in use
+	std::vector<uint64_t> palette;
+	static thread_local std::vector<uint8_t> s_indices;
+	s_indices.resize(volume);
+
+	// Consecutive voxels often have the same value, which saves looking up the palette
+	uint64_t prev_value = ::get_channel_value(channel, 0);
+	int prev_index = -1;
+
+	for (unsigned int i = 0; i < volume; ++i) {
+		const uint64_t v = ::get_channel_value(channel, i);
+		if (v != prev_value || prev_index == -1) {
+			prev_index = find_palette_index(palette, v);
+			if (prev_index == -1) {
+				if (palette.size() == max_palette_size) {
+					// Too many distinct values
+					return false;
+				}
+				prev_index = palette.size();
+				palette.push_back(v);
+			}
+			prev_value = v;
+		}
+		s_indices[i] = prev_index;
+	}
+
+	if (palette.size() == 1) {
+		clear_channel(channel_index, palette[0]);
+		return true;
+	}
+
+	const uint32_t index_bits = get_palette_index_bits_for_count(palette.size());
+	const uint32_t size_in_bytes = get_size_in_bytes_for_palette_indices(volume, index_bits);
+	uint8_t *packed = allocate_channel_data(size_in_bytes);
+	memset(packed, 0, size_in_bytes);
+	for (unsigned int i = 0; i < volume; ++i) {
+		::set_palette_index(packed, i, index_bits, s_indices[i]);
+	}
+
+	delete_channel(channel_index);
+	channel.data = packed;
+	channel.size_in_bytes = size_in_bytes;
+	channel.palette_index_bits = index_bits;
+	channel.palette = std::move(palette);
+	return true;
+}
+
+void VoxelBuffer::repack_palette_channel(unsigned int channel_index, uint32_t index_bits) {
+	Channel &channel = _channels[channel_index];
+	CRASH_COND(channel.palette_index_bits == 0);
+
+	const unsigned int volume = get_volume();
+	const uint32_t size_in_bytes = get_size_in_bytes_for_palette_indices(volume, index_bits);
+	uint8_t *packed = allocate_channel_data(size_in_bytes);
+	memset(packed, 0, size_in_bytes);
+	for (unsigned int i = 0; i < volume; ++i) {
+		::set_palette_index(packed, i, index_bits, ::get_palette_index(channel.data, i, channel.palette_index_bits));
+	}
+
+	free_channel_data(channel.data, channel.size_in_bytes);
+	channel.data = packed;
+	channel.size_in_bytes = size_in_bytes;
+	channel.palette_index_bits = index_bits;
+}
+
+void VoxelBuffer::compress_brick_channels() {
+	VOXEL_PROFILE_SCOPE();
+	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
+		compress_channel_bricks(i);
+	}
+}
+
+bool VoxelBuffer::compress_channel_bricks(unsigned int channel_index) {
+	Channel &channel = _channels[channel_index];
+	if (channel.data == nullptr || channel.palette_index_bits != 0 || channel.brick_size_po2 != 0) {
+		return false;
+	}
+
+	const uint32_t po2 = BRICK_SIZE_PO2;
+	const int brick_size = 1 << po2;
+	if (_size.x % brick_size != 0 || _size.y % brick_size != 0 || _size.z % brick_size != 0) {
+		// Bricks must fit exactly
+		return false;
+	}
+
+	const Vector3i grid_size = _size >> po2;
+	const unsigned int item_size = get_depth_byte_count(channel.depth);
+	const uint32_t brick_size_in_bytes = (brick_size * brick_size * brick_size) * item_size;
+	const uint32_t table_size_in_bytes = grid_size.volume() * sizeof(Brick);
+
+	static thread_local std::vector<Brick> s_bricks;
+	s_bricks.resize(grid_size.volume());
+
+	uint32_t size_in_bytes = table_size_in_bytes;
+
+	// Find which bricks are uniform
+	Vector3i bpos;
+	unsigned int brick_index = 0;
+	for (bpos.z = 0; bpos.z < grid_size.z; ++bpos.z) {
+		for (bpos.x = 0; bpos.x < grid_size.x; ++bpos.x) {
+			for (bpos.y = 0; bpos.y < grid_size.y; ++bpos.y) {
+				const Vector3i origin = bpos << po2;
+				Brick &brick = s_bricks[brick_index];
+				++brick_index;
+
+				brick.value = get_raw_value(channel.data, channel.depth, get_index(origin.x, origin.y, origin.z));
+				brick.data_offset = 0;
+
+				Vector3i pos;
+				for (pos.z = origin.z; pos.z < origin.z + brick_size && brick.data_offset == 0; ++pos.z) {
+					for (pos.x = origin.x; pos.x < origin.x + brick_size && brick.data_offset == 0; ++pos.x) {
+						const unsigned int row_index = get_index(pos.x, origin.y, pos.z);
+						for (int i = 0; i < brick_size; ++i) {
+							if (get_raw_value(channel.data, channel.depth, row_index + i) != brick.value) {
+								brick.data_offset = size_in_bytes;
+								size_in_bytes += brick_size_in_bytes;
+								break;
+							}
+						}
+					}
+				}
+			}
+		}
+	}
+
+	if (size_in_bytes >= channel.size_in_bytes) {
+		// Not sparse enough
+		return false;
+	}
+
+	uint8_t *data = allocate_channel_data(size_in_bytes);
+	memcpy(data, s_bricks.data(), table_size_in_bytes);
+
+	// Copy voxels of non-uniform bricks, row by row
+	brick_index = 0;
+	for (bpos.z = 0; bpos.z < grid_size.z; ++bpos.z) {
+		for (bpos.x = 0; bpos.x < grid_size.x; ++bpos.x) {
+			for (bpos.y = 0; bpos.y < grid_size.y; ++bpos.y) {
+				const Brick &brick = s_bricks[brick_index];
+				++brick_index;
+				if (brick.data_offset == 0) {
+					continue;
+				}
+				const Vector3i origin = bpos << po2;
+				uint8_t *dst = data + brick.data_offset;
+				for (int z = 0; z < brick_size; ++z) {
+					for (int x = 0; x < brick_size; ++x) {
+						const unsigned int src_index = get_index(origin.x + x, origin.y, origin.z + z);
+						memcpy(dst, channel.data + src_index * item_size, brick_size * item_size);
+						dst += brick_size * item_size;
+					}
+				}
+			}
+		}
+	}
+
+	delete_channel(channel_index);
+	channel.data = data;
+	channel.size_in_bytes = size_in_bytes;
+	channel.brick_size_po2 = po2;
+	return true;
+}
+
+void VoxelBuffer::allocate_brick_voxels(unsigned int channel_index, unsigned int brick_index) {
+	Channel &channel = _channels[channel_index];
+	CRASH_COND(channel.brick_size_po2 == 0);
+
+	const uint32_t brick_volume = 1 << (3 * channel.brick_size_po2);
+	const uint32_t size_in_bytes = channel.size_in_bytes + brick_volume * get_depth_byte_count(channel.depth);
+
+	if (size_in_bytes >= get_size_in_bytes_for_volume(_size, channel.depth)) {
+		// Bricks would take more memory than storing all voxels
+		decompress_channel(channel_index);
+		return;
+	}
+
+	uint8_t *data = allocate_channel_data(size_in_bytes);
+	memcpy(data, channel.data, channel.size_in_bytes);
+
+	Brick &brick = reinterpret_cast<Brick *>(data)[brick_index];
+	brick.data_offset = channel.size_in_bytes;
+	for (uint32_t i = 0; i < brick_volume; ++i) {
+		set_raw_value(data + brick.data_offset, channel.depth, i, brick.value);
+	}
+
+	free_channel_data(channel.data, channel.size_in_bytes);
+	channel.data = data;
+	channel.size_in_bytes = size_in_bytes;
+}
+
+template <typename T>
+inline void decode_region_t(const VoxelBuffer::Channel &channel, Vector3i src_size, Span<uint8_t> dst,
+		Vector3i dst_size, Vector3i dst_min, Vector3i src_min, Vector3i src_max) {
+	if (channel.palette_index_bits != 0) {
+		decode_palette_region(channel, src_size, dst.reinterpret_cast_to<T>(), dst_size, dst_min, src_min, src_max);
+	} else {
+		decode_brick_region(channel, src_size, dst.reinterpret_cast_to<T>(), dst_size, dst_min, src_min, src_max);
+	}
+}
+
+void VoxelBuffer::decode_region(unsigned int channel_index, Span<uint8_t> dst, Vector3i dst_size,
+		Vector3i dst_min, Vector3i src_min, Vector3i src_max) const {
+	const Channel &channel = _channels[channel_index];
+	CRASH_COND(channel.palette_index_bits == 0 && channel.brick_size_po2 == 0);
+
+	switch (channel.depth) {
+		case DEPTH_8_BIT:
+			decode_region_t<uint8_t>(channel, _size, dst, dst_size, dst_min, src_min, src_max);
+			break;
+		case DEPTH_16_BIT:
+			decode_region_t<uint16_t>(channel, _size, dst, dst_size, dst_min, src_min, src_max);
+			break;
+		case DEPTH_32_BIT:
+			decode_region_t<uint32_t>(channel, _size, dst, dst_size, dst_min, src_min, src_max);
+			break;
+		case DEPTH_64_BIT:
+			decode_region_t<uint64_t>(channel, _size, dst, dst_size, dst_min, src_min, src_max);
+			break;
+		default:
+			CRASH_NOW();
+			break;
+	}
+}
+
 void VoxelBuffer::decompress_channel(unsigned int channel_index) {
 	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
 	Channel &channel = _channels[channel_index];
 	if (channel.data == nullptr) {
 		create_channel(channel_index, _size, channel.defval);
+
+	} else if (channel.palette_index_bits != 0 || channel.brick_size_po2 != 0) {
+		const uint32_t size_in_bytes = get_size_in_bytes_for_volume(_size, channel.depth);
+		uint8_t *data = allocate_channel_data(size_in_bytes);
+		decode_region(channel_index, Span<uint8_t>(data, size_in_bytes), _size, Vector3i(), Vector3i(), _size);
+		delete_channel(channel_index);
+		channel.data = data;
+		channel.size_in_bytes = size_in_bytes;
+
+	} else {
+		fork_channel_if_shared(channel_index);
+	}
+}
+
+void VoxelBuffer::fork_channel_if_shared(unsigned int channel_index) {
+	Channel &channel = _channels[channel_index];
+	if (!is_channel_data_shared(channel.data)) {
+		return;
 	}
+	// Other buffers keep the previous version
+	uint8_t *data = allocate_channel_data(channel.size_in_bytes);
+	memcpy(data, channel.data, channel.size_in_bytes);
+	free_channel_data(channel.data, channel.size_in_bytes);
+	channel.data = data;
 }
 
 VoxelBuffer::Compression VoxelBuffer::get_channel_compression(unsigned int channel_index) const {
@@ -458,6 +988,12 @@ VoxelBuffer::Compression VoxelBuffer::get_channel_compression(unsigned int chann
 	if (channel.data == nullptr) {
 		return COMPRESSION_UNIFORM;
 	}
+	if (channel.palette_index_bits != 0) {
+		return COMPRESSION_PALETTE;
+	}
+	if (channel.brick_size_po2 != 0) {
+		return COMPRESSION_BRICKS;
+	}
 	return COMPRESSION_NONE;
 }
 
@@ -484,11 +1020,18 @@ void VoxelBuffer::copy_from(const VoxelBuffer &other, unsigned int channel_index
 	ERR_FAIL_COND(other_channel.depth != channel.depth);
 
 	if (other_channel.data != nullptr) {
-		if (channel.data == nullptr) {
-			create_channel_noinit(channel_index, _size);
+		if (channel.data != other_channel.data) {
+			if (channel.data != nullptr) {
+				delete_channel(channel_index);
+			}
+			// Data is shared until one of the buffers modifies it
+			reference_channel_data(other_channel.data);
+			channel.data = other_channel.data;
+			channel.size_in_bytes = other_channel.size_in_bytes;
 		}
-		CRASH_COND(channel.size_in_bytes != other_channel.size_in_bytes);
-		memcpy(channel.data, other_channel.data, channel.size_in_bytes);
+		channel.palette_index_bits = other_channel.palette_index_bits;
+		channel.palette = other_channel.palette;
+		channel.brick_size_po2 = other_channel.brick_size_po2;
 
 	} else if (channel.data != nullptr) {
 		delete_channel(channel_index);
@@ -518,11 +1061,17 @@ void VoxelBuffer::copy_from(const VoxelBuffer &other, Vector3i src_min, Vector3i
 			// Note, we do this even if the pasted data happens to be all the same value as our current channel.
 			// We assume that this case is not frequent enough to bother, and compression can happen later
 			create_channel(channel_index, _size, channel.defval);
+		} else {
+			decompress_channel(channel_index);
 		}
-		const unsigned int item_size = get_depth_byte_count(channel.depth);
-		Span<const uint8_t> src(other_channel.data, other_channel.size_in_bytes);
 		Span<uint8_t> dst(channel.data, channel.size_in_bytes);
-		copy_3d_region_zxy(dst, _size, dst_min, src, other._size, src_min, src_max, item_size);
+		if (other_channel.palette_index_bits != 0 || other_channel.brick_size_po2 != 0) {
+			other.decode_region(channel_index, dst, _size, dst_min, src_min, src_max);
+		} else {
+			const unsigned int item_size = get_depth_byte_count(channel.depth);
+			Span<const uint8_t> src(other_channel.data, other_channel.size_in_bytes);
+			copy_3d_region_zxy(dst, _size, dst_min, src, other._size, src_min, src_max, item_size);
+		}
 
 	} else if (channel.defval != other_channel.defval) {
 		// This logic is still required due to how source and destination regions can be specified.
@@ -553,7 +1102,7 @@ Ref<VoxelBuffer> VoxelBuffer::duplicate(bool include_metadata) const {
 
 bool VoxelBuffer::get_channel_raw(unsigned int channel_index, Span<uint8_t> &slice) const {
 	const Channel &channel = _channels[channel_index];
-	if (channel.data != nullptr) {
+	if (channel.data != nullptr && channel.palette_index_bits == 0 && channel.brick_size_po2 == 0) {
 		slice = Span<uint8_t>(channel.data, 0, channel.size_in_bytes);
 		return true;
 	}
@@ -561,6 +1110,41 @@ bool VoxelBuffer::get_channel_raw(unsigned int channel_index, Span<uint8_t> &sli
 	return false;
 }
 
+void VoxelBuffer::decode_channel(unsigned int channel_index, Span<uint8_t> dst) const {
+	ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
+	const Channel &channel = _channels[channel_index];
+	ERR_FAIL_COND(dst.size() != get_size_in_bytes_for_volume(_size, channel.depth));
+
+	if (channel.data == nullptr) {
+		switch (channel.depth) {
+			case DEPTH_8_BIT:
+				fill_3d_region_zxy<uint8_t>(dst, _size, Vector3i(), _size, channel.defval);
+				break;
+			case DEPTH_16_BIT:
+				fill_3d_region_zxy<uint16_t>(dst.reinterpret_cast_to<uint16_t>(), _size, Vector3i(), _size,
+						channel.defval);
+				break;
+			case DEPTH_32_BIT:
+				fill_3d_region_zxy<uint32_t>(dst.reinterpret_cast_to<uint32_t>(), _size, Vector3i(), _size,
+						channel.defval);
+				break;
+			case DEPTH_64_BIT:
+				fill_3d_region_zxy<uint64_t>(dst.reinterpret_cast_to<uint64_t>(), _size, Vector3i(), _size,
+						channel.defval);
+				break;
+			default:
+				CRASH_NOW();
+				break;
+		}
+
+	} else if (channel.palette_index_bits != 0 || channel.brick_size_po2 != 0) {
+		decode_region(channel_index, dst, _size, Vector3i(), Vector3i(), _size);
+
+	} else {
+		memcpy(dst.data(), channel.data, channel.size_in_bytes);
+	}
+}
+
 void VoxelBuffer::create_channel(int i, Vector3i size, uint64_t defval) {
 	create_channel_noinit(i, size);
 	fill(defval, i);
@@ -574,6 +1158,19 @@ uint32_t VoxelBuffer::get_size_in_bytes_for_volume(Vector3i size, Depth depth) {
 	return size_in_bytes;
 }
 
+size_t VoxelBuffer::get_memory_usage() const {
+	size_t usage = 0;
+	for (unsigned int i = 0; i < MAX_CHANNELS; ++i) {
+		const Channel &channel = _channels[i];
+		if (channel.data != nullptr) {
+			usage += channel.size_in_bytes;
+		}
+		usage += channel.palette.size() * sizeof(uint64_t);
+	}
+	usage += _voxel_metadata.size() * (sizeof(uint32_t) + sizeof(Variant));
+	return usage;
+}
+
 void VoxelBuffer::create_channel_noinit(int i, Vector3i size) {
 	Channel &channel = _channels[i];
 	uint32_t size_in_bytes = get_size_in_bytes_for_volume(size, channel.depth);
@@ -588,51 +1185,403 @@ void VoxelBuffer::delete_channel(int i) {
 	free_channel_data(channel.data, channel.size_in_bytes);
 	channel.data = nullptr;
 	channel.size_in_bytes = 0;
+	channel.palette_index_bits = 0;
+	channel.palette.clear();
+	channel.palette.shrink_to_fit();
+	channel.brick_size_po2 = 0;
+}
+
+namespace {
+
+// Downscaling processes one row of destination voxels at a time. Its groups of 2x2x2 source voxels come from 4 rows
+// of the source: `rows[0]` is at the lowest X and Z, `rows[1]` at X+1, `rows[2]` at Z+1 and `rows[3]` at X+1 and Z+1.
+// Voxels of a group are visited in the same order everywhere, so the first one is the nearest.
+
+// Reads rows directly, because going through a copy of the group is much slower
+template <typename T>
+inline bool is_downscale_group_uniform(const T *const *rows, unsigned int i) {
+	const unsigned int y = i * 2;
+	const T v = rows[0][y];
+	return (rows[0][y + 1] == v) & (rows[1][y] == v) & (rows[1][y + 1] == v) & (rows[2][y] == v) &
+			(rows[2][y + 1] == v) & (rows[3][y] == v) & (rows[3][y + 1] == v);
+}
+
+template <typename T>
+inline void get_downscale_group(const T *const *rows, unsigned int i, FixedArray<T, 8> &group) {
+	const unsigned int y = i * 2;
+	for (unsigned int r = 0; r < 4; ++r) {
+		group[r * 2] = rows[r][y];
+		group[r * 2 + 1] = rows[r][y + 1];
+	}
+}
+
+// 8-bit and 16-bit values are unsigned fixed-point numbers, so they can be summed and compared as integers
+template <typename T>
+struct DownscaleArithmetic {
+	typedef uint32_t Value;
+	static inline Value decode(T v) {
+		return v;
+	}
+	static inline T encode(Value v) {
+		return v;
+	}
+	static inline T encode_average(Value sum) {
+		return (sum + 4) >> 3;
+	}
+};
+
+template <>
+struct DownscaleArithmetic<uint32_t> {
+	typedef float Value;
+	static inline Value decode(uint32_t v) {
+		float f;
+		memcpy(&f, &v, sizeof(f));
+		return f;
+	}
+	static inline uint32_t encode(Value f) {
+		uint32_t v;
+		memcpy(&v, &f, sizeof(v));
+		return v;
+	}
+	static inline uint32_t encode_average(Value sum) {
+		return encode(sum * 0.125f);
+	}
+};
+
+template <>
+struct DownscaleArithmetic<uint64_t> {
+	typedef double Value;
+	static inline Value decode(uint64_t v) {
+		double d;
+		memcpy(&d, &v, sizeof(d));
+		return d;
+	}
+	static inline uint64_t encode(Value d) {
+		uint64_t v;
+		memcpy(&v, &d, sizeof(v));
+		return v;
+	}
+	static inline uint64_t encode_average(Value sum) {
+		return encode(sum * 0.125);
+	}
+};
+
+template <typename T>
+void downscale_row_nearest(T *dst, const T *const *rows, unsigned int count) {
+	const T *row = rows[0];
+	for (unsigned int i = 0; i < count; ++i) {
+		dst[i] = row[i * 2];
+	}
+}
+
+template <typename T>
+void downscale_row_average(T *dst, const T *const *rows, unsigned int count) {
+	typedef DownscaleArithmetic<T> A;
+	const T *r0 = rows[0];
+	const T *r1 = rows[1];
+	const T *r2 = rows[2];
+	const T *r3 = rows[3];
+	// Written without branches so it can be vectorized
+	for (unsigned int i = 0; i < count; ++i) {
+		const unsigned int y = i * 2;
+		const typename A::Value sum = //
+				(A::decode(r0[y]) + A::decode(r0[y + 1])) + (A::decode(r1[y]) + A::decode(r1[y + 1])) +
+				(A::decode(r2[y]) + A::decode(r2[y + 1])) + (A::decode(r3[y]) + A::decode(r3[y + 1]));
+		dst[i] = A::encode_average(sum);
+	}
+}
+
+template <typename T>
+void downscale_row_min(T *dst, const T *const *rows, unsigned int count) {
+	typedef DownscaleArithmetic<T> A;
+	const T *r0 = rows[0];
+	const T *r1 = rows[1];
+	const T *r2 = rows[2];
+	const T *r3 = rows[3];
+	for (unsigned int i = 0; i < count; ++i) {
+		const unsigned int y = i * 2;
+		const typename A::Value m = ::min( //
+				A::decode(r0[y]), A::decode(r0[y + 1]), A::decode(r1[y]), A::decode(r1[y + 1]),
+				A::decode(r2[y]), A::decode(r2[y + 1]), A::decode(r3[y]), A::decode(r3[y + 1]));
+		dst[i] = A::encode(m);
+	}
+}
+
+template <typename T>
+void downscale_row_majority(T *dst, const T *const *rows, unsigned int count) {
+	FixedArray<T, 8> group;
+	FixedArray<T, 8> values;
+	FixedArray<uint8_t, 8> counts;
+	for (unsigned int i = 0; i < count; ++i) {
+		// Most groups are uniform, especially with types
+		if (is_downscale_group_uniform(rows, i)) {
+			dst[i] = rows[0][i * 2];
+			continue;
+		}
+
+		get_downscale_group(rows, i, group);
+
+		// Other groups rarely contain more than two or three different values, so they are counted in a short list,
+		// in order of first appearance
+		unsigned int value_count = 0;
+		for (unsigned int j = 0; j < group.size(); ++j) {
+			const T v = group[j];
+			unsigned int k = 0;
+			while (k < value_count && values[k] != v) {
+				++k;
+			}
+			if (k == value_count) {
+				values[k] = v;
+				counts[k] = 0;
+				++value_count;
+			}
+			++counts[k];
+		}
+
+		// Ties are won by the value found first, so even splits keep the nearest value
+		unsigned int best = 0;
+		for (unsigned int k = 1; k < value_count; ++k) {
+			if (counts[k] > counts[best]) {
+				best = k;
+			}
+		}
+		dst[i] = values[best];
+	}
+}
+
+void downscale_row_texture_weights(uint16_t *dst_indices, uint16_t *dst_weights, const uint16_t *const *index_rows,
+		const uint16_t *const *weight_rows, unsigned int count) {
+	//
+	FixedArray<uint16_t, 8> indices_group;
+	FixedArray<uint16_t, 8> weights_group;
+	FixedArray<int32_t, 16> texture_weights;
+
+	for (unsigned int i = 0; i < count; ++i) {
+		if (is_downscale_group_uniform(index_rows, i) && is_downscale_group_uniform(weight_rows, i)) {
+			dst_indices[i] = index_rows[0][i * 2];
+			dst_weights[i] = weight_rows[0][i * 2];
+			continue;
+		}
+
+		get_downscale_group(index_rows, i, indices_group);
+		get_downscale_group(weight_rows, i, weights_group);
+
+		texture_weights.fill(0);
+		for (unsigned int j = 0; j < indices_group.size(); ++j) {
+			const FixedArray<uint8_t, 4> indices = decode_indices_from_packed_u16(indices_group[j]);
+			const FixedArray<uint8_t, 4> weights = decode_weights_from_packed_u16(weights_group[j]);
+			for (unsigned int k = 0; k < indices.size(); ++k) {
+				texture_weights[indices[k]] += weights[k];
+			}
+		}
+
+		// Keep the heaviest textures. Indices must remain different, even if their weight is zero
+		FixedArray<uint8_t, 4> picked_indices;
+		FixedArray<uint8_t, 4> picked_weights;
+		for (unsigned int k = 0; k < picked_indices.size(); ++k) {
+			unsigned int best_index = 0;
+			int32_t best_weight = -1;
+			for (unsigned int ti = 0; ti < texture_weights.size(); ++ti) {
+				if (texture_weights[ti] > best_weight) {
+					best_weight = texture_weights[ti];
+					best_index = ti;
+				}
+			}
+			picked_indices[k] = best_index;
+			// Averaging keeps the total weight of the group
+			picked_weights[k] = (best_weight + 4) >> 3;
+			// Can't be picked again
+			texture_weights[best_index] = -1;
+		}
+		dst_indices[i] = encode_indices_to_packed_u16(
+				picked_indices[0], picked_indices[1], picked_indices[2], picked_indices[3]);
+		dst_weights[i] = encode_weights_to_packed_u16(
+				picked_weights[0], picked_weights[1], picked_weights[2], picked_weights[3]);
+	}
+}
+
+// Gets indices of the 4 source rows used to downscale the destination row starting at `src_pos`
+inline void get_downscale_rows(Vector3i src_pos, Vector3i src_size, unsigned int *row_indices) {
+	row_indices[0] = src_pos.get_zxy_index(src_size);
+	row_indices[1] = row_indices[0] + src_size.y;
+	row_indices[2] = row_indices[0] + src_size.y * src_size.x;
+	row_indices[3] = row_indices[2] + src_size.y;
+}
+
+template <typename T, typename RowFunc_T>
+void downscale_channel(const VoxelBuffer::ChannelView<const T> &src, VoxelBuffer::ChannelView<T> &dst,
+		Vector3i src_min, Vector3i dst_min, Vector3i dst_max, RowFunc_T row_func) {
+	const unsigned int count = dst_max.y - dst_min.y;
+	unsigned int row_indices[4];
+	const T *rows[4];
+	Vector3i pos;
+	for (pos.z = dst_min.z; pos.z < dst_max.z; ++pos.z) {
+		for (pos.x = dst_min.x; pos.x < dst_max.x; ++pos.x) {
+			pos.y = dst_min.y;
+			get_downscale_rows(src_min + ((pos - dst_min) << 1), src.size, row_indices);
+			for (unsigned int r = 0; r < 4; ++r) {
+				rows[r] = &src.data[row_indices[r]];
+			}
+			row_func(&dst.data[dst.get_index(pos)], rows, count);
+		}
+	}
+}
+
+template <typename T>
+void downscale_channel(const VoxelBuffer &src, VoxelBuffer &dst, unsigned int channel_index, Vector3i src_min,
+		Vector3i dst_min, Vector3i dst_max, VoxelBuffer::DownscaleMode mode) {
+	static thread_local std::vector<T> s_src_backing_buffer;
+	const VoxelBuffer::ChannelView<const T> src_view =
+			src.get_channel_view_decoded<T>(channel_index, s_src_backing_buffer);
+	VoxelBuffer::ChannelView<T> dst_view = dst.get_channel_view_for_write<T>(channel_index);
+
+	switch (mode) {
+		case VoxelBuffer::DOWNSCALE_AVERAGE:
+			downscale_channel(src_view, dst_view, src_min, dst_min, dst_max, downscale_row_average<T>);
+			break;
+		case VoxelBuffer::DOWNSCALE_MIN:
+			downscale_channel(src_view, dst_view, src_min, dst_min, dst_max, downscale_row_min<T>);
+			break;
+		case VoxelBuffer::DOWNSCALE_MAJORITY:
+			downscale_channel(src_view, dst_view, src_min, dst_min, dst_max, downscale_row_majority<T>);
+			break;
+		default:
+			downscale_channel(src_view, dst_view, src_min, dst_min, dst_max, downscale_row_nearest<T>);
+			break;
+	}
+}
+
+void downscale_texture_channels(const VoxelBuffer &src, VoxelBuffer &dst, Vector3i src_min, Vector3i dst_min,
+		Vector3i dst_max) {
+	static thread_local std::vector<uint16_t> s_src_indices_backing_buffer;
+	static thread_local std::vector<uint16_t> s_src_weights_backing_buffer;
+	const VoxelBuffer::ChannelView<const uint16_t> src_indices =
+			src.get_channel_view_decoded<uint16_t>(VoxelBuffer::CHANNEL_INDICES, s_src_indices_backing_buffer);
+	const VoxelBuffer::ChannelView<const uint16_t> src_weights =
+			src.get_channel_view_decoded<uint16_t>(VoxelBuffer::CHANNEL_WEIGHTS, s_src_weights_backing_buffer);
+	VoxelBuffer::ChannelView<uint16_t> dst_indices =
+			dst.get_channel_view_for_write<uint16_t>(VoxelBuffer::CHANNEL_INDICES);
+	VoxelBuffer::ChannelView<uint16_t> dst_weights =
+			dst.get_channel_view_for_write<uint16_t>(VoxelBuffer::CHANNEL_WEIGHTS);
+
+	const unsigned int count = dst_max.y - dst_min.y;
+	unsigned int row_indices[4];
+	const uint16_t *index_rows[4];
+	const uint16_t *weight_rows[4];
+	Vector3i pos;
+	for (pos.z = dst_min.z; pos.z < dst_max.z; ++pos.z) {
+		for (pos.x = dst_min.x; pos.x < dst_max.x; ++pos.x) {
+			pos.y = dst_min.y;
+			get_downscale_rows(src_min + ((pos - dst_min) << 1), src_indices.size, row_indices);
+			for (unsigned int r = 0; r < 4; ++r) {
+				index_rows[r] = &src_indices.data[row_indices[r]];
+				weight_rows[r] = &src_weights.data[row_indices[r]];
+			}
+			const unsigned int dst_i = dst_indices.get_index(pos);
+			downscale_row_texture_weights(
+					&dst_indices.data[dst_i], &dst_weights.data[dst_i], index_rows, weight_rows, count);
+		}
+	}
+}
+
+} // namespace
+
+VoxelBuffer::DownscaleMode VoxelBuffer::get_default_downscale_mode(unsigned int channel_index) {
+	switch (channel_index) {
+		case CHANNEL_TYPE:
+		case CHANNEL_COLOR:
+			return DOWNSCALE_MAJORITY;
+		case CHANNEL_SDF:
+			return DOWNSCALE_AVERAGE;
+		case CHANNEL_INDICES:
+		case CHANNEL_WEIGHTS:
+			return DOWNSCALE_TEXTURE_WEIGHTS;
+		default:
+			return DOWNSCALE_NEAREST;
+	}
 }
 
 void VoxelBuffer::downscale_to(VoxelBuffer &dst, Vector3i src_min, Vector3i src_max, Vector3i dst_min) const {
-	// TODO Align input to multiple of two
+	FixedArray<DownscaleMode, MAX_CHANNELS> modes;
+	for (unsigned int channel_index = 0; channel_index < MAX_CHANNELS; ++channel_index) {
+		modes[channel_index] = get_default_downscale_mode(channel_index);
+	}
+	downscale_to(dst, src_min, src_max, dst_min, modes);
+}
 
-	src_min.clamp_to(Vector3i(), _size);
+void VoxelBuffer::downscale_to(VoxelBuffer &dst, Vector3i src_min, Vector3i src_max, Vector3i dst_min,
+		const FixedArray<DownscaleMode, MAX_CHANNELS> &modes) const {
+	// Groups of voxels start at even coordinates
+	Vector3i::sort_min_max(src_min, src_max);
+	src_min = Vector3i(src_min.x & ~1, src_min.y & ~1, src_min.z & ~1);
+	src_max = Vector3i(src_max.x + (src_max.x & 1), src_max.y + (src_max.y & 1), src_max.z + (src_max.z & 1));
+
+	// Clip the source, keeping `dst_min` attached to `src_min`
+	for (unsigned int i = 0; i < Vector3i::AXIS_COUNT; ++i) {
+		if (src_min[i] < 0) {
+			dst_min[i] += -src_min[i] >> 1;
+			src_min[i] = 0;
+		}
+		if (dst_min[i] < 0) {
+			src_min[i] += -dst_min[i] * 2;
+			dst_min[i] = 0;
+		}
+	}
 	src_max.clamp_to(Vector3i(), _size + Vector3i(1));
 
+	// Incomplete groups at the end of an odd-sized buffer are left out
 	Vector3i dst_max = dst_min + ((src_max - src_min) >> 1);
-
-	// TODO This will be wrong if it overlaps the border?
-	dst_min.clamp_to(Vector3i(), dst._size);
 	dst_max.clamp_to(Vector3i(), dst._size + Vector3i(1));
 
-	for (int channel_index = 0; channel_index < MAX_CHANNELS; ++channel_index) {
+	if (dst_min.x >= dst_max.x || dst_min.y >= dst_max.y || dst_min.z >= dst_max.z) {
+		return;
+	}
+
+	const bool textures_combined = modes[CHANNEL_INDICES] == DOWNSCALE_TEXTURE_WEIGHTS &&
+			modes[CHANNEL_WEIGHTS] == DOWNSCALE_TEXTURE_WEIGHTS &&
+			_channels[CHANNEL_INDICES].depth == DEPTH_16_BIT && _channels[CHANNEL_WEIGHTS].depth == DEPTH_16_BIT &&
+			dst._channels[CHANNEL_INDICES].depth == DEPTH_16_BIT &&
+			dst._channels[CHANNEL_WEIGHTS].depth == DEPTH_16_BIT &&
+			(_channels[CHANNEL_INDICES].data != nullptr || _channels[CHANNEL_WEIGHTS].data != nullptr);
+	if (textures_combined) {
+		downscale_texture_channels(*this, dst, src_min, dst_min, dst_max);
+	}
+
+	for (unsigned int channel_index = 0; channel_index < MAX_CHANNELS; ++channel_index) {
+		if (textures_combined && (channel_index == CHANNEL_INDICES || channel_index == CHANNEL_WEIGHTS)) {
+			continue;
+		}
+
 		const Channel &src_channel = _channels[channel_index];
 		const Channel &dst_channel = dst._channels[channel_index];
 
-		if (src_channel.data == nullptr && dst_channel.data == nullptr && src_channel.defval == dst_channel.defval) {
-			// No action needed
+		if (src_channel.data == nullptr) {
+			// All modes give the same value in this case.
+			// Keeps the destination compressed if it is uniform too
+			dst.fill_area(src_channel.defval, dst_min, dst_max, channel_index);
 			continue;
 		}
 
-		// Nearest-neighbor downscaling
+		ERR_CONTINUE_MSG(src_channel.depth != dst_channel.depth, "Channel depths must match to downscale");
 
-		Vector3i pos;
-		for (pos.z = dst_min.z; pos.z < dst_max.z; ++pos.z) {
-			for (pos.x = dst_min.x; pos.x < dst_max.x; ++pos.x) {
-				for (pos.y = dst_min.y; pos.y < dst_max.y; ++pos.y) {
-					const Vector3i src_pos = src_min + ((pos - dst_min) << 1);
-
-					// TODO Remove check once it works
-					CRASH_COND(!is_position_valid(src_pos.x, src_pos.y, src_pos.z));
-
-					uint64_t v;
-					if (src_channel.data) {
-						// TODO Optimized version?
-						v = get_voxel(src_pos, channel_index);
-					} else {
-						v = src_channel.defval;
-					}
+		const DownscaleMode mode = modes[channel_index];
 
-					dst.set_voxel(v, pos, channel_index);
-				}
-			}
+		switch (src_channel.depth) {
+			case DEPTH_8_BIT:
+				downscale_channel<uint8_t>(*this, dst, channel_index, src_min, dst_min, dst_max, mode);
+				break;
+			case DEPTH_16_BIT:
+				downscale_channel<uint16_t>(*this, dst, channel_index, src_min, dst_min, dst_max, mode);
+				break;
+			case DEPTH_32_BIT:
+				downscale_channel<uint32_t>(*this, dst, channel_index, src_min, dst_min, dst_max, mode);
+				break;
+			case DEPTH_64_BIT:
+				downscale_channel<uint64_t>(*this, dst, channel_index, src_min, dst_min, dst_max, mode);
+				break;
+			default:
+				CRASH_NOW();
+				break;
 		}
 	}
 }
@@ -667,6 +1616,19 @@ bool VoxelBuffer::equals(const VoxelBuffer &p_other) const {
 				return false;
 			}
 
+		} else if (get_channel_compression(channel_index) != COMPRESSION_NONE ||
+				   p_other.get_channel_compression(channel_index) != COMPRESSION_NONE) {
+			// The same values can be compressed in different ways, so they are compared decoded
+			static thread_local std::vector<uint8_t> s_decoded;
+			static thread_local std::vector<uint8_t> s_other_decoded;
+			s_decoded.resize(get_size_in_bytes_for_volume(_size, channel.depth));
+			s_other_decoded.resize(s_decoded.size());
+			decode_channel(channel_index, to_span(s_decoded));
+			p_other.decode_channel(channel_index, to_span(s_other_decoded));
+			if (s_decoded != s_other_decoded) {
+				return false;
+			}
+
 		} else {
 			ERR_FAIL_COND_V(channel.size_in_bytes != other_channel.size_in_bytes, false);
 			for (unsigned int i = 0; i < channel.size_in_bytes; ++i) {
@@ -724,9 +1686,9 @@ void VoxelBuffer::set_block_metadata(Variant meta) {
 
 Variant VoxelBuffer::get_voxel_metadata(Vector3i pos) const {
 	ERR_FAIL_COND_V(!is_position_valid(pos), Variant());
-	const Map<Vector3i, Variant>::Element *elem = _voxel_metadata.find(pos);
-	if (elem != nullptr) {
-		return elem->value();
+	const Variant *meta = _voxel_metadata.find(pos);
+	if (meta != nullptr) {
+		return *meta;
 	} else {
 		return Variant();
 	}
@@ -737,17 +1699,16 @@ void VoxelBuffer::set_voxel_metadata(Vector3i pos, Variant meta) {
 	if (meta.get_type() == Variant::NIL) {
 		_voxel_metadata.erase(pos);
 	} else {
-		_voxel_metadata[pos] = meta;
+		_voxel_metadata.set(pos, meta);
 	}
 }
 
 void VoxelBuffer::for_each_voxel_metadata(Ref<FuncRef> callback) const {
 	ERR_FAIL_COND(callback.is_null());
-	const Map<Vector3i, Variant>::Element *elem = _voxel_metadata.front();
 
-	while (elem != nullptr) {
-		const Variant key = elem->key().to_vec3();
-		const Variant *args[2] = { &key, &elem->value() };
+	for (unsigned int i = 0; i < _voxel_metadata.size(); ++i) {
+		const Variant key = _voxel_metadata.get_position(i).to_vec3();
+		const Variant *args[2] = { &key, &_voxel_metadata.get_value(i) };
 		Variant::CallError err;
 		callback->call_func(args, 2, err);
 
@@ -756,8 +1717,6 @@ void VoxelBuffer::for_each_voxel_metadata(Ref<FuncRef> callback) const {
 		// TODO Can't provide detailed error because FuncRef doesn't give us access to the object
 		// ERR_FAIL_COND_MSG(err.error != Variant::CallError::CALL_OK, false,
 		// 		Variant::get_call_error_text(callback->get_object(), method_name, nullptr, 0, err));
-
-		elem = elem->next();
 	}
 }
 
@@ -782,14 +1741,7 @@ void VoxelBuffer::clear_voxel_metadata() {
 }
 
 void VoxelBuffer::clear_voxel_metadata_in_area(Box3i box) {
-	Map<Vector3i, Variant>::Element *elem = _voxel_metadata.front();
-	while (elem != nullptr) {
-		Map<Vector3i, Variant>::Element *next_elem = elem->next();
-		if (box.contains(elem->key())) {
-			_voxel_metadata.erase(elem);
-		}
-		elem = next_elem;
-	}
+	_voxel_metadata.erase_in_area(box);
 }
 
 void VoxelBuffer::copy_voxel_metadata_in_area(Ref<VoxelBuffer> src_buffer, Box3i src_box, Vector3i dst_origin) {
@@ -799,28 +1751,22 @@ void VoxelBuffer::copy_voxel_metadata_in_area(Ref<VoxelBuffer> src_buffer, Box3i
 	const Box3i clipped_src_box = src_box.clipped(Box3i(src_box.pos - dst_origin, _size));
 	const Vector3i clipped_dst_offset = dst_origin + clipped_src_box.pos - src_box.pos;
 
-	const Map<Vector3i, Variant>::Element *elem = src_buffer->_voxel_metadata.front();
-
-	while (elem != nullptr) {
-		const Vector3i src_pos = elem->key();
-		if (src_box.contains(src_pos)) {
-			const Vector3i dst_pos = src_pos + clipped_dst_offset;
-			CRASH_COND(!is_position_valid(dst_pos));
-			_voxel_metadata[dst_pos] = elem->value().duplicate();
-		}
-		elem = elem->next();
-	}
+	src_buffer->_voxel_metadata.for_each_in_area(src_box, [this, clipped_dst_offset](Vector3i src_pos, const Variant &meta) {
+		const Vector3i dst_pos = src_pos + clipped_dst_offset;
+		CRASH_COND(!is_position_valid(dst_pos));
+		_voxel_metadata.set(dst_pos, meta.duplicate());
+	});
 }
 
 void VoxelBuffer::copy_voxel_metadata(const VoxelBuffer &src_buffer) {
 	ERR_FAIL_COND(src_buffer.get_size() != _size);
 
-	const Map<Vector3i, Variant>::Element *elem = src_buffer._voxel_metadata.front();
-
-	while (elem != nullptr) {
-		const Vector3i pos = elem->key();
-		_voxel_metadata[pos] = elem->value().duplicate();
-		elem = elem->next();
+	if (_voxel_metadata.is_empty()) {
+		_voxel_metadata.copy_from(src_buffer._voxel_metadata);
+	} else {
+		src_buffer._voxel_metadata.for_each([this](Vector3i pos, const Variant &meta) {
+			_voxel_metadata.set(pos, meta.duplicate());
+		});
 	}
 
 	_block_metadata = src_buffer._block_metadata.duplicate();
@@ -882,6 +1828,8 @@ void VoxelBuffer::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("is_uniform", "channel"), &VoxelBuffer::is_uniform);
 	// TODO Rename `compress_uniform_channels`
 	ClassDB::bind_method(D_METHOD("optimize"), &VoxelBuffer::compress_uniform_channels);
+	ClassDB::bind_method(D_METHOD("compress_palette_channels"), &VoxelBuffer::compress_palette_channels);
+	ClassDB::bind_method(D_METHOD("compress_brick_channels"), &VoxelBuffer::compress_brick_channels);
 	ClassDB::bind_method(D_METHOD("get_channel_compression", "channel"), &VoxelBuffer::get_channel_compression);
 
 	ClassDB::bind_method(D_METHOD("get_block_metadata"), &VoxelBuffer::get_block_metadata);
@@ -916,6 +1864,8 @@ void VoxelBuffer::_bind_methods() {
 
 	BIND_ENUM_CONSTANT(COMPRESSION_NONE);
 	BIND_ENUM_CONSTANT(COMPRESSION_UNIFORM);
+	BIND_ENUM_CONSTANT(COMPRESSION_PALETTE);
+	BIND_ENUM_CONSTANT(COMPRESSION_BRICKS);
 	BIND_ENUM_CONSTANT(COMPRESSION_COUNT);
 
 	BIND_CONSTANT(MAX_SIZE);
@@ -6,11 +6,14 @@
 #include "../util/math/box3i.h"
 #include "../util/span.h"
 #include "funcs.h"
+#include "voxel_metadata_map.h"
 
-#include <core/map.h>
 #include <core/reference.h>
 #include <core/vector.h>
 
+#include <limits>
+#include <vector>
+
 class VoxelTool;
 class Image;
 class FuncRef;
@@ -43,6 +46,8 @@ public:
 	enum Compression {
 		COMPRESSION_NONE = 0,
 		COMPRESSION_UNIFORM,
+		COMPRESSION_PALETTE,
+		COMPRESSION_BRICKS,
 		//COMPRESSION_RLE,
 		COMPRESSION_COUNT
 	};
@@ -75,6 +80,24 @@ public:
 		}
 	}
 
+	// How groups of 2x2x2 voxels become one voxel when producing lower LODs
+	enum DownscaleMode {
+		// Takes the first voxel of each group
+		DOWNSCALE_NEAREST = 0,
+		// Averages voxels. 32-bit and 64-bit values are averaged as floats and doubles, like SDF.
+		DOWNSCALE_AVERAGE,
+		// Takes the lowest value, which keeps thin features of SDF from disappearing.
+		// 32-bit and 64-bit values are compared as floats and doubles.
+		DOWNSCALE_MIN,
+		// Takes the most frequent value, suited to types
+		DOWNSCALE_MAJORITY,
+		// Sums texture weights of all voxels and keeps the 4 heaviest textures.
+		// Applies to `CHANNEL_INDICES` and `CHANNEL_WEIGHTS` together, which must both be 16-bit,
+		// otherwise they use `DOWNSCALE_NEAREST`.
+		DOWNSCALE_TEXTURE_WEIGHTS,
+		DOWNSCALE_MODE_COUNT
+	};
+
 	static const Depth DEFAULT_CHANNEL_DEPTH = DEPTH_8_BIT;
 	static const Depth DEFAULT_TYPE_CHANNEL_DEPTH = DEPTH_16_BIT;
 	static const Depth DEFAULT_SDF_CHANNEL_DEPTH = DEPTH_16_BIT;
@@ -93,6 +116,37 @@ public:
 		Depth depth = DEFAULT_CHANNEL_DEPTH;
 
 		uint32_t size_in_bytes = 0;
+
+		// When not zero, the channel is palette-compressed: `data` contains indices into `palette`,
+		// packed with this many bits each (1, 2, 4 or 8), in the same order as values would be.
+		uint8_t palette_index_bits = 0;
+
+		// Distinct values of a palette-compressed channel
+		std::vector<uint64_t> palette;
+
+		// When not zero, the channel is split in cubic bricks of this size (as a power of two),
+		// and uniform bricks only store one value. `data` then starts with a table of bricks.
+		uint8_t brick_size_po2 = 0;
+	};
+
+	// Typed access to voxels of an uncompressed channel, in ZXY order.
+	// Getting one per channel avoids checking depth and compression for every voxel in bulk operations.
+	template <typename T>
+	struct ChannelView {
+		Span<T> data;
+		Vector3i size;
+
+		inline unsigned int get_index(const Vector3i pos) const {
+			return pos.get_zxy_index(size);
+		}
+
+		inline T get(const Vector3i pos) const {
+			return data[get_index(pos)];
+		}
+
+		inline void set(const Vector3i pos, T value) {
+			data[get_index(pos)] = value;
+		}
 	};
 
 	VoxelBuffer();
@@ -129,11 +183,23 @@ public:
 	bool is_uniform(unsigned int channel_index) const;
 
 	void compress_uniform_channels();
+	// Stores channels having few distinct values as a palette with bit-packed indices, when it takes less memory.
+	// Such channels remain compressed when modified with `set_voxel`, unless they get too many distinct values.
+	// Other ways of writing voxels decompress them.
+	void compress_palette_channels();
+	// Splits channels in small bricks, so that uniform parts of them only take one value, when it takes less memory.
+	// Suits channels with few large uniform areas, like signed distance fields of terrain with a thin surface.
+	// Such channels remain compressed when modified with `set_voxel`, other ways of writing voxels decompress them.
+	void compress_brick_channels();
+	// Makes the channel store all its voxels, so they can be written directly.
 	void decompress_channel(unsigned int channel_index);
 	Compression get_channel_compression(unsigned int channel_index) const;
 
 	static uint32_t get_size_in_bytes_for_volume(Vector3i size, Depth depth);
 
+	// Approximate memory taken by voxels and metadata. Data shared with duplicates is counted in each of them.
+	size_t get_memory_usage() const;
+
 	void copy_format(const VoxelBuffer &other);
 
 	// Specialized copy functions.
@@ -162,10 +228,8 @@ public:
 		// This function always decompresses the destination.
 		// To keep it compressed, either check what you are about to copy,
 		// or schedule a recompression for later.
-		decompress_channel(channel_index);
-
-		Span<T> dst(static_cast<T *>(channel.data), channel.size_in_bytes / sizeof(T));
-		copy_3d_region_zxy<T>(dst, _size, dst_min, src, src_size, src_min, src_max);
+		ChannelView<T> dst = get_channel_view_for_write<T>(channel_index);
+		copy_3d_region_zxy<T>(dst.data, _size, dst_min, src, src_size, src_min, src_max);
 	}
 
 	// Copy a region of the data into a dense buffer.
@@ -187,8 +251,11 @@ public:
 
 		if (channel.data == nullptr) {
 			fill_3d_region_zxy<T>(dst, dst_size, dst_min, dst_min + (src_max - src_min), channel.defval);
+		} else if (channel.palette_index_bits != 0 || channel.brick_size_po2 != 0) {
+			decode_region(channel_index, dst.template reinterpret_cast_to<uint8_t>(), dst_size, dst_min,
+					src_min, src_max);
 		} else {
-			Span<const T> src(static_cast<const T *>(channel.data), channel.size_in_bytes / sizeof(T));
+			Span<const T> src(reinterpret_cast<const T *>(channel.data), channel.size_in_bytes / sizeof(T));
 			copy_3d_region_zxy<T>(dst, dst_size, dst_min, src, _size, src_min, src_max);
 		}
 	}
@@ -196,30 +263,46 @@ public:
 	// TODO Deprecate?
 	// Executes a read-write action on all cells of the provided box that intersect with this buffer.
 	// `action_func` receives a voxel value from the channel, and returns a modified value.
-	// if the returned value is different, it will be applied to the buffer.
 	// Can be used to blend voxels together.
+	// The channel gets decompressed.
 	template <typename F>
 	inline void read_write_action(Box3i box, unsigned int channel_index, F action_func) {
 		ERR_FAIL_INDEX(channel_index, MAX_CHANNELS);
 
 		box.clip(Box3i(Vector3i(), _size));
-		Vector3i min_pos = box.pos;
-		Vector3i max_pos = box.pos + box.size;
-		Vector3i pos;
-		for (pos.z = min_pos.z; pos.z < max_pos.z; ++pos.z) {
-			for (pos.x = min_pos.x; pos.x < max_pos.x; ++pos.x) {
-				for (pos.y = min_pos.y; pos.y < max_pos.y; ++pos.y) {
-					// TODO Optimization: a bunch of checks and branching could be skipped
-					const uint64_t v0 = get_voxel(pos, channel_index);
-					const uint64_t v1 = action_func(pos, v0);
-					if (v0 != v1) {
-						set_voxel(v1, pos, channel_index);
-					}
-				}
-			}
+		if (box.is_empty()) {
+			return;
+		}
+
+		switch (_channels[channel_index].depth) {
+			case DEPTH_8_BIT:
+				read_write_action_template<F, uint8_t>(box, channel_index, action_func);
+				break;
+			case DEPTH_16_BIT:
+				read_write_action_template<F, uint16_t>(box, channel_index, action_func);
+				break;
+			case DEPTH_32_BIT:
+				read_write_action_template<F, uint32_t>(box, channel_index, action_func);
+				break;
+			case DEPTH_64_BIT:
+				read_write_action_template<F, uint64_t>(box, channel_index, action_func);
+				break;
+			default:
+				ERR_FAIL();
+				break;
 		}
 	}
 
+	template <typename F, typename T>
+	void read_write_action_template(const Box3i &box, unsigned int channel_index, F action_func) {
+		ChannelView<T> view = get_channel_view_for_write<T>(channel_index);
+		for_each_index_and_pos(box, [&view, &action_func](unsigned int i, Vector3i pos) {
+			// Values too big for the channel get clamped, like `set_voxel` does
+			const uint64_t v = action_func(pos, view.data[i]);
+			view.data[i] = MIN(v, static_cast<uint64_t>(std::numeric_limits<T>::max()));
+		});
+	}
+
 	static _FORCE_INLINE_ unsigned int get_index(const Vector3i pos, const Vector3i size) {
 		return pos.get_zxy_index(size);
 	}
@@ -248,16 +331,12 @@ public:
 	// Data_T action_func(Vector3i pos, Data_T in_v)
 	template <typename F, typename Data_T>
 	void write_box_template(const Box3i &box, unsigned int channel_index, F action_func, Vector3i offset) {
-		decompress_channel(channel_index);
-		Channel &channel = _channels[channel_index];
 #ifdef DEBUG_ENABLED
 		ERR_FAIL_COND(!Box3i(Vector3i(), _size).contains(box));
-		ERR_FAIL_COND(get_depth_byte_count(channel.depth) != sizeof(Data_T));
 #endif
-		Span<Data_T> data = Span<uint8_t>(channel.data, channel.size_in_bytes)
-									.reinterpret_cast_to<Data_T>();
-		for_each_index_and_pos(box, [data, action_func, offset](unsigned int i, Vector3i pos) {
-			data[i] = action_func(pos + offset, data[i]);
+		ChannelView<Data_T> view = get_channel_view_for_write<Data_T>(channel_index);
+		for_each_index_and_pos(box, [&view, &action_func, offset](unsigned int i, Vector3i pos) {
+			view.data[i] = action_func(pos + offset, view.data[i]);
 		});
 	}
 
@@ -265,22 +344,14 @@ public:
 	template <typename F, typename Data0_T, typename Data1_T>
 	void write_box_2_template(const Box3i &box, unsigned int channel_index0, unsigned channel_index1, F action_func,
 			Vector3i offset) {
-		decompress_channel(channel_index0);
-		decompress_channel(channel_index1);
-		Channel &channel0 = _channels[channel_index0];
-		Channel &channel1 = _channels[channel_index1];
 #ifdef DEBUG_ENABLED
 		ERR_FAIL_COND(!Box3i(Vector3i(), _size).contains(box));
-		ERR_FAIL_COND(get_depth_byte_count(channel0.depth) != sizeof(Data0_T));
-		ERR_FAIL_COND(get_depth_byte_count(channel1.depth) != sizeof(Data1_T));
 #endif
-		Span<Data0_T> data0 = Span<uint8_t>(channel0.data, channel0.size_in_bytes)
-									  .reinterpret_cast_to<Data0_T>();
-		Span<Data1_T> data1 = Span<uint8_t>(channel1.data, channel1.size_in_bytes)
-									  .reinterpret_cast_to<Data1_T>();
-		for_each_index_and_pos(box, [action_func, offset, &data0, &data1](unsigned int i, Vector3i pos) {
+		ChannelView<Data0_T> view0 = get_channel_view_for_write<Data0_T>(channel_index0);
+		ChannelView<Data1_T> view1 = get_channel_view_for_write<Data1_T>(channel_index1);
+		for_each_index_and_pos(box, [action_func, offset, &view0, &view1](unsigned int i, Vector3i pos) {
 			// TODO The caller must still specify exactly the correct type, maybe some conversion could be used
-			action_func(pos + offset, data0[i], data1[i]);
+			action_func(pos + offset, view0.data[i], view1.data[i]);
 		});
 	}
 
@@ -357,6 +428,8 @@ public:
 		return channels;
 	}
 
+	// Channels of the duplicate share memory with this buffer until one of them is modified, so it is cheap.
+	// Duplicates are snapshots: threads may read them while this buffer keeps being modified.
 	Ref<VoxelBuffer> duplicate(bool include_metadata) const;
 
 	_FORCE_INLINE_ bool is_position_valid(unsigned int x, unsigned int y, unsigned int z) const {
@@ -376,9 +449,61 @@ public:
 	}
 
 	// TODO Have a template version based on channel depth
+	// Returns false if the channel is compressed, use `decode_channel` to read it in that case.
+	// Data may be shared with duplicates of the buffer, so only write to it after calling `decompress_channel`.
 	bool get_channel_raw(unsigned int channel_index, Span<uint8_t> &slice) const;
 
+	// Gets typed access to voxels of the channel for reading.
+	// Returns false if the channel is compressed, or if `T` doesn't match its depth.
+	template <typename T>
+	bool get_channel_view(unsigned int channel_index, ChannelView<const T> &out_view) const {
+		Span<uint8_t> raw;
+		if (get_channel_depth(channel_index) != get_depth_from_size(sizeof(T)) ||
+				!get_channel_raw(channel_index, raw)) {
+			return false;
+		}
+		out_view = ChannelView<const T>{ raw.reinterpret_cast_to<const T>(), _size };
+		return true;
+	}
+
+	// Same as `get_channel_view`, but compressed channels are decoded into `backing_buffer`
+	template <typename T>
+	ChannelView<const T> get_channel_view_decoded(unsigned int channel_index, std::vector<T> &backing_buffer) const {
+		ChannelView<const T> view;
+		ERR_FAIL_COND_V(get_channel_depth(channel_index) != get_depth_from_size(sizeof(T)), view);
+		if (!get_channel_view(channel_index, view)) {
+			backing_buffer.resize(_size.volume());
+			decode_channel(channel_index, to_span(backing_buffer).template reinterpret_cast_to<uint8_t>());
+			view = ChannelView<const T>{ to_span_const(backing_buffer), _size };
+		}
+		return view;
+	}
+
+	// Decompresses the channel so its voxels can be written directly, and gets typed access to them.
+	template <typename T>
+	ChannelView<T> get_channel_view_for_write(unsigned int channel_index) {
+		ERR_FAIL_INDEX_V(channel_index, MAX_CHANNELS, ChannelView<T>());
+		const Channel &channel = _channels[channel_index];
+		ERR_FAIL_COND_V(channel.depth != get_depth_from_size(sizeof(T)), ChannelView<T>());
+		decompress_channel(channel_index);
+		return ChannelView<T>{ Span<uint8_t>(channel.data, channel.size_in_bytes).reinterpret_cast_to<T>(), _size };
+	}
+
+	// Writes all values of a channel into `dst`, in the same layout `get_channel_raw` gives, whatever its compression.
+	// `dst` must have the size of the uncompressed channel.
+	void decode_channel(unsigned int channel_index, Span<uint8_t> dst) const;
+
+	// Mode used for a channel when none is specified: types and colors use majority, SDF is averaged,
+	// texture indices and weights are combined and other channels use nearest.
+	static DownscaleMode get_default_downscale_mode(unsigned int channel_index);
+
+	// Writes a version of the area `[src_min, src_max)` of this buffer downscaled by a factor of 2 into `dst`.
+	// The area is first enlarged to even coordinates, and `dst_min` is where its rounded-down `src_min` goes.
+	// Channel depths must match between the two buffers.
 	void downscale_to(VoxelBuffer &dst, Vector3i src_min, Vector3i src_max, Vector3i dst_min) const;
+	void downscale_to(VoxelBuffer &dst, Vector3i src_min, Vector3i src_max, Vector3i dst_min,
+			const FixedArray<DownscaleMode, MAX_CHANNELS> &modes) const;
+
 	Ref<VoxelTool> get_voxel_tool();
 
 	bool equals(const VoxelBuffer &p_other) const;
@@ -401,13 +526,7 @@ public:
 
 	template <typename F>
 	void for_each_voxel_metadata_in_area(Box3i box, F callback) const {
-		const Map<Vector3i, Variant>::Element *elem = _voxel_metadata.front();
-		while (elem != nullptr) {
-			if (box.contains(elem->key())) {
-				callback(elem->key(), elem->value());
-			}
-			elem = elem->next();
-		}
+		_voxel_metadata.for_each_in_area(box, callback);
 	}
 
 	void for_each_voxel_metadata(Ref<FuncRef> callback) const;
@@ -418,12 +537,7 @@ public:
 	void copy_voxel_metadata_in_area(Ref<VoxelBuffer> src_buffer, Box3i src_box, Vector3i dst_origin);
 	void copy_voxel_metadata(const VoxelBuffer &src_buffer);
 
-	const Map<Vector3i, Variant> &get_voxel_metadata() const { return _voxel_metadata; }
-
-	// Internal synchronization.
-	// This lock is optional, and used internally at the moment, only in multithreaded areas.
-	inline const RWLock &get_lock() const { return _rw_lock; }
-	inline RWLock &get_lock() { return _rw_lock; }
+	const VoxelMetadataMap &get_voxel_metadata() const { return _voxel_metadata; }
 
 	// Debugging
 
@@ -433,6 +547,17 @@ private:
 	void create_channel_noinit(int i, Vector3i size);
 	void create_channel(int i, Vector3i size, uint64_t defval);
 	void delete_channel(int i);
+	// Copies data of the channel if other buffers use it too, before it gets modified
+	void fork_channel_if_shared(unsigned int channel_index);
+
+	bool compress_channel_palette(unsigned int channel_index);
+	void repack_palette_channel(unsigned int channel_index, uint32_t index_bits);
+	bool compress_channel_bricks(unsigned int channel_index);
+	void allocate_brick_voxels(unsigned int channel_index, unsigned int brick_index);
+	// Same conventions as `copy_3d_region_zxy`, where the source is a channel of this buffer
+	// compressed with a palette or bricks
+	void decode_region(unsigned int channel_index, Span<uint8_t> dst, Vector3i dst_size, Vector3i dst_min,
+			Vector3i src_min, Vector3i src_max) const;
 
 	static void _bind_methods();
 
@@ -466,12 +591,7 @@ private:
 	Vector3i _size;
 
 	Variant _block_metadata;
-	Map<Vector3i, Variant> _voxel_metadata;
-
-	// TODO It may be preferable to actually move away from storing an RWLock in every buffer in the future.
-	// We should be able to find a solution because very few of these locks are actually used at a given time.
-	// It worked so far on PC but other platforms like the PS5 might have a pretty low limit (8K?)
-	RWLock _rw_lock;
+	VoxelMetadataMap _voxel_metadata;
 };
 
 inline void debug_check_texture_indices_packed_u16(const VoxelBuffer &voxels) {
@@ -12,6 +12,8 @@ public:
 	const Vector3i position;
 	const unsigned int lod_index = 0;
 	VoxelRefCount viewers;
+	// Memory taken by voxels when the map last measured it
+	size_t memory_usage = 0;
 
 	static VoxelDataBlock *create(Vector3i bpos, Ref<VoxelBuffer> buffer, unsigned int size, unsigned int p_lod_index) {
 		const int bs = size;
@@ -32,17 +34,38 @@ public:
 	inline bool is_modified() const { return _modified; }
 
 	void set_needs_lodding(bool need_lodding) {
+		if (need_lodding && !_needs_lodding) {
+			_lodding_area = Box3i();
+		}
 		_needs_lodding = need_lodding;
 	}
 
 	inline bool get_needs_lodding() const { return _needs_lodding; }
 
+	// Grows the area of the block where LOD counterparts have to be recomputed, in voxels relative to the block.
+	// It starts over when the block gets marked as needing lodding again.
+	void add_lodding_area(const Box3i &box) {
+		if (_lodding_area.is_empty()) {
+			_lodding_area = box;
+		} else {
+			_lodding_area = Box3i::get_bounding_box(_lodding_area, box);
+		}
+	}
+
+	// Gets the area accumulated with `add_lodding_area` and resets it
+	Box3i take_lodding_area() {
+		const Box3i area = _lodding_area;
+		_lodding_area = Box3i();
+		return area;
+	}
+
 private:
 	VoxelDataBlock(Vector3i bpos, Ref<VoxelBuffer> buffer, unsigned int p_lod_index) :
 			voxels(buffer), position(bpos), lod_index(p_lod_index) {}
 
 	// The block was edited, which requires its LOD counterparts to be recomputed
 	bool _needs_lodding = false;
+	Box3i _lodding_area;
 
 	// Indicates if this block is different from the time it was loaded (should be saved)
 	bool _modified = false;
@@ -49,7 +49,6 @@ int VoxelDataMap::get_voxel(Vector3i pos, unsigned int c) const {
 	if (block == nullptr) {
 		return _default_voxel[c];
 	}
-	RWLockRead lock(block->voxels->get_lock());
 	return block->voxels->get_voxel(to_local(pos), c);
 }
 
@@ -73,8 +72,6 @@ VoxelDataBlock *VoxelDataMap::get_or_create_block_at_voxel_pos(Vector3i pos) {
 
 void VoxelDataMap::set_voxel(int value, Vector3i pos, unsigned int c) {
 	VoxelDataBlock *block = get_or_create_block_at_voxel_pos(pos);
-	// TODO If it turns out to be a problem, use CoW
-	RWLockWrite lock(block->voxels->get_lock());
 	block->voxels->set_voxel(value, to_local(pos), c);
 }
 
@@ -85,14 +82,12 @@ float VoxelDataMap::get_voxel_f(Vector3i pos, unsigned int c) const {
 		return _default_voxel[c];
 	}
 	Vector3i lpos = to_local(pos);
-	RWLockRead lock(block->voxels->get_lock());
 	return block->voxels->get_voxel_f(lpos.x, lpos.y, lpos.z, c);
 }
 
 void VoxelDataMap::set_voxel_f(real_t value, Vector3i pos, unsigned int c) {
 	VoxelDataBlock *block = get_or_create_block_at_voxel_pos(pos);
 	Vector3i lpos = to_local(pos);
-	RWLockWrite lock(block->voxels->get_lock());
 	block->voxels->set_voxel_f(value, lpos.x, lpos.y, lpos.z, c);
 }
 
@@ -154,6 +149,15 @@ void VoxelDataMap::set_block(Vector3i bpos, VoxelDataBlock *block) {
 	unsigned int i = _blocks.size();
 	_blocks.push_back(block);
 	_blocks_map.set(bpos, i);
+	block->memory_usage = block->voxels->get_memory_usage();
+	_memory_usage += block->memory_usage;
+}
+
+void VoxelDataMap::update_block_memory_usage(VoxelDataBlock *block) {
+	ERR_FAIL_COND(block == nullptr);
+	_memory_usage -= block->memory_usage;
+	block->memory_usage = block->voxels->get_memory_usage();
+	_memory_usage += block->memory_usage;
 }
 
 void VoxelDataMap::remove_block_internal(Vector3i bpos, unsigned int index) {
@@ -182,6 +186,7 @@ VoxelDataBlock *VoxelDataMap::set_block_buffer(Vector3i bpos, Ref<VoxelBuffer> b
 		set_block(bpos, block);
 	} else {
 		block->voxels = buffer;
+		update_block_memory_usage(block);
 	}
 	return block;
 }
@@ -225,8 +230,6 @@ void VoxelDataMap::copy(Vector3i min_pos, VoxelBuffer &dst_buffer, unsigned int
 
 						dst_buffer.set_channel_depth(channel, src_buffer.get_channel_depth(channel));
 
-						RWLockRead lock(src_buffer.get_lock());
-
 						// Note: copy_from takes care of clamping the area if it's on an edge
 						dst_buffer.copy_from(src_buffer,
 								min_pos - src_block_origin,
@@ -249,6 +252,66 @@ void VoxelDataMap::copy(Vector3i min_pos, VoxelBuffer &dst_buffer, unsigned int
 	}
 }
 
+namespace {
+
+template <typename T>
+void paste_masked_template(VoxelBuffer &dst_buffer, const VoxelBuffer &src_buffer, const Box3i &dst_box,
+		Vector3i src_offset, unsigned int channel, uint64_t mask_value) {
+	static thread_local std::vector<T> s_src_backing_buffer;
+	const VoxelBuffer::ChannelView<const T> src_view =
+			src_buffer.get_channel_view_decoded<T>(channel, s_src_backing_buffer);
+	VoxelBuffer::ChannelView<T> dst_view = dst_buffer.get_channel_view_for_write<T>(channel);
+
+	dst_buffer.for_each_index_and_pos(dst_box,
+			[&src_view, &dst_view, src_offset, mask_value](unsigned int i, Vector3i pos) {
+				const T src_v = src_view.get(pos + src_offset);
+				if (src_v != mask_value) {
+					dst_view.data[i] = src_v;
+				}
+			});
+}
+
+// Copies voxels of `src_buffer` into `dst_buffer` at `dst_pos`, except those having the mask value
+void paste_masked(VoxelBuffer &dst_buffer, const VoxelBuffer &src_buffer, Vector3i dst_pos, unsigned int channel,
+		uint64_t mask_value) {
+	Box3i dst_box(dst_pos, src_buffer.get_size());
+	dst_box.clip(Box3i(Vector3i(), dst_buffer.get_size()));
+	// Taken before clipping, which can move the box when it starts at negative coordinates
+	const Vector3i src_offset = -dst_pos;
+	if (dst_box.is_empty()) {
+		return;
+	}
+
+	if (src_buffer.get_channel_compression(channel) == VoxelBuffer::COMPRESSION_UNIFORM &&
+			src_buffer.get_voxel(Vector3i(), channel) == mask_value) {
+		// Nothing to paste
+		return;
+	}
+
+	const VoxelBuffer::Depth depth = dst_buffer.get_channel_depth(channel);
+	ERR_FAIL_COND_MSG(src_buffer.get_channel_depth(channel) != depth, "Channel depths must match to paste");
+
+	switch (depth) {
+		case VoxelBuffer::DEPTH_8_BIT:
+			paste_masked_template<uint8_t>(dst_buffer, src_buffer, dst_box, src_offset, channel, mask_value);
+			break;
+		case VoxelBuffer::DEPTH_16_BIT:
+			paste_masked_template<uint16_t>(dst_buffer, src_buffer, dst_box, src_offset, channel, mask_value);
+			break;
+		case VoxelBuffer::DEPTH_32_BIT:
+			paste_masked_template<uint32_t>(dst_buffer, src_buffer, dst_box, src_offset, channel, mask_value);
+			break;
+		case VoxelBuffer::DEPTH_64_BIT:
+			paste_masked_template<uint64_t>(dst_buffer, src_buffer, dst_box, src_offset, channel, mask_value);
+			break;
+		default:
+			ERR_FAIL();
+			break;
+	}
+}
+
+} // namespace
+
 void VoxelDataMap::paste(Vector3i min_pos, VoxelBuffer &src_buffer, unsigned int channels_mask, uint64_t mask_value,
 		bool create_new_blocks) {
 	const Vector3i max_pos = min_pos + src_buffer.get_size();
@@ -277,21 +340,9 @@ void VoxelDataMap::paste(Vector3i min_pos, VoxelBuffer &src_buffer, unsigned int
 					const Vector3i dst_block_origin = block_to_voxel(bpos);
 
 					VoxelBuffer &dst_buffer = **block->voxels;
-					RWLockWrite lock(dst_buffer.get_lock());
 
 					if (mask_value != std::numeric_limits<uint64_t>::max()) {
-						const Box3i dst_box(min_pos - dst_block_origin, src_buffer.get_size());
-
-						const Vector3i src_offset = -dst_box.pos;
-
-						dst_buffer.read_write_action(dst_box, channel,
-								[&src_buffer, mask_value, src_offset, channel](const Vector3i pos, uint64_t dst_v) {
-									const uint64_t src_v = src_buffer.get_voxel(pos + src_offset, channel);
-									if (src_v == mask_value) {
-										return dst_v;
-									}
-									return src_v;
-								});
+						paste_masked(dst_buffer, src_buffer, min_pos - dst_block_origin, channel, mask_value);
 
 					} else {
 						dst_buffer.copy_from(src_buffer,
@@ -301,6 +352,11 @@ void VoxelDataMap::paste(Vector3i min_pos, VoxelBuffer &src_buffer, unsigned int
 								channel);
 					}
 				}
+
+				VoxelDataBlock *block = get_block(bpos);
+				if (block != nullptr) {
+					update_block_memory_usage(block);
+				}
 			}
 		}
 	}
@@ -318,6 +374,7 @@ void VoxelDataMap::clear() {
 	_blocks.clear();
 	_blocks_map.clear();
 	_last_accessed_block = nullptr;
+	_memory_usage = 0;
 }
 
 int VoxelDataMap::get_block_count() const {
@@ -2,6 +2,7 @@
 #define VOXEL_DATA_MAP_H
 
 #include "../util/fixed_array.h"
+#include "../util/vector3i_flat_map.h"
 #include "voxel_data_block.h"
 
 #include <core/hash_map.h>
@@ -82,6 +83,7 @@ public:
 			VoxelDataBlock *block = _blocks[i];
 			ERR_FAIL_COND(block == nullptr);
 			pre_delete(block);
+			_memory_usage -= block->memory_usage;
 			memdelete(block);
 			remove_block_internal(bpos, i);
 		}
@@ -97,6 +99,15 @@ public:
 
 	int get_block_count() const;
 
+	// Sum of the memory taken by voxels of all blocks.
+	// It is updated when blocks are added, replaced or removed. Editing voxels of a block directly can change it too,
+	// so `update_block_memory_usage` should be called after that.
+	inline size_t get_memory_usage() const {
+		return _memory_usage;
+	}
+
+	void update_block_memory_usage(VoxelDataBlock *block);
+
 	// TODO Rename for_each_block
 	template <typename Op_T>
 	inline void for_all_blocks(Op_T op) {
@@ -160,9 +171,9 @@ private:
 	// Voxel values that will be returned if access is out of map bounds
 	FixedArray<uint64_t, VoxelBuffer::MAX_CHANNELS> _default_voxel;
 
-	// Blocks stored with a spatial hash in all 3D directions.
-	// RELATIONSHIP = 2 because it delivers better performance with this kind of key and hash (less collisions).
-	HashMap<Vector3i, unsigned int, Vector3iHasher, HashMapComparatorDefault<Vector3i>, 3, 2> _blocks_map;
+	// Indices of blocks in `_blocks`, by position.
+	// Flat storage, because neighbor lookups are frequent and would otherwise miss CPU caches.
+	Vector3iFlatMap<unsigned int> _blocks_map;
 	std::vector<VoxelDataBlock *> _blocks;
 
 	// Voxel access will most frequently be in contiguous areas, so the same blocks are accessed.
@@ -174,6 +185,8 @@ private:
 	unsigned int _block_size_mask;
 
 	unsigned int _lod_index = 0;
+
+	size_t _memory_usage = 0;
 };
 
 #endif // VOXEL_MAP_H
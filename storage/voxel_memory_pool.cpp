@@ -8,8 +8,27 @@
 
 namespace {
 VoxelMemoryPool *g_memory_pool = nullptr;
+
+// Threads keep at most this amount of memory in each size class.
+// Big blocks are rare enough to always go through the shared pools.
+const uint64_t THREAD_CACHE_BYTES_PER_CLASS = 256 * 1024;
+const unsigned int THREAD_CACHE_MAX_BLOCKS_PER_CLASS = 32;
+
+inline unsigned int get_thread_cache_capacity(uint64_t class_bytes) {
+	return MIN(THREAD_CACHE_BYTES_PER_CLASS / class_bytes, uint64_t(THREAD_CACHE_MAX_BLOCKS_PER_CLASS));
+}
+
 } // namespace
 
+thread_local VoxelMemoryPool::ThreadCache VoxelMemoryPool::_thread_cache;
+
+VoxelMemoryPool::ThreadCache::~ThreadCache() {
+	// Happens when a thread exits
+	if (registered && g_memory_pool != nullptr) {
+		g_memory_pool->unregister_thread_cache(*this);
+	}
+}
+
 void VoxelMemoryPool::create_singleton() {
 	CRASH_COND(g_memory_pool != nullptr);
 	g_memory_pool = memnew(VoxelMemoryPool);
@@ -36,80 +55,224 @@ VoxelMemoryPool::~VoxelMemoryPool() {
 		debug_print();
 	}
 #endif
+	MutexLock lock(_mutex);
+	// Threads still having a cache at this point are expected to no longer use the pool
+	for (auto it = _thread_caches.begin(); it != _thread_caches.end(); ++it) {
+		ThreadCache &cache = **it;
+		for (unsigned int size_class = 0; size_class < SIZE_CLASS_COUNT; ++size_class) {
+			std::vector<uint8_t *> &blocks = cache.pools[size_class];
+			for (auto block_it = blocks.begin(); block_it != blocks.end(); ++block_it) {
+				memfree(*block_it);
+			}
+			blocks.clear();
+		}
+		cache.cached_bytes = 0;
+		cache.registered = false;
+	}
+	_thread_caches.clear();
 	clear();
 }
 
+VoxelMemoryPool::ThreadCache &VoxelMemoryPool::get_thread_cache() {
+	ThreadCache &cache = _thread_cache;
+	if (!cache.registered) {
+		MutexLock lock(_mutex);
+		_thread_caches.push_back(&cache);
+		cache.registered = true;
+	}
+	return cache;
+}
+
 uint8_t *VoxelMemoryPool::allocate(uint32_t size) {
 	VOXEL_PROFILE_SCOPE();
-	MutexLock lock(_mutex);
-	Pool *pool = get_or_create_pool(size);
+	const unsigned int size_class = get_size_class(size);
+	const int64_t class_bytes = get_size_class_bytes(size_class);
+	ThreadCache &cache = get_thread_cache();
+	std::vector<uint8_t *> &local_blocks = cache.pools[size_class];
+
+	if (local_blocks.size() == 0) {
+		// Take a batch from the shared pool, so next allocations don't have to lock
+		const size_t batch_count = MAX(get_thread_cache_capacity(class_bytes) / 2, 1u);
+		MutexLock lock(_mutex);
+		std::vector<uint8_t *> &shared_blocks = _pools[size_class].blocks;
+		const size_t count = MIN(batch_count, shared_blocks.size());
+		local_blocks.insert(local_blocks.end(), shared_blocks.end() - count, shared_blocks.end());
+		shared_blocks.resize(shared_blocks.size() - count);
+		_shared_cached_bytes -= count * class_bytes;
+		add(cache.cached_bytes, count * class_bytes);
+	}
+
 	uint8_t *block;
-	if (pool->blocks.size() > 0) {
-		block = pool->blocks.back();
-		pool->blocks.pop_back();
+	if (local_blocks.size() > 0) {
+		block = local_blocks.back();
+		local_blocks.pop_back();
+		add(cache.cached_bytes, -class_bytes);
+		add(cache.reused, 1);
 	} else {
-		block = (uint8_t *)memalloc(size * sizeof(uint8_t));
+		block = (uint8_t *)memalloc(class_bytes * sizeof(uint8_t));
+		add(cache.created, 1);
 	}
-	++_used_blocks;
+
+	add(cache.live_bytes, class_bytes);
+	add(cache.used_blocks, 1);
 	return block;
 }
 
 void VoxelMemoryPool::recycle(uint8_t *block, uint32_t size) {
+	CRASH_COND(block == nullptr);
+	const unsigned int size_class = get_size_class(size);
+	const int64_t class_bytes = get_size_class_bytes(size_class);
+	ThreadCache &cache = get_thread_cache();
+
+	add(cache.used_blocks, -1);
+	add(cache.live_bytes, -class_bytes);
+
+	std::vector<uint8_t *> &local_blocks = cache.pools[size_class];
+	local_blocks.push_back(block);
+	add(cache.cached_bytes, class_bytes);
+
+	const unsigned int capacity = get_thread_cache_capacity(class_bytes);
+	if (local_blocks.size() > capacity) {
+		// Give half of them back so other threads can use them
+		move_to_shared_pool(cache, size_class, local_blocks.size() - capacity / 2);
+	}
+}
+
+void VoxelMemoryPool::move_to_shared_pool(ThreadCache &cache, unsigned int size_class, unsigned int count) {
+	const int64_t class_bytes = get_size_class_bytes(size_class);
+	std::vector<uint8_t *> &blocks = cache.pools[size_class];
+
 	MutexLock lock(_mutex);
-	Pool *pool = _pools[size]; // If not found, entry will be created! It would be an error
-	// Check recycling before having allocated
-	CRASH_COND(pool == nullptr);
-	pool->blocks.push_back(block);
-	--_used_blocks;
+	std::vector<uint8_t *> &shared_blocks = _pools[size_class].blocks;
+
+	// The oldest blocks go first, recently used ones are more likely to still be in CPU caches
+	for (size_t i = 0; i < count; ++i) {
+		if (_max_cached_bytes != 0 && _shared_cached_bytes + class_bytes > _max_cached_bytes) {
+			memfree(blocks[i]);
+		} else {
+			shared_blocks.push_back(blocks[i]);
+			_shared_cached_bytes += class_bytes;
+		}
+	}
+
+	blocks.erase(blocks.begin(), blocks.begin() + count);
+	add(cache.cached_bytes, -int64_t(count) * class_bytes);
+}
+
+void VoxelMemoryPool::unregister_thread_cache(ThreadCache &cache) {
+	for (unsigned int size_class = 0; size_class < SIZE_CLASS_COUNT; ++size_class) {
+		const std::vector<uint8_t *> &blocks = cache.pools[size_class];
+		if (blocks.size() > 0) {
+			move_to_shared_pool(cache, size_class, blocks.size());
+		}
+	}
+
+	MutexLock lock(_mutex);
+	_exited_threads_counts.created += cache.created;
+	_exited_threads_counts.reused += cache.reused;
+	_exited_threads_counts.live_bytes += cache.live_bytes;
+	_exited_threads_counts.used_blocks += cache.used_blocks;
+	for (size_t i = 0; i < _thread_caches.size(); ++i) {
+		if (_thread_caches[i] == &cache) {
+			_thread_caches[i] = _thread_caches.back();
+			_thread_caches.pop_back();
+			break;
+		}
+	}
+	cache.registered = false;
+}
+
+void VoxelMemoryPool::set_max_cached_bytes(uint64_t max_bytes) {
+	MutexLock lock(_mutex);
+	_max_cached_bytes = max_bytes;
+}
+
+uint64_t VoxelMemoryPool::get_max_cached_bytes() const {
+	MutexLock lock(_mutex);
+	return _max_cached_bytes;
+}
+
+void VoxelMemoryPool::trim() {
+	VOXEL_PROFILE_SCOPE();
+	clear();
+}
+
+VoxelMemoryPool::Counts VoxelMemoryPool::get_counts() const {
+	MutexLock lock(_mutex);
+	Counts counts = _exited_threads_counts;
+	counts.cached_bytes = _shared_cached_bytes;
+	for (auto it = _thread_caches.begin(); it != _thread_caches.end(); ++it) {
+		const ThreadCache &cache = **it;
+		counts.created += cache.created;
+		counts.reused += cache.reused;
+		counts.cached_bytes += cache.cached_bytes;
+		counts.live_bytes += cache.live_bytes;
+		counts.used_blocks += cache.used_blocks;
+	}
+	return counts;
+}
+
+VoxelMemoryPool::Stats VoxelMemoryPool::get_stats() const {
+	const Counts counts = get_counts();
+	Stats s;
+	s.created = counts.created;
+	s.reused = counts.reused;
+	s.cached_bytes = counts.cached_bytes;
+	s.live_bytes = counts.live_bytes;
+	return s;
 }
 
 void VoxelMemoryPool::clear() {
 	MutexLock lock(_mutex);
-	const uint32_t *key = nullptr;
-	while ((key = _pools.next(key))) {
-		Pool *pool = _pools.get(*key);
-		CRASH_COND(pool == nullptr);
-		for (auto it = pool->blocks.begin(); it != pool->blocks.end(); ++it) {
+
+	ThreadCache &local_cache = _thread_cache;
+	if (local_cache.registered) {
+		for (unsigned int size_class = 0; size_class < SIZE_CLASS_COUNT; ++size_class) {
+			std::vector<uint8_t *> &local_blocks = local_cache.pools[size_class];
+			for (auto it = local_blocks.begin(); it != local_blocks.end(); ++it) {
+				memfree(*it);
+			}
+			local_blocks.clear();
+		}
+		local_cache.cached_bytes = 0;
+	}
+
+	for (unsigned int size_class = 0; size_class < SIZE_CLASS_COUNT; ++size_class) {
+		std::vector<uint8_t *> &shared_blocks = _pools[size_class].blocks;
+		for (auto it = shared_blocks.begin(); it != shared_blocks.end(); ++it) {
 			uint8_t *ptr = *it;
 			CRASH_COND(ptr == nullptr);
 			memfree(ptr);
 		}
+		// Release the array itself too
+		std::vector<uint8_t *>().swap(shared_blocks);
 	}
-	_pools.clear();
+	_shared_cached_bytes = 0;
 }
 
 void VoxelMemoryPool::debug_print() {
+	const Stats stats = get_stats();
 	MutexLock lock(_mutex);
 	print_line("-------- VoxelMemoryPool ----------");
-	if (_pools.size() == 0) {
-		print_line("No pools created");
-	} else {
-		const uint32_t *key = nullptr;
-		int i = 0;
-		while ((key = _pools.next(key))) {
-			Pool *pool = _pools.get(*key);
-			print_line(String("Pool {0} for size {1}: {2} blocks")
-							   .format(varray(i, *key, SIZE_T_TO_VARIANT(pool->blocks.size()))));
-			++i;
+	unsigned int pool_count = 0;
+	for (unsigned int size_class = 0; size_class < SIZE_CLASS_COUNT; ++size_class) {
+		const Pool &pool = _pools[size_class];
+		if (pool.blocks.size() == 0) {
+			continue;
 		}
+		print_line(String("Pool {0} for size {1}: {2} blocks")
+						   .format(varray(size_class, SIZE_T_TO_VARIANT(get_size_class_bytes(size_class)),
+								   SIZE_T_TO_VARIANT(pool.blocks.size()))));
+		++pool_count;
 	}
+	if (pool_count == 0) {
+		print_line("No pooled blocks");
+	}
+	print_line(String("Created: {0}, reused: {1}, cached bytes: {2}, live bytes: {3}")
+					   .format(varray(SIZE_T_TO_VARIANT(stats.created), SIZE_T_TO_VARIANT(stats.reused),
+							   SIZE_T_TO_VARIANT(stats.cached_bytes), SIZE_T_TO_VARIANT(stats.live_bytes))));
 }
 
 unsigned int VoxelMemoryPool::debug_get_used_blocks() const {
-	MutexLock lock(_mutex);
-	return _used_blocks;
-}
-
-VoxelMemoryPool::Pool *VoxelMemoryPool::get_or_create_pool(uint32_t size) {
-	Pool *pool;
-	Pool **ppool = _pools.getptr(size);
-	if (ppool == nullptr) {
-		pool = memnew(Pool);
-		CRASH_COND(pool == nullptr);
-		_pools.set(size, pool);
-	} else {
-		pool = *ppool;
-		CRASH_COND(pool == nullptr);
-	}
-	return pool;
+	return get_counts().used_blocks;
 }
@@ -1,20 +1,29 @@
 #ifndef VOXEL_MEMORY_POOL_H
 #define VOXEL_MEMORY_POOL_H
 
-#include "core/hash_map.h"
+#include "../util/fixed_array.h"
 #include "core/os/mutex.h"
 
+#include <atomic>
 #include <vector>
 
 // Pool based on a scenario where allocated blocks are often the same size.
-// A pool of blocks is assigned for each size.
+// Sizes are rounded up to size classes, each having a pool of blocks.
+// Each thread keeps a few blocks of every class for itself, so most allocations and recycling don't lock.
+// Thread caches are not tied to an instance, so only the singleton should be used.
 class VoxelMemoryPool {
-private:
-	struct Pool {
-		std::vector<uint8_t *> blocks;
+public:
+	struct Stats {
+		// How many blocks had to be allocated from the system
+		uint64_t created;
+		// How many blocks were taken from the pool instead of being allocated
+		uint64_t reused;
+		// Memory of blocks waiting to be reused, including those kept by threads
+		uint64_t cached_bytes;
+		// Memory of blocks currently in use
+		uint64_t live_bytes;
 	};
 
-public:
 	static void create_singleton();
 	static void destroy_singleton();
 	static VoxelMemoryPool *get_singleton();
@@ -23,18 +32,110 @@ public:
 	~VoxelMemoryPool();
 
 	uint8_t *allocate(uint32_t size);
+	// Size must be the same as the one given when the block was allocated
 	void recycle(uint8_t *block, uint32_t size);
 
+	// Blocks given back to shared pools beyond this amount of memory are freed instead. 0 means no limit.
+	// Caches of threads are not included, they are small.
+	void set_max_cached_bytes(uint64_t max_bytes);
+	uint64_t get_max_cached_bytes() const;
+
+	// Frees blocks waiting to be reused, so memory goes back to the system after a peak of usage.
+	// Only the small caches of other threads are kept.
+	void trim();
+
+	Stats get_stats() const;
+
 	void debug_print();
 	unsigned int debug_get_used_blocks() const;
 
 private:
-	Pool *get_or_create_pool(uint32_t size);
+	// Sizes up to 64 bytes share one class. Above that, each power of two is split in 8 classes,
+	// so rounding wastes at most 12.5% of a block.
+	static const unsigned int MIN_CLASS_SIZE = 64;
+	static const unsigned int SIZE_CLASS_COUNT = 1 + (32 - 6) * 8;
+
+	// Index of the highest bit set. v must not be zero.
+	static inline unsigned int get_msb(uint32_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+		return 31 - __builtin_clz(v);
+#else
+		unsigned int msb = 0;
+		while (v >>= 1) {
+			++msb;
+		}
+		return msb;
+#endif
+	}
+
+	static inline unsigned int get_size_class(uint32_t size) {
+		if (size <= MIN_CLASS_SIZE) {
+			return 0;
+		}
+		const uint32_t v = size - 1;
+		const unsigned int msb = get_msb(v);
+		return 1 + (msb - 6) * 8 + ((v >> (msb - 3)) & 7);
+	}
+
+	static inline uint64_t get_size_class_bytes(unsigned int size_class) {
+		if (size_class == 0) {
+			return MIN_CLASS_SIZE;
+		}
+		const unsigned int msb = (size_class - 1) / 8 + 6;
+		const unsigned int sub = (size_class - 1) % 8;
+		return uint64_t(8 + sub + 1) << (msb - 3);
+	}
+
+	struct Counts {
+		int64_t created = 0;
+		int64_t reused = 0;
+		int64_t cached_bytes = 0;
+		// Blocks can be recycled by another thread than the one that allocated them,
+		// so these can be negative for a given thread. Only the sum over all threads is meaningful.
+		int64_t live_bytes = 0;
+		int64_t used_blocks = 0;
+	};
+
+	struct ThreadCache {
+		FixedArray<std::vector<uint8_t *>, SIZE_CLASS_COUNT> pools;
+		// Same as `Counts`. Only the owning thread writes them, so they don't need atomic operations to change,
+		// but they are atomic so other threads can read them.
+		std::atomic<int64_t> created{ 0 };
+		std::atomic<int64_t> reused{ 0 };
+		std::atomic<int64_t> cached_bytes{ 0 };
+		std::atomic<int64_t> live_bytes{ 0 };
+		std::atomic<int64_t> used_blocks{ 0 };
+		// Set when the thread first uses the pool. Only reset when the thread exits or the pool is destroyed.
+		bool registered = false;
+		~ThreadCache();
+	};
+
+	static inline void add(std::atomic<int64_t> &counter, int64_t delta) {
+		counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+	}
+
+	struct Pool {
+		std::vector<uint8_t *> blocks;
+	};
+
+	ThreadCache &get_thread_cache();
+	void move_to_shared_pool(ThreadCache &cache, unsigned int size_class, unsigned int count);
+	void unregister_thread_cache(ThreadCache &cache);
+	Counts get_counts() const;
 	void clear();
 
-	HashMap<uint32_t, Pool *> _pools;
-	unsigned int _used_blocks = 0;
-	Mutex _mutex;
+	static thread_local ThreadCache _thread_cache;
+
+	// Shared by all threads. Threads access them with batches of blocks, when their own cache is empty or full.
+	FixedArray<Pool, SIZE_CLASS_COUNT> _pools;
+	uint64_t _shared_cached_bytes = 0;
+	uint64_t _max_cached_bytes = 0;
+
+	// Threads count allocations on their own, and the pool sums them up when needed
+	std::vector<ThreadCache *> _thread_caches;
+	Counts _exited_threads_counts;
+
+	mutable Mutex _mutex;
 };
 
 #endif // VOXEL_MEMORY_POOL_H
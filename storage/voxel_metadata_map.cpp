@@ -0,0 +1,85 @@
+#include "voxel_metadata_map.h"
+
+void VoxelMetadataMap::create(Vector3i size) {
+	clear();
+	// Keys are 32-bit. Buffers are much smaller than that in practice.
+	ERR_FAIL_COND_MSG(uint64_t(size.x) * uint64_t(size.y) * uint64_t(size.z) > 0xffffffff,
+			"Buffer is too large to store voxel metadata");
+	_size = size;
+}
+
+void VoxelMetadataMap::clear() {
+	_keys.clear();
+	_values.clear();
+}
+
+const Variant *VoxelMetadataMap::find(Vector3i pos) const {
+	const uint32_t key = get_key(pos);
+	const unsigned int i = lower_bound(key, 0);
+	if (i < _keys.size() && _keys[i] == key) {
+		return &_values[i];
+	}
+	return nullptr;
+}
+
+void VoxelMetadataMap::set(Vector3i pos, const Variant &value) {
+	ERR_FAIL_COND(!Box3i(Vector3i(), _size).contains(pos));
+	const uint32_t key = get_key(pos);
+
+	// Items are often added in order, when loading or copying
+	if (_keys.size() == 0 || _keys.back() < key) {
+		_keys.push_back(key);
+		_values.push_back(value);
+		return;
+	}
+
+	const unsigned int i = lower_bound(key, 0);
+	if (_keys[i] == key) {
+		_values[i] = value;
+	} else {
+		_keys.insert(_keys.begin() + i, key);
+		_values.insert(_values.begin() + i, value);
+	}
+}
+
+void VoxelMetadataMap::erase(Vector3i pos) {
+	const uint32_t key = get_key(pos);
+	const unsigned int i = lower_bound(key, 0);
+	if (i < _keys.size() && _keys[i] == key) {
+		_keys.erase(_keys.begin() + i);
+		_values.erase(_values.begin() + i);
+	}
+}
+
+void VoxelMetadataMap::erase_in_area(Box3i box) {
+	box.clip(Box3i(Vector3i(), _size));
+	if (box.is_empty() || _keys.size() == 0) {
+		return;
+	}
+
+	// Only items between the first and last positions of the box can be in it
+	const unsigned int begin = lower_bound(get_key(box.pos), 0);
+	const unsigned int end = lower_bound(get_key(box.pos + box.size - Vector3i(1)) + 1, begin);
+
+	unsigned int dst = begin;
+	for (unsigned int src = begin; src < end; ++src) {
+		if (!box.contains(get_position_from_key(_keys[src]))) {
+			_keys[dst] = _keys[src];
+			_values[dst] = _values[src];
+			++dst;
+		}
+	}
+	if (dst != end) {
+		_keys.erase(_keys.begin() + dst, _keys.begin() + end);
+		_values.erase(_values.begin() + dst, _values.begin() + end);
+	}
+}
+
+void VoxelMetadataMap::copy_from(const VoxelMetadataMap &src) {
+	ERR_FAIL_COND(src._size != _size);
+	_keys = src._keys;
+	_values.resize(src._values.size());
+	for (unsigned int i = 0; i < _values.size(); ++i) {
+		_values[i] = src._values[i].duplicate();
+	}
+}
@@ -0,0 +1,109 @@
+#ifndef VOXEL_METADATA_MAP_H
+#define VOXEL_METADATA_MAP_H
+
+#include "../util/math/box3i.h"
+
+#include <core/variant.h>
+#include <algorithm>
+#include <vector>
+
+// Stores per-voxel metadata of a buffer, sorted by ZXY index of their position.
+// Keys and values are in separate arrays, so searches only go through keys. Finding an item is O(log n),
+// and box queries skip rows of the box that have no items.
+class VoxelMetadataMap {
+public:
+	// Size of the buffer owning the metadata. Items are removed.
+	void create(Vector3i size);
+	void clear();
+
+	inline unsigned int size() const {
+		return _keys.size();
+	}
+
+	inline bool is_empty() const {
+		return _keys.size() == 0;
+	}
+
+	// Returns null if there is no item at this position
+	const Variant *find(Vector3i pos) const;
+
+	void set(Vector3i pos, const Variant &value);
+	void erase(Vector3i pos);
+	void erase_in_area(Box3i box);
+
+	// Replaces all items with those of another map having the same size. Values are duplicated.
+	void copy_from(const VoxelMetadataMap &src);
+
+	inline Vector3i get_position(unsigned int i) const {
+		return get_position_from_key(_keys[i]);
+	}
+
+	inline const Variant &get_value(unsigned int i) const {
+		return _values[i];
+	}
+
+	template <typename F>
+	void for_each(F callback) const {
+		for (unsigned int i = 0; i < _keys.size(); ++i) {
+			callback(get_position_from_key(_keys[i]), _values[i]);
+		}
+	}
+
+	template <typename F>
+	void for_each_in_area(Box3i box, F callback) const {
+		box.clip(Box3i(Vector3i(), _size));
+		if (box.is_empty() || _keys.size() == 0) {
+			return;
+		}
+		const Vector3i box_max = box.pos + box.size;
+		const uint32_t last_key = get_key(box_max - Vector3i(1));
+
+		unsigned int i = lower_bound(get_key(box.pos), 0);
+
+		while (i < _keys.size() && _keys[i] <= last_key) {
+			const Vector3i pos = get_position_from_key(_keys[i]);
+
+			if (box.contains(pos)) {
+				callback(pos, _values[i]);
+				++i;
+				continue;
+			}
+
+			// Jump to the next position of the box coming after this item
+			Vector3i next(box.pos.x, box.pos.y, pos.z);
+			if (pos.x >= box.pos.x) {
+				if (pos.x < box_max.x && pos.y < box.pos.y) {
+					next.x = pos.x;
+				} else if (pos.x + 1 < box_max.x) {
+					next.x = pos.x + 1;
+				} else {
+					++next.z;
+					if (next.z == box_max.z) {
+						break;
+					}
+				}
+			}
+			i = lower_bound(get_key(next), i);
+		}
+	}
+
+private:
+	inline uint32_t get_key(Vector3i pos) const {
+		return pos.y + _size.y * (pos.x + _size.x * pos.z);
+	}
+
+	inline Vector3i get_position_from_key(uint32_t key) const {
+		const uint32_t xz = key / _size.y;
+		return Vector3i(xz % _size.x, key % _size.y, xz / _size.x);
+	}
+
+	inline unsigned int lower_bound(uint32_t key, unsigned int from) const {
+		return std::lower_bound(_keys.begin() + from, _keys.end(), key) - _keys.begin();
+	}
+
+	std::vector<uint32_t> _keys;
+	std::vector<Variant> _values;
+	Vector3i _size;
+};
+
+#endif // VOXEL_METADATA_MAP_H
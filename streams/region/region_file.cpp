@@ -2,6 +2,7 @@
 #include "../../streams/voxel_block_serializer.h"
 #include "../../util/macros.h"
 #include "../../util/profiling.h"
+#include "../../util/serialization.h"
 #include "../file_utils.h"
 #include <core/os/file_access.h>
 #include <algorithm>
@@ -18,6 +19,7 @@ const char *FORMAT_REGION_MAGIC = "VXR_";
 const uint32_t MAGIC_AND_VERSION_SIZE = 4 + 1;
 const uint32_t FIXED_HEADER_DATA_SIZE = 7 + VoxelRegionFormat::CHANNEL_COUNT;
 const uint32_t PALETTE_SIZE_IN_BYTES = 256 * 4;
+const uint32_t INVALID_SECTOR_INDEX = 0xffffffff;
 } // namespace
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -222,38 +224,28 @@ Error VoxelRegionFile::open(const String &fpath, bool create_if_not_found) {
 
 	_file_access = f;
 
-	// Precalculate location of sectors and which block they contain.
-	// This will be useful to know when sectors get moved on insertion and removal
+	// Find which sectors are not used by blocks, so they can be reused when saving
 
-	struct BlockInfoAndIndex {
-		VoxelRegionBlockInfo b;
-		unsigned int i;
-	};
-
-	// Filter only present blocks and keep the index around because it represents the 3D position of the block
-	std::vector<BlockInfoAndIndex> blocks_sorted_by_offset;
+	std::vector<SectorRange> used_sectors;
 	for (unsigned int i = 0; i < _header.blocks.size(); ++i) {
 		const VoxelRegionBlockInfo b = _header.blocks[i];
 		if (b.data != 0) {
-			BlockInfoAndIndex p;
-			p.b = b;
-			p.i = i;
-			blocks_sorted_by_offset.push_back(p);
+			used_sectors.push_back(SectorRange{ b.get_sector_index(), b.get_sector_count() });
 		}
 	}
 
-	std::sort(blocks_sorted_by_offset.begin(), blocks_sorted_by_offset.end(),
-			[](const BlockInfoAndIndex &a, const BlockInfoAndIndex &b) {
-				return a.b.get_sector_index() < b.b.get_sector_index();
-			});
+	std::sort(used_sectors.begin(), used_sectors.end(), [](const SectorRange &a, const SectorRange &b) {
+		return a.index < b.index;
+	});
 
-	CRASH_COND(_sectors.size() != 0);
-	for (unsigned int i = 0; i < blocks_sorted_by_offset.size(); ++i) {
-		const BlockInfoAndIndex b = blocks_sorted_by_offset[i];
-		Vector3i bpos = get_block_position_from_index(b.i);
-		for (unsigned int j = 0; j < b.b.get_sector_count(); ++j) {
-			_sectors.push_back(bpos);
+	CRASH_COND(_free_sectors.size() != 0);
+	_sector_count = 0;
+	for (unsigned int i = 0; i < used_sectors.size(); ++i) {
+		const SectorRange r = used_sectors[i];
+		if (r.index > _sector_count) {
+			_free_sectors.push_back(SectorRange{ _sector_count, r.index - _sector_count });
 		}
+		_sector_count = MAX(_sector_count, r.index + r.count);
 	}
 
 #ifdef DEBUG_ENABLED
@@ -278,10 +270,24 @@ Error VoxelRegionFile::close() {
 		memdelete(_file_access);
 		_file_access = nullptr;
 	}
-	_sectors.clear();
+	_mapped_file.close();
+	_mapped_file_outdated = true;
+	_mapped_file_unavailable = false;
+	_free_sectors.clear();
+	_sector_count = 0;
 	return err;
 }
 
+Error VoxelRegionFile::flush() {
+	ERR_FAIL_COND_V(_file_access == nullptr, ERR_FILE_CANT_WRITE);
+	if (_header_modified) {
+		_file_access->seek(MAGIC_AND_VERSION_SIZE);
+		ERR_FAIL_COND_V(!save_header(_file_access), ERR_FILE_CANT_WRITE);
+	}
+	_file_access->flush();
+	return OK;
+}
+
 bool VoxelRegionFile::is_open() const {
 	return _file_access != nullptr;
 }
@@ -324,6 +330,22 @@ Error VoxelRegionFile::load_block(
 	const unsigned int sector_index = block_info.get_sector_index();
 	const unsigned int block_begin = _blocks_begin_offset + sector_index * _header.format.sector_size;
 
+	const Span<const uint8_t> mapped_data = get_mapped_data();
+	if (mapped_data.size() > 0) {
+		// Compressed data is given to the serializer straight from the mapping
+		ERR_FAIL_COND_V(block_begin + sizeof(uint32_t) > mapped_data.size(), ERR_PARSE_ERROR);
+		VoxelUtility::MemoryReader reader(mapped_data, VoxelUtility::ENDIANESS_LITTLE_ENDIAN);
+		reader.pos = block_begin;
+		const uint32_t block_data_size = reader.get_32();
+		ERR_FAIL_COND_V(block_data_size > mapped_data.size() - reader.pos, ERR_PARSE_ERROR);
+
+		ERR_FAIL_COND_V_MSG(!serializer.decompress_and_deserialize(
+									mapped_data.sub(reader.pos, block_data_size), **out_block),
+				ERR_PARSE_ERROR, String("Failed to read block {0}").format(varray(position.to_vec3())));
+
+		return OK;
+	}
+
 	f->seek(block_begin);
 
 	unsigned int block_data_size = f->get_32();
@@ -339,9 +361,17 @@ Error VoxelRegionFile::save_block(Vector3i position, Ref<VoxelBuffer> block, Vox
 	ERR_FAIL_COND_V(block.is_null(), ERR_INVALID_PARAMETER);
 	ERR_FAIL_COND_V(_header.format.verify_block(**block) == false, ERR_INVALID_PARAMETER);
 
+	VoxelBlockSerializerInternal::SerializeResult res = serializer.serialize_and_compress(**block);
+	ERR_FAIL_COND_V(!res.success, ERR_INVALID_PARAMETER);
+	return save_compressed_block(position, to_span_const(res.data));
+}
+
+Error VoxelRegionFile::save_compressed_block(Vector3i position, Span<const uint8_t> data) {
 	ERR_FAIL_COND_V(_file_access == nullptr, ERR_FILE_CANT_WRITE);
 	FileAccess *f = _file_access;
 
+	invalidate_mapped_data();
+
 	// We should be allowed to migrate before write operations
 	if (_header.version != FORMAT_VERSION) {
 		ERR_FAIL_COND_V(migrate_to_latest(f) == false, ERR_UNAVAILABLE);
@@ -351,96 +381,64 @@ Error VoxelRegionFile::save_block(Vector3i position, Ref<VoxelBuffer> block, Vox
 	ERR_FAIL_COND_V(lut_index >= _header.blocks.size(), ERR_INVALID_PARAMETER);
 	VoxelRegionBlockInfo &block_info = _header.blocks[lut_index];
 
-	if (block_info.data == 0) {
-		// The block isn't in the file yet, append at the end
+	const unsigned int written_size = sizeof(uint32_t) + data.size();
 
-		const unsigned int end_offset = _blocks_begin_offset + _sectors.size() * _header.format.sector_size;
-		f->seek(end_offset);
-		const unsigned int block_offset = f->get_position();
-		// Check position matches the sectors rule
-		CRASH_COND((block_offset - _blocks_begin_offset) % _header.format.sector_size != 0);
+	const unsigned int new_sector_count = get_sector_count_from_bytes(written_size);
+	CRASH_COND(new_sector_count < 1);
+	ERR_FAIL_COND_V(new_sector_count > VoxelRegionBlockInfo::MAX_SECTOR_COUNT, ERR_INVALID_PARAMETER);
 
-		VoxelBlockSerializerInternal::SerializeResult res = serializer.serialize_and_compress(**block);
-		ERR_FAIL_COND_V(!res.success, ERR_INVALID_PARAMETER);
-		f->store_32(res.data.size());
-		const unsigned int written_size = sizeof(int) + res.data.size();
-		f->store_buffer(res.data.data(), res.data.size());
-
-		const unsigned int end_pos = f->get_position();
-		CRASH_COND(written_size != (end_pos - block_offset));
-		pad_to_sector_size(f);
-
-		block_info.set_sector_index((block_offset - _blocks_begin_offset) / _header.format.sector_size);
-		block_info.set_sector_count(get_sector_count_from_bytes(written_size));
+	if (_sector_count + new_sector_count > VoxelRegionBlockInfo::MAX_SECTOR_INDEX && _free_sectors.size() > 0) {
+		// Free sectors are too fragmented to fit more blocks
+		const Error compact_err = compact();
+		ERR_FAIL_COND_V(compact_err != OK, compact_err);
+	}
 
-		for (unsigned int i = 0; i < block_info.get_sector_count(); ++i) {
-			_sectors.push_back(position);
-		}
+	uint32_t sector_index;
 
-		_header_modified = true;
+	if (block_info.data == 0) {
+		// The block isn't in the file yet
+		sector_index = allocate_sectors(new_sector_count);
+		ERR_FAIL_COND_V(sector_index == INVALID_SECTOR_INDEX, ERR_FILE_CANT_WRITE);
 
 	} else {
 		// The block is already in the file
-
-		CRASH_COND(_sectors.size() == 0);
-
-		const int old_sector_index = block_info.get_sector_index();
-		const int old_sector_count = block_info.get_sector_count();
+		const uint32_t old_sector_index = block_info.get_sector_index();
+		const uint32_t old_sector_count = block_info.get_sector_count();
 		CRASH_COND(old_sector_count < 1);
 
-		VoxelBlockSerializerInternal::SerializeResult res = serializer.serialize_and_compress(**block);
-		ERR_FAIL_COND_V(!res.success, ERR_INVALID_PARAMETER);
-		const std::vector<uint8_t> &data = res.data;
-		const int written_size = sizeof(int) + data.size();
-
-		const int new_sector_count = get_sector_count_from_bytes(written_size);
-		CRASH_COND(new_sector_count < 1);
-
 		if (new_sector_count <= old_sector_count) {
-			// We can write the block at the same spot
-
+			// We can write the block at the same spot, and sectors it no longer uses become free
+			sector_index = old_sector_index;
 			if (new_sector_count < old_sector_count) {
-				// The block now uses less sectors, we can compact others.
-				remove_sectors_from_block(position, old_sector_count - new_sector_count);
-				_header_modified = true;
+				free_sectors(old_sector_index + new_sector_count, old_sector_count - new_sector_count);
 			}
 
-			const int block_offset = _blocks_begin_offset + old_sector_index * _header.format.sector_size;
-			f->seek(block_offset);
-
-			f->store_32(data.size());
-			f->store_buffer(data.data(), data.size());
-
-			int end_pos = f->get_position();
-			CRASH_COND(written_size != (end_pos - block_offset));
+		} else if (grow_sectors_in_place(old_sector_index, old_sector_count, new_sector_count)) {
+			sector_index = old_sector_index;
 
 		} else {
-			// The block now uses more sectors, we have to move others.
-			// Note: we could shift blocks forward, but we can also remove the block entirely and rewrite it at the end.
-			// Need to investigate if it's worth implementing forward shift instead.
-
-			remove_sectors_from_block(position, old_sector_count);
-
-			const int block_offset = _blocks_begin_offset + _sectors.size() * _header.format.sector_size;
-			f->seek(block_offset);
-
-			f->store_32(data.size());
-			f->store_buffer(data.data(), data.size());
+			// The block moves elsewhere. Allocating before freeing leaves the old data intact if that fails.
+			sector_index = allocate_sectors(new_sector_count);
+			ERR_FAIL_COND_V(sector_index == INVALID_SECTOR_INDEX, ERR_FILE_CANT_WRITE);
+			free_sectors(old_sector_index, old_sector_count);
+		}
+	}
 
-			const int end_pos = f->get_position();
-			CRASH_COND(written_size != (end_pos - block_offset));
+	const unsigned int block_offset = _blocks_begin_offset + sector_index * _header.format.sector_size;
+	f->seek(block_offset);
 
-			pad_to_sector_size(f);
+	f->store_32(data.size());
+	f->store_buffer(data.data(), data.size());
 
-			block_info.set_sector_index(_sectors.size());
-			for (int i = 0; i < new_sector_count; ++i) {
-				_sectors.push_back(Vector3u16(position));
-			}
-
-			_header_modified = true;
-		}
+	const unsigned int end_pos = f->get_position();
+	CRASH_COND(written_size != (end_pos - block_offset));
+	pad_to_sector_size(f);
 
+	if (block_info.data == 0 || block_info.get_sector_index() != sector_index ||
+			block_info.get_sector_count() != new_sector_count) {
+		block_info.set_sector_index(sector_index);
 		block_info.set_sector_count(new_sector_count);
+		_header_modified = true;
 	}
 
 	return OK;
@@ -459,80 +457,225 @@ void VoxelRegionFile::pad_to_sector_size(FileAccess *f) {
 	}
 }
 
-void VoxelRegionFile::remove_sectors_from_block(Vector3i block_pos, unsigned int p_sector_count) {
-	VOXEL_PROFILE_SCOPE();
+Span<const uint8_t> VoxelRegionFile::get_mapped_data() {
+	if (_mapped_file_unavailable) {
+		return Span<const uint8_t>();
+	}
+	if (_mapped_file_outdated) {
+		_mapped_file_outdated = false;
+		// Written data may still be in buffers of `FileAccess`, the mapping has to see it
+		_file_access->flush();
+		const Error err = _mapped_file.open(_file_path);
+		if (err != OK) {
+			// Can happen on platforms without support, or if the file is in a pack
+			PRINT_VERBOSE(String("Could not map region file {0} in memory (error {1}), reading it with FileAccess")
+								  .format(varray(_file_path, err)));
+			_mapped_file_unavailable = true;
+			return Span<const uint8_t>();
+		}
+	}
+	return _mapped_file.get_data();
+}
 
-	// Removes sectors from a block, starting from the last ones.
-	// So if a block has 5 sectors and we remove 2, the first 3 will be preserved.
-	// Then all following sectors are moved earlier in the file to fill the gap.
+void VoxelRegionFile::invalidate_mapped_data() {
+	// Unmapping is also required because sectors can be moved and the file can grow
+	_mapped_file.close();
+	_mapped_file_outdated = true;
+}
 
-	CRASH_COND(_file_access == nullptr);
-	CRASH_COND(p_sector_count <= 0);
+uint32_t VoxelRegionFile::allocate_sectors(uint32_t count) {
+	// Best fit, so large free ranges remain available for large blocks
+	unsigned int best_index = _free_sectors.size();
+	for (unsigned int i = 0; i < _free_sectors.size(); ++i) {
+		const SectorRange &r = _free_sectors[i];
+		if (r.count >= count && (best_index == _free_sectors.size() || r.count < _free_sectors[best_index].count)) {
+			best_index = i;
+			if (r.count == count) {
+				break;
+			}
+		}
+	}
 
-	FileAccess *f = _file_access;
-	const unsigned int sector_size = _header.format.sector_size;
-	const unsigned int old_end_offset = _blocks_begin_offset + _sectors.size() * sector_size;
+	if (best_index < _free_sectors.size()) {
+		SectorRange &r = _free_sectors[best_index];
+		const uint32_t sector_index = r.index;
+		if (r.count == count) {
+			_free_sectors.erase(_free_sectors.begin() + best_index);
+		} else {
+			r.index += count;
+			r.count -= count;
+		}
+		return sector_index;
+	}
+
+	// Append at the end
+	ERR_FAIL_COND_V_MSG(_sector_count + count > VoxelRegionBlockInfo::MAX_SECTOR_INDEX, INVALID_SECTOR_INDEX,
+			String("Region file {0} has no room left, it may need to be compacted").format(varray(_file_path)));
+	const uint32_t sector_index = _sector_count;
+	_sector_count += count;
+	return sector_index;
+}
+
+bool VoxelRegionFile::grow_sectors_in_place(uint32_t index, uint32_t old_count, uint32_t new_count) {
+	const uint32_t end = index + old_count;
+	const uint32_t extra_count = new_count - old_count;
 
-	const unsigned int block_index = get_block_index_in_header(block_pos);
-	CRASH_COND(block_index >= _header.blocks.size());
-	VoxelRegionBlockInfo &block_info = _header.blocks[block_index];
+	if (end == _sector_count) {
+		// Last block of the file
+		if (_sector_count + extra_count > VoxelRegionBlockInfo::MAX_SECTOR_INDEX) {
+			return false;
+		}
+		_sector_count += extra_count;
+		return true;
+	}
 
-	unsigned int src_offset = _blocks_begin_offset +
-							  (block_info.get_sector_index() + block_info.get_sector_count()) * sector_size;
+	// Is there enough free space right after?
+	auto it = std::lower_bound(_free_sectors.begin(), _free_sectors.end(), end,
+			[](const SectorRange &r, uint32_t i) { return r.index < i; });
+	if (it == _free_sectors.end() || it->index != end || it->count < extra_count) {
+		return false;
+	}
+	if (it->count == extra_count) {
+		_free_sectors.erase(it);
+	} else {
+		it->index += extra_count;
+		it->count -= extra_count;
+	}
+	return true;
+}
 
-	unsigned int dst_offset = src_offset - p_sector_count * sector_size;
+void VoxelRegionFile::free_sectors(uint32_t index, uint32_t count) {
+	CRASH_COND(count == 0);
+	CRASH_COND(index + count > _sector_count);
+
+	if (index + count == _sector_count) {
+		// Sectors at the end of the file can be used again by appending
+		_sector_count = index;
+		if (_free_sectors.size() > 0) {
+			const SectorRange &last = _free_sectors.back();
+			if (last.index + last.count == _sector_count) {
+				_sector_count = last.index;
+				_free_sectors.pop_back();
+			}
+		}
+		return;
+	}
 
-	// Note: removing the last block from a region doesn't make the file invalid, but is not a known use case
-	CRASH_COND(_sectors.size() - p_sector_count <= 0);
-	CRASH_COND(src_offset - sector_size < dst_offset);
-	CRASH_COND(block_info.get_sector_index() + p_sector_count > _sectors.size());
-	CRASH_COND(p_sector_count > block_info.get_sector_count());
-	CRASH_COND(dst_offset < _blocks_begin_offset);
+	auto it = std::lower_bound(_free_sectors.begin(), _free_sectors.end(), index,
+			[](const SectorRange &r, uint32_t i) { return r.index < i; });
 
-	std::vector<uint8_t> temp;
-	temp.resize(sector_size);
+	// Merge with neighbor ranges
+	const bool merge_next = it != _free_sectors.end() && it->index == index + count;
+	const bool merge_previous = it != _free_sectors.begin() && (it - 1)->index + (it - 1)->count == index;
+#ifdef DEBUG_ENABLED
+	CRASH_COND(it != _free_sectors.end() && it->index < index + count);
+	CRASH_COND(it != _free_sectors.begin() && (it - 1)->index + (it - 1)->count > index);
+#endif
 
-	// TODO There might be a faster way to shrink a file
-	// Erase sectors from file
-	while (src_offset < old_end_offset) {
-		f->seek(src_offset);
-		size_t read_bytes = f->get_buffer(temp.data(), sector_size);
-		CRASH_COND(read_bytes != sector_size); // Corrupted file
+	if (merge_previous && merge_next) {
+		(it - 1)->count += count + it->count;
+		_free_sectors.erase(it);
+	} else if (merge_previous) {
+		(it - 1)->count += count;
+	} else if (merge_next) {
+		it->index = index;
+		it->count += count;
+	} else {
+		_free_sectors.insert(it, SectorRange{ index, count });
+	}
+}
 
-		f->seek(dst_offset);
-		f->store_buffer(temp.data(), sector_size);
+Error VoxelRegionFile::compact() {
+	VOXEL_PROFILE_SCOPE();
+	ERR_FAIL_COND_V(_file_access == nullptr, ERR_FILE_CANT_WRITE);
+	FileAccess *f = _file_access;
 
-		src_offset += sector_size;
-		dst_offset += sector_size;
+	if (_free_sectors.size() == 0) {
+		return OK;
 	}
 
-	// TODO We need to truncate the end of the file since we effectively shortened it,
-	// but FileAccess doesn't have any function to do that... so can't rely on EOF either
+	invalidate_mapped_data();
 
-	// Erase sectors from cache
-	_sectors.erase(
-			_sectors.begin() + (block_info.get_sector_index() + block_info.get_sector_count() - p_sector_count),
-			_sectors.begin() + (block_info.get_sector_index() + block_info.get_sector_count()));
+	// We should be allowed to migrate before write operations.
+	// Migration changes where blocks begin, so it has to be done before anything gets moved.
+	if (_header.version != FORMAT_VERSION) {
+		ERR_FAIL_COND_V(migrate_to_latest(f) == false, ERR_UNAVAILABLE);
+	}
 
-	const unsigned int old_sector_index = block_info.get_sector_index();
+	// The header in the file has to be up to date before moving anything, so if the process stops during
+	// compaction, every block it references is still intact. Each block then gets its own header entry
+	// written after it is moved.
+	f->seek(MAGIC_AND_VERSION_SIZE);
+	ERR_FAIL_COND_V(!save_header(f), ERR_FILE_CANT_WRITE);
 
-	// Reduce sectors of current block in header.
-	if (block_info.get_sector_count() > p_sector_count) {
-		block_info.set_sector_count(block_info.get_sector_count() - p_sector_count);
-	} else {
-		// Block removed
-		block_info.data = 0;
+	// Blocks are moved in the order they appear in the file, so data is only moved towards the beginning
+	// and never overwrites a block that hasn't been moved yet.
+	std::vector<unsigned int> block_indices;
+	for (unsigned int i = 0; i < _header.blocks.size(); ++i) {
+		if (_header.blocks[i].data != 0) {
+			block_indices.push_back(i);
+		}
 	}
+	const std::vector<VoxelRegionBlockInfo> &blocks = _header.blocks;
+	std::sort(block_indices.begin(), block_indices.end(), [&blocks](unsigned int a, unsigned int b) {
+		return blocks[a].get_sector_index() < blocks[b].get_sector_index();
+	});
 
-	// Shift sector index of following blocks
-	if (old_sector_index < _sectors.size()) {
-		for (unsigned int i = 0; i < _header.blocks.size(); ++i) {
-			VoxelRegionBlockInfo &b = _header.blocks[i];
-			if (b.data != 0 && b.get_sector_index() > old_sector_index) {
-				b.set_sector_index(b.get_sector_index() - p_sector_count);
+	const unsigned int sector_size = _header.format.sector_size;
+	std::vector<uint8_t> temp;
+	uint32_t next_sector_index = 0;
+
+	for (unsigned int i = 0; i < block_indices.size(); ++i) {
+		VoxelRegionBlockInfo &block_info = _header.blocks[block_indices[i]];
+		const uint32_t sector_index = block_info.get_sector_index();
+		const uint32_t sector_count = block_info.get_sector_count();
+		CRASH_COND(sector_index < next_sector_index);
+
+		if (sector_index != next_sector_index) {
+			temp.resize(sector_count * sector_size);
+			f->seek(_blocks_begin_offset + sector_index * sector_size);
+			const unsigned int read_size = f->get_buffer(temp.data(), temp.size());
+			ERR_FAIL_COND_V(read_size < sizeof(uint32_t), ERR_FILE_CORRUPT);
+
+			if (next_sector_index + sector_count > sector_index) {
+				// The destination overlaps the block, so it is first copied past the end of the file.
+				// That way the header entry always points at a complete copy.
+				f->seek(_blocks_begin_offset + _sector_count * sector_size);
+				f->store_buffer(temp.data(), read_size);
+				block_info.set_sector_index(_sector_count);
+				save_block_info(f, block_indices[i]);
 			}
+
+			f->seek(_blocks_begin_offset + next_sector_index * sector_size);
+			f->store_buffer(temp.data(), read_size);
+
+			block_info.set_sector_index(next_sector_index);
+			save_block_info(f, block_indices[i]);
 		}
+
+		next_sector_index += sector_count;
+	}
+
+	// TODO We should truncate the end of the file since we effectively shortened it,
+	// but FileAccess doesn't have any function to do that.
+	// It isn't a problem, blocks appended later will overwrite it.
+
+	_sector_count = next_sector_index;
+	_free_sectors.clear();
+
+	return OK;
+}
+
+unsigned int VoxelRegionFile::get_sector_count() const {
+	return _sector_count;
+}
+
+unsigned int VoxelRegionFile::get_free_sector_count() const {
+	unsigned int count = 0;
+	for (auto it = _free_sectors.begin(); it != _free_sectors.end(); ++it) {
+		count += it->count;
 	}
+	return count;
 }
 
 bool VoxelRegionFile::save_header(FileAccess *f) {
@@ -546,6 +689,15 @@ bool VoxelRegionFile::save_header(FileAccess *f) {
 	return true;
 }
 
+void VoxelRegionFile::save_block_info(FileAccess *f, unsigned int lut_index) {
+	// Block infos are the last part of the header
+	const unsigned int offset =
+			_blocks_begin_offset - (_header.blocks.size() - lut_index) * sizeof(VoxelRegionBlockInfo);
+	f->seek(offset);
+	// TODO Deal with endianess
+	f->store_buffer(reinterpret_cast<const uint8_t *>(&_header.blocks[lut_index]), sizeof(VoxelRegionBlockInfo));
+}
+
 bool VoxelRegionFile::migrate_from_v2_to_v3(FileAccess *f, VoxelRegionFormat &format) {
 	PRINT_VERBOSE(String("Migrating region file {0} from v2 to v3").format(varray(_file_path)));
 
@@ -666,4 +818,18 @@ void VoxelRegionFile::debug_check() {
 									   SIZE_T_TO_VARIANT(remaining_size))));
 		}
 	}
+
+	// Every sector must either be used by a block or be free
+	unsigned int used_sector_count = 0;
+	for (unsigned int lut_index = 0; lut_index < _header.blocks.size(); ++lut_index) {
+		const VoxelRegionBlockInfo &block_info = _header.blocks[lut_index];
+		if (block_info.data != 0) {
+			used_sector_count += block_info.get_sector_count();
+		}
+	}
+	const unsigned int free_sector_count = get_free_sector_count();
+	if (used_sector_count + free_sector_count != _sector_count) {
+		print_line(String("ERROR: {0} used sectors and {1} free sectors don't add up to {2} sectors")
+						   .format(varray(used_sector_count, free_sector_count, _sector_count)));
+	}
 }
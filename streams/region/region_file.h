@@ -5,6 +5,7 @@
 #include "../../util/fixed_array.h"
 #include "../../util/math/color8.h"
 #include "../../util/math/vector3i.h"
+#include "../../util/memory_mapped_file.h"
 #include <vector>
 
 class FileAccess;
@@ -81,23 +82,41 @@ public:
 
 	Error load_block(Vector3i position, Ref<VoxelBuffer> out_block, VoxelBlockSerializerInternal &serializer);
 	Error save_block(Vector3i position, Ref<VoxelBuffer> block, VoxelBlockSerializerInternal &serializer);
+	// Saves a block already serialized and compressed in the format of this file
+	Error save_compressed_block(Vector3i position, Span<const uint8_t> data);
+
+	// Writes the header if it changed and pushes buffered data to the file, without closing it
+	Error flush();
 
 	unsigned int get_header_block_count() const;
 	bool has_block(Vector3i position) const;
 	bool has_block(unsigned int index) const;
 	Vector3i get_block_position_from_index(uint32_t i) const;
 
+	// Moves blocks towards the beginning of the file so no free sectors remain between them.
+	// Saving blocks does not do that, so its cost doesn't depend on how many blocks come after.
+	// The file remains valid if the process stops in the middle.
+	Error compact();
+	// Sectors from the beginning of blocks data to the end of the last block, including free ones
+	unsigned int get_sector_count() const;
+	unsigned int get_free_sector_count() const;
+
 	void debug_check();
 
 private:
 	bool save_header(FileAccess *f);
+	void save_block_info(FileAccess *f, unsigned int lut_index);
 	Error load_header(FileAccess *f);
 
 	unsigned int get_block_index_in_header(const Vector3i &rpos) const;
 	uint32_t get_sector_count_from_bytes(uint32_t size_in_bytes) const;
 
 	void pad_to_sector_size(FileAccess *f);
-	void remove_sectors_from_block(Vector3i block_pos, unsigned int p_sector_count);
+	Span<const uint8_t> get_mapped_data();
+	void invalidate_mapped_data();
+	uint32_t allocate_sectors(uint32_t count);
+	bool grow_sectors_in_place(uint32_t index, uint32_t old_count, uint32_t new_count);
+	void free_sectors(uint32_t index, uint32_t count);
 
 	bool migrate_to_latest(FileAccess *f);
 	bool migrate_from_v2_to_v3(FileAccess *f, VoxelRegionFormat &format);
@@ -116,22 +135,23 @@ private:
 
 	Header _header;
 
-	struct Vector3u16 {
-		uint16_t x;
-		uint16_t y;
-		uint16_t z;
-
-		Vector3u16(Vector3i p) :
-				x(p.x), y(p.y), z(p.z) {}
+	struct SectorRange {
+		uint32_t index;
+		uint32_t count;
 	};
 
-	// TODO Is it ever read?
-	// List of sectors in the order they appear in the file,
-	// and which position their block is. The same block can span multiple sectors.
-	// This is essentially a reverse table of `Header::blocks`.
-	std::vector<Vector3u16> _sectors;
+	// Sectors not used by any block, sorted by index. Adjacent ranges are merged,
+	// and there is never a free range at the end, the sector count gets reduced instead.
+	std::vector<SectorRange> _free_sectors;
+	uint32_t _sector_count = 0;
 	uint32_t _blocks_begin_offset;
 	String _file_path;
+
+	// Blocks are read from a memory mapping of the file when possible, to decompress them without copying.
+	// It is mapped again after the file gets written to.
+	VoxelMemoryMappedFile _mapped_file;
+	bool _mapped_file_outdated = true;
+	bool _mapped_file_unavailable = false;
 };
 
 #endif // REGION_FILE_H
@@ -0,0 +1,333 @@
+#include "region_journal.h"
+#include "../../util/fixed_array.h"
+#include "../../util/profiling.h"
+#include "../voxel_block_serializer.h"
+
+#include <core/hashfuncs.h>
+#include <core/os/dir_access.h>
+#include <core/os/file_access.h>
+
+namespace {
+const uint8_t FORMAT_VERSION = 1;
+const char *FORMAT_JOURNAL_MAGIC = "VXRJ";
+const uint32_t HEADER_SIZE = 4 + 1;
+
+enum RecordType {
+	RECORD_BLOCK = 1,
+	RECORD_COMMIT = 2
+};
+
+// type + lod + position + data size
+const uint32_t BLOCK_RECORD_HEADER_SIZE = 1 + 1 + 3 * 4 + 4;
+const uint32_t BLOCK_RECORD_CHECKSUM_SIZE = 4;
+
+inline uint32_t get_checksum(Span<const uint8_t> data) {
+	return hash_djb2_buffer(data.data(), data.size());
+}
+
+} // namespace
+
+VoxelRegionJournal::~VoxelRegionJournal() {
+	close();
+}
+
+Error VoxelRegionJournal::open(const String &fpath) {
+	close();
+	_file_path = fpath;
+
+	Error err;
+	FileAccess *f = FileAccess::open(fpath, FileAccess::READ_WRITE, &err);
+	if (f == nullptr) {
+		// No journal yet
+		return reset();
+	}
+	_file_access = f;
+
+	if (load_records() != OK) {
+		ERR_PRINT(String("Journal {0} is invalid, its contents will be lost").format(varray(fpath)));
+		return reset();
+	}
+
+	return remove_incomplete_batch();
+}
+
+Error VoxelRegionJournal::remove_incomplete_batch() {
+	if (_size == _file_access->get_len()) {
+		return OK;
+	}
+	// An incomplete batch follows the last commit.
+	// It has to go, otherwise new records would be written over part of it and old ones could remain after them.
+	if (get_block_count() == 0) {
+		return reset();
+	}
+	return truncate_uncommitted();
+}
+
+Error VoxelRegionJournal::truncate_uncommitted() {
+	VOXEL_PROFILE_SCOPE();
+	ERR_FAIL_COND_V(_file_access == nullptr, ERR_FILE_CANT_WRITE);
+
+	// FileAccess can't truncate files, so committed records are copied to a new file which then replaces the journal.
+	// If the process stops before that, the journal is still the previous one.
+	const String temp_path = _file_path + ".tmp";
+	{
+		Error err;
+		FileAccessRef temp_f = FileAccess::open(temp_path, FileAccess::WRITE, &err);
+		ERR_FAIL_COND_V_MSG(!temp_f, err, String("Could not create {0}").format(varray(temp_path)));
+
+		std::vector<uint8_t> buffer;
+		buffer.resize(64 * 1024);
+		_file_access->seek(0);
+		uint64_t remaining_size = _size;
+		while (remaining_size > 0) {
+			const unsigned int chunk_size = MIN(remaining_size, buffer.size());
+			ERR_FAIL_COND_V(_file_access->get_buffer(buffer.data(), chunk_size) != chunk_size, ERR_FILE_CORRUPT);
+			temp_f->store_buffer(buffer.data(), chunk_size);
+			remaining_size -= chunk_size;
+		}
+		temp_f->flush();
+	}
+
+	// The journal is closed while it gets replaced. If that fails, it stays closed and can be opened again later.
+	memdelete(_file_access);
+	_file_access = nullptr;
+
+	DirAccessRef da = DirAccess::create_for_path(_file_path.get_base_dir());
+	Error err = da ? da->rename(temp_path, _file_path) : ERR_FILE_CANT_OPEN;
+	if (err != OK) {
+		close();
+		ERR_FAIL_V_MSG(err, String("Could not replace journal {0}").format(varray(_file_path)));
+	}
+
+	// Offsets of committed blocks remain the same
+	_file_access = FileAccess::open(_file_path, FileAccess::READ_WRITE, &err);
+	if (_file_access == nullptr) {
+		close();
+		ERR_FAIL_V_MSG(err, String("Could not open journal {0}").format(varray(_file_path)));
+	}
+	return OK;
+}
+
+void VoxelRegionJournal::close() {
+	if (_file_access != nullptr) {
+		memdelete(_file_access);
+		_file_access = nullptr;
+	}
+	clear_blocks();
+	_size = 0;
+}
+
+bool VoxelRegionJournal::is_open() const {
+	return _file_access != nullptr;
+}
+
+Error VoxelRegionJournal::load_records() {
+	VOXEL_PROFILE_SCOPE();
+	FileAccess *f = _file_access;
+	const uint64_t len = f->get_len();
+
+	ERR_FAIL_COND_V(len < HEADER_SIZE, ERR_FILE_CORRUPT);
+	FixedArray<char, 5> magic(0);
+	ERR_FAIL_COND_V(f->get_buffer(reinterpret_cast<uint8_t *>(magic.data()), 4) != 4, ERR_FILE_CORRUPT);
+	ERR_FAIL_COND_V(strcmp(magic.data(), FORMAT_JOURNAL_MAGIC) != 0, ERR_FILE_UNRECOGNIZED);
+	const uint8_t version = f->get_8();
+	ERR_FAIL_COND_V(version != FORMAT_VERSION, ERR_FILE_UNRECOGNIZED);
+
+	std::vector<Block> uncommitted_blocks;
+	std::vector<uint8_t> data;
+	uint64_t pos = HEADER_SIZE;
+	_size = HEADER_SIZE;
+
+	// Reading stops at the first incomplete or damaged record, which is where the process stopped writing
+	while (pos < len) {
+		const uint8_t type = f->get_8();
+
+		if (type == RECORD_BLOCK) {
+			if (len - pos < BLOCK_RECORD_HEADER_SIZE) {
+				break;
+			}
+			Block block;
+			block.lod = f->get_8();
+			block.position.x = static_cast<int32_t>(f->get_32());
+			block.position.y = static_cast<int32_t>(f->get_32());
+			block.position.z = static_cast<int32_t>(f->get_32());
+			block.size = f->get_32();
+			block.offset = pos + BLOCK_RECORD_HEADER_SIZE;
+			if (len - block.offset < uint64_t(block.size) + BLOCK_RECORD_CHECKSUM_SIZE) {
+				break;
+			}
+			data.resize(block.size);
+			f->get_buffer(data.data(), data.size());
+			const uint32_t checksum = f->get_32();
+			if (checksum != get_checksum(to_span_const(data))) {
+				break;
+			}
+			uncommitted_blocks.push_back(block);
+			pos = block.offset + block.size + BLOCK_RECORD_CHECKSUM_SIZE;
+
+		} else if (type == RECORD_COMMIT) {
+			for (auto it = uncommitted_blocks.begin(); it != uncommitted_blocks.end(); ++it) {
+				const Block &block = *it;
+				if (block.lod >= _blocks_per_lod.size()) {
+					_blocks_per_lod.resize(block.lod + 1);
+				}
+				Location location;
+				location.offset = block.offset;
+				location.size = block.size;
+				_blocks_per_lod[block.lod].set(block.position, location);
+			}
+			uncommitted_blocks.clear();
+			pos += 1;
+			_size = pos;
+
+		} else {
+			break;
+		}
+	}
+
+	return OK;
+}
+
+Error VoxelRegionJournal::append_block(Vector3i position, uint8_t lod, Span<const uint8_t> compressed_data) {
+	ERR_FAIL_COND_V(_file_access == nullptr, ERR_FILE_CANT_WRITE);
+	const uint64_t record_size = BLOCK_RECORD_HEADER_SIZE + compressed_data.size() + BLOCK_RECORD_CHECKSUM_SIZE;
+	// Offsets are stored in 32 bits. Journals are expected to be checkpointed well before that.
+	ERR_FAIL_COND_V(_size + record_size > 0xffffffff, ERR_FILE_CANT_WRITE);
+
+	FileAccess *f = _file_access;
+	f->seek(_size);
+	f->store_8(RECORD_BLOCK);
+	f->store_8(lod);
+	f->store_32(position.x);
+	f->store_32(position.y);
+	f->store_32(position.z);
+	f->store_32(compressed_data.size());
+	f->store_buffer(compressed_data.data(), compressed_data.size());
+	f->store_32(get_checksum(compressed_data));
+
+	Location location;
+	location.offset = _size + BLOCK_RECORD_HEADER_SIZE;
+	location.size = compressed_data.size();
+	if (lod >= _blocks_per_lod.size()) {
+		_blocks_per_lod.resize(lod + 1);
+	}
+	_blocks_per_lod[lod].set(position, location);
+
+	_size += record_size;
+	++_uncommitted_block_count;
+	return OK;
+}
+
+Error VoxelRegionJournal::commit() {
+	ERR_FAIL_COND_V(_file_access == nullptr, ERR_FILE_CANT_WRITE);
+	if (_uncommitted_block_count == 0) {
+		return OK;
+	}
+	FileAccess *f = _file_access;
+	f->seek(_size);
+	f->store_8(RECORD_COMMIT);
+	_size += 1;
+	// Data has to leave buffers of the process, so it remains if the process stops.
+	// FileAccess can't wait for data to reach the disk, so this doesn't cover power loss.
+	f->flush();
+	_uncommitted_block_count = 0;
+	return OK;
+}
+
+Error VoxelRegionJournal::discard_uncommitted() {
+	ERR_FAIL_COND_V(_file_access == nullptr, ERR_FILE_CANT_WRITE);
+	if (_uncommitted_block_count == 0) {
+		return OK;
+	}
+	// Uncommitted blocks replaced locations of earlier versions, so committed records are read again
+	clear_blocks();
+	_file_access->seek(0);
+	if (load_records() != OK) {
+		ERR_PRINT(String("Journal {0} is invalid, its contents will be lost").format(varray(_file_path)));
+		return reset();
+	}
+	return remove_incomplete_batch();
+}
+
+bool VoxelRegionJournal::has_uncommitted_blocks() const {
+	return _uncommitted_block_count > 0;
+}
+
+Error VoxelRegionJournal::load_block(
+		Vector3i position, uint8_t lod, VoxelBuffer &out_block, VoxelBlockSerializerInternal &serializer) {
+	if (lod >= _blocks_per_lod.size()) {
+		return ERR_DOES_NOT_EXIST;
+	}
+	const Location *location = _blocks_per_lod[lod].getptr(position);
+	if (location == nullptr) {
+		return ERR_DOES_NOT_EXIST;
+	}
+	ERR_FAIL_COND_V(_file_access == nullptr, ERR_FILE_CANT_READ);
+	_file_access->seek(location->offset);
+	ERR_FAIL_COND_V(!serializer.decompress_and_deserialize(_file_access, location->size, out_block), ERR_PARSE_ERROR);
+	return OK;
+}
+
+void VoxelRegionJournal::get_blocks(std::vector<Block> &out_blocks) const {
+	for (unsigned int lod = 0; lod < _blocks_per_lod.size(); ++lod) {
+		const HashMap<Vector3i, Location, Vector3iHasher> &blocks = _blocks_per_lod[lod];
+		const Vector3i *key = nullptr;
+		while ((key = blocks.next(key))) {
+			const Location &location = blocks[*key];
+			Block block;
+			block.position = *key;
+			block.lod = lod;
+			block.offset = location.offset;
+			block.size = location.size;
+			out_blocks.push_back(block);
+		}
+	}
+}
+
+Error VoxelRegionJournal::read_block_data(const Block &block, std::vector<uint8_t> &out_compressed_data) {
+	ERR_FAIL_COND_V(_file_access == nullptr, ERR_FILE_CANT_READ);
+	out_compressed_data.resize(block.size);
+	_file_access->seek(block.offset);
+	const unsigned int read_size = _file_access->get_buffer(out_compressed_data.data(), block.size);
+	ERR_FAIL_COND_V(read_size != block.size, ERR_FILE_CORRUPT);
+	return OK;
+}
+
+unsigned int VoxelRegionJournal::get_block_count() const {
+	unsigned int count = 0;
+	for (unsigned int lod = 0; lod < _blocks_per_lod.size(); ++lod) {
+		count += _blocks_per_lod[lod].size();
+	}
+	return count;
+}
+
+uint64_t VoxelRegionJournal::get_size_in_bytes() const {
+	return _size;
+}
+
+Error VoxelRegionJournal::reset() {
+	VOXEL_PROFILE_SCOPE();
+	if (_file_access != nullptr) {
+		memdelete(_file_access);
+		_file_access = nullptr;
+	}
+	clear_blocks();
+
+	// Opening for writing truncates the file
+	Error err;
+	FileAccess *f = FileAccess::open(_file_path, FileAccess::WRITE_READ, &err);
+	ERR_FAIL_COND_V_MSG(f == nullptr, err, String("Could not create journal {0}").format(varray(_file_path)));
+
+	f->store_buffer(reinterpret_cast<const uint8_t *>(FORMAT_JOURNAL_MAGIC), 4);
+	f->store_8(FORMAT_VERSION);
+	f->flush();
+
+	_file_access = f;
+	_size = HEADER_SIZE;
+	return OK;
+}
+
+void VoxelRegionJournal::clear_blocks() {
+	_blocks_per_lod.clear();
+	_uncommitted_block_count = 0;
+}
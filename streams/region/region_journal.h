@@ -0,0 +1,80 @@
+#ifndef VOXEL_REGION_JOURNAL_H
+#define VOXEL_REGION_JOURNAL_H
+
+#include "../../util/math/vector3i.h"
+#include "../../util/span.h"
+#include <core/error_list.h>
+#include <core/hash_map.h>
+#include <core/ustring.h>
+#include <vector>
+
+class FileAccess;
+class VoxelBuffer;
+class VoxelBlockSerializerInternal;
+
+// Append-only file where saved blocks are written before they are copied into region files.
+// Blocks are appended in batches, and a batch only counts once its commit record is written.
+// If the process stops before that, the whole batch is ignored when the journal is opened again,
+// and if it stops while blocks are being copied to regions, they can be copied again from the journal.
+// Appending is also cheaper than writing at various places of region files.
+//
+// It isn't thread-safe.
+//
+class VoxelRegionJournal {
+public:
+	struct Block {
+		Vector3i position;
+		uint8_t lod;
+		// Location of compressed block data in the journal
+		uint32_t offset;
+		uint32_t size;
+	};
+
+	~VoxelRegionJournal();
+
+	// Creates the file if it doesn't exist.
+	// Blocks of batches committed in a previous session are available after opening.
+	Error open(const String &fpath);
+	void close();
+	bool is_open() const;
+
+	Error append_block(Vector3i position, uint8_t lod, Span<const uint8_t> compressed_data);
+	// Makes blocks appended since the last commit durable, all at once
+	Error commit();
+	// Forgets blocks appended since the last commit. Blocks they replaced become available again.
+	Error discard_uncommitted();
+	bool has_uncommitted_blocks() const;
+
+	// Gets the latest version of blocks, including uncommitted ones
+	Error load_block(Vector3i position, uint8_t lod, VoxelBuffer &out_block, VoxelBlockSerializerInternal &serializer);
+	void get_blocks(std::vector<Block> &out_blocks) const;
+	Error read_block_data(const Block &block, std::vector<uint8_t> &out_compressed_data);
+	unsigned int get_block_count() const;
+
+	uint64_t get_size_in_bytes() const;
+
+	// Empties the journal, once all its blocks have been copied somewhere else
+	Error reset();
+
+private:
+	struct Location {
+		uint32_t offset;
+		uint32_t size;
+	};
+
+	Error load_records();
+	// Removes what follows the last commit from the file
+	Error remove_incomplete_batch();
+	Error truncate_uncommitted();
+	void clear_blocks();
+
+	FileAccess *_file_access = nullptr;
+	String _file_path;
+	// Where the next record gets written
+	uint64_t _size = 0;
+	unsigned int _uncommitted_block_count = 0;
+	// Latest record of each block, indexed by LOD
+	std::vector<HashMap<Vector3i, Location, Vector3iHasher> > _blocks_per_lod;
+};
+
+#endif // VOXEL_REGION_JOURNAL_H
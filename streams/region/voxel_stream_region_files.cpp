@@ -16,6 +16,9 @@ const uint8_t FORMAT_VERSION_LEGACY_2 = 2;
 
 const uint8_t FORMAT_VERSION_LEGACY_1 = 1;
 const char *META_FILE_NAME = "meta.vxrm";
+const char *JOURNAL_FILE_NAME = "journal.vxrj";
+// Blocks are copied from the journal into regions once it gets larger than this
+const uint64_t JOURNAL_CHECKPOINT_SIZE = 4 * 1024 * 1024;
 } // namespace
 
 thread_local VoxelBlockSerializerInternal VoxelStreamRegionFiles::_block_serializer;
@@ -59,29 +62,37 @@ void VoxelStreamRegionFiles::emerge_blocks(Vector<VoxelBlockRequest> &p_blocks,
 	VOXEL_PROFILE_SCOPE();
 
 	// In order to minimize opening/closing files, requests are grouped according to their region.
-
-	// Had to copy input to sort it, as some areas in the module break if they get responses in different order
-	Vector<VoxelBlockRequest> sorted_blocks;
-	sorted_blocks.append_array(p_blocks);
-
-	SortArray<VoxelBlockRequest, BlockRequestComparator> sorter;
-	sorter.compare.self = this;
-	sorter.sort(sorted_blocks.ptrw(), sorted_blocks.size());
-
-	Vector<VoxelBlockRequest> fallback_requests;
-
-	for (int i = 0; i < sorted_blocks.size(); ++i) {
-		VoxelBlockRequest &r = sorted_blocks.write[i];
+	// Some areas in the module break if they get responses in different order,
+	// so we sort indices and results are written in the same order as the input.
+	std::vector<int> sorted_indices;
+	sorted_indices.resize(p_blocks.size());
+	for (int i = 0; i < p_blocks.size(); ++i) {
+		sorted_indices[i] = i;
+	}
+
+	BlockRequestComparator comparator;
+	comparator.self = this;
+	std::sort(sorted_indices.begin(), sorted_indices.end(), [&comparator, &p_blocks](int a, int b) {
+		return comparator(p_blocks[a], p_blocks[b]);
+	});
+
+	const int results_begin = out_results.size();
+	out_results.resize(results_begin + p_blocks.size());
+
+	for (unsigned int i = 0; i < sorted_indices.size(); ++i) {
+		const int block_index = sorted_indices[i];
+		VoxelBlockRequest &r = p_blocks.write[block_index];
 		const EmergeResult result = _emerge_block(r.voxel_buffer, r.origin_in_voxels, r.lod);
+		Result &out_result = out_results.write[results_begin + block_index];
 		switch (result) {
 			case EMERGE_OK:
-				out_results.push_back(RESULT_BLOCK_FOUND);
+				out_result = RESULT_BLOCK_FOUND;
 				break;
 			case EMERGE_OK_FALLBACK:
-				out_results.push_back(RESULT_BLOCK_NOT_FOUND);
+				out_result = RESULT_BLOCK_NOT_FOUND;
 				break;
 			case EMERGE_FAILED:
-				out_results.push_back(RESULT_ERROR);
+				out_result = RESULT_ERROR;
 				break;
 			default:
 				CRASH_NOW();
@@ -101,10 +112,20 @@ void VoxelStreamRegionFiles::immerge_blocks(const Vector<VoxelBlockRequest> &p_b
 	sorter.compare.self = this;
 	sorter.sort(sorted_blocks.ptrw(), sorted_blocks.size());
 
+	// Locking for the whole batch, so it gets committed at once
+	MutexLock lock(_mutex);
+
 	for (int i = 0; i < sorted_blocks.size(); ++i) {
 		VoxelBlockRequest &r = sorted_blocks.write[i];
 		_immerge_block(r.voxel_buffer, r.origin_in_voxels, r.lod);
 	}
+
+	if (_journal.has_uncommitted_blocks()) {
+		ERR_FAIL_COND(_journal.commit() != OK);
+		if (_journal.get_size_in_bytes() >= JOURNAL_CHECKPOINT_SIZE) {
+			checkpoint_journal();
+		}
+	}
 }
 
 int VoxelStreamRegionFiles::get_used_channels_mask() const {
@@ -151,6 +172,21 @@ VoxelStreamRegionFiles::EmergeResult VoxelStreamRegionFiles::_emerge_block(
 	}
 
 	const Vector3i block_pos = get_block_position_from_voxels(origin_in_voxels) >> lod;
+
+	if (!_journal_recovered) {
+		recover_journal();
+	}
+
+	// Blocks in the journal are more recent than those in regions
+	if (_journal.is_open()) {
+		const Error journal_err = _journal.load_block(block_pos, lod, **out_buffer, _block_serializer);
+		if (journal_err == OK) {
+			return EMERGE_OK;
+		} else if (journal_err != ERR_DOES_NOT_EXIST) {
+			return EMERGE_FAILED;
+		}
+	}
+
 	const Vector3i region_pos = get_region_position_from_blocks(block_pos);
 
 	CachedRegion *cache = open_region(region_pos, lod, false);
@@ -203,20 +239,21 @@ void VoxelStreamRegionFiles::_immerge_block(Ref<VoxelBuffer> voxel_buffer, Vecto
 	}
 
 	// Verify format
+	ERR_FAIL_COND(lod < 0 || lod >= _meta.lod_count);
 	const Vector3i block_size = Vector3i(1 << _meta.block_size_po2);
 	ERR_FAIL_COND(voxel_buffer->get_size() != block_size);
 	for (unsigned int i = 0; i < VoxelBuffer::MAX_CHANNELS; ++i) {
 		ERR_FAIL_COND(voxel_buffer->get_channel_depth(i) != _meta.channel_depths[i]);
 	}
 
-	const Vector3i region_size = Vector3i(1 << _meta.region_size_po2);
-	Vector3i block_pos = get_block_position_from_voxels(origin_in_voxels) >> lod;
-	Vector3i region_pos = get_region_position_from_blocks(block_pos);
-	Vector3i block_rpos = block_pos.wrap(region_size);
+	ERR_FAIL_COND_MSG(open_journal() != OK, "Could not save block data");
+
+	const Vector3i block_pos = get_block_position_from_voxels(origin_in_voxels) >> lod;
 
-	CachedRegion *cache = open_region(region_pos, lod, true);
-	ERR_FAIL_COND_MSG(cache == nullptr, "Could not save region file data");
-	ERR_FAIL_COND(cache->region.save_block(block_rpos, voxel_buffer, _block_serializer) != OK);
+	VoxelBlockSerializerInternal::SerializeResult res = _block_serializer.serialize_and_compress(**voxel_buffer);
+	ERR_FAIL_COND(!res.success);
+	// Region files store blocks compressed the same way, so they are copied as-is when checkpointing
+	ERR_FAIL_COND(_journal.append_block(block_pos, lod, to_span_const(res.data)) != OK);
 }
 
 String VoxelStreamRegionFiles::get_directory() const {
@@ -402,14 +439,90 @@ Vector3i VoxelStreamRegionFiles::get_region_position_from_blocks(const Vector3i
 }
 
 void VoxelStreamRegionFiles::close_all_regions() {
+	// This is also called from the main thread, when the stream is destroyed or its directory changes.
+	// So the journal is not checkpointed and regions are not compacted here: committed blocks stay in the journal,
+	// and get copied into regions when the directory is opened again, from the streaming thread.
+	// A batch left uncommitted was interrupted, and gets dropped at that point too.
+	_journal.close();
+	_journal_recovered = false;
+
 	for (unsigned int i = 0; i < _region_cache.size(); ++i) {
 		CachedRegion *cache = _region_cache[i];
-		close_region(cache);
+		cache->region.close();
 		memdelete(cache);
 	}
 	_region_cache.clear();
 }
 
+Error VoxelStreamRegionFiles::open_journal() {
+	if (_journal.is_open()) {
+		return OK;
+	}
+	_journal_recovered = true;
+
+	const String fpath = _directory_path.plus_file(JOURNAL_FILE_NAME);
+	const Error err = _journal.open(fpath);
+	ERR_FAIL_COND_V_MSG(err != OK, err, String("Could not open journal {0}, error {1}").format(varray(fpath, err)));
+
+	if (_journal.get_block_count() > 0) {
+		// The previous session stopped before copying these blocks into regions
+		PRINT_VERBOSE(String("Recovering {0} blocks from journal {1}")
+							  .format(varray(_journal.get_block_count(), fpath)));
+		return checkpoint_journal();
+	}
+	return OK;
+}
+
+void VoxelStreamRegionFiles::recover_journal() {
+	_journal_recovered = true;
+	if (FileAccess::exists(_directory_path.plus_file(JOURNAL_FILE_NAME))) {
+		open_journal();
+	}
+}
+
+Error VoxelStreamRegionFiles::checkpoint_journal() {
+	VOXEL_PROFILE_SCOPE();
+	CRASH_COND(_journal.has_uncommitted_blocks());
+
+	std::vector<VoxelRegionJournal::Block> blocks;
+	_journal.get_blocks(blocks);
+
+	// Group blocks by region, so each region gets opened once
+	const int region_size_po2 = _meta.region_size_po2;
+	std::sort(blocks.begin(), blocks.end(),
+			[region_size_po2](const VoxelRegionJournal::Block &a, const VoxelRegionJournal::Block &b) {
+				if (a.lod != b.lod) {
+					return a.lod < b.lod;
+				}
+				return (a.position >> region_size_po2) < (b.position >> region_size_po2);
+			});
+
+	const Vector3i region_size = Vector3i(1 << _meta.region_size_po2);
+	std::vector<uint8_t> data;
+
+	for (unsigned int i = 0; i < blocks.size(); ++i) {
+		const VoxelRegionJournal::Block &block = blocks[i];
+		const Vector3i region_pos = get_region_position_from_blocks(block.position);
+
+		CachedRegion *cache = open_region(region_pos, block.lod, true);
+		ERR_FAIL_COND_V_MSG(cache == nullptr, ERR_FILE_CANT_WRITE, "Could not save region file data");
+
+		Error err = _journal.read_block_data(block, data);
+		ERR_FAIL_COND_V(err != OK, err);
+		err = cache->region.save_compressed_block(block.position.wrap(region_size), to_span_const(data));
+		ERR_FAIL_COND_V(err != OK, err);
+	}
+
+	// Regions must have all blocks before the journal can be emptied.
+	// If the process stops before that, blocks will be copied again from the journal.
+	for (unsigned int i = 0; i < _region_cache.size(); ++i) {
+		const Error err = _region_cache[i]->region.flush();
+		ERR_FAIL_COND_V(err != OK, err);
+	}
+
+	return _journal.reset();
+}
+
 String VoxelStreamRegionFiles::get_region_file_path(const Vector3i &region_pos, unsigned int lod) const {
 	Array a;
 	a.resize(5);
@@ -511,7 +624,13 @@ VoxelStreamRegionFiles::CachedRegion *VoxelStreamRegionFiles::open_region(
 
 // TODO Get rid of to simplify?
 void VoxelStreamRegionFiles::close_region(CachedRegion *region) {
-	region->region.close();
+	// Saving blocks leaves free sectors behind instead of moving following blocks.
+	// They get compacted once enough of them accumulated, rather than on every save.
+	VoxelRegionFile &file = region->region;
+	if (file.is_open() && file.get_free_sector_count() * 4 > file.get_sector_count()) {
+		file.compact();
+	}
+	file.close();
 }
 
 void VoxelStreamRegionFiles::close_oldest_region() {
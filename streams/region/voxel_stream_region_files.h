@@ -6,6 +6,7 @@
 #include "../voxel_block_serializer.h"
 #include "../voxel_stream.h"
 #include "region_file.h"
+#include "region_journal.h"
 
 class FileAccess;
 
@@ -18,6 +19,10 @@ class FileAccess;
 //
 // Region files are not thread-safe. Because of this, internal mutexing may often constrain the use by one thread only.
 //
+// Saved blocks are appended to a journal first, and each batch of saved blocks is committed at once.
+// They are copied into region files once the journal grows large enough, or when regions get closed.
+// If the process stops while saving, the next session recovers the last committed batches from the journal.
+//
 class VoxelStreamRegionFiles : public VoxelStream {
 	GDCLASS(VoxelStreamRegionFiles, VoxelStream)
 public:
@@ -73,6 +78,9 @@ private:
 	Vector3i get_block_position_from_voxels(const Vector3i &origin_in_voxels) const;
 	Vector3i get_region_position_from_blocks(const Vector3i &block_position) const;
 	void close_all_regions();
+	Error open_journal();
+	void recover_journal();
+	Error checkpoint_journal();
 	String get_region_file_path(const Vector3i &region_pos, unsigned int lod) const;
 	CachedRegion *open_region(const Vector3i region_pos, unsigned int lod, bool create_if_not_found);
 	void close_region(CachedRegion *cache);
@@ -133,6 +141,9 @@ private:
 	std::vector<CachedRegion *> _region_cache;
 	// TODO Add memory caches to increase capacity.
 	unsigned int _max_open_regions = MIN(8, FOPEN_MAX);
+	VoxelRegionJournal _journal;
+	// Reading blocks doesn't create a journal, but must recover the one a previous session may have left
+	bool _journal_recovered = false;
 
 	Mutex _mutex;
 };
@@ -22,9 +22,9 @@ const unsigned int BLOCK_METADATA_HEADER_SIZE = sizeof(uint32_t);
 size_t get_metadata_size_in_bytes(const VoxelBuffer &buffer) {
 	size_t size = 0;
 
-	const Map<Vector3i, Variant>::Element *elem = buffer.get_voxel_metadata().front();
-	while (elem != nullptr) {
-		const Vector3i pos = elem->key();
+	const VoxelMetadataMap &voxel_metadata = buffer.get_voxel_metadata();
+	for (unsigned int i = 0; i < voxel_metadata.size(); ++i) {
+		const Vector3i pos = voxel_metadata.get_position(i);
 
 		ERR_FAIL_COND_V_MSG(pos.x < 0 || static_cast<uint32_t>(pos.x) >= VoxelBuffer::MAX_SIZE, 0,
 				"Invalid voxel metadata X position");
@@ -36,11 +36,9 @@ size_t get_metadata_size_in_bytes(const VoxelBuffer &buffer) {
 		size += 3 * sizeof(uint16_t); // Positions are stored as 3 unsigned shorts
 
 		int len;
-		const Error err = encode_variant(elem->value(), nullptr, len, false);
+		const Error err = encode_variant(voxel_metadata.get_value(i), nullptr, len, false);
 		ERR_FAIL_COND_V_MSG(err != OK, 0, "Error when trying to encode voxel metadata.");
 		size += len;
-
-		elem = elem->next();
 	}
 
 	// If no metadata is found at all, nothing is serialized, not even null.
@@ -85,23 +83,21 @@ void serialize_metadata(uint8_t *p_dst, const VoxelBuffer &buffer, const size_t
 		CRASH_COND_MSG(static_cast<size_t>(dst - p_dst) > metadata_size, "Wrote block metadata out of expected bounds");
 	}
 
-	const Map<Vector3i, Variant>::Element *elem = buffer.get_voxel_metadata().front();
-	while (elem != nullptr) {
+	const VoxelMetadataMap &voxel_metadata = buffer.get_voxel_metadata();
+	for (unsigned int i = 0; i < voxel_metadata.size(); ++i) {
 		// Serializing key as ushort because it's more than enough for a 3D dense array
 		static_assert(VoxelBuffer::MAX_SIZE <= 65535, "Maximum size exceeds serialization support");
-		const Vector3i pos = elem->key();
+		const Vector3i pos = voxel_metadata.get_position(i);
 		write<uint16_t>(dst, pos.x);
 		write<uint16_t>(dst, pos.y);
 		write<uint16_t>(dst, pos.z);
 
 		int written_length;
-		const Error err = encode_variant(elem->value(), dst, written_length, false);
+		const Error err = encode_variant(voxel_metadata.get_value(i), dst, written_length, false);
 		CRASH_COND_MSG(err != OK, "Error when trying to encode voxel metadata.");
 		dst += written_length;
 
 		CRASH_COND_MSG(static_cast<size_t>(dst - p_dst) > metadata_size, "Wrote voxel metadata out of expected bounds");
-
-		elem = elem->next();
 	}
 
 	CRASH_COND_MSG(static_cast<size_t>(dst - p_dst) != metadata_size,
@@ -160,7 +156,9 @@ size_t get_size_in_bytes(const VoxelBuffer &buffer, size_t &metadata_size) {
 		size += 1;
 
 		switch (compression) {
-			case VoxelBuffer::COMPRESSION_NONE: {
+			case VoxelBuffer::COMPRESSION_NONE:
+			case VoxelBuffer::COMPRESSION_PALETTE:
+			case VoxelBuffer::COMPRESSION_BRICKS: {
 				size += VoxelBuffer::get_size_in_bytes_for_volume(size_in_voxels, depth);
 			} break;
 
@@ -206,7 +204,12 @@ VoxelBlockSerializerInternal::SerializeResult VoxelBlockSerializerInternal::seri
 	f->store_16(voxel_buffer.get_size().z);
 
 	for (unsigned int channel_index = 0; channel_index < VoxelBuffer::MAX_CHANNELS; ++channel_index) {
-		const VoxelBuffer::Compression compression = voxel_buffer.get_channel_compression(channel_index);
+		VoxelBuffer::Compression compression = voxel_buffer.get_channel_compression(channel_index);
+		if (compression == VoxelBuffer::COMPRESSION_PALETTE || compression == VoxelBuffer::COMPRESSION_BRICKS) {
+			// Palettes and bricks only save memory at runtime, saved data gets compressed as a whole afterwards.
+			// They are saved as plain values so the format doesn't change.
+			compression = VoxelBuffer::COMPRESSION_NONE;
+		}
 		const VoxelBuffer::Depth depth = voxel_buffer.get_channel_depth(channel_index);
 		// Low nibble: compression (up to 16 values allowed)
 		// High nibble: depth (up to 16 values allowed)
@@ -216,7 +219,11 @@ VoxelBlockSerializerInternal::SerializeResult VoxelBlockSerializerInternal::seri
 		switch (compression) {
 			case VoxelBuffer::COMPRESSION_NONE: {
 				Span<uint8_t> data;
-				ERR_FAIL_COND_V(!voxel_buffer.get_channel_raw(channel_index, data), SerializeResult(_data, false));
+				if (!voxel_buffer.get_channel_raw(channel_index, data)) {
+					_channel_tmp.resize(VoxelBuffer::get_size_in_bytes_for_volume(voxel_buffer.get_size(), depth));
+					voxel_buffer.decode_channel(channel_index, to_span(_channel_tmp));
+					data = to_span(_channel_tmp);
+				}
 				f->store_buffer(data.data(), data.size());
 			} break;
 
@@ -379,9 +386,14 @@ VoxelBlockSerializerInternal::SerializeResult VoxelBlockSerializerInternal::seri
 
 bool VoxelBlockSerializerInternal::decompress_and_deserialize(
 		const std::vector<uint8_t> &p_data, VoxelBuffer &out_voxel_buffer) {
+	return decompress_and_deserialize(to_span_const(p_data), out_voxel_buffer);
+}
+
+bool VoxelBlockSerializerInternal::decompress_and_deserialize(
+		Span<const uint8_t> p_data, VoxelBuffer &out_voxel_buffer) {
 	VOXEL_PROFILE_SCOPE();
 
-	const bool res = VoxelCompressedData::decompress(Span<const uint8_t>(p_data.data(), 0, p_data.size()), _data);
+	const bool res = VoxelCompressedData::decompress(p_data, _data);
 	ERR_FAIL_COND_V(!res, false);
 
 	return deserialize(_data, out_voxel_buffer);
@@ -1,6 +1,7 @@
 #ifndef VOXEL_BLOCK_SERIALIZER_H
 #define VOXEL_BLOCK_SERIALIZER_H
 
+#include "../util/span.h"
 #include <core/io/file_access_memory.h>
 #include <core/reference.h>
 #include <vector>
@@ -24,6 +25,8 @@ public:
 
 	SerializeResult serialize_and_compress(const VoxelBuffer &voxel_buffer);
 	bool decompress_and_deserialize(const std::vector<uint8_t> &p_data, VoxelBuffer &out_voxel_buffer);
+	// Reads directly from the given memory, which can come from a memory-mapped file
+	bool decompress_and_deserialize(Span<const uint8_t> p_data, VoxelBuffer &out_voxel_buffer);
 	bool decompress_and_deserialize(FileAccess *f, unsigned int size_to_read, VoxelBuffer &out_voxel_buffer);
 
 	int serialize(Ref<StreamPeer> peer, Ref<VoxelBuffer> voxel_buffer, bool compress);
@@ -34,6 +37,7 @@ private:
 	std::vector<uint8_t> _data;
 	std::vector<uint8_t> _compressed_data;
 	std::vector<uint8_t> _metadata_tmp;
+	std::vector<uint8_t> _channel_tmp;
 	FileAccessMemory _file_access_memory;
 };
 
@@ -4,6 +4,7 @@
 #include "../../util/godot/funcs.h"
 #include "../../util/macros.h"
 #include "../../util/profiling.h"
+#include "../../util/profiling_clock.h"
 #include "../voxel_lod_terrain.h"
 
 #include <scene/3d/camera.h>
@@ -249,8 +250,28 @@ void VoxelInstancer::process_mesh_lods() {
 		}
 	}
 
-	for (auto it = _blocks.begin(); it != _blocks.end(); ++it) {
-		Block *block = *it;
+	// Blocks are checked in turns within the main thread budget shared with terrains.
+	// The budget is only looked at every few blocks, which also ensures some progress on busy frames.
+	const unsigned int budget_check_interval = 32;
+	VoxelServer &server = *VoxelServer::get_singleton();
+	const uint64_t time_budget_usec = server.get_main_thread_time_budget_left_usec();
+	ProfilingClock profiling_clock;
+	uint64_t time_spent_usec = 0;
+
+	for (unsigned int checked_count = 0; checked_count < _blocks.size(); ++checked_count) {
+		if (checked_count % budget_check_interval == budget_check_interval - 1) {
+			time_spent_usec += profiling_clock.restart();
+			if (time_spent_usec >= time_budget_usec) {
+				break;
+			}
+		}
+
+		// Blocks can be removed between frames, so the index may have to wrap around early
+		if (_next_mesh_lod_block_index >= _blocks.size()) {
+			_next_mesh_lod_block_index = 0;
+		}
+		Block *block = _blocks[_next_mesh_lod_block_index];
+		++_next_mesh_lod_block_index;
 
 		const VoxelInstanceLibraryItem *item = _library->get_item_const(block->layer_id);
 		const int mesh_lod_count = item->get_mesh_lod_count();
@@ -292,6 +313,8 @@ void VoxelInstancer::process_mesh_lods() {
 			}
 		}
 	}
+
+	server.add_main_thread_time_spent_usec(time_spent_usec + profiling_clock.restart());
 }
 
 void VoxelInstancer::update_visibility() {
@@ -160,6 +160,8 @@ private:
 
 	FixedArray<Lod, MAX_LOD> _lods;
 	std::vector<Block *> _blocks; // Does not have nulls
+	// Where mesh LOD updates resume, when they didn't fit in the main thread budget of the previous frame
+	unsigned int _next_mesh_lod_block_index = 0;
 	HashMap<int, Layer> _layers; // Each layer corresponds to a library item
 	Ref<VoxelInstanceLibrary> _library;
 
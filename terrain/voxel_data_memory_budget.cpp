@@ -0,0 +1,45 @@
+#include "voxel_data_memory_budget.h"
+#include "../server/voxel_server.h"
+
+namespace {
+// Unloaded blocks take effect on memory usage right away, so shrinking can be quick.
+// Growing is slower, otherwise loading blocks would make usage go over budget again and oscillate.
+const uint64_t SHRINK_INTERVAL_MSEC = 100;
+const uint64_t GROW_INTERVAL_MSEC = 2000;
+} // namespace
+
+void VoxelDataMemoryBudget::set_budget_bytes(uint64_t budget) {
+	_budget = budget;
+}
+
+void VoxelDataMemoryBudget::update(
+		uint64_t memory_usage, unsigned int view_distance, unsigned int step, uint64_t time_msec) {
+	const VoxelServer &server = *VoxelServer::get_singleton();
+
+	if ((_budget != 0 && memory_usage > _budget) || server.is_data_memory_over_budget()) {
+		if (!_limiting) {
+			_limiting = true;
+			_distance_limit = MAX(view_distance, step);
+			_last_change_time_msec = 0;
+		}
+		if (time_msec - _last_change_time_msec >= SHRINK_INTERVAL_MSEC && _distance_limit > step) {
+			_distance_limit = MAX(_distance_limit - step, step);
+			_last_change_time_msec = time_msec;
+		}
+
+	} else if (_limiting && time_msec - _last_change_time_msec >= GROW_INTERVAL_MSEC) {
+		if ((_budget == 0 || memory_usage < _budget - _budget / 4) && server.has_data_memory_room()) {
+			_distance_limit += step;
+			_last_change_time_msec = time_msec;
+			if (_distance_limit >= view_distance) {
+				_limiting = false;
+			}
+		}
+	}
+}
+
+void VoxelDataMemoryBudget::reset() {
+	_limiting = false;
+	_distance_limit = 0;
+	_last_change_time_msec = 0;
+}
@@ -0,0 +1,37 @@
+#ifndef VOXEL_DATA_MEMORY_BUDGET_H
+#define VOXEL_DATA_MEMORY_BUDGET_H
+
+#include <cstdint>
+
+// Keeps voxel data of a volume within a memory budget, by limiting its view distance.
+// Blocks in range of a viewer can't just be dropped, they would be loaded again right away.
+// So when the budget is exceeded, the distance shrinks step by step, and blocks farthest from viewers are
+// unloaded first. Modified blocks get saved as usual when they are unloaded.
+// The distance grows back once memory usage went well below the budget.
+class VoxelDataMemoryBudget {
+public:
+	// 0 means no limit. The global budget of VoxelServer applies too.
+	void set_budget_bytes(uint64_t budget);
+	inline uint64_t get_budget_bytes() const { return _budget; }
+
+	// To call once per frame, with the memory currently taken by voxel data of the volume.
+	// `view_distance` is the largest distance viewers ask for, and `step` is by how much to shrink or grow it.
+	// The distance is never reduced below one step.
+	void update(uint64_t memory_usage, unsigned int view_distance, unsigned int step, uint64_t time_msec);
+
+	inline bool is_limiting() const { return _limiting; }
+
+	inline unsigned int clamp_view_distance(unsigned int distance) const {
+		return _limiting && distance > _distance_limit ? _distance_limit : distance;
+	}
+
+	void reset();
+
+private:
+	uint64_t _budget = 0;
+	unsigned int _distance_limit = 0;
+	bool _limiting = false;
+	uint64_t _last_change_time_msec = 0;
+};
+
+#endif // VOXEL_DATA_MEMORY_BUDGET_H
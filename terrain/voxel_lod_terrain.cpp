@@ -117,8 +117,6 @@ struct ScheduleSaveAction {
 		if (block->is_modified()) {
 			//print_line(String("Scheduling save for block {0}").format(varray(block->position.to_vec3())));
 			VoxelLodTerrain::BlockToSave b;
-
-			RWLockRead lock(block->voxels->get_lock());
 			b.voxels = block->voxels->duplicate(true);
 
 			b.position = block->position;
@@ -153,6 +151,8 @@ VoxelLodTerrain::VoxelLodTerrain() {
 	_volume_id = VoxelServer::get_singleton()->add_volume(&_reception_buffers, VoxelServer::VOLUME_SPARSE_OCTREE);
 	VoxelServer::get_singleton()->set_volume_octree_lod_distance(_volume_id, get_lod_distance());
 
+	_time_spread_task_dependency = gd_make_shared<TimeSpreadTaskDependency>();
+
 	// TODO Being able to set a LOD smaller than the stream is probably a bad idea,
 	// Because it prevents edits from propagating up to the last one, they will be left out of sync
 	set_lod_count(4);
@@ -167,6 +167,7 @@ VoxelLodTerrain::VoxelLodTerrain() {
 
 VoxelLodTerrain::~VoxelLodTerrain() {
 	PRINT_VERBOSE("Destroy VoxelLodTerrain");
+	_time_spread_task_dependency->valid = false;
 	VoxelServer::get_singleton()->remove_volume(_volume_id);
 	// Instancer can take care of itself
 }
@@ -417,10 +418,13 @@ void VoxelLodTerrain::set_mesh_block_active(VoxelMeshBlock &block, bool active)
 // The provided box must be at LOD0 coordinates.
 void VoxelLodTerrain::post_edit_area(Box3i p_box) {
 	const Box3i box = p_box.padded(1);
-	const Box3i bbox = box.downscaled(get_data_block_size());
+	const int data_block_size = get_data_block_size();
+	const Box3i bbox = box.downscaled(data_block_size);
 
-	bbox.for_each_cell([this](Vector3i block_pos_lod0) {
-		post_edit_block_lod0(block_pos_lod0);
+	bbox.for_each_cell([this, box, data_block_size](Vector3i block_pos_lod0) {
+		const Vector3i block_origin = block_pos_lod0 * data_block_size;
+		const Box3i box_in_block = box.clipped(Box3i(block_origin, Vector3i(data_block_size)));
+		post_edit_block_lod0(block_pos_lod0, Box3i(box_in_block.pos - block_origin, box_in_block.size));
 	});
 
 	if (_instancer != nullptr) {
@@ -428,17 +432,19 @@ void VoxelLodTerrain::post_edit_area(Box3i p_box) {
 	}
 }
 
-void VoxelLodTerrain::post_edit_block_lod0(Vector3i block_pos_lod0) {
+void VoxelLodTerrain::post_edit_block_lod0(Vector3i block_pos_lod0, Box3i box_in_block) {
 	Lod &lod0 = _lods[0];
 	VoxelDataBlock *block = lod0.data_map.get_block(block_pos_lod0);
 	ERR_FAIL_COND(block == nullptr);
 
 	block->set_modified(true);
+	lod0.data_map.update_block_memory_usage(block);
 
 	if (!block->get_needs_lodding()) {
 		block->set_needs_lodding(true);
 		lod0.blocks_pending_lodding.push_back(block_pos_lod0);
 	}
+	block->add_lodding_area(box_in_block);
 }
 
 Ref<VoxelTool> VoxelLodTerrain::get_voxel_tool() {
@@ -461,6 +467,15 @@ void VoxelLodTerrain::set_view_distance(int p_distance_in_voxels) {
 	_view_distance_voxels = p_distance_in_voxels;
 }
 
+void VoxelLodTerrain::set_data_memory_budget(int64_t budget_bytes) {
+	ERR_FAIL_COND(budget_bytes < 0);
+	_data_memory_budget.set_budget_bytes(budget_bytes);
+}
+
+int64_t VoxelLodTerrain::get_data_memory_budget() const {
+	return _data_memory_budget.get_budget_bytes();
+}
+
 void VoxelLodTerrain::start_updater() {
 	Ref<VoxelMesherBlocky> blocky_mesher = _mesher;
 	if (blocky_mesher.is_valid()) {
@@ -487,6 +502,7 @@ void VoxelLodTerrain::stop_updater() {
 	VoxelServer::get_singleton()->set_volume_mesher(_volume_id, Ref<VoxelMesher>());
 
 	_reception_buffers.mesh_output.clear();
+	invalidate_time_spread_tasks();
 
 	for (unsigned int i = 0; i < _lods.size(); ++i) {
 		Lod &lod = _lods[i];
@@ -494,6 +510,14 @@ void VoxelLodTerrain::stop_updater() {
 
 		ResetMeshStateAction a;
 		lod.mesh_map.for_all_blocks(a);
+
+		// Collision updates that were submitted got dropped too, gather them again
+		lod.deferred_collision_updates.clear();
+		lod.mesh_map.for_all_blocks([&lod](VoxelMeshBlock *block) {
+			if (block->has_deferred_collider_update) {
+				lod.deferred_collision_updates.push_back(block->position);
+			}
+		});
 	}
 }
 
@@ -591,6 +615,8 @@ void VoxelLodTerrain::reset_maps() {
 	// Reset previous state caches to force rebuilding the view area
 	_last_octree_region_box = Box3i();
 	_lod_octrees.clear();
+
+	_data_memory_budget.reset();
 }
 
 int VoxelLodTerrain::get_lod_count() const {
@@ -695,6 +721,12 @@ void VoxelLodTerrain::_notification(int p_what) {
 
 		case NOTIFICATION_ENTER_WORLD: {
 			World *world = *get_world();
+			if (!Engine::get_singleton()->is_editor_hint()) {
+				// Only pair with viewers of the same world.
+				// The editor viewer isn't a node, so everything stays in the default world in the editor.
+				VoxelServer &server = *VoxelServer::get_singleton();
+				server.set_volume_world(_volume_id, server.get_world_for_godot_world(world->get_instance_id()));
+			}
 			for (unsigned int lod_index = 0; lod_index < _lods.size(); ++lod_index) {
 				_lods[lod_index].mesh_map.for_all_blocks([world](VoxelMeshBlock *block) {
 					block->set_world(world);
@@ -710,6 +742,7 @@ void VoxelLodTerrain::_notification(int p_what) {
 		} break;
 
 		case NOTIFICATION_EXIT_WORLD: {
+			VoxelServer::get_singleton()->set_volume_world(_volume_id, VoxelServer::get_singleton()->get_default_world());
 			for (unsigned int lod_index = 0; lod_index < _lods.size(); ++lod_index) {
 				_lods[lod_index].mesh_map.for_all_blocks([](VoxelMeshBlock *block) {
 					block->set_world(nullptr);
@@ -763,9 +796,11 @@ Vector3 VoxelLodTerrain::get_local_viewer_pos() const {
 	Vector3 pos = (_lods[0].last_viewer_data_block_pos << _lods[0].data_map.get_block_size_pow2()).to_vec3();
 
 	// TODO Support for multiple viewers, this is a placeholder implementation
-	VoxelServer::get_singleton()->for_each_viewer([&pos](const VoxelServer::Viewer &viewer, uint32_t viewer_id) {
-		pos = viewer.world_position;
-	});
+	VoxelServer &server = *VoxelServer::get_singleton();
+	server.for_each_viewer(server.get_volume_world(_volume_id),
+			[&pos](const VoxelServer::Viewer &viewer, uint32_t viewer_id) {
+				pos = viewer.world_position;
+			});
 
 	const Transform world_to_local = get_global_transform().affine_inverse();
 	pos = world_to_local.xform(pos);
@@ -919,18 +954,17 @@ bool VoxelLodTerrain::check_block_mesh_updated(VoxelMeshBlock *block) {
 				}
 			});
 
-			// Check if neighbors are loaded
+			// Check if neighbors are loaded.
+			// Neighbors still loading are enough: VoxelServer makes the meshing task wait for them,
+			// so it can start as soon as they are ready instead of waiting for them to come back to us first.
 			bool surrounded = true;
 			for (unsigned int i = 0; i < neighbor_positions_count; ++i) {
 				const Vector3i npos = neighbor_positions[i];
-				if (!lod.data_map.has_block(npos)) {
-					// That neighbor is not loaded
+				if (!lod.data_map.has_block(npos) && !lod.loading_blocks.has(npos)) {
+					// Schedule loading for that neighbor
 					surrounded = false;
-					if (!lod.loading_blocks.has(npos)) {
-						// Schedule loading for that neighbor
-						lod.blocks_to_load.push_back(npos);
-						lod.loading_blocks.insert(npos);
-					}
+					lod.blocks_to_load.push_back(npos);
+					lod.loading_blocks.insert(npos);
 				}
 			}
 
@@ -1004,6 +1038,16 @@ void VoxelLodTerrain::_process(float delta) {
 	// It has to happen first because blocks can be unloaded afterwards.
 	flush_pending_lod_edits();
 
+	const unsigned int octree_size_po2 = get_mesh_block_size_pow2() + get_lod_count() - 1;
+
+	// Shorten view distance while voxel data takes too much memory.
+	// Only the extent of the octree grid depends on it, so the farthest octrees get unloaded first.
+	{
+		const uint64_t memory_usage = get_data_memory_usage();
+		VoxelServer::get_singleton()->set_volume_data_memory_usage(_volume_id, memory_usage);
+		_data_memory_budget.update(memory_usage, _view_distance_voxels, 1 << octree_size_po2, get_ticks_msec());
+	}
+
 	ProfilingClock profiling_clock;
 
 	// Unload data blocks falling out of block region extent
@@ -1153,9 +1197,9 @@ void VoxelLodTerrain::_process(float delta) {
 		VOXEL_PROFILE_SCOPE();
 		// TODO Investigate if multi-octree can produce cracks in the terrain (so far I haven't noticed)
 
-		const unsigned int octree_size_po2 = get_mesh_block_size_pow2() + get_lod_count() - 1;
 		const unsigned int octree_size = 1 << octree_size_po2;
-		const unsigned int octree_region_extent = 1 + _view_distance_voxels / (1 << octree_size_po2);
+		const unsigned int view_distance_voxels = _data_memory_budget.clamp_view_distance(_view_distance_voxels);
+		const unsigned int octree_region_extent = 1 + view_distance_voxels / octree_size;
 
 		const Vector3i viewer_octree_pos = (Vector3i(viewer_pos) + Vector3i(octree_size / 2)) >> octree_size_po2;
 
@@ -1487,6 +1531,7 @@ void VoxelLodTerrain::_process(float delta) {
 		VOXEL_PROFILE_SCOPE();
 
 		const int render_to_data_factor = get_mesh_block_size() / get_data_block_size();
+		const Box3i data_bounds = _bounds_in_voxels.downscaled(get_data_block_size());
 
 		for (unsigned int lod_index = 0; lod_index < _lod_count; ++lod_index) {
 			VOXEL_PROFILE_SCOPE();
@@ -1512,15 +1557,26 @@ void VoxelLodTerrain::_process(float delta) {
 				// Iteration order matters for thread access.
 				// The array also implicitely encodes block position due to the convention being used,
 				// so there is no need to also include positions in the request
-				data_box.for_each_cell_zxy([&mesh_request, &lod](Vector3i data_block_pos) {
-					VoxelDataBlock *nblock = lod.data_map.get_block(data_block_pos);
-					// The block can actually be null on some occasions. Not sure yet if it's that bad
-					//CRASH_COND(nblock == nullptr);
-					if (nblock != nullptr) {
-						mesh_request.data_blocks[mesh_request.data_blocks_count] = nblock->voxels;
-					}
-					++mesh_request.data_blocks_count;
-				});
+				bool missing_neighbor = false;
+				data_box.for_each_cell_zxy(
+						[&mesh_request, &lod, &data_bounds, &missing_neighbor](Vector3i data_block_pos) {
+							VoxelDataBlock *nblock = lod.data_map.get_block(data_block_pos);
+							// The block can be null if it is still loading, in which case VoxelServer will wait for it
+							if (nblock != nullptr) {
+								mesh_request.data_blocks[mesh_request.data_blocks_count] = nblock->voxels;
+							} else if (data_bounds.contains(data_block_pos) &&
+									!lod.loading_blocks.has(data_block_pos)) {
+								missing_neighbor = true;
+							}
+							++mesh_request.data_blocks_count;
+						});
+
+				if (missing_neighbor) {
+					// A neighbor got dropped while loading since the update was scheduled.
+					// The mesh would have holes on that side, so it will be scheduled again once it's needed.
+					block->set_mesh_state(VoxelMeshBlock::MESH_NEED_UPDATE);
+					continue;
+				}
 
 				VoxelServer::get_singleton()->request_block_mesh(_volume_id, mesh_request);
 
@@ -1533,165 +1589,177 @@ void VoxelLodTerrain::_process(float delta) {
 
 	_stats.time_request_blocks_to_update = profiling_clock.restart();
 
-	const uint32_t main_thread_task_timeout = get_ticks_msec() + VoxelConstants::MAIN_THREAD_MESHING_BUDGET_MS;
-
 	// Receive mesh updates:
 	// This contains work that should normally be threaded, but isn't because of Godot limitations.
-	// So after a timeout, it stops processing and will resume next frame.
+	// So it is submitted to VoxelServer, which spreads it over several frames along with other volumes.
 	{
 		VOXEL_PROFILE_SCOPE_NAMED("Receive mesh updates");
 
-		const Transform global_transform = get_global_transform();
+		VoxelServer &server = *VoxelServer::get_singleton();
 
-		// The following is done on the main thread because Godot doesn't really support multithreaded Mesh allocation.
-		// This also proved to be very slow compared to the meshing process itself...
-		// hopefully Vulkan will allow us to upload graphical resources without stalling rendering as they upload?
+		for (size_t i = 0; i < _reception_buffers.mesh_output.size(); ++i) {
+			ApplyMeshUpdateTask *task = memnew(ApplyMeshUpdateTask);
+			task->dependency = _time_spread_task_dependency;
+			task->terrain = this;
+			task->data = std::move(_reception_buffers.mesh_output[i]);
+			server.push_time_spread_task(task, VoxelTimeSpreadTaskRunner::PRIORITY_HIGH);
+			++_stats.remaining_main_thread_blocks;
+		}
 
-		size_t queue_index = 0;
-		for (; queue_index < _reception_buffers.mesh_output.size() && get_ticks_msec() < main_thread_task_timeout;
-				++queue_index) {
-			VOXEL_PROFILE_SCOPE();
-			const VoxelServer::BlockMeshOutput &ob = _reception_buffers.mesh_output[queue_index];
+		_reception_buffers.mesh_output.clear();
+	}
 
-			if (ob.lod >= _lod_count) {
-				// Sorry, LOD configuration changed, drop that mesh
-				++_stats.dropped_block_meshs;
-				continue;
-			}
+	_stats.time_process_update_responses = profiling_clock.restart();
 
-			Lod &lod = _lods[ob.lod];
+	// Work done above, like storing received blocks and requesting saves, can't be spread over frames.
+	// It is still part of the main thread budget shared with other volumes.
+	VoxelServer::get_singleton()->add_main_thread_time_spent_usec(_stats.time_detect_required_blocks +
+			_stats.time_request_blocks_to_load + _stats.time_process_load_responses +
+			_stats.time_request_blocks_to_update + _stats.time_process_update_responses);
 
-			VoxelMeshBlock *block = lod.mesh_map.get_block(ob.position);
-			if (block == nullptr) {
-				// That block is no longer loaded, drop the result
-				++_stats.dropped_block_meshs;
-				continue;
-			}
+	process_deferred_collision_updates();
 
-			if (ob.type == VoxelServer::BlockMeshOutput::TYPE_DROPPED) {
-				// That block is loaded, but its meshing request was dropped.
-				// TODO Not sure what to do in this case, the code sending update queries has to be tweaked
-				PRINT_VERBOSE("Received a block mesh drop while we were still expecting it");
-				++_stats.dropped_block_meshs;
-				continue;
-			}
+#ifdef TOOLS_ENABLED
+	if (is_showing_gizmos() && is_visible_in_tree()) {
+		update_gizmos();
+	}
+#endif
+}
 
-			if (block->get_mesh_state() == VoxelMeshBlock::MESH_UPDATE_SENT) {
-				block->set_mesh_state(VoxelMeshBlock::MESH_UP_TO_DATE);
-			}
+void VoxelLodTerrain::apply_mesh_update(const VoxelServer::BlockMeshOutput &ob) {
+	VOXEL_PROFILE_SCOPE();
 
-			const VoxelMesher::Output mesh_data = ob.surfaces;
+	// The following is done on the main thread because Godot doesn't really support multithreaded Mesh allocation.
+	// This also proved to be very slow compared to the meshing process itself...
+	// hopefully Vulkan will allow us to upload graphical resources without stalling rendering as they upload?
 
-			Ref<ArrayMesh> mesh = build_mesh(
-					mesh_data.surfaces,
-					mesh_data.primitive_type,
-					mesh_data.compression_flags,
-					_material);
+	if (ob.lod >= _lod_count) {
+		// Sorry, LOD configuration changed, drop that mesh
+		++_stats.dropped_block_meshs;
+		return;
+	}
 
-			bool has_collision = _generate_collisions;
-			if (has_collision && _collision_lod_count != 0) {
-				has_collision = ob.lod < _collision_lod_count;
-			}
+	Lod &lod = _lods[ob.lod];
 
-			if (block->got_first_mesh_update == false) {
-				block->got_first_mesh_update = true;
+	VoxelMeshBlock *block = lod.mesh_map.get_block(ob.position);
+	if (block == nullptr) {
+		// That block is no longer loaded, drop the result
+		++_stats.dropped_block_meshs;
+		return;
+	}
 
-				// TODO Need a more generic API for this kind of stuff
-				if (_instancer != nullptr && ob.surfaces.surfaces.size() > 0) {
-					// TODO The mesh could come from an edited region!
-					// We would have to know if specific voxels got edited, or different from the generator
-					_instancer->on_mesh_block_enter(ob.position, ob.lod, ob.surfaces.surfaces[0]);
-				}
+	if (ob.type == VoxelServer::BlockMeshOutput::TYPE_DROPPED) {
+		// That block is loaded, but its meshing request was dropped.
+		// This can happen if it was waiting for a neighbor which then got dropped.
+		PRINT_VERBOSE("Received a block mesh drop while we were still expecting it");
+		++_stats.dropped_block_meshs;
+		if (block->get_mesh_state() == VoxelMeshBlock::MESH_UPDATE_SENT) {
+			// Try again when the block is needed
+			block->set_mesh_state(VoxelMeshBlock::MESH_NEED_UPDATE);
+		}
+		return;
+	}
 
-				// Lazy initialization
-
-				//print_line(String("Adding block {0} at lod {1}").format(varray(eo.block_position.to_vec3(), eo.lod)));
-				//set_mesh_block_active(*block, false);
-				block->set_parent_visible(is_visible());
-				block->set_world(get_world());
-
-				Ref<ShaderMaterial> shader_material = _material;
-				if (shader_material.is_valid() && block->get_shader_material().is_null()) {
-					VOXEL_PROFILE_SCOPE();
-
-					// Pooling shader materials is necessary for now, to avoid stuttering in the editor.
-					// Due to a signal used to keep the inspector up to date, even though these
-					// material copies will never be seen in the inspector
-					// See https://github.com/godotengine/godot/issues/34741
-					Ref<ShaderMaterial> sm;
-					if (_shader_material_pool.size() > 0) {
-						sm = _shader_material_pool.back();
-						// The joys of pooling materials
-						sm->set_shader_param(VoxelStringNames::get_singleton()->u_transition_mask, 0);
-						_shader_material_pool.pop_back();
-					} else {
-						sm = shader_material->duplicate(false);
-					}
+	if (block->get_mesh_state() == VoxelMeshBlock::MESH_UPDATE_SENT) {
+		block->set_mesh_state(VoxelMeshBlock::MESH_UP_TO_DATE);
+	}
 
-					// Set individual shader material, because each block can have dynamic parameters,
-					// used to smooth seams without re-uploading meshes and allow to implement LOD fading
-					block->set_shader_material(sm);
-				}
-			}
+	const VoxelMesher::Output mesh_data = ob.surfaces;
 
-			block->set_mesh(mesh);
-			{
-				VOXEL_PROFILE_SCOPE();
-				for (unsigned int dir = 0; dir < mesh_data.transition_surfaces.size(); ++dir) {
-					Ref<ArrayMesh> transition_mesh = build_mesh(
-							mesh_data.transition_surfaces[dir],
-							mesh_data.primitive_type,
-							mesh_data.compression_flags,
-							_material);
-
-					block->set_transition_mesh(transition_mesh, dir);
-				}
-			}
+	Ref<ArrayMesh> mesh = build_mesh(
+			mesh_data.surfaces,
+			mesh_data.primitive_type,
+			mesh_data.compression_flags,
+			_material);
 
-			const uint32_t now = get_ticks_msec();
-			if (has_collision) {
-				if (_collision_update_delay == 0 ||
-						static_cast<int>(now - block->last_collider_update_time) > _collision_update_delay) {
-					block->set_collision_mesh(mesh_data.surfaces, get_tree()->is_debugging_collisions_hint(), this);
-					block->set_collision_layer(_collision_layer);
-					block->set_collision_mask(_collision_mask);
-					block->last_collider_update_time = now;
-					block->has_deferred_collider_update = false;
-					block->deferred_collider_data.clear();
-				} else {
-					if (!block->has_deferred_collider_update) {
-						lod.deferred_collision_updates.push_back(ob.position);
-						block->has_deferred_collider_update = true;
-					}
-					block->deferred_collider_data = mesh_data.surfaces;
-				}
-			}
+	bool has_collision = _generate_collisions;
+	if (has_collision && _collision_lod_count != 0) {
+		has_collision = ob.lod < _collision_lod_count;
+	}
+
+	if (block->got_first_mesh_update == false) {
+		block->got_first_mesh_update = true;
 
-			block->set_parent_transform(global_transform);
+		// TODO Need a more generic API for this kind of stuff
+		if (_instancer != nullptr && ob.surfaces.surfaces.size() > 0) {
+			// TODO The mesh could come from an edited region!
+			// We would have to know if specific voxels got edited, or different from the generator
+			_instancer->on_mesh_block_enter(ob.position, ob.lod, ob.surfaces.surfaces[0]);
 		}
 
-		{
+		// Lazy initialization
+
+		//print_line(String("Adding block {0} at lod {1}").format(varray(eo.block_position.to_vec3(), eo.lod)));
+		//set_mesh_block_active(*block, false);
+		block->set_parent_visible(is_visible());
+		block->set_world(get_world());
+
+		Ref<ShaderMaterial> shader_material = _material;
+		if (shader_material.is_valid() && block->get_shader_material().is_null()) {
 			VOXEL_PROFILE_SCOPE();
-			shift_up(_reception_buffers.mesh_output, queue_index);
-		}
 
-		_stats.remaining_main_thread_blocks = (int)_reception_buffers.mesh_output.size();
+			// Pooling shader materials is necessary for now, to avoid stuttering in the editor.
+			// Due to a signal used to keep the inspector up to date, even though these
+			// material copies will never be seen in the inspector
+			// See https://github.com/godotengine/godot/issues/34741
+			Ref<ShaderMaterial> sm;
+			if (_shader_material_pool.size() > 0) {
+				sm = _shader_material_pool.back();
+				// The joys of pooling materials
+				sm->set_shader_param(VoxelStringNames::get_singleton()->u_transition_mask, 0);
+				_shader_material_pool.pop_back();
+			} else {
+				sm = shader_material->duplicate(false);
+			}
+
+			// Set individual shader material, because each block can have dynamic parameters,
+			// used to smooth seams without re-uploading meshes and allow to implement LOD fading
+			block->set_shader_material(sm);
+		}
 	}
 
-	_stats.time_process_update_responses = profiling_clock.restart();
+	block->set_mesh(mesh);
+	{
+		VOXEL_PROFILE_SCOPE();
+		for (unsigned int dir = 0; dir < mesh_data.transition_surfaces.size(); ++dir) {
+			Ref<ArrayMesh> transition_mesh = build_mesh(
+					mesh_data.transition_surfaces[dir],
+					mesh_data.primitive_type,
+					mesh_data.compression_flags,
+					_material);
 
-	process_deferred_collision_updates(main_thread_task_timeout);
+			block->set_transition_mesh(transition_mesh, dir);
+		}
+	}
 
-#ifdef TOOLS_ENABLED
-	if (is_showing_gizmos() && is_visible_in_tree()) {
-		update_gizmos();
+	const uint32_t now = get_ticks_msec();
+	if (has_collision) {
+		if (_collision_update_delay == 0 ||
+				static_cast<int>(now - block->last_collider_update_time) > _collision_update_delay) {
+			block->set_collision_mesh(mesh_data.surfaces, get_tree()->is_debugging_collisions_hint(), this);
+			block->set_collision_layer(_collision_layer);
+			block->set_collision_mask(_collision_mask);
+			block->last_collider_update_time = now;
+			block->has_deferred_collider_update = false;
+			block->deferred_collider_data.clear();
+		} else {
+			if (!block->has_deferred_collider_update) {
+				lod.deferred_collision_updates.push_back(ob.position);
+				block->has_deferred_collider_update = true;
+			}
+			block->deferred_collider_data = mesh_data.surfaces;
+		}
 	}
-#endif
+
+	block->set_parent_transform(get_global_transform());
 }
 
-void VoxelLodTerrain::process_deferred_collision_updates(uint32_t timeout_msec) {
+void VoxelLodTerrain::process_deferred_collision_updates() {
 	VOXEL_PROFILE_SCOPE();
 
+	VoxelServer &server = *VoxelServer::get_singleton();
+	const uint32_t now = get_ticks_msec();
+
 	for (unsigned int lod_index = 0; lod_index < _lod_count; ++lod_index) {
 		Lod &lod = _lods[lod_index];
 
@@ -1706,27 +1774,79 @@ void VoxelLodTerrain::process_deferred_collision_updates(uint32_t timeout_msec)
 				continue;
 			}
 
-			const uint32_t now = get_ticks_msec();
-
 			if (static_cast<int>(now - block->last_collider_update_time) > _collision_update_delay) {
-				block->set_collision_mesh(
-						block->deferred_collider_data, get_tree()->is_debugging_collisions_hint(), this);
-				block->set_collision_layer(_collision_layer);
-				block->set_collision_mask(_collision_mask);
-				block->last_collider_update_time = now;
-				block->has_deferred_collider_update = false;
-				block->deferred_collider_data.clear();
+				// Colliders are less urgent than visuals, they can lag behind a bit more
+				ApplyCollisionUpdateTask *task = memnew(ApplyCollisionUpdateTask);
+				task->dependency = _time_spread_task_dependency;
+				task->terrain = this;
+				task->block_position = block_pos;
+				task->lod_index = lod_index;
+				server.push_time_spread_task(task, VoxelTimeSpreadTaskRunner::PRIORITY_LOW);
+				++_stats.remaining_main_thread_blocks;
 
 				unordered_remove(lod.deferred_collision_updates, i);
 				--i;
 			}
+		}
+	}
+}
 
-			// We always process at least one, then we to check the timeout
-			if (get_ticks_msec() >= timeout_msec) {
-				return;
-			}
+void VoxelLodTerrain::apply_deferred_collision_update(Vector3i block_pos, unsigned int lod_index) {
+	VOXEL_PROFILE_SCOPE();
+
+	if (lod_index >= _lod_count) {
+		return;
+	}
+	Lod &lod = _lods[lod_index];
+
+	VoxelMeshBlock *block = lod.mesh_map.get_block(block_pos);
+	if (block == nullptr || block->has_deferred_collider_update == false) {
+		// Block was unloaded, or got a more recent collider in the meantime
+		return;
+	}
+
+	block->set_collision_mesh(block->deferred_collider_data, get_tree()->is_debugging_collisions_hint(), this);
+	block->set_collision_layer(_collision_layer);
+	block->set_collision_mask(_collision_mask);
+	block->last_collider_update_time = get_ticks_msec();
+	block->has_deferred_collider_update = false;
+	block->deferred_collider_data.clear();
+}
+
+void VoxelLodTerrain::ApplyMeshUpdateTask::run() {
+	if (!dependency->valid) {
+		// The terrain was destroyed or reset its meshing
+		return;
+	}
+	--terrain->_stats.remaining_main_thread_blocks;
+	if (!terrain->is_inside_tree()) {
+		// Can't build meshes and colliders without a world, put it back until the terrain gets processed again
+		terrain->_reception_buffers.mesh_output.push_back(std::move(data));
+		return;
+	}
+	terrain->apply_mesh_update(data);
+}
+
+void VoxelLodTerrain::ApplyCollisionUpdateTask::run() {
+	if (!dependency->valid) {
+		return;
+	}
+	--terrain->_stats.remaining_main_thread_blocks;
+	if (!terrain->is_inside_tree()) {
+		// Picked up again by `process_deferred_collision_updates`
+		if (lod_index < terrain->_lod_count) {
+			terrain->_lods[lod_index].deferred_collision_updates.push_back(block_position);
 		}
+		return;
 	}
+	terrain->apply_deferred_collision_update(block_position, lod_index);
+}
+
+void VoxelLodTerrain::invalidate_time_spread_tasks() {
+	// Tasks already submitted will see this and do nothing
+	_time_spread_task_dependency->valid = false;
+	_time_spread_task_dependency = gd_make_shared<TimeSpreadTaskDependency>();
+	_stats.remaining_main_thread_blocks = 0;
 }
 
 void VoxelLodTerrain::process_fading_blocks(float delta) {
@@ -1826,21 +1946,29 @@ void VoxelLodTerrain::flush_pending_lod_edits() {
 
 			dst_block->set_modified(true);
 
-			if (dst_lod_index != _lod_count - 1 && !dst_block->get_needs_lodding()) {
-				dst_block->set_needs_lodding(true);
-				dst_lod.blocks_pending_lodding.push_back(dst_bpos);
+			const Vector3i rel = src_bpos - (dst_bpos << 1);
+
+			// Only the edited area of the source block is downscaled, in groups of 2x2x2 voxels
+			Box3i src_area = src_block->take_lodding_area();
+			if (src_area.is_empty()) {
+				src_area = Box3i(Vector3i(), src_block->voxels->get_size());
 			}
+			const Box3i dst_area_in_src = src_area.downscaled(2);
+			const Box3i dst_area(rel * half_bs + dst_area_in_src.pos, dst_area_in_src.size);
 
-			const Vector3i rel = src_bpos - (dst_bpos << 1);
+			if (dst_lod_index != _lod_count - 1) {
+				if (!dst_block->get_needs_lodding()) {
+					dst_block->set_needs_lodding(true);
+					dst_lod.blocks_pending_lodding.push_back(dst_bpos);
+				}
+				dst_block->add_lodding_area(dst_area);
+			}
 
 			// Update lower LOD
 			// This must always be done after an edit before it gets saved, otherwise LODs won't match and it will look ugly.
-			// TODO Try to narrow to edited region instead of taking whole block
-			{
-				RWLockWrite lock(src_block->voxels->get_lock());
-				src_block->voxels->downscale_to(
-						**dst_block->voxels, Vector3i(), src_block->voxels->get_size(), rel * half_bs);
-			}
+			src_block->voxels->downscale_to(**dst_block->voxels, dst_area_in_src.pos << 1,
+					(dst_area_in_src.pos + dst_area_in_src.size) << 1, dst_area.pos);
+			dst_lod.data_map.update_block_memory_usage(dst_block);
 		}
 
 		src_lod.blocks_pending_lodding.clear();
@@ -1852,6 +1980,14 @@ void VoxelLodTerrain::flush_pending_lod_edits() {
 	//	}
 }
 
+uint64_t VoxelLodTerrain::get_data_memory_usage() const {
+	uint64_t usage = 0;
+	for (unsigned int lod_index = 0; lod_index < _lod_count; ++lod_index) {
+		usage += _lods[lod_index].data_map.get_memory_usage();
+	}
+	return usage;
+}
+
 void VoxelLodTerrain::set_instancer(VoxelInstancer *instancer) {
 	if (_instancer != nullptr && instancer != nullptr) {
 		ERR_FAIL_COND_MSG(_instancer != nullptr, "No more than one VoxelInstancer per terrain");
@@ -2085,6 +2221,9 @@ Dictionary VoxelLodTerrain::_b_get_statistics() const {
 	d["updated_blocks"] = _stats.updated_blocks;
 	d["blocked_lods"] = _stats.blocked_lods;
 
+	d["data_memory_usage"] = SIZE_T_TO_VARIANT(get_data_memory_usage());
+	d["view_distance_limited_by_memory"] = _data_memory_budget.is_limiting();
+
 	return d;
 }
 
@@ -2473,6 +2612,10 @@ void VoxelLodTerrain::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("set_view_distance", "distance_in_voxels"), &VoxelLodTerrain::set_view_distance);
 	ClassDB::bind_method(D_METHOD("get_view_distance"), &VoxelLodTerrain::get_view_distance);
 
+	ClassDB::bind_method(D_METHOD("set_data_memory_budget", "budget_bytes"),
+			&VoxelLodTerrain::set_data_memory_budget);
+	ClassDB::bind_method(D_METHOD("get_data_memory_budget"), &VoxelLodTerrain::get_data_memory_budget);
+
 	ClassDB::bind_method(D_METHOD("get_generate_collisions"), &VoxelLodTerrain::get_generate_collisions);
 	ClassDB::bind_method(D_METHOD("set_generate_collisions", "enabled"), &VoxelLodTerrain::set_generate_collisions);
 
@@ -2576,4 +2719,5 @@ void VoxelLodTerrain::_bind_methods() {
 	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "run_stream_in_editor"),
 			"set_run_stream_in_editor", "is_stream_running_in_editor");
 	ADD_PROPERTY(PropertyInfo(Variant::INT, "mesh_block_size"), "set_mesh_block_size", "get_mesh_block_size");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "data_memory_budget"), "set_data_memory_budget", "get_data_memory_budget");
 }
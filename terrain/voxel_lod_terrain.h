@@ -4,6 +4,7 @@
 #include "../server/voxel_server.h"
 #include "../storage/voxel_data_map.h"
 #include "lod_octree.h"
+#include "voxel_data_memory_budget.h"
 #include "voxel_mesh_map.h"
 #include "voxel_node.h"
 
@@ -43,6 +44,10 @@ public:
 	int get_view_distance() const;
 	void set_view_distance(int p_distance_in_voxels);
 
+	// When voxel data of all LODs takes more memory than this, view distance gets shortened. 0 means no limit.
+	void set_data_memory_budget(int64_t budget_bytes);
+	int64_t get_data_memory_budget() const;
+
 	void set_lod_distance(float p_lod_distance);
 	float get_lod_distance() const;
 
@@ -78,7 +83,8 @@ public:
 
 	// These must be called after an edit
 	void post_edit_area(Box3i p_box);
-	void post_edit_block_lod0(Vector3i bpos);
+	// `box_in_block` is the edited area, in voxels relative to the block
+	void post_edit_block_lod0(Vector3i bpos, Box3i box_in_block);
 
 	void set_voxel_bounds(Box3i p_box);
 	inline Box3i get_voxel_bounds() const { return _bounds_in_voxels; }
@@ -191,11 +197,16 @@ private:
 	void _on_stream_params_changed();
 
 	void flush_pending_lod_edits();
+	uint64_t get_data_memory_usage() const;
 	void save_all_modified_blocks(bool with_copy);
 	void send_block_data_requests();
-	void process_deferred_collision_updates(uint32_t timeout_msec);
+	void process_deferred_collision_updates();
 	void process_fading_blocks(float delta);
 
+	void apply_mesh_update(const VoxelServer::BlockMeshOutput &ob);
+	void apply_deferred_collision_update(Vector3i block_pos, unsigned int lod_index);
+	void invalidate_time_spread_tasks();
+
 	void add_transition_update(VoxelMeshBlock *block);
 	void add_transition_updates_around(Vector3i block_pos, int lod_index);
 	void process_transition_updates();
@@ -240,6 +251,32 @@ private:
 
 	VoxelServer::ReceptionBuffers _reception_buffers;
 	uint32_t _volume_id = 0;
+
+	// Main thread work submitted to VoxelServer references this, so it can be dropped
+	// if the terrain gets destroyed or resets its meshing before the work runs
+	struct TimeSpreadTaskDependency {
+		bool valid = true;
+	};
+	std::shared_ptr<TimeSpreadTaskDependency> _time_spread_task_dependency;
+
+	class ApplyMeshUpdateTask : public IVoxelTimeSpreadTask {
+	public:
+		void run() override;
+
+		std::shared_ptr<TimeSpreadTaskDependency> dependency;
+		VoxelLodTerrain *terrain = nullptr;
+		VoxelServer::BlockMeshOutput data;
+	};
+
+	class ApplyCollisionUpdateTask : public IVoxelTimeSpreadTask {
+	public:
+		void run() override;
+
+		std::shared_ptr<TimeSpreadTaskDependency> dependency;
+		VoxelLodTerrain *terrain = nullptr;
+		Vector3i block_position;
+		unsigned int lod_index = 0;
+	};
 	ProcessMode _process_mode = PROCESS_MODE_IDLE;
 
 	// Only populated and then cleared inside _process, so lifetime of pointers should be valid
@@ -283,6 +320,7 @@ private:
 	float _lod_distance = 0.f;
 	float _lod_fade_duration = 0.f;
 	unsigned int _view_distance_voxels = 512;
+	VoxelDataMemoryBudget _data_memory_budget;
 
 	bool _run_stream_in_editor = true;
 #ifdef TOOLS_ENABLED
@@ -1,6 +1,7 @@
 #ifndef VOXEL_MESH_MAP_H
 #define VOXEL_MESH_MAP_H
 
+#include "../util/vector3i_flat_map.h"
 #include "voxel_mesh_block.h"
 #include <vector>
 
@@ -100,9 +101,9 @@ private:
 	void set_block_size_pow2(unsigned int p);
 
 private:
-	// Blocks stored with a spatial hash in all 3D directions.
-	// RELATIONSHIP = 2 because it delivers better performance with this kind of key and hash (less collisions).
-	HashMap<Vector3i, unsigned int, Vector3iHasher, HashMapComparatorDefault<Vector3i>, 3, 2> _blocks_map;
+	// Indices of blocks in `_blocks`, by position.
+	// Flat storage, because neighbor lookups are frequent and would otherwise miss CPU caches.
+	Vector3iFlatMap<unsigned int> _blocks_map;
 	// Blocks are stored in a vector to allow faster iteration over all of them
 	std::vector<VoxelMeshBlock *> _blocks;
 
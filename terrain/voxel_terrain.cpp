@@ -11,6 +11,7 @@
 
 #include <core/core_string_names.h>
 #include <core/engine.h>
+#include <core/os/os.h>
 #include <scene/3d/mesh_instance.h>
 
 VoxelTerrain::VoxelTerrain() {
@@ -26,6 +27,8 @@ VoxelTerrain::VoxelTerrain() {
 
 	_volume_id = VoxelServer::get_singleton()->add_volume(&_reception_buffers, VoxelServer::VOLUME_SPARSE_GRID);
 
+	_time_spread_task_dependency = gd_make_shared<TimeSpreadTaskDependency>();
+
 	// For ease of use in editor
 	Ref<VoxelMesherBlocky> default_mesher;
 	default_mesher.instance();
@@ -34,6 +37,7 @@ VoxelTerrain::VoxelTerrain() {
 
 VoxelTerrain::~VoxelTerrain() {
 	PRINT_VERBOSE("Destroying VoxelTerrain");
+	_time_spread_task_dependency->valid = false;
 	VoxelServer::get_singleton()->remove_volume(_volume_id);
 }
 
@@ -284,6 +288,15 @@ void VoxelTerrain::set_max_view_distance(unsigned int distance_in_voxels) {
 	_max_view_distance_voxels = distance_in_voxels;
 }
 
+void VoxelTerrain::set_data_memory_budget(int64_t budget_bytes) {
+	ERR_FAIL_COND(budget_bytes < 0);
+	_data_memory_budget.set_budget_bytes(budget_bytes);
+}
+
+int64_t VoxelTerrain::get_data_memory_budget() const {
+	return _data_memory_budget.get_budget_bytes();
+}
+
 void VoxelTerrain::set_material(unsigned int id, Ref<Material> material) {
 	// TODO Update existing block surfaces
 	ERR_FAIL_COND(id < 0 || id >= VoxelMesherBlocky::MAX_MATERIALS);
@@ -467,7 +480,6 @@ struct ScheduleSaveAction {
 			//print_line(String("Scheduling save for block {0}").format(varray(block->position.to_vec3())));
 			VoxelTerrain::BlockToSave b;
 			if (with_copy) {
-				RWLockRead lock(block->voxels->get_lock());
 				b.voxels = block->voxels->duplicate(true);
 			} else {
 				b.voxels = block->voxels;
@@ -518,12 +530,14 @@ Dictionary VoxelTerrain::_b_get_statistics() const {
 	d["time_request_blocks_to_update"] = _stats.time_request_blocks_to_update;
 	d["time_process_update_responses"] = _stats.time_process_update_responses;
 
-	d["remaining_main_thread_blocks"] = (int)_reception_buffers.mesh_output.size();
 	d["dropped_block_loads"] = _stats.dropped_block_loads;
 	d["dropped_block_meshs"] = _stats.dropped_block_meshs;
 	d["updated_blocks"] = _stats.updated_blocks;
 	d["remaining_main_thread_blocks"] = _stats.remaining_main_thread_blocks;
 
+	d["data_memory_usage"] = SIZE_T_TO_VARIANT(_data_map.get_memory_usage());
+	d["view_distance_limited_by_memory"] = _data_memory_budget.is_limiting();
+
 	return d;
 }
 
@@ -554,6 +568,7 @@ void VoxelTerrain::stop_updater() {
 	VoxelServer::get_singleton()->set_volume_mesher(_volume_id, Ref<VoxelMesher>());
 
 	_reception_buffers.mesh_output.clear();
+	invalidate_time_spread_tasks();
 	_blocks_pending_update.clear();
 
 	ResetMeshStateAction a;
@@ -594,6 +609,8 @@ void VoxelTerrain::reset_map() {
 	_blocks_pending_update.clear();
 	_blocks_to_save.clear();
 
+	_data_memory_budget.reset();
+
 	// No need to care about refcounts, we drop everything anyways. Will pair it back on next process.
 	_paired_viewers.clear();
 }
@@ -625,6 +642,7 @@ void VoxelTerrain::post_edit_area(Box3i box_in_voxels) {
 		// The edit can happen next to a boundary
 		if (block != nullptr) {
 			block->set_modified(true);
+			_data_map.update_block_memory_usage(block);
 		}
 	});
 
@@ -668,10 +686,17 @@ void VoxelTerrain::_notification(int p_what) {
 			break;
 
 		case NOTIFICATION_ENTER_WORLD:
+			if (!Engine::get_singleton()->is_editor_hint()) {
+				// Only pair with viewers of the same world.
+				// The editor viewer isn't a node, so everything stays in the default world in the editor.
+				VoxelServer &server = *VoxelServer::get_singleton();
+				server.set_volume_world(_volume_id, server.get_world_for_godot_world(get_world()->get_instance_id()));
+			}
 			_mesh_map.for_all_blocks(SetWorldAction(*get_world()));
 			break;
 
 		case NOTIFICATION_EXIT_WORLD:
+			VoxelServer::get_singleton()->set_volume_world(_volume_id, VoxelServer::get_singleton()->get_default_world());
 			_mesh_map.for_all_blocks(SetWorldAction(nullptr));
 			break;
 
@@ -783,11 +808,14 @@ void VoxelTerrain::_process() {
 		// Our node doesn't have bounds yet, so for now viewers are always paired.
 		// TODO Update: the node has bounds now, need to change this
 
-		// Destroyed viewers
+		const uint32_t world_id = VoxelServer::get_singleton()->get_volume_world(_volume_id);
+
+		// Destroyed viewers, or viewers which left our world
 		for (size_t i = 0; i < _paired_viewers.size(); ++i) {
 			PairedViewer &p = _paired_viewers[i];
-			if (!VoxelServer::get_singleton()->viewer_exists(p.id)) {
-				PRINT_VERBOSE("Detected destroyed viewer in VoxelTerrain");
+			if (!VoxelServer::get_singleton()->viewer_exists(p.id) ||
+					VoxelServer::get_singleton()->get_viewer_world(p.id) != world_id) {
+				PRINT_VERBOSE("Detected destroyed or moved viewer in VoxelTerrain");
 				// Interpret removal as nullified view distance so the same code handling loading of blocks
 				// will be used to unload those viewed by this viewer.
 				// We'll actually remove unpaired viewers in a second pass.
@@ -803,6 +831,30 @@ void VoxelTerrain::_process() {
 		// TODO There is probably a better way to do this
 		const float view_distance_scale = world_to_local_transform.basis.xform(Vector3(1, 0, 0)).length();
 
+		// Shorten view distance while voxel data takes too much memory.
+		// Blocks farthest from viewers fall out of range first.
+		{
+			unsigned int requested_view_distance_voxels = 0;
+			const unsigned int max_view_distance_voxels = _max_view_distance_voxels;
+			VoxelServer::get_singleton()->for_each_viewer(world_id,
+					[&requested_view_distance_voxels, view_distance_scale, max_view_distance_voxels](
+							const VoxelServer::Viewer &viewer, uint32_t viewer_id) {
+						const unsigned int view_distance_voxels = static_cast<unsigned int>(
+								static_cast<float>(viewer.view_distance) * view_distance_scale);
+						requested_view_distance_voxels = max(requested_view_distance_voxels,
+								min(view_distance_voxels, max_view_distance_voxels));
+					});
+			// While there are no viewers, the budget keeps referring to the distance they last asked for
+			if (requested_view_distance_voxels != 0) {
+				_requested_view_distance_voxels = requested_view_distance_voxels;
+			}
+
+			const uint64_t memory_usage = _data_map.get_memory_usage();
+			VoxelServer::get_singleton()->set_volume_data_memory_usage(_volume_id, memory_usage);
+			_data_memory_budget.update(memory_usage, _requested_view_distance_voxels, get_mesh_block_size(),
+					OS::get_singleton()->get_ticks_msec());
+		}
+
 		const Box3i bounds_in_data_blocks = _bounds_in_voxels.downscaled(get_data_block_size());
 		const Box3i bounds_in_mesh_blocks = _bounds_in_voxels.downscaled(get_mesh_block_size());
 
@@ -830,7 +882,8 @@ void VoxelTerrain::_process() {
 						static_cast<unsigned int>(static_cast<float>(viewer.view_distance) * view_distance_scale);
 				const Vector3 local_position = world_to_local_transform.xform(viewer.world_position);
 
-				state.view_distance_voxels = min(view_distance_voxels, self._max_view_distance_voxels);
+				state.view_distance_voxels = self._data_memory_budget.clamp_view_distance(
+						min(view_distance_voxels, self._max_view_distance_voxels));
 				state.local_position_voxels = Vector3i::from_floored(local_position);
 				state.requires_collisions = VoxelServer::get_singleton()->is_viewer_requiring_collisions(viewer_id);
 				state.requires_meshes = VoxelServer::get_singleton()->is_viewer_requiring_visuals(viewer_id);
@@ -875,7 +928,7 @@ void VoxelTerrain::_process() {
 			world_to_local_transform,
 			view_distance_scale
 		};
-		VoxelServer::get_singleton()->for_each_viewer(u);
+		VoxelServer::get_singleton()->for_each_viewer(world_id, u);
 	}
 
 	const bool stream_enabled = (_stream.is_valid() || _generator.is_valid()) &&
@@ -1150,95 +1203,124 @@ void VoxelTerrain::_process() {
 
 	_stats.time_request_blocks_to_update = profiling_clock.restart();
 
-	// Receive mesh updates
+	// Receive mesh updates:
+	// Building meshes has to be done on the main thread, so it is submitted to VoxelServer,
+	// which spreads it over several frames along with other volumes.
 	{
 		VOXEL_PROFILE_SCOPE_NAMED("Receive mesh updates");
 
-		const OS &os = *OS::get_singleton();
+		VoxelServer &server = *VoxelServer::get_singleton();
 
-		const uint32_t timeout = os.get_ticks_msec() + VoxelConstants::MAIN_THREAD_MESHING_BUDGET_MS;
-		size_t queue_index = 0;
+		for (size_t i = 0; i < _reception_buffers.mesh_output.size(); ++i) {
+			ApplyMeshUpdateTask *task = memnew(ApplyMeshUpdateTask);
+			task->dependency = _time_spread_task_dependency;
+			task->terrain = this;
+			task->data = std::move(_reception_buffers.mesh_output[i]);
+			server.push_time_spread_task(task, VoxelTimeSpreadTaskRunner::PRIORITY_HIGH);
+			++_stats.remaining_main_thread_blocks;
+		}
 
-		const Transform local_to_world_transform = get_global_transform();
+		_reception_buffers.mesh_output.clear();
+	}
 
-		// The following is done on the main thread because Godot doesn't really support multithreaded Mesh allocation.
-		// This also proved to be very slow compared to the meshing process itself...
-		// hopefully Vulkan will allow us to upload graphical resources without stalling rendering as they upload?
+	_stats.time_process_update_responses = profiling_clock.restart();
 
-		for (; queue_index < _reception_buffers.mesh_output.size() && os.get_ticks_msec() < timeout; ++queue_index) {
-			const VoxelServer::BlockMeshOutput &ob = _reception_buffers.mesh_output[queue_index];
+	// Work done above, like storing received blocks and requesting saves, can't be spread over frames.
+	// It is still part of the main thread budget shared with other volumes.
+	VoxelServer::get_singleton()->add_main_thread_time_spent_usec(_stats.time_detect_required_blocks +
+			_stats.time_request_blocks_to_load + _stats.time_process_load_responses +
+			_stats.time_request_blocks_to_update + _stats.time_process_update_responses);
 
-			//print_line(String("DDD receive {0}").format(varray(ob.position.to_vec3())));
+	//print_line(String("d:") + String::num(_dirty_blocks.size()) + String(", q:") + String::num(_block_update_queue.size()));
+}
 
-			VoxelMeshBlock *block = _mesh_map.get_block(ob.position);
-			if (block == nullptr) {
-				//print_line("- no longer loaded");
-				// That block is no longer loaded, drop the result
-				++_stats.dropped_block_meshs;
-				continue;
-			}
+void VoxelTerrain::apply_mesh_update(const VoxelServer::BlockMeshOutput &ob) {
+	// The following is done on the main thread because Godot doesn't really support multithreaded Mesh allocation.
+	// This also proved to be very slow compared to the meshing process itself...
+	// hopefully Vulkan will allow us to upload graphical resources without stalling rendering as they upload?
 
-			if (ob.type == VoxelServer::BlockMeshOutput::TYPE_DROPPED) {
-				// That block is loaded, but its meshing request was dropped.
-				// TODO Not sure what to do in this case, the code sending update queries has to be tweaked
-				PRINT_VERBOSE("Received a block mesh drop while we were still expecting it");
-				++_stats.dropped_block_meshs;
-				continue;
-			}
+	//print_line(String("DDD receive {0}").format(varray(ob.position.to_vec3())));
 
-			Ref<ArrayMesh> mesh;
-			mesh.instance();
+	VoxelMeshBlock *block = _mesh_map.get_block(ob.position);
+	if (block == nullptr) {
+		//print_line("- no longer loaded");
+		// That block is no longer loaded, drop the result
+		++_stats.dropped_block_meshs;
+		return;
+	}
 
-			Vector<Array> collidable_surfaces; //need to put both blocky and smooth surfaces into one list
+	if (ob.type == VoxelServer::BlockMeshOutput::TYPE_DROPPED) {
+		// That block is loaded, but its meshing request was dropped.
+		// TODO Not sure what to do in this case, the code sending update queries has to be tweaked
+		PRINT_VERBOSE("Received a block mesh drop while we were still expecting it");
+		++_stats.dropped_block_meshs;
+		return;
+	}
 
-			VOXEL_PROFILE_SCOPE_NAMED("Build mesh");
+	Ref<ArrayMesh> mesh;
+	mesh.instance();
 
-			int surface_index = 0;
-			for (int i = 0; i < ob.surfaces.surfaces.size(); ++i) {
-				Array surface = ob.surfaces.surfaces[i];
-				if (surface.empty()) {
-					continue;
-				}
+	Vector<Array> collidable_surfaces; //need to put both blocky and smooth surfaces into one list
 
-				CRASH_COND(surface.size() != Mesh::ARRAY_MAX);
-				if (!is_surface_triangulated(surface)) {
-					continue;
-				}
+	VOXEL_PROFILE_SCOPE_NAMED("Build mesh");
 
-				collidable_surfaces.push_back(surface);
+	int surface_index = 0;
+	for (int i = 0; i < ob.surfaces.surfaces.size(); ++i) {
+		Array surface = ob.surfaces.surfaces[i];
+		if (surface.empty()) {
+			continue;
+		}
 
-				mesh->add_surface_from_arrays(
-						ob.surfaces.primitive_type, surface, Array(), ob.surfaces.compression_flags);
-				mesh->surface_set_material(surface_index, _materials[i]);
-				++surface_index;
-			}
+		CRASH_COND(surface.size() != Mesh::ARRAY_MAX);
+		if (!is_surface_triangulated(surface)) {
+			continue;
+		}
 
-			if (is_mesh_empty(mesh)) {
-				mesh = Ref<Mesh>();
-				collidable_surfaces.clear();
-			}
+		collidable_surfaces.push_back(surface);
 
-			const bool gen_collisions = _generate_collisions && block->collision_viewers.get() > 0;
+		mesh->add_surface_from_arrays(
+				ob.surfaces.primitive_type, surface, Array(), ob.surfaces.compression_flags);
+		mesh->surface_set_material(surface_index, _materials[i]);
+		++surface_index;
+	}
 
-			block->set_mesh(mesh);
-			if (gen_collisions) {
-				block->set_collision_mesh(collidable_surfaces, get_tree()->is_debugging_collisions_hint(), this);
-				block->set_collision_layer(_collision_layer);
-				block->set_collision_mask(_collision_mask);
-			}
-			block->set_visible(true);
-			block->set_parent_visible(is_visible());
-			block->set_parent_transform(local_to_world_transform);
-		}
+	if (is_mesh_empty(mesh)) {
+		mesh = Ref<Mesh>();
+		collidable_surfaces.clear();
+	}
 
-		shift_up(_reception_buffers.mesh_output, queue_index);
+	const bool gen_collisions = _generate_collisions && block->collision_viewers.get() > 0;
 
-		_stats.remaining_main_thread_blocks = _reception_buffers.mesh_output.size();
+	block->set_mesh(mesh);
+	if (gen_collisions) {
+		block->set_collision_mesh(collidable_surfaces, get_tree()->is_debugging_collisions_hint(), this);
+		block->set_collision_layer(_collision_layer);
+		block->set_collision_mask(_collision_mask);
 	}
+	block->set_visible(true);
+	block->set_parent_visible(is_visible());
+	block->set_parent_transform(get_global_transform());
+}
 
-	_stats.time_process_update_responses = profiling_clock.restart();
+void VoxelTerrain::ApplyMeshUpdateTask::run() {
+	if (!dependency->valid) {
+		// The terrain was destroyed or reset its meshing
+		return;
+	}
+	--terrain->_stats.remaining_main_thread_blocks;
+	if (!terrain->is_inside_tree()) {
+		// Can't build meshes and colliders without a world, put it back until the terrain gets processed again
+		terrain->_reception_buffers.mesh_output.push_back(std::move(data));
+		return;
+	}
+	terrain->apply_mesh_update(data);
+}
 
-	//print_line(String("d:") + String::num(_dirty_blocks.size()) + String(", q:") + String::num(_block_update_queue.size()));
+void VoxelTerrain::invalidate_time_spread_tasks() {
+	// Tasks already submitted will see this and do nothing
+	_time_spread_task_dependency->valid = false;
+	_time_spread_task_dependency = gd_make_shared<TimeSpreadTaskDependency>();
+	_stats.remaining_main_thread_blocks = 0;
 }
 
 Ref<VoxelTool> VoxelTerrain::get_voxel_tool() {
@@ -1340,6 +1422,9 @@ void VoxelTerrain::_bind_methods() {
 	ClassDB::bind_method(D_METHOD("set_max_view_distance", "distance_in_voxels"), &VoxelTerrain::set_max_view_distance);
 	ClassDB::bind_method(D_METHOD("get_max_view_distance"), &VoxelTerrain::get_max_view_distance);
 
+	ClassDB::bind_method(D_METHOD("set_data_memory_budget", "budget_bytes"), &VoxelTerrain::set_data_memory_budget);
+	ClassDB::bind_method(D_METHOD("get_data_memory_budget"), &VoxelTerrain::get_data_memory_budget);
+
 	ClassDB::bind_method(D_METHOD("get_generate_collisions"), &VoxelTerrain::get_generate_collisions);
 	ClassDB::bind_method(D_METHOD("set_generate_collisions", "enabled"), &VoxelTerrain::set_generate_collisions);
 
@@ -1392,6 +1477,7 @@ void VoxelTerrain::_bind_methods() {
 	ADD_PROPERTY(PropertyInfo(Variant::BOOL, "run_stream_in_editor"),
 			"set_run_stream_in_editor", "is_stream_running_in_editor");
 	ADD_PROPERTY(PropertyInfo(Variant::INT, "mesh_block_size"), "set_mesh_block_size", "get_mesh_block_size");
+	ADD_PROPERTY(PropertyInfo(Variant::INT, "data_memory_budget"), "set_data_memory_budget", "get_data_memory_budget");
 
 	// TODO Add back access to block, but with an API securing multithreaded access
 	ADD_SIGNAL(MethodInfo(VoxelStringNames::get_singleton()->block_loaded,
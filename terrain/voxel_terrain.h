@@ -3,6 +3,7 @@
 
 #include "../server/voxel_server.h"
 #include "../storage/voxel_data_map.h"
+#include "voxel_data_memory_budget.h"
 #include "voxel_mesh_map.h"
 #include "voxel_node.h"
 
@@ -53,6 +54,10 @@ public:
 	unsigned int get_max_view_distance() const;
 	void set_max_view_distance(unsigned int distance_in_voxels);
 
+	// When voxel data takes more memory than this, view distance gets shortened. 0 means no limit.
+	void set_data_memory_budget(int64_t budget_bytes);
+	int64_t get_data_memory_budget() const;
+
 	// TODO Make this obsolete with multi-viewers
 	void set_viewer_path(NodePath path);
 	NodePath get_viewer_path() const;
@@ -126,8 +131,9 @@ private:
 	void try_schedule_mesh_update_from_data(const Box3i &box_in_voxels);
 
 	void save_all_modified_blocks(bool with_copy);
-	void get_viewer_pos_and_direction(Vector3 &out_pos, Vector3 &out_direction) const;
 	void send_block_data_requests();
+	void apply_mesh_update(const VoxelServer::BlockMeshOutput &ob);
+	void invalidate_time_spread_tasks();
 
 	void emit_data_block_loaded(const VoxelDataBlock *block);
 	void emit_data_block_unloaded(const VoxelDataBlock *block);
@@ -149,6 +155,22 @@ private:
 	uint32_t _volume_id = 0;
 	VoxelServer::ReceptionBuffers _reception_buffers;
 
+	// Main thread work submitted to VoxelServer references this, so it can be dropped
+	// if the terrain gets destroyed or resets its meshing before the work runs
+	struct TimeSpreadTaskDependency {
+		bool valid = true;
+	};
+	std::shared_ptr<TimeSpreadTaskDependency> _time_spread_task_dependency;
+
+	class ApplyMeshUpdateTask : public IVoxelTimeSpreadTask {
+	public:
+		void run() override;
+
+		std::shared_ptr<TimeSpreadTaskDependency> dependency;
+		VoxelTerrain *terrain = nullptr;
+		VoxelServer::BlockMeshOutput data;
+	};
+
 	struct PairedViewer {
 		struct State {
 			Vector3i local_position_voxels;
@@ -178,6 +200,11 @@ private:
 
 	unsigned int _max_view_distance_voxels = 128;
 
+	VoxelDataMemoryBudget _data_memory_budget;
+	// Largest view distance asked by viewers, before the memory budget applies.
+	// Keeps the last non-zero value, so the budget doesn't collapse while there are no viewers.
+	unsigned int _requested_view_distance_voxels = 0;
+
 	// TODO Terrains only need to handle the visible portion of voxels, which reduces the bounds blocks to handle.
 	// Therefore, could a simple grid be better to use than a hashmap?
 
@@ -1,6 +1,8 @@
 #include "voxel_viewer.h"
 #include "../server/voxel_server.h"
 #include <core/engine.h>
+#include <scene/3d/camera.h>
+#include <scene/main/viewport.h>
 
 VoxelViewer::VoxelViewer() {
 	set_notify_transform(!Engine::get_singleton()->is_editor_hint());
@@ -43,12 +45,13 @@ void VoxelViewer::_notification(int p_what) {
 	switch (p_what) {
 		case NOTIFICATION_ENTER_TREE: {
 			if (!Engine::get_singleton()->is_editor_hint()) {
-				_viewer_id = VoxelServer::get_singleton()->add_viewer();
+				VoxelServer &server = *VoxelServer::get_singleton();
+				_viewer_id = server.add_viewer();
+				server.set_viewer_world(_viewer_id, server.get_world_for_godot_world(get_world()->get_instance_id()));
 				VoxelServer::get_singleton()->set_viewer_distance(_viewer_id, _view_distance);
 				VoxelServer::get_singleton()->set_viewer_requires_visuals(_viewer_id, _requires_visuals);
 				VoxelServer::get_singleton()->set_viewer_requires_collisions(_viewer_id, _requires_collisions);
-				const Vector3 pos = get_global_transform().origin;
-				VoxelServer::get_singleton()->set_viewer_position(_viewer_id, pos);
+				update_view();
 			}
 		} break;
 
@@ -60,8 +63,7 @@ void VoxelViewer::_notification(int p_what) {
 
 		case NOTIFICATION_TRANSFORM_CHANGED:
 			if (is_active()) {
-				const Vector3 pos = get_global_transform().origin;
-				VoxelServer::get_singleton()->set_viewer_position(_viewer_id, pos);
+				update_view();
 			}
 			break;
 
@@ -70,6 +72,35 @@ void VoxelViewer::_notification(int p_what) {
 	}
 }
 
+float VoxelViewer::get_camera_view_cone_fov(const Camera &camera) {
+	if (camera.get_projection() != Camera::PROJECTION_PERSPECTIVE) {
+		return 0.f;
+	}
+	// The view is wider than `fov` on one axis, so use the angle of a cone enclosing the whole frustum
+	const Size2 viewport_size = camera.get_viewport()->get_visible_rect().size;
+	const float aspect = viewport_size.y > 0.f ? viewport_size.x / viewport_size.y : 1.f;
+	const float tan_half_fov = Math::tan(Math::deg2rad(0.5f * camera.get_fov()));
+	const float tan_half_diagonal = camera.get_keep_aspect_mode() == Camera::KEEP_HEIGHT ?
+			tan_half_fov * Math::sqrt(1.f + aspect * aspect) :
+			tan_half_fov * Math::sqrt(1.f + 1.f / (aspect * aspect));
+	return Math::rad2deg(2.f * Math::atan(tan_half_diagonal));
+}
+
+void VoxelViewer::update_view() {
+	VoxelServer &server = *VoxelServer::get_singleton();
+	const Transform transform = get_global_transform();
+	server.set_viewer_position(_viewer_id, transform.origin);
+	server.set_viewer_view_direction(_viewer_id, -transform.basis.get_axis(Vector3::AXIS_Z));
+
+	// When attached to a camera, blocks in its view get processed first
+	float fov = 0.f;
+	const Camera *camera = Object::cast_to<Camera>(get_parent());
+	if (camera != nullptr) {
+		fov = get_camera_view_cone_fov(*camera);
+	}
+	server.set_viewer_view_fov(_viewer_id, fov);
+}
+
 bool VoxelViewer::is_active() const {
 	return is_inside_tree() && !Engine::get_singleton()->is_editor_hint();
 }
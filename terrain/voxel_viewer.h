@@ -3,6 +3,8 @@
 
 #include <scene/3d/spatial.h>
 
+class Camera;
+
 // Triggers loading of voxel nodes around its position. Voxels will update in priority closer to viewers.
 // Usually added as child of the player's camera.
 class VoxelViewer : public Spatial {
@@ -21,6 +23,9 @@ public:
 	void set_requires_collisions(bool enabled);
 	bool is_requiring_collisions() const;
 
+	// Angle of a cone enclosing the view of a camera, in degrees. Zero if it can't be represented.
+	static float get_camera_view_cone_fov(const Camera &camera);
+
 protected:
 	void _notification(int p_what);
 
@@ -28,6 +33,7 @@ private:
 	static void _bind_methods();
 
 	void _process();
+	void update_view();
 	bool is_active() const;
 
 	uint32_t _viewer_id = 0;
@@ -1,10 +1,23 @@
 #include "tests.h"
+#include "../constants/cube_tables.h"
 #include "../generators/graph/voxel_generator_graph.h"
+#include "../server/voxel_server.h"
+#include "../server/voxel_task_graph.h"
+#include "../server/voxel_thread_pool.h"
 #include "../storage/voxel_data_map.h"
+#include "../storage/voxel_memory_pool.h"
+#include "../streams/region/region_file.h"
+#include "../streams/region/region_journal.h"
+#include "../streams/voxel_block_serializer.h"
 #include "../util/math/box3i.h"
+#include "../util/profiling_clock.h"
+#include "../util/vector3i_flat_map.h"
 
 #include <core/hash_map.h>
+#include <core/os/dir_access.h>
+#include <core/os/file_access.h>
 #include <core/print_string.h>
+#include <unordered_map>
 
 void test_box3i_for_inner_outline() {
 	const Box3i box(-1, 2, 3, 8, 6, 5);
@@ -147,6 +160,41 @@ void test_voxel_data_map_paste_mask() {
 	ERR_FAIL_COND(!outside_is_ok);
 }
 
+void test_voxel_data_map_paste_mask_negative_offset() {
+	static const int masked_value = 1;
+	static const int default_value = 0;
+	static const int channel = VoxelBuffer::CHANNEL_TYPE;
+
+	Ref<VoxelBuffer> buffer;
+	buffer.instance();
+	buffer->create(20, 18, 23);
+	// Every voxel has a value depending on its position, so reading at a wrong offset gets noticed.
+	// Some of them have the mask value.
+	for (int z = 0; z < buffer->get_size().z; ++z) {
+		for (int x = 0; x < buffer->get_size().x; ++x) {
+			for (int y = 0; y < buffer->get_size().y; ++y) {
+				const int v = (x + y * 3 + z * 7) % 5 == 0 ? masked_value : 2 + (x + y * 11 + z * 13) % 250;
+				buffer->set_voxel(v, x, y, z, channel);
+			}
+		}
+	}
+
+	VoxelDataMap map;
+	map.create(4, 0);
+
+	// Starts inside blocks on every axis, and spans several blocks, including negative ones
+	const Box3i box(Vector3i(-7, 5, -13), buffer->get_size());
+
+	map.paste(box.pos, **buffer, (1 << channel), masked_value, true);
+
+	const bool is_match = box.all_cells_match([&map, &buffer, &box](const Vector3i &pos) {
+		const int src_v = buffer->get_voxel(pos - box.pos, channel);
+		const int expected_v = src_v == masked_value ? default_value : src_v;
+		return map.get_voxel(pos, channel) == expected_v;
+	});
+	ERR_FAIL_COND(!is_match);
+}
+
 void test_voxel_data_map_copy() {
 	static const int voxel_value = 1;
 	static const int default_value = 0;
@@ -196,6 +244,345 @@ void test_voxel_data_map_copy() {
 	ERR_FAIL_COND(!buffer->equals(**buffer2));
 }
 
+void test_voxel_data_map_memory_usage() {
+	static const int channel = VoxelBuffer::CHANNEL_TYPE;
+
+	VoxelDataMap map;
+	map.create(4, 0);
+	const Vector3i block_size(map.get_block_size());
+
+	// Uniform blocks don't allocate voxels
+	Ref<VoxelBuffer> uniform_buffer;
+	uniform_buffer.instance();
+	uniform_buffer->create(block_size);
+	map.set_block_buffer(Vector3i(0, 0, 0), uniform_buffer);
+	ERR_FAIL_COND(map.get_memory_usage() != uniform_buffer->get_memory_usage());
+
+	Ref<VoxelBuffer> buffer;
+	buffer.instance();
+	buffer->create(block_size);
+	buffer->set_voxel(1, Vector3i(1, 2, 3), channel);
+	ERR_FAIL_COND(buffer->get_memory_usage() <
+				  VoxelBuffer::get_size_in_bytes_for_volume(block_size, buffer->get_channel_depth(channel)));
+	map.set_block_buffer(Vector3i(1, 0, 0), buffer);
+	ERR_FAIL_COND(map.get_memory_usage() != uniform_buffer->get_memory_usage() + buffer->get_memory_usage());
+
+	// Replacing the buffer of a block
+	map.set_block_buffer(Vector3i(0, 0, 0), buffer->duplicate(false));
+	ERR_FAIL_COND(map.get_memory_usage() != 2 * buffer->get_memory_usage());
+
+	// Editing voxels directly needs an update
+	map.set_voxel(1, Vector3i(5, 0, 0) + map.block_to_voxel(Vector3i(0, 1, 0)), channel);
+	VoxelDataBlock *edited_block = map.get_block(Vector3i(0, 1, 0));
+	ERR_FAIL_COND(edited_block == nullptr);
+	map.update_block_memory_usage(edited_block);
+	ERR_FAIL_COND(map.get_memory_usage() !=
+				  2 * buffer->get_memory_usage() + edited_block->voxels->get_memory_usage());
+
+	map.remove_block(Vector3i(1, 0, 0), VoxelDataMap::NoAction());
+	ERR_FAIL_COND(map.get_memory_usage() != buffer->get_memory_usage() + edited_block->voxels->get_memory_usage());
+
+	map.clear();
+	ERR_FAIL_COND(map.get_memory_usage() != 0);
+}
+
+void test_vector3i_flat_map() {
+	// Compare against a reference with a sequence of insertions and removals that cause collisions and growth
+	Vector3iFlatMap<unsigned int> map;
+	std::unordered_map<Vector3i, unsigned int> expected;
+	uint32_t seed = 131;
+
+	for (unsigned int i = 0; i < 20000; ++i) {
+		seed = seed * 1664525u + 1013904223u;
+		const Vector3i pos(int(seed >> 24) - 128, int((seed >> 16) & 15) - 8, int((seed >> 8) & 63) - 32);
+		if ((seed & 3) == 0) {
+			ERR_FAIL_COND(map.erase(pos) != (expected.erase(pos) != 0));
+		} else {
+			map.set(pos, i);
+			expected[pos] = i;
+		}
+		ERR_FAIL_COND(map.size() != expected.size());
+	}
+
+	for (auto it = expected.begin(); it != expected.end(); ++it) {
+		const unsigned int *value = map.getptr(it->first);
+		ERR_FAIL_COND(value == nullptr);
+		ERR_FAIL_COND(*value != it->second);
+	}
+	ERR_FAIL_COND(map.has(Vector3i(1000, 0, 0)));
+
+	for (auto it = expected.begin(); it != expected.end(); ++it) {
+		ERR_FAIL_COND(!map.erase(it->first));
+	}
+	ERR_FAIL_COND(map.size() != 0);
+	ERR_FAIL_COND(map.has(Vector3i(0, 0, 0)));
+}
+
+template <typename Map_T>
+static void run_block_map_benchmark(Map_T &map, const std::vector<Vector3i> &positions, const char *name) {
+	ProfilingClock clock;
+
+	for (unsigned int i = 0; i < positions.size(); ++i) {
+		map.set(positions[i], i);
+	}
+	const uint64_t insert_usec = clock.restart();
+
+	// Like checking if a block is surrounded: neighbors of blocks at the edge are missing
+	unsigned int found_count = 0;
+	for (unsigned int i = 0; i < positions.size(); ++i) {
+		for (unsigned int side = 0; side < Cube::SIDE_COUNT; ++side) {
+			if (map.getptr(positions[i] + Cube::g_side_normals[side]) != nullptr) {
+				++found_count;
+			}
+		}
+	}
+	const uint64_t lookup_usec = clock.restart();
+
+	// Half of the blocks, in loading order, like when a viewer moves away
+	for (unsigned int i = 0; i < positions.size(); i += 2) {
+		map.erase(positions[i]);
+	}
+	const uint64_t remove_usec = clock.restart();
+
+	print_line(String("{0} with {1} blocks: insert {2} us, lookup {3} neighbors ({4} found) {5} us, remove {6} us")
+					   .format(varray(name, SIZE_T_TO_VARIANT(positions.size()), SIZE_T_TO_VARIANT(insert_usec),
+							   SIZE_T_TO_VARIANT(positions.size() * Cube::SIDE_COUNT), found_count,
+							   SIZE_T_TO_VARIANT(lookup_usec), SIZE_T_TO_VARIANT(remove_usec))));
+	ERR_FAIL_COND(map.size() != positions.size() / 2);
+}
+
+void test_block_map_throughput() {
+	// Compares the index of VoxelDataMap and VoxelMeshMap with the Godot HashMap it replaced
+	const Box3i box(Vector3i(-25, -20, -25), Vector3i(50, 40, 50));
+	std::vector<Vector3i> positions;
+	positions.reserve(box.size.volume());
+	box.for_each_cell_zxy([&positions](Vector3i pos) {
+		positions.push_back(pos);
+	});
+
+	{
+		HashMap<Vector3i, unsigned int, Vector3iHasher, HashMapComparatorDefault<Vector3i>, 3, 2> map;
+		run_block_map_benchmark(map, positions, "HashMap");
+	}
+	{
+		Vector3iFlatMap<unsigned int> map;
+		run_block_map_benchmark(map, positions, "Vector3iFlatMap");
+	}
+}
+
+static Ref<VoxelBuffer> make_region_test_block(
+		const VoxelRegionFormat &format, unsigned int noise_count, uint32_t &seed) {
+	Ref<VoxelBuffer> block;
+	block.instance();
+	block->create(Vector3i(1 << format.block_size_po2));
+	for (unsigned int channel = 0; channel < format.channel_depths.size(); ++channel) {
+		block->set_channel_depth(channel, format.channel_depths[channel]);
+	}
+	// Random voxels make blocks compress to various sizes, so they span various amounts of sectors
+	const uint32_t mask = (1 << format.block_size_po2) - 1;
+	for (unsigned int i = 0; i < noise_count; ++i) {
+		seed = seed * 1664525u + 1013904223u;
+		const Vector3i pos((seed >> 4) & mask, (seed >> 10) & mask, (seed >> 16) & mask);
+		block->set_voxel(seed >> 24, pos, VoxelBuffer::CHANNEL_TYPE);
+	}
+	return block;
+}
+
+static bool check_region_blocks(
+		VoxelRegionFile &region, const std::vector<Ref<VoxelBuffer>> &expected_blocks, const VoxelRegionFormat &format) {
+	VoxelBlockSerializerInternal serializer;
+	for (unsigned int i = 0; i < expected_blocks.size(); ++i) {
+		Ref<VoxelBuffer> block;
+		block.instance();
+		block->create(Vector3i(1 << format.block_size_po2));
+		const Vector3i position = region.get_block_position_from_index(i);
+		ERR_FAIL_COND_V(region.load_block(position, block, serializer) != OK, false);
+		ERR_FAIL_COND_V(!block->equals(**expected_blocks[i]), false);
+	}
+	return true;
+}
+
+void test_region_file() {
+	const String path = "user://test_region_file.vxr";
+
+	VoxelRegionFormat format;
+	format.block_size_po2 = 4;
+	format.region_size = Vector3i(4, 4, 4);
+	format.channel_depths.fill(VoxelBuffer::DEPTH_8_BIT);
+	format.sector_size = 512;
+
+	std::vector<Ref<VoxelBuffer>> expected_blocks;
+	uint32_t seed = 131;
+
+	{
+		VoxelRegionFile region;
+		ERR_FAIL_COND(!region.set_format(format));
+		ERR_FAIL_COND(region.open(path, true) != OK);
+		VoxelBlockSerializerInternal serializer;
+
+		for (unsigned int i = 0; i < region.get_header_block_count(); ++i) {
+			Ref<VoxelBuffer> block = make_region_test_block(format, (i * 37) % 500, seed);
+			ERR_FAIL_COND(region.save_block(region.get_block_position_from_index(i), block, serializer) != OK);
+			expected_blocks.push_back(block);
+		}
+		ERR_FAIL_COND(!check_region_blocks(region, expected_blocks, format));
+
+		// Blocks growing and shrinking make sectors of other blocks move
+		for (unsigned int i = 0; i < expected_blocks.size(); i += 3) {
+			Ref<VoxelBuffer> block = make_region_test_block(format, (i * 53) % 700, seed);
+			ERR_FAIL_COND(region.save_block(region.get_block_position_from_index(i), block, serializer) != OK);
+			expected_blocks[i] = block;
+		}
+		ERR_FAIL_COND(!check_region_blocks(region, expected_blocks, format));
+
+		// Sectors left free by blocks that shrank or moved get reused
+		for (unsigned int i = 0; i < 200; ++i) {
+			seed = seed * 1664525u + 1013904223u;
+			const unsigned int block_index = (seed >> 8) % expected_blocks.size();
+			Ref<VoxelBuffer> block = make_region_test_block(format, (seed >> 16) % 800, seed);
+			ERR_FAIL_COND(
+					region.save_block(region.get_block_position_from_index(block_index), block, serializer) != OK);
+			expected_blocks[block_index] = block;
+		}
+		ERR_FAIL_COND(!check_region_blocks(region, expected_blocks, format));
+
+		ERR_FAIL_COND(region.compact() != OK);
+		ERR_FAIL_COND(region.get_free_sector_count() != 0);
+		ERR_FAIL_COND(!check_region_blocks(region, expected_blocks, format));
+
+		ERR_FAIL_COND(region.close() != OK);
+	}
+
+	{
+		VoxelRegionFile region;
+		ERR_FAIL_COND(region.open(path, false) != OK);
+		ERR_FAIL_COND(!check_region_blocks(region, expected_blocks, format));
+	}
+
+	DirAccessRef da = DirAccess::create(DirAccess::ACCESS_USERDATA);
+	ERR_FAIL_COND(!da);
+	da->remove(path);
+}
+
+static bool check_journal_block(VoxelRegionJournal &journal, Vector3i position, uint8_t lod,
+		Ref<VoxelBuffer> expected_block, VoxelBlockSerializerInternal &serializer) {
+	Ref<VoxelBuffer> block;
+	block.instance();
+	block->create(expected_block->get_size());
+	ERR_FAIL_COND_V(journal.load_block(position, lod, **block, serializer) != OK, false);
+	ERR_FAIL_COND_V(!block->equals(**expected_block), false);
+	return true;
+}
+
+static Error append_journal_test_block(VoxelRegionJournal &journal, Vector3i position, uint8_t lod,
+		Ref<VoxelBuffer> block, VoxelBlockSerializerInternal &serializer) {
+	VoxelBlockSerializerInternal::SerializeResult res = serializer.serialize_and_compress(**block);
+	ERR_FAIL_COND_V(!res.success, ERR_INVALID_DATA);
+	return journal.append_block(position, lod, to_span_const(res.data));
+}
+
+void test_region_journal() {
+	const String path = "user://test_region_journal.vxrj";
+
+	VoxelRegionFormat format;
+	format.block_size_po2 = 4;
+	format.channel_depths.fill(VoxelBuffer::DEPTH_8_BIT);
+
+	VoxelBlockSerializerInternal serializer;
+	uint32_t seed = 131;
+	Ref<VoxelBuffer> block_a = make_region_test_block(format, 100, seed);
+	Ref<VoxelBuffer> block_a2 = make_region_test_block(format, 200, seed);
+	Ref<VoxelBuffer> block_b = make_region_test_block(format, 300, seed);
+	Ref<VoxelBuffer> block_c = make_region_test_block(format, 400, seed);
+	const Vector3i pos_a(0, 0, 0);
+	const Vector3i pos_b(1, -2, 3);
+	const Vector3i pos_c(-5, 6, 7);
+	uint64_t last_commit_offset = 0;
+
+	{
+		VoxelRegionJournal journal;
+		ERR_FAIL_COND(journal.open(path) != OK);
+		ERR_FAIL_COND(journal.get_block_count() != 0);
+		ERR_FAIL_COND(append_journal_test_block(journal, pos_a, 0, block_a, serializer) != OK);
+		ERR_FAIL_COND(append_journal_test_block(journal, pos_b, 1, block_b, serializer) != OK);
+		ERR_FAIL_COND(journal.commit() != OK);
+
+		// Simulates the process stopping in the middle of a batch
+		ERR_FAIL_COND(append_journal_test_block(journal, pos_a, 0, block_a2, serializer) != OK);
+		ERR_FAIL_COND(append_journal_test_block(journal, pos_c, 0, block_c, serializer) != OK);
+		ERR_FAIL_COND(!check_journal_block(journal, pos_a, 0, block_a2, serializer));
+	}
+
+	{
+		// Only the committed batch remains
+		VoxelRegionJournal journal;
+		ERR_FAIL_COND(journal.open(path) != OK);
+		ERR_FAIL_COND(journal.get_block_count() != 2);
+		ERR_FAIL_COND(!check_journal_block(journal, pos_a, 0, block_a, serializer));
+		ERR_FAIL_COND(!check_journal_block(journal, pos_b, 1, block_b, serializer));
+		Ref<VoxelBuffer> block;
+		block.instance();
+		block->create(block_c->get_size());
+		ERR_FAIL_COND(journal.load_block(pos_c, 0, **block, serializer) != ERR_DOES_NOT_EXIST);
+		ERR_FAIL_COND(journal.load_block(pos_b, 0, **block, serializer) != ERR_DOES_NOT_EXIST);
+		{
+			// The incomplete batch was removed from the file
+			FileAccessRef f = FileAccess::open(path, FileAccess::READ);
+			ERR_FAIL_COND(!f);
+			ERR_FAIL_COND(f->get_len() != journal.get_size_in_bytes());
+		}
+
+		ERR_FAIL_COND(append_journal_test_block(journal, pos_c, 0, block_c, serializer) != OK);
+		ERR_FAIL_COND(journal.commit() != OK);
+		last_commit_offset = journal.get_size_in_bytes() - 1;
+	}
+
+	{
+		// Damage the last commit record, as if it wasn't written
+		FileAccessRef f = FileAccess::open(path, FileAccess::READ_WRITE);
+		ERR_FAIL_COND(!f);
+		f->seek(last_commit_offset);
+		f->store_8(0xff);
+	}
+
+	{
+		VoxelRegionJournal journal;
+		ERR_FAIL_COND(journal.open(path) != OK);
+		ERR_FAIL_COND(journal.get_block_count() != 2);
+		ERR_FAIL_COND(!check_journal_block(journal, pos_a, 0, block_a, serializer));
+		ERR_FAIL_COND(!check_journal_block(journal, pos_b, 1, block_b, serializer));
+
+		// Dropping an unfinished batch brings back the blocks it replaced
+		ERR_FAIL_COND(append_journal_test_block(journal, pos_a, 0, block_a2, serializer) != OK);
+		ERR_FAIL_COND(journal.discard_uncommitted() != OK);
+		ERR_FAIL_COND(journal.has_uncommitted_blocks());
+		ERR_FAIL_COND(journal.get_block_count() != 2);
+		ERR_FAIL_COND(!check_journal_block(journal, pos_a, 0, block_a, serializer));
+
+		std::vector<VoxelRegionJournal::Block> blocks;
+		journal.get_blocks(blocks);
+		ERR_FAIL_COND(blocks.size() != 2);
+		std::vector<uint8_t> data;
+		for (unsigned int i = 0; i < blocks.size(); ++i) {
+			ERR_FAIL_COND(journal.read_block_data(blocks[i], data) != OK);
+			ERR_FAIL_COND(data.size() != blocks[i].size);
+		}
+
+		ERR_FAIL_COND(journal.reset() != OK);
+		ERR_FAIL_COND(journal.get_block_count() != 0);
+	}
+
+	{
+		VoxelRegionJournal journal;
+		ERR_FAIL_COND(journal.open(path) != OK);
+		ERR_FAIL_COND(journal.get_block_count() != 0);
+	}
+
+	DirAccessRef da = DirAccess::create(DirAccess::ACCESS_USERDATA);
+	ERR_FAIL_COND(!da);
+	da->remove(path);
+}
+
 void test_encode_weights_packed_u16() {
 	FixedArray<uint8_t, 4> weights;
 	// There is data loss of the 4 smaller bits in this encoding,
@@ -272,6 +659,486 @@ void test_copy_3d_region_zxy() {
 	}
 }
 
+static void run_region_kernels_benchmark(const int size, const unsigned int item_size) {
+	// Compares SIMD region kernels with their scalar reference, on buffers of the size of blocks, or blocks padded
+	// for meshing. Results must be identical.
+	const Vector3i buffer_size(size, size, size);
+	const size_t size_in_bytes = buffer_size.volume() * item_size;
+	// Process about the same amount of bytes regardless of buffer size
+	const unsigned int iteration_count = max(static_cast<size_t>(1), (8 << 20) / size_in_bytes);
+
+	std::vector<uint8_t> src;
+	std::vector<uint8_t> dst;
+	std::vector<uint8_t> expected_dst;
+	src.resize(size_in_bytes);
+	dst.resize(size_in_bytes, 0);
+	expected_dst.resize(size_in_bytes, 0);
+	for (unsigned int i = 0; i < src.size(); ++i) {
+		src[i] = (i * 7919) >> 3;
+	}
+
+	// Copying without padding is what happens the most, rows are not contiguous in that case
+	const Vector3i inner_min(1, 1, 1);
+	const Vector3i inner_max = buffer_size - Vector3i(1, 1, 1);
+	const uint64_t fill_value = 0x0123456789abcdef;
+
+	struct Timing {
+		uint64_t scalar_usec;
+		uint64_t simd_usec;
+	};
+
+	Span<const uint8_t> srcs = to_span_const(src);
+	Span<uint8_t> dsts = to_span(dst);
+	Span<uint8_t> expected_dsts = to_span(expected_dst);
+	ProfilingClock clock;
+
+	Timing copy_timing;
+	clock.restart();
+	for (unsigned int i = 0; i < iteration_count; ++i) {
+		copy_3d_region_zxy_scalar(expected_dsts, buffer_size, Vector3i(), srcs, buffer_size, Vector3i(), buffer_size,
+				item_size);
+	}
+	copy_timing.scalar_usec = clock.restart();
+	for (unsigned int i = 0; i < iteration_count; ++i) {
+		copy_3d_region_zxy(dsts, buffer_size, Vector3i(), srcs, buffer_size, Vector3i(), buffer_size, item_size);
+	}
+	copy_timing.simd_usec = clock.restart();
+	ERR_FAIL_COND(dst != expected_dst);
+
+	Timing copy_inner_timing;
+	clock.restart();
+	for (unsigned int i = 0; i < iteration_count; ++i) {
+		copy_3d_region_zxy_scalar(expected_dsts, buffer_size, inner_min, srcs, buffer_size, inner_min, inner_max,
+				item_size);
+	}
+	copy_inner_timing.scalar_usec = clock.restart();
+	for (unsigned int i = 0; i < iteration_count; ++i) {
+		copy_3d_region_zxy(dsts, buffer_size, inner_min, srcs, buffer_size, inner_min, inner_max, item_size);
+	}
+	copy_inner_timing.simd_usec = clock.restart();
+	ERR_FAIL_COND(dst != expected_dst);
+
+	Timing fill_inner_timing;
+	clock.restart();
+	for (unsigned int i = 0; i < iteration_count; ++i) {
+		fill_3d_region_zxy_scalar(expected_dsts, buffer_size, inner_min, inner_max, fill_value, item_size);
+	}
+	fill_inner_timing.scalar_usec = clock.restart();
+	for (unsigned int i = 0; i < iteration_count; ++i) {
+		fill_3d_region_zxy(dsts, buffer_size, inner_min, inner_max, fill_value, item_size);
+	}
+	fill_inner_timing.simd_usec = clock.restart();
+	ERR_FAIL_COND(dst != expected_dst);
+
+	// Uniform buffers are the worst case, every item has to be checked
+	fill_3d_region_zxy(dsts, buffer_size, Vector3i(), buffer_size, fill_value, item_size);
+	Span<const uint8_t> uniform = to_span_const(dst);
+	unsigned int scalar_uniform_count = 0;
+	unsigned int simd_uniform_count = 0;
+
+	Timing uniform_timing;
+	clock.restart();
+	for (unsigned int i = 0; i < iteration_count; ++i) {
+		scalar_uniform_count += is_uniform_b_scalar(uniform, item_size);
+	}
+	uniform_timing.scalar_usec = clock.restart();
+	for (unsigned int i = 0; i < iteration_count; ++i) {
+		simd_uniform_count += is_uniform_b(uniform, item_size);
+	}
+	uniform_timing.simd_usec = clock.restart();
+	ERR_FAIL_COND(scalar_uniform_count != iteration_count);
+	ERR_FAIL_COND(simd_uniform_count != iteration_count);
+
+	// A single different byte anywhere must be detected
+	for (unsigned int i = 0; i < dst.size(); i += 13) {
+		const uint8_t v = dst[i];
+		dst[i] = ~v;
+		ERR_FAIL_COND(is_uniform_b(uniform, item_size));
+		ERR_FAIL_COND(is_uniform_b_scalar(uniform, item_size));
+		dst[i] = v;
+	}
+
+	const Timing timings[] = { copy_timing, copy_inner_timing, fill_inner_timing, uniform_timing };
+	const char *timing_names[] = { "copy", "copy inner", "fill inner", "is_uniform" };
+	for (unsigned int i = 0; i < 4; ++i) {
+		print_line(String("{0}^3 buffer of {1}-byte items, {2}: scalar {3} us, SIMD {4} us")
+						   .format(varray(size, item_size, timing_names[i],
+								   SIZE_T_TO_VARIANT(timings[i].scalar_usec),
+								   SIZE_T_TO_VARIANT(timings[i].simd_usec))));
+	}
+}
+
+void test_region_kernels_throughput() {
+	// Data blocks, padded blocks given to meshers with the default block size, and small blocks
+	const int sizes[] = { 16, 32, 34 };
+	for (unsigned int i = 0; i < 3; ++i) {
+		for (unsigned int item_size = 1; item_size <= 8; item_size *= 2) {
+			run_region_kernels_benchmark(sizes[i], item_size);
+		}
+	}
+}
+
+void test_voxel_buffer_palette_compression() {
+	const int channel = VoxelBuffer::CHANNEL_TYPE;
+	const Vector3i size(16, 16, 16);
+
+	Ref<VoxelBuffer> buffer;
+	buffer.instance();
+	buffer->create(size);
+	buffer->set_channel_depth(channel, VoxelBuffer::DEPTH_16_BIT);
+
+	// Layers of a few block types, like typical terrain
+	Vector3i pos;
+	for (pos.z = 0; pos.z < size.z; ++pos.z) {
+		for (pos.x = 0; pos.x < size.x; ++pos.x) {
+			for (pos.y = 0; pos.y < size.y; ++pos.y) {
+				buffer->set_voxel(pos.y < 8 ? 1 : (pos.y < 12 ? 2 : 0), pos, channel);
+			}
+		}
+	}
+	Ref<VoxelBuffer> expected = buffer->duplicate(false);
+
+	buffer->compress_palette_channels();
+	ERR_FAIL_COND(buffer->get_channel_compression(channel) != VoxelBuffer::COMPRESSION_PALETTE);
+	ERR_FAIL_COND(!buffer->equals(**expected));
+
+	// New values grow the palette
+	for (unsigned int i = 0; i < 20; ++i) {
+		const Vector3i p(i % size.x, 0, i / size.x);
+		buffer->set_voxel(100 + i, p, channel);
+		expected->set_voxel(100 + i, p, channel);
+	}
+	ERR_FAIL_COND(buffer->get_channel_compression(channel) != VoxelBuffer::COMPRESSION_PALETTE);
+	ERR_FAIL_COND(!buffer->equals(**expected));
+
+	// Partial copies decode the palette
+	Ref<VoxelBuffer> dst;
+	dst.instance();
+	dst->create(Vector3i(10, 10, 10));
+	dst->set_channel_depth(channel, VoxelBuffer::DEPTH_16_BIT);
+	dst->copy_from(**buffer, Vector3i(-2, 4, 3), Vector3i(6, 14, 9), Vector3i(1, 0, 2), channel);
+	for (pos.z = 0; pos.z < 6; ++pos.z) {
+		for (pos.x = 0; pos.x < 6; ++pos.x) {
+			for (pos.y = 0; pos.y < 10; ++pos.y) {
+				const uint64_t v = dst->get_voxel(pos + Vector3i(3, 0, 2), channel);
+				ERR_FAIL_COND(v != expected->get_voxel(pos + Vector3i(0, 4, 3), channel));
+			}
+		}
+	}
+
+	// Too many values for a palette to be worth it
+	for (unsigned int i = 0; i < 300; ++i) {
+		const Vector3i p(i % size.x, 1 + i / (size.x * size.z), (i / size.x) % size.z);
+		buffer->set_voxel(1000 + i, p, channel);
+		expected->set_voxel(1000 + i, p, channel);
+	}
+	ERR_FAIL_COND(buffer->get_channel_compression(channel) != VoxelBuffer::COMPRESSION_NONE);
+	ERR_FAIL_COND(!buffer->equals(**expected));
+}
+
+void test_voxel_buffer_brick_compression() {
+	const int channel = VoxelBuffer::CHANNEL_SDF;
+	const Vector3i size(16, 16, 16);
+
+	Ref<VoxelBuffer> buffer;
+	buffer.instance();
+	buffer->create(size);
+	buffer->set_channel_depth(channel, VoxelBuffer::DEPTH_16_BIT);
+
+	// Flat ground with a thin surface, only a few bricks have varying values
+	Vector3i pos;
+	for (pos.z = 0; pos.z < size.z; ++pos.z) {
+		for (pos.x = 0; pos.x < size.x; ++pos.x) {
+			for (pos.y = 0; pos.y < size.y; ++pos.y) {
+				buffer->set_voxel(CLAMP(pos.y - 6, -1, 1) + 10, pos, channel);
+			}
+		}
+	}
+	Ref<VoxelBuffer> expected = buffer->duplicate(false);
+
+	buffer->compress_brick_channels();
+	ERR_FAIL_COND(buffer->get_channel_compression(channel) != VoxelBuffer::COMPRESSION_BRICKS);
+	ERR_FAIL_COND(!buffer->equals(**expected));
+
+	// Edits in uniform bricks keep the channel compressed
+	buffer->set_voxel(42, Vector3i(1, 14, 2), channel);
+	expected->set_voxel(42, Vector3i(1, 14, 2), channel);
+	ERR_FAIL_COND(buffer->get_channel_compression(channel) != VoxelBuffer::COMPRESSION_BRICKS);
+	ERR_FAIL_COND(!buffer->equals(**expected));
+
+	// Partial copies decode bricks
+	Ref<VoxelBuffer> dst;
+	dst.instance();
+	dst->create(Vector3i(10, 10, 10));
+	dst->set_channel_depth(channel, VoxelBuffer::DEPTH_16_BIT);
+	dst->copy_from(**buffer, Vector3i(-2, 3, 1), Vector3i(6, 15, 9), Vector3i(1, 0, 2), channel);
+	for (pos.z = 0; pos.z < 8; ++pos.z) {
+		for (pos.x = 0; pos.x < 6; ++pos.x) {
+			for (pos.y = 0; pos.y < 10; ++pos.y) {
+				const uint64_t v = dst->get_voxel(pos + Vector3i(3, 0, 2), channel);
+				ERR_FAIL_COND(v != expected->get_voxel(pos + Vector3i(0, 3, 1), channel));
+			}
+		}
+	}
+
+	// Filling makes the channel uniform
+	buffer->fill(5, channel);
+	ERR_FAIL_COND(buffer->get_channel_compression(channel) != VoxelBuffer::COMPRESSION_UNIFORM);
+}
+
+void test_voxel_buffer_copy_on_write() {
+	const int channel = VoxelBuffer::CHANNEL_TYPE;
+	const Vector3i size(8, 8, 8);
+
+	Ref<VoxelBuffer> buffer;
+	buffer.instance();
+	buffer->create(size);
+	buffer->set_voxel(1, Vector3i(1, 2, 3), channel);
+
+	Ref<VoxelBuffer> snapshot = buffer->duplicate(false);
+	ERR_FAIL_COND(!snapshot->equals(**buffer));
+
+	// Modifying the original must not affect the duplicate
+	buffer->set_voxel(2, Vector3i(4, 5, 6), channel);
+	ERR_FAIL_COND(snapshot->get_voxel(Vector3i(4, 5, 6), channel) != 0);
+	ERR_FAIL_COND(buffer->get_voxel(Vector3i(4, 5, 6), channel) != 2);
+
+	Ref<VoxelBuffer> snapshot2 = buffer->duplicate(false);
+	buffer->fill_area(3, Vector3i(0, 0, 0), Vector3i(4, 4, 4), channel);
+	ERR_FAIL_COND(snapshot2->get_voxel(Vector3i(1, 2, 3), channel) != 1);
+	ERR_FAIL_COND(buffer->get_voxel(Vector3i(1, 2, 3), channel) != 3);
+
+	// And the other way around
+	Ref<VoxelBuffer> snapshot3 = buffer->duplicate(false);
+	snapshot3->fill(4, channel);
+	ERR_FAIL_COND(buffer->get_voxel(Vector3i(1, 2, 3), channel) != 3);
+	ERR_FAIL_COND(snapshot2->get_voxel(Vector3i(4, 5, 6), channel) != 2);
+	ERR_FAIL_COND(snapshot->get_voxel(Vector3i(1, 2, 3), channel) != 1);
+
+	// Writing the value a voxel already has must not copy data shared with duplicates
+	{
+		Ref<VoxelBuffer> snapshot4 = buffer->duplicate(false);
+		buffer->set_voxel(3, Vector3i(1, 2, 3), channel);
+		Span<uint8_t> raw;
+		Span<uint8_t> raw4;
+		ERR_FAIL_COND(!buffer->get_channel_raw(channel, raw));
+		ERR_FAIL_COND(!snapshot4->get_channel_raw(channel, raw4));
+		ERR_FAIL_COND(raw.data() != raw4.data());
+	}
+
+	// Data remains valid when the original goes away
+	buffer.unref();
+	ERR_FAIL_COND(snapshot2->get_voxel(Vector3i(4, 5, 6), channel) != 2);
+}
+
+void test_voxel_buffer_channel_views() {
+	const int channel = VoxelBuffer::CHANNEL_TYPE;
+	const Vector3i size(8, 8, 8);
+
+	Ref<VoxelBuffer> buffer;
+	buffer.instance();
+	buffer->create(size);
+	buffer->set_channel_depth(channel, VoxelBuffer::DEPTH_16_BIT);
+	Vector3i pos;
+	for (pos.z = 0; pos.z < size.z; ++pos.z) {
+		for (pos.x = 0; pos.x < size.x; ++pos.x) {
+			for (pos.y = 0; pos.y < size.y; ++pos.y) {
+				buffer->set_voxel(pos.y < 4 ? pos.x : 0, pos, channel);
+			}
+		}
+	}
+	buffer->compress_palette_channels();
+	ERR_FAIL_COND(buffer->get_channel_compression(channel) != VoxelBuffer::COMPRESSION_PALETTE);
+
+	// Compressed channels can be read through a decoded view
+	VoxelBuffer::ChannelView<const uint16_t> view;
+	ERR_FAIL_COND(buffer->get_channel_view(channel, view));
+	std::vector<uint16_t> backing_buffer;
+	view = buffer->get_channel_view_decoded(channel, backing_buffer);
+	ERR_FAIL_COND(view.get(Vector3i(3, 2, 1)) != 3);
+	ERR_FAIL_COND(view.get(Vector3i(3, 6, 1)) != 0);
+
+	// Downscaling goes through views too
+	Ref<VoxelBuffer> dst;
+	dst.instance();
+	dst->create(size);
+	dst->set_channel_depth(channel, VoxelBuffer::DEPTH_16_BIT);
+	buffer->downscale_to(**dst, Vector3i(), size, Vector3i(4, 0, 0));
+	ERR_FAIL_COND(dst->get_voxel(Vector3i(5, 1, 2), channel) != 2);
+	ERR_FAIL_COND(dst->get_voxel(Vector3i(5, 3, 2), channel) != 0);
+	ERR_FAIL_COND(dst->get_voxel(Vector3i(1, 1, 2), channel) != 0);
+
+	// Writing decompresses the channel
+	VoxelBuffer::ChannelView<uint16_t> write_view = buffer->get_channel_view_for_write<uint16_t>(channel);
+	ERR_FAIL_COND(buffer->get_channel_compression(channel) != VoxelBuffer::COMPRESSION_NONE);
+	write_view.set(Vector3i(1, 2, 3), 42);
+	ERR_FAIL_COND(buffer->get_voxel(Vector3i(1, 2, 3), channel) != 42);
+	ERR_FAIL_COND(!buffer->get_channel_view(channel, view));
+	ERR_FAIL_COND(view.get(Vector3i(1, 2, 3)) != 42);
+}
+
+void test_voxel_buffer_downscale_modes() {
+	const Vector3i size(8, 8, 8);
+
+	Ref<VoxelBuffer> src;
+	src.instance();
+	src->create(size);
+	src->set_channel_depth(VoxelBuffer::CHANNEL_TYPE, VoxelBuffer::DEPTH_16_BIT);
+	src->set_channel_depth(VoxelBuffer::CHANNEL_SDF, VoxelBuffer::DEPTH_16_BIT);
+	src->set_channel_depth(VoxelBuffer::CHANNEL_INDICES, VoxelBuffer::DEPTH_16_BIT);
+	src->set_channel_depth(VoxelBuffer::CHANNEL_WEIGHTS, VoxelBuffer::DEPTH_16_BIT);
+
+	// In each group of 2x2x2 voxels, the one at the lowest corner differs from the 7 others
+	Vector3i pos;
+	for (pos.z = 0; pos.z < size.z; ++pos.z) {
+		for (pos.x = 0; pos.x < size.x; ++pos.x) {
+			for (pos.y = 0; pos.y < size.y; ++pos.y) {
+				const bool corner = (pos.x & 1) == 0 && (pos.y & 1) == 0 && (pos.z & 1) == 0;
+				src->set_voxel(corner ? 1 : 2, pos, VoxelBuffer::CHANNEL_TYPE);
+				src->set_voxel(corner ? 1000 : 2000, pos, VoxelBuffer::CHANNEL_SDF);
+				src->set_voxel(corner ? encode_indices_to_packed_u16(3, 0, 1, 2) : encode_indices_to_packed_u16(0, 1, 2, 5),
+						pos, VoxelBuffer::CHANNEL_INDICES);
+				src->set_voxel(encode_weights_to_packed_u16(corner ? 240 : 0, 0, 0, corner ? 0 : 240), pos,
+						VoxelBuffer::CHANNEL_WEIGHTS);
+			}
+		}
+	}
+
+	Ref<VoxelBuffer> dst;
+	dst.instance();
+	dst->create(size);
+	for (unsigned int i = 0; i < VoxelBuffer::MAX_CHANNELS; ++i) {
+		dst->set_channel_depth(i, src->get_channel_depth(i));
+	}
+
+	// Default modes
+	src->downscale_to(**dst, Vector3i(), size, Vector3i());
+	ERR_FAIL_COND(dst->get_voxel(Vector3i(1, 2, 3), VoxelBuffer::CHANNEL_TYPE) != 2);
+	ERR_FAIL_COND(dst->get_voxel(Vector3i(1, 2, 3), VoxelBuffer::CHANNEL_SDF) != (1000 + 7 * 2000 + 4) / 8);
+	{
+		const FixedArray<uint8_t, 4> indices = decode_indices_from_packed_u16(
+				dst->get_voxel(Vector3i(1, 2, 3), VoxelBuffer::CHANNEL_INDICES));
+		const FixedArray<uint8_t, 4> weights = decode_weights_from_packed_u16(
+				dst->get_voxel(Vector3i(1, 2, 3), VoxelBuffer::CHANNEL_WEIGHTS));
+		// Texture 5 covers most of the group, texture 3 the rest
+		ERR_FAIL_COND(indices[0] != 5 || weights[0] != 208);
+		ERR_FAIL_COND(indices[1] != 3 || weights[1] != 16);
+		debug_check_texture_indices(indices);
+	}
+	// Outside of the destination area
+	ERR_FAIL_COND(dst->get_voxel(Vector3i(5, 2, 3), VoxelBuffer::CHANNEL_TYPE) != 0);
+
+	// Other modes, on a sub-area not aligned to groups
+	FixedArray<VoxelBuffer::DownscaleMode, VoxelBuffer::MAX_CHANNELS> modes;
+	modes.fill(VoxelBuffer::DOWNSCALE_NEAREST);
+	modes[VoxelBuffer::CHANNEL_SDF] = VoxelBuffer::DOWNSCALE_MIN;
+	dst->clear();
+	dst->create(size);
+	for (unsigned int i = 0; i < VoxelBuffer::MAX_CHANNELS; ++i) {
+		dst->set_channel_depth(i, src->get_channel_depth(i));
+	}
+	src->downscale_to(**dst, Vector3i(3, 3, 3), Vector3i(5, 5, 5), Vector3i(1, 1, 1), modes);
+	ERR_FAIL_COND(dst->get_voxel(Vector3i(1, 1, 1), VoxelBuffer::CHANNEL_SDF) != 1000);
+	ERR_FAIL_COND(dst->get_voxel(Vector3i(2, 2, 2), VoxelBuffer::CHANNEL_SDF) != 1000);
+	ERR_FAIL_COND(dst->get_voxel(Vector3i(2, 2, 2), VoxelBuffer::CHANNEL_TYPE) != 1);
+	ERR_FAIL_COND(dst->get_voxel(Vector3i(3, 2, 2), VoxelBuffer::CHANNEL_TYPE) != 0);
+	ERR_FAIL_COND(dst->get_voxel(Vector3i(0, 2, 2), VoxelBuffer::CHANNEL_TYPE) != 0);
+}
+
+void test_voxel_buffer_metadata() {
+	const Vector3i size(16, 16, 16);
+
+	Ref<VoxelBuffer> buffer;
+	buffer.instance();
+	buffer->create(size);
+
+	// Fill a pattern in an order different from storage
+	for (int x = size.x - 1; x >= 0; x -= 3) {
+		for (int y = 0; y < size.y; y += 2) {
+			for (int z = 0; z < size.z; z += 5) {
+				buffer->set_voxel_metadata(Vector3i(x, y, z), x + y * 100 + z * 10000);
+			}
+		}
+	}
+	ERR_FAIL_COND(buffer->get_voxel_metadata(Vector3i(15, 4, 10)) != Variant(15 + 400 + 100000));
+	ERR_FAIL_COND(buffer->get_voxel_metadata(Vector3i(15, 5, 10)) != Variant());
+
+	// Box queries must find exactly the items in the box
+	const Box3i box(Vector3i(2, 3, 4), Vector3i(7, 5, 9));
+	int found_count = 0;
+	bool wrong = false;
+	buffer->for_each_voxel_metadata_in_area(box, [&found_count, &wrong, &box](Vector3i pos, Variant meta) {
+		wrong |= !box.contains(pos) || meta != Variant(pos.x + pos.y * 100 + pos.z * 10000);
+		++found_count;
+	});
+	ERR_FAIL_COND(wrong);
+	int expected_count = 0;
+	box.for_each_cell([&expected_count, &buffer](Vector3i pos) {
+		if (buffer->get_voxel_metadata(pos) != Variant()) {
+			++expected_count;
+		}
+	});
+	ERR_FAIL_COND(found_count != expected_count);
+	ERR_FAIL_COND(found_count == 0);
+
+	buffer->clear_voxel_metadata_in_area(box);
+	box.for_each_cell([&wrong, &buffer](Vector3i pos) { wrong |= buffer->get_voxel_metadata(pos) != Variant(); });
+	ERR_FAIL_COND(wrong);
+	ERR_FAIL_COND(buffer->get_voxel_metadata(Vector3i(15, 4, 10)) == Variant());
+
+	// Setting null removes the item
+	buffer->set_voxel_metadata(Vector3i(15, 4, 10), Variant());
+	ERR_FAIL_COND(buffer->get_voxel_metadata(Vector3i(15, 4, 10)) != Variant());
+
+	// Serialized items must come back the same
+	VoxelBlockSerializerInternal serializer;
+	VoxelBlockSerializerInternal::SerializeResult result = serializer.serialize(**buffer);
+	ERR_FAIL_COND(!result.success);
+	Ref<VoxelBuffer> buffer2;
+	buffer2.instance();
+	ERR_FAIL_COND(!serializer.deserialize(result.data, **buffer2));
+	ERR_FAIL_COND(buffer2->get_voxel_metadata().size() != buffer->get_voxel_metadata().size());
+	Box3i(Vector3i(), size).for_each_cell([&wrong, &buffer, &buffer2](Vector3i pos) {
+		wrong |= buffer->get_voxel_metadata(pos) != buffer2->get_voxel_metadata(pos);
+	});
+	ERR_FAIL_COND(wrong);
+}
+
+void test_voxel_memory_pool() {
+	VoxelMemoryPool *pool = VoxelMemoryPool::get_singleton();
+	const VoxelMemoryPool::Stats stats0 = pool->get_stats();
+
+	// Sizes get rounded up, but blocks must still be reused for the same size
+	const uint32_t size = 8200;
+	uint8_t *a = pool->allocate(size);
+	uint8_t *b = pool->allocate(size);
+	ERR_FAIL_COND(a == nullptr || b == nullptr || a == b);
+	memset(a, 1, size);
+	memset(b, 2, size);
+
+	const VoxelMemoryPool::Stats stats1 = pool->get_stats();
+	ERR_FAIL_COND(stats1.live_bytes < stats0.live_bytes + 2 * size);
+	ERR_FAIL_COND(stats1.created + stats1.reused != stats0.created + stats0.reused + 2);
+
+	pool->recycle(a, size);
+	pool->recycle(b, size);
+	const VoxelMemoryPool::Stats stats2 = pool->get_stats();
+	ERR_FAIL_COND(stats2.live_bytes != stats0.live_bytes);
+	ERR_FAIL_COND(stats2.cached_bytes < stats1.cached_bytes + 2 * size);
+
+	// The last recycled block comes back first
+	uint8_t *c = pool->allocate(size);
+	ERR_FAIL_COND(c != b);
+	const VoxelMemoryPool::Stats stats3 = pool->get_stats();
+	ERR_FAIL_COND(stats3.reused != stats2.reused + 1);
+	pool->recycle(c, size);
+
+	pool->trim();
+	const VoxelMemoryPool::Stats stats4 = pool->get_stats();
+	ERR_FAIL_COND(stats4.live_bytes != stats0.live_bytes);
+	ERR_FAIL_COND(stats4.cached_bytes > stats2.cached_bytes - 2 * size);
+}
+
 void test_voxel_graph_generator_default_graph_compilation() {
 	Ref<VoxelGeneratorGraph> generator;
 	generator.instance();
@@ -476,6 +1343,294 @@ void test_voxel_graph_generator_texturing() {
 	}
 }
 
+static void run_voxel_thread_pool_pick_benchmark(bool work_stealing) {
+	// Measures how fast tasks get picked when the queue is very large.
+	// Tasks do nothing, so most of the time is spent scheduling them.
+	class DummyTask : public IVoxelTask {
+	public:
+		DummyTask(int p_priority) :
+				priority(p_priority) {}
+
+		void run(VoxelTaskContext ctx) override {
+			has_run = true;
+		}
+
+		int get_priority() override {
+			return priority;
+		}
+
+		int priority;
+		bool has_run = false;
+	};
+
+	const unsigned int task_count = 100000;
+
+	std::vector<IVoxelTask *> tasks;
+	tasks.reserve(task_count);
+	for (unsigned int i = 0; i < task_count; ++i) {
+		// Spread priorities so the queue has to actually sort them
+		tasks.push_back(memnew(DummyTask((i * 7919) % 10000)));
+	}
+
+	VoxelThreadPool pool;
+	pool.set_name("Test pool");
+	pool.set_work_stealing_enabled(work_stealing);
+	pool.set_thread_count(4);
+	pool.set_batch_count(1);
+	pool.set_priority_update_period(64);
+
+	ProfilingClock clock;
+	pool.enqueue(to_span(tasks));
+	pool.wait_for_all_tasks();
+	const uint64_t time_spent_usec = clock.restart();
+
+	unsigned int completed_count = 0;
+	pool.dequeue_completed_tasks([&completed_count](IVoxelTask *task) {
+		DummyTask *dt = static_cast<DummyTask *>(task);
+		if (dt->has_run) {
+			++completed_count;
+		}
+		memdelete(dt);
+	});
+
+	print_line(String("Picked {0} tasks in {1} us ({2} tasks/ms), work stealing: {3}")
+					   .format(varray(task_count, SIZE_T_TO_VARIANT(time_spent_usec),
+							   SIZE_T_TO_VARIANT(task_count * 1000 / (time_spent_usec + 1)), work_stealing)));
+
+	ERR_FAIL_COND(completed_count != task_count);
+}
+
+void test_voxel_thread_pool_pick_throughput() {
+	run_voxel_thread_pool_pick_benchmark(false);
+	run_voxel_thread_pool_pick_benchmark(true);
+}
+
+void test_voxel_thread_pool_batch_lookahead() {
+	// Batches must group tasks sharing a key among the best ones, without a group going before a better one
+	class KeyedTask : public IVoxelTask {
+	public:
+		KeyedTask(int p_priority, uint64_t p_key) :
+				priority(p_priority), key(p_key) {}
+
+		void run(VoxelTaskContext ctx) override {}
+
+		int get_priority() override {
+			return priority;
+		}
+
+		uint64_t get_batch_key() override {
+			return key;
+		}
+
+		int priority;
+		uint64_t key;
+	};
+
+	struct L {
+		static std::vector<std::vector<int>> &get_batches() {
+			static std::vector<std::vector<int>> s_batches;
+			return s_batches;
+		}
+
+		static void run_batch(Span<IVoxelTask *> tasks, VoxelTaskContext ctx) {
+			std::vector<int> batch;
+			for (size_t i = 0; i < tasks.size(); ++i) {
+				batch.push_back(static_cast<KeyedTask *>(tasks[i])->priority);
+			}
+			get_batches().push_back(batch);
+		}
+	};
+
+	L::get_batches().clear();
+
+	// Keys by priority, where lower priority values run first
+	const uint64_t keys[] = { 0, 1, 0, 2, 1, 0, 3, 0, 4, 5 };
+	const unsigned int task_count = sizeof(keys) / sizeof(keys[0]);
+
+	std::vector<IVoxelTask *> tasks;
+	for (unsigned int i = 0; i < task_count; ++i) {
+		tasks.push_back(memnew(KeyedTask(i, keys[i])));
+	}
+
+	VoxelThreadPool pool;
+	pool.set_name("Test pool");
+	pool.set_kind_batch_count(0, 4);
+	pool.set_kind_batch_lookahead(0, 8);
+	pool.set_kind_batch_runner(0, &L::run_batch);
+	// Queued before threads exist, so the first pick sees all of them
+	pool.enqueue(to_span(tasks));
+	pool.set_thread_count(1);
+	pool.wait_for_all_tasks();
+
+	unsigned int completed_count = 0;
+	pool.dequeue_completed_tasks([&completed_count](IVoxelTask *task) {
+		++completed_count;
+		memdelete(task);
+	});
+	ERR_FAIL_COND(completed_count != task_count);
+
+	const std::vector<std::vector<int>> &batches = L::get_batches();
+	const std::vector<std::vector<int>> expected_batches = { { 0, 2, 5, 7 }, { 1, 4, 3, 6 }, { 8, 9 } };
+	ERR_FAIL_COND(batches != expected_batches);
+}
+
+void test_voxel_thread_pool_switch_work_stealing() {
+	// Switching modes while tasks are queued must not drop any of them,
+	// including those already spread in per-thread queues.
+	class CountingTask : public IVoxelTask {
+	public:
+		CountingTask(std::atomic<uint32_t> &p_run_count) :
+				run_count(p_run_count) {}
+
+		void run(VoxelTaskContext ctx) override {
+			++run_count;
+		}
+
+		std::atomic<uint32_t> &run_count;
+	};
+
+	const unsigned int task_count_per_step = 10000;
+
+	std::atomic<uint32_t> run_count;
+	run_count = 0;
+
+	VoxelThreadPool pool;
+	pool.set_name("Test pool");
+	pool.set_thread_count(4);
+
+	std::vector<IVoxelTask *> tasks;
+	for (unsigned int step = 0; step < 3; ++step) {
+		tasks.clear();
+		for (unsigned int i = 0; i < task_count_per_step; ++i) {
+			tasks.push_back(memnew(CountingTask(run_count)));
+		}
+		pool.enqueue(to_span(tasks));
+		pool.set_work_stealing_enabled(!pool.is_work_stealing_enabled());
+		ERR_FAIL_COND(pool.get_thread_count() != 4);
+	}
+
+	pool.wait_for_all_tasks();
+
+	unsigned int completed_count = 0;
+	pool.dequeue_completed_tasks([&completed_count](IVoxelTask *task) {
+		++completed_count;
+		memdelete(task);
+	});
+
+	ERR_FAIL_COND(completed_count != 3 * task_count_per_step);
+	ERR_FAIL_COND(run_count != 3 * task_count_per_step);
+
+	// Same setting exposed by the server, which switches its own threads
+	VoxelServer *server = VoxelServer::get_singleton();
+	ERR_FAIL_COND(server == nullptr);
+	const bool server_work_stealing = server->is_thread_pool_work_stealing_enabled();
+	const unsigned int server_thread_count = server->get_thread_count();
+	server->set_thread_pool_work_stealing_enabled(!server_work_stealing);
+	ERR_FAIL_COND(server->is_thread_pool_work_stealing_enabled() == server_work_stealing);
+	ERR_FAIL_COND(server->get_thread_count() != server_thread_count);
+	server->set_thread_pool_work_stealing_enabled(server_work_stealing);
+	ERR_FAIL_COND(server->is_thread_pool_work_stealing_enabled() != server_work_stealing);
+}
+
+void test_voxel_task_graph_dependencies() {
+	// A task depending on several others must run only after all of them completed,
+	// without having to be enqueued again from the calling thread.
+	struct Shared {
+		std::atomic<uint32_t> producers_run_count;
+		uint32_t producers_run_count_seen_by_consumer = 0;
+		uint32_t consumers_destroyed_count = 0;
+		bool consumer_has_run = false;
+	};
+
+	class ProducerTask : public IVoxelTask {
+	public:
+		ProducerTask(Shared &p_shared, std::shared_ptr<VoxelTaskDependents> p_dependents) :
+				shared(p_shared), dependents(p_dependents) {}
+
+		void run(VoxelTaskContext ctx) override {
+			++shared.producers_run_count;
+			dependents->complete();
+		}
+
+		Shared &shared;
+		std::shared_ptr<VoxelTaskDependents> dependents;
+	};
+
+	class ConsumerTask : public IVoxelTask {
+	public:
+		ConsumerTask(Shared &p_shared) :
+				shared(p_shared) {}
+
+		~ConsumerTask() {
+			++shared.consumers_destroyed_count;
+		}
+
+		void run(VoxelTaskContext ctx) override {
+			shared.producers_run_count_seen_by_consumer = shared.producers_run_count;
+			shared.consumer_has_run = true;
+		}
+
+		Shared &shared;
+	};
+
+	const unsigned int producer_count = 27;
+
+	Shared shared;
+	shared.producers_run_count = 0;
+
+	VoxelThreadPool pool;
+	pool.set_name("Test pool");
+	pool.set_thread_count(4);
+
+	const VoxelTaskGraphNode::ReleaseTaskFunc release_task = [](IVoxelTask *task) { memdelete(task); };
+
+	std::shared_ptr<VoxelTaskGraphNode> consumer_node(
+			memnew(VoxelTaskGraphNode(memnew(ConsumerTask(shared)), pool, release_task)),
+			memdelete<VoxelTaskGraphNode>);
+
+	std::vector<IVoxelTask *> producers;
+	for (unsigned int i = 0; i < producer_count; ++i) {
+		std::shared_ptr<VoxelTaskDependents> dependents(memnew(VoxelTaskDependents), memdelete<VoxelTaskDependents>);
+		if (i == 0) {
+			// A dependency that completed before being added must not be waited for
+			dependents->complete();
+			++shared.producers_run_count;
+			dependents->add(consumer_node);
+		} else {
+			dependents->add(consumer_node);
+			producers.push_back(memnew(ProducerTask(shared, dependents)));
+		}
+	}
+	consumer_node->schedule();
+	// Nodes are kept alive by the dependencies they wait for
+	consumer_node.reset();
+
+	pool.enqueue(to_span(producers));
+	pool.wait_for_all_tasks();
+
+	unsigned int completed_count = 0;
+	pool.dequeue_completed_tasks([&completed_count](IVoxelTask *task) {
+		++completed_count;
+		memdelete(task);
+	});
+
+	ERR_FAIL_COND(completed_count != producer_count);
+	ERR_FAIL_COND(!shared.consumer_has_run);
+	ERR_FAIL_COND(shared.producers_run_count_seen_by_consumer != producer_count);
+
+	// A node destroyed before being scheduled gives its task back instead of running it
+	{
+		shared.consumer_has_run = false;
+		const uint32_t destroyed_count = shared.consumers_destroyed_count;
+		std::shared_ptr<VoxelTaskGraphNode> node(
+				memnew(VoxelTaskGraphNode(memnew(ConsumerTask(shared)), pool, release_task)),
+				memdelete<VoxelTaskGraphNode>);
+		node.reset();
+		ERR_FAIL_COND(shared.consumers_destroyed_count != destroyed_count + 1);
+		ERR_FAIL_COND(shared.consumer_has_run);
+	}
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 #define VOXEL_TEST(fname)                                     \
@@ -488,11 +1643,29 @@ void run_voxel_tests() {
 	VOXEL_TEST(test_box3i_for_inner_outline);
 	VOXEL_TEST(test_voxel_data_map_paste_fill);
 	VOXEL_TEST(test_voxel_data_map_paste_mask);
+	VOXEL_TEST(test_voxel_data_map_paste_mask_negative_offset);
 	VOXEL_TEST(test_voxel_data_map_copy);
+	VOXEL_TEST(test_voxel_data_map_memory_usage);
+	VOXEL_TEST(test_vector3i_flat_map);
+	VOXEL_TEST(test_block_map_throughput);
+	VOXEL_TEST(test_region_file);
+	VOXEL_TEST(test_region_journal);
 	VOXEL_TEST(test_encode_weights_packed_u16);
 	VOXEL_TEST(test_copy_3d_region_zxy);
+	VOXEL_TEST(test_region_kernels_throughput);
+	VOXEL_TEST(test_voxel_buffer_palette_compression);
+	VOXEL_TEST(test_voxel_buffer_brick_compression);
+	VOXEL_TEST(test_voxel_buffer_copy_on_write);
+	VOXEL_TEST(test_voxel_buffer_channel_views);
+	VOXEL_TEST(test_voxel_buffer_downscale_modes);
+	VOXEL_TEST(test_voxel_buffer_metadata);
+	VOXEL_TEST(test_voxel_memory_pool);
 	VOXEL_TEST(test_voxel_graph_generator_default_graph_compilation);
 	VOXEL_TEST(test_voxel_graph_generator_texturing);
+	VOXEL_TEST(test_voxel_thread_pool_pick_throughput);
+	VOXEL_TEST(test_voxel_thread_pool_batch_lookahead);
+	VOXEL_TEST(test_voxel_thread_pool_switch_work_stealing);
+	VOXEL_TEST(test_voxel_task_graph_dependencies);
 
 	print_line("------------ Voxel tests end -------------");
 }
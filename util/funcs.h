@@ -1,8 +1,10 @@
 #ifndef HEADER_VOXEL_UTILITY_H
 #define HEADER_VOXEL_UTILITY_H
 
+#include <core/os/memory.h>
 #include <core/pool_vector.h>
 #include <core/vector.h>
+#include <memory>
 #include <utility>
 #include <vector>
 
@@ -187,4 +189,10 @@ inline bool is_uniform(const Item_T *p_data, uint32_t item_count) {
 	return true;
 }
 
+template <typename T>
+inline std::shared_ptr<T> gd_make_shared() {
+	// std::make_shared() apparently wont allow us to specify custom new and delete
+	return std::shared_ptr<T>(memnew(T), memdelete<T>);
+}
+
 #endif // HEADER_VOXEL_UTILITY_H
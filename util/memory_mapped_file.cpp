@@ -0,0 +1,64 @@
+#include "memory_mapped_file.h"
+
+#include <core/project_settings.h>
+
+#ifdef UNIX_ENABLED
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+VoxelMemoryMappedFile::~VoxelMemoryMappedFile() {
+	close();
+}
+
+Error VoxelMemoryMappedFile::open(const String &fpath) {
+	close();
+
+#ifdef UNIX_ENABLED
+	const String global_path = ProjectSettings::get_singleton()->globalize_path(fpath);
+	const CharString global_path_utf8 = global_path.utf8();
+
+	const int fd = ::open(global_path_utf8.get_data(), O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return ERR_FILE_CANT_OPEN;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		::close(fd);
+		return ERR_FILE_CANT_READ;
+	}
+	if (st.st_size == 0) {
+		// Empty mappings are not allowed
+		::close(fd);
+		return ERR_FILE_EOF;
+	}
+
+	void *ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	// The mapping remains valid after closing the descriptor
+	::close(fd);
+	if (ptr == MAP_FAILED) {
+		return ERR_FILE_CANT_READ;
+	}
+
+	_data = static_cast<const uint8_t *>(ptr);
+	_size = st.st_size;
+	return OK;
+
+#else
+	return ERR_UNAVAILABLE;
+#endif
+}
+
+void VoxelMemoryMappedFile::close() {
+	if (_data == nullptr) {
+		return;
+	}
+#ifdef UNIX_ENABLED
+	munmap(const_cast<uint8_t *>(_data), _size);
+#endif
+	_data = nullptr;
+	_size = 0;
+}
@@ -0,0 +1,33 @@
+#ifndef VOXEL_MEMORY_MAPPED_FILE_H
+#define VOXEL_MEMORY_MAPPED_FILE_H
+
+#include "span.h"
+#include <core/error_list.h>
+#include <core/ustring.h>
+
+// Read-only view of a whole file mapped in memory, so its contents can be read without copying them.
+// Only supported on Unix-like platforms, and only for files of the real filesystem (not inside a PCK).
+// Other cases fail to open, and callers are expected to fall back on `FileAccess`.
+// The view does not grow if the file is written to after mapping it, it has to be opened again.
+// Note: has nothing to do with voxels, it's just prefixed.
+class VoxelMemoryMappedFile {
+public:
+	~VoxelMemoryMappedFile();
+
+	Error open(const String &fpath);
+	void close();
+
+	inline bool is_open() const {
+		return _data != nullptr;
+	}
+
+	inline Span<const uint8_t> get_data() const {
+		return Span<const uint8_t>(_data, _size);
+	}
+
+private:
+	const uint8_t *_data = nullptr;
+	size_t _size = 0;
+};
+
+#endif // VOXEL_MEMORY_MAPPED_FILE_H
@@ -2,8 +2,12 @@
 #define OBJECT_POOL_H
 
 #include "core/os/memory.h"
+#include "core/os/mutex.h"
+#include <atomic>
 #include <vector>
 
+// Objects must have an `init()` method resetting them to defaults when they get recycled.
+// It should reset fields one by one and clear containers, so memory they allocated can be reused.
 template <class T>
 class ObjectPool {
 public:
@@ -32,4 +36,63 @@ private:
 	std::vector<T *> _objects;
 };
 
+// Same as ObjectPool, but can be used from multiple threads.
+// Also counts how often objects get reused, to check if pooling is worth it.
+template <class T>
+class ThreadSafeObjectPool {
+public:
+	ThreadSafeObjectPool() :
+			_created_count(0),
+			_reused_count(0) {}
+
+	T *create() {
+		{
+			MutexLock lock(_mutex);
+			if (!_objects.empty()) {
+				T *obj = _objects.back();
+				_objects.pop_back();
+				++_reused_count;
+				return obj;
+			}
+		}
+		++_created_count;
+		return memnew(T);
+	}
+
+	void recycle(T *obj) {
+		// Resetting can release resources, don't do it while locked
+		obj->init();
+		MutexLock lock(_mutex);
+		_objects.push_back(obj);
+	}
+
+	// How many objects had to be allocated
+	uint32_t get_created_count() const {
+		return _created_count;
+	}
+
+	// How many objects were taken from the pool instead of being allocated
+	uint32_t get_reused_count() const {
+		return _reused_count;
+	}
+
+	// How many objects are in the pool, waiting to be reused
+	uint32_t get_pooled_count() const {
+		MutexLock lock(_mutex);
+		return _objects.size();
+	}
+
+	~ThreadSafeObjectPool() {
+		for (auto it = _objects.begin(); it != _objects.end(); ++it) {
+			memdelete(*it);
+		}
+	}
+
+private:
+	std::vector<T *> _objects;
+	mutable Mutex _mutex;
+	std::atomic<uint32_t> _created_count;
+	std::atomic<uint32_t> _reused_count;
+};
+
 #endif // OBJECT_POOL_H
@@ -0,0 +1,205 @@
+#ifndef VECTOR3I_FLAT_MAP_H
+#define VECTOR3I_FLAT_MAP_H
+
+#include "math/vector3i.h"
+
+#include <core/error_macros.h>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Map with Vector3i keys, stored in a single array with open addressing and linear probing.
+// Instead of hashing, keys are placed in a toroidal grid using the low bits of their coordinates, so a contiguous
+// area of blocks smaller than the grid has no collisions, and neighbor lookups stay close in memory.
+// Keys spread far apart with the same low bits end up in the same cell and make lookups slower,
+// so this is meant for maps of blocks loaded around viewers, not for arbitrary positions.
+// Removal shifts following entries back, so no tombstones accumulate when blocks are constantly loaded and unloaded.
+// Meant for small values such as indices. The key with all coordinates at the minimum integer is reserved.
+template <typename T>
+class Vector3iFlatMap {
+public:
+	inline unsigned int size() const {
+		return _size;
+	}
+
+	inline T *getptr(const Vector3i key) {
+		if (_size == 0) {
+			return nullptr;
+		}
+		unsigned int i = get_home_slot(key);
+		while (true) {
+			Entry &e = _entries[i];
+			if (e.key == key) {
+				return &e.value;
+			}
+			if (e.key == get_empty_key()) {
+				return nullptr;
+			}
+			i = (i + 1) & _mask;
+		}
+	}
+
+	inline const T *getptr(const Vector3i key) const {
+		return const_cast<Vector3iFlatMap<T> *>(this)->getptr(key);
+	}
+
+	inline bool has(const Vector3i key) const {
+		return getptr(key) != nullptr;
+	}
+
+	void set(const Vector3i key, const T value) {
+#ifdef DEBUG_ENABLED
+		CRASH_COND(key == get_empty_key());
+#endif
+		// Keeping the table at most half full keeps probe sequences short
+		if ((_size + 1) * 2 > _entries.size()) {
+			rehash(_entries.size() == 0 ? MIN_CAPACITY : _entries.size() * 2);
+		}
+		unsigned int i = get_home_slot(key);
+		unsigned int distance = 0;
+		while (true) {
+			Entry &e = _entries[i];
+			if (e.key == key) {
+				e.value = value;
+				return;
+			}
+			if (e.key == get_empty_key()) {
+				break;
+			}
+			i = (i + 1) & _mask;
+			++distance;
+		}
+		// The loaded area can be larger than the grid and wrap around it, making long runs of entries.
+		// A larger grid spreads them again. The load condition prevents growing forever with unlucky keys.
+		if (distance > MAX_PROBE_DISTANCE && _size * 8 >= _entries.size()) {
+			rehash(_entries.size() * 2);
+			i = get_home_slot(key);
+			while (_entries[i].key != get_empty_key()) {
+				i = (i + 1) & _mask;
+			}
+		}
+		_entries[i].key = key;
+		_entries[i].value = value;
+		++_size;
+	}
+
+	bool erase(const Vector3i key) {
+		if (_size == 0) {
+			return false;
+		}
+		unsigned int i = get_home_slot(key);
+		while (true) {
+			const Entry &e = _entries[i];
+			if (e.key == key) {
+				break;
+			}
+			if (e.key == get_empty_key()) {
+				return false;
+			}
+			i = (i + 1) & _mask;
+		}
+
+		// Move back following entries which would no longer be found past the hole
+		unsigned int j = i;
+		while (true) {
+			j = (j + 1) & _mask;
+			const Entry &e = _entries[j];
+			if (e.key == get_empty_key()) {
+				break;
+			}
+			const unsigned int home = get_home_slot(e.key);
+			if (((j - home) & _mask) >= ((j - i) & _mask)) {
+				_entries[i] = e;
+				i = j;
+			}
+		}
+		_entries[i].key = get_empty_key();
+		--_size;
+		return true;
+	}
+
+	// Also releases memory
+	void clear() {
+		std::vector<Entry>().swap(_entries);
+		_size = 0;
+		_mask = 0;
+	}
+
+	void reserve(unsigned int count) {
+		unsigned int capacity = MIN_CAPACITY;
+		while (capacity < count * 2) {
+			capacity *= 2;
+		}
+		if (capacity > _entries.size()) {
+			rehash(capacity);
+		}
+	}
+
+private:
+	static const unsigned int MIN_CAPACITY = 16;
+	static const unsigned int MAX_PROBE_DISTANCE = 16;
+
+	struct Entry {
+		Vector3i key;
+		T value;
+	};
+
+	static inline Vector3i get_empty_key() {
+		return Vector3i(std::numeric_limits<int>::min());
+	}
+
+	inline unsigned int get_home_slot(const Vector3i key) const {
+		// The table is a toroidal grid indexed with the low bits of coordinates, in ZXY order.
+		// Blocks are loaded in contiguous areas, so they rarely share a cell, and neighbors are close in memory.
+		// When distant blocks do share a cell, linear probing moves them along Y, which is often free.
+		return (((key.x & _grid_mask_x) << _grid_shift_x) | ((key.z & _grid_mask_z) << _grid_shift_z) |
+					   (key.y & _grid_mask_y)) &
+				_mask;
+	}
+
+	void rehash(unsigned int capacity) {
+		std::vector<Entry> old_entries;
+		old_entries.swap(_entries);
+
+		Entry empty_entry;
+		empty_entry.key = get_empty_key();
+		_entries.resize(capacity, empty_entry);
+		_mask = capacity - 1;
+		unsigned int capacity_po2 = 0;
+		while ((1u << capacity_po2) < capacity) {
+			++capacity_po2;
+		}
+		// Terrains are often wider than they are tall, so X and Z get the remaining bits
+		const unsigned int po2_y = capacity_po2 / 3;
+		const unsigned int po2_z = (capacity_po2 - po2_y) / 2;
+		const unsigned int po2_x = capacity_po2 - po2_y - po2_z;
+		_grid_mask_x = (1 << po2_x) - 1;
+		_grid_mask_y = (1 << po2_y) - 1;
+		_grid_mask_z = (1 << po2_z) - 1;
+		_grid_shift_z = po2_y;
+		_grid_shift_x = po2_y + po2_z;
+
+		for (auto it = old_entries.begin(); it != old_entries.end(); ++it) {
+			const Entry &e = *it;
+			if (e.key == get_empty_key()) {
+				continue;
+			}
+			unsigned int i = get_home_slot(e.key);
+			while (_entries[i].key != get_empty_key()) {
+				i = (i + 1) & _mask;
+			}
+			_entries[i] = e;
+		}
+	}
+
+	std::vector<Entry> _entries;
+	unsigned int _size = 0;
+	unsigned int _mask = 0;
+	unsigned int _grid_mask_x = 0;
+	unsigned int _grid_mask_y = 0;
+	unsigned int _grid_mask_z = 0;
+	unsigned int _grid_shift_x = 0;
+	unsigned int _grid_shift_z = 0;
+};
+
+#endif // VECTOR3I_FLAT_MAP_H